@@ -0,0 +1,1066 @@
+
+/*
+ * Non-blocking outbound TCP connections with a keyed pool of idle connections.
+ * 
+ * Connector::connect() creates a non-blocking socket, waits for writability
+ * with an ev_io and checks SO_ERROR, all in C, with an ev_timer for the
+ * timeout. Host names are looked up through a libev\Resolver, each resolved
+ * address is tried in turn until one accepts the connection.
+ * 
+ * Connector::release() parks a connection keyed by its address, connect()
+ * to the same address then reuses it after checking with a MSG_PEEK recv()
+ * that the peer has neither closed it nor sent unexpected data.
+ */
+
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* Missing on macOS, connector_socket() uses fcntl() there */
+#ifndef SOCK_NONBLOCK
+#  define SOCK_NONBLOCK 0
+#endif
+
+#ifndef SOCK_CLOEXEC
+#  define SOCK_CLOEXEC 0
+#endif
+
+/* Parked connection, value of connector_object->idle is the head of a list */
+typedef struct connector_idle {
+	struct connector_idle *next;
+	int    fd;
+	double since;  /* ev_now() when it was released */
+} connector_idle;
+
+struct connector_object;
+
+/* Connection attempt started by Connector::connect() */
+typedef struct connector_op {
+	ev_io      io;
+	ev_timer   timer;
+	struct connector_object *connector;  /* NULL once cancelled */
+	struct connector_op *next;           /* Part of the doubly-linked list of connector->ops */
+	struct connector_op *prev;
+	long       id;
+	int        fd;            /* -1 while not connecting */
+	int        pooled;        /* fd was taken from the idle pool */
+	int        resolving;     /* Waiting for the Resolver, which owns op meanwhile */
+	char       *host;
+	int        host_len;
+	unsigned short port;
+	zval       *addresses;    /* Resolved addresses, tried in order */
+	int        next_address;
+	char       *error;        /* Set when the attempt failed and is about to be reported */
+	zval       *callback;
+	zend_fcall_info_cache fcc;
+} connector_op;
+
+typedef struct connector_object {
+	zend_object     std;
+	zval            *this;          /* Reference keeping the object alive while connecting */
+	struct ev_loop  *loop;          /* NULL once the loop was destroyed */
+	zval            *resolver;      /* libev\Resolver for host names, or NULL */
+	connector_op    *ops;           /* Head of the doubly-linked list of attempts */
+	long            next_id;
+	HashTable       idle;           /* address => connector_idle * */
+	ev_timer        sweep_timer;    /* Closes expired idle connections */
+	ev_cleanup      cleanup_watcher;
+	long            max_idle;
+	double          idle_timeout;
+} connector_object;
+
+zend_class_entry *connector_ce;
+
+zend_object_handlers connector_object_handlers;
+
+
+/* Returns true if the idle connection fd can still be used, ie. reading
+   would block */
+static inline int connector_fd_healthy(int fd)
+{
+	char c;
+	
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Returns a non-blocking, close-on-exec TCP socket, -1 and errno on failure */
+static int connector_socket(int family)
+{
+	int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	
+	if(fd >= 0 && ! SOCK_NONBLOCK && (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0))
+	{
+		int error = errno;
+		
+		close(fd);
+		errno = error;
+		
+		return -1;
+	}
+	
+	return fd;
+}
+
+static void connector_idle_dtor(void *data)
+{
+	connector_idle *entry = *(connector_idle **) data;
+	connector_idle *next;
+	
+	while(entry)
+	{
+		next = entry->next;
+		
+		close(entry->fd);
+		efree(entry);
+		
+		entry = next;
+	}
+}
+
+/* Closes expired and broken idle connections, deleting empty keys */
+static void connector_sweep(connector_object *obj)
+{
+	connector_idle **list;
+	connector_idle **p;
+	connector_idle *entry;
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong index;
+	double now = ev_now(obj->loop);
+	
+	for(zend_hash_internal_pointer_reset_ex(&obj->idle, &pos);
+		zend_hash_get_current_data_ex(&obj->idle, (void **) &list, &pos) == SUCCESS; )
+	{
+		for(p = list; (entry = *p); )
+		{
+			if((obj->idle_timeout > 0. && entry->since + obj->idle_timeout <= now) || ! connector_fd_healthy(entry->fd))
+			{
+				*p = entry->next;
+				
+				close(entry->fd);
+				efree(entry);
+			}
+			else
+			{
+				p = &entry->next;
+			}
+		}
+		
+		zend_hash_get_current_key_ex(&obj->idle, &key, &key_len, &index, 0, &pos);
+		zend_hash_move_forward_ex(&obj->idle, &pos);
+		
+		if( ! *list)
+		{
+			zend_hash_del(&obj->idle, key, key_len);
+		}
+	}
+}
+
+static void connector_sweep_stop(connector_object *obj)
+{
+	if(ev_is_active(&obj->sweep_timer))
+	{
+		/* Undo the ev_unref() of connector_sweep_start() */
+		ev_ref(obj->loop);
+		ev_timer_stop(obj->loop, &obj->sweep_timer);
+	}
+}
+
+static void connector_sweep_start(connector_object *obj)
+{
+	if( ! ev_is_active(&obj->sweep_timer) && obj->idle_timeout > 0.)
+	{
+		ev_timer_set(&obj->sweep_timer, obj->idle_timeout, obj->idle_timeout);
+		ev_timer_start(obj->loop, &obj->sweep_timer);
+		
+		/* Idle connections do not keep the loop running */
+		ev_unref(obj->loop);
+	}
+}
+
+static void connector_sweep_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	connector_object *obj = (connector_object *)((char *) w - XtOffsetOf(connector_object, sweep_timer));
+	
+	connector_sweep(obj);
+	
+	if( ! zend_hash_num_elements(&obj->idle))
+	{
+		connector_sweep_stop(obj);
+	}
+}
+
+/* Takes a usable idle connection to address out of the pool, -1 if none */
+static int connector_checkout(connector_object *obj, const char *key, int key_len)
+{
+	connector_idle **list;
+	connector_idle *entry;
+	double now = ev_now(obj->loop);
+	int fd = -1;
+	
+	if(zend_hash_find(&obj->idle, key, key_len + 1, (void **) &list) != SUCCESS)
+	{
+		return -1;
+	}
+	
+	/* Most recently released first */
+	while(fd < 0 && (entry = *list))
+	{
+		*list = entry->next;
+		
+		if((obj->idle_timeout <= 0. || entry->since + obj->idle_timeout > now) && connector_fd_healthy(entry->fd))
+		{
+			fd = entry->fd;
+		}
+		else
+		{
+			close(entry->fd);
+		}
+		
+		efree(entry);
+	}
+	
+	if( ! *list)
+	{
+		zend_hash_del(&obj->idle, key, key_len + 1);
+	}
+	
+	return fd;
+}
+
+static void connector_op_free(connector_op *op)
+{
+	if(op->fd >= 0)
+	{
+		close(op->fd);
+	}
+	
+	if(op->addresses)
+	{
+		zval_ptr_dtor(&op->addresses);
+	}
+	
+	if(op->callback)
+	{
+		zval_ptr_dtor(&op->callback);
+	}
+	
+	if(op->error)
+	{
+		efree(op->error);
+	}
+	
+	efree(op->host);
+	efree(op);
+}
+
+/* Stops the watchers of op and removes it from the list of its connector */
+static void connector_op_unlink(connector_op *op)
+{
+	connector_object *obj = op->connector;
+	
+	if( ! obj)
+	{
+		return;
+	}
+	
+	if(obj->loop)
+	{
+		ev_io_stop(obj->loop, &op->io);
+		ev_timer_stop(obj->loop, &op->timer);
+	}
+	
+	if(op->prev)
+	{
+		op->prev->next = op->next;
+	}
+	else
+	{
+		obj->ops = op->next;
+	}
+	
+	if(op->next)
+	{
+		op->next->prev = op->prev;
+	}
+	
+	op->connector = NULL;
+}
+
+/* Drops the self reference once no attempt is in progress, the object might be freed */
+static void connector_release_if_idle(connector_object *obj TSRMLS_DC)
+{
+	zval *self = obj->this;
+	
+	if( ! self || obj->ops)
+	{
+		return;
+	}
+	
+	obj->this = NULL;
+	
+	zval_ptr_dtor(&self);
+}
+
+/* Calls the callback of op with ($stream, null) or (false, $error) and frees op */
+static void connector_op_finish(connector_op *op, zval *stream TSRMLS_DC)
+{
+	connector_object *obj = op->connector;
+	zval *retval = NULL;
+	zval *zerror;
+	zval **params[2] = { &stream, &zerror };
+	
+	connector_op_unlink(op);
+	
+	MAKE_STD_ZVAL(zerror);
+	
+	if(op->error)
+	{
+		ZVAL_STRING(zerror, op->error, 1);
+	}
+	else
+	{
+		ZVAL_NULL(zerror);
+	}
+	
+	libev_call_function(op->callback, &op->fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+	
+	zval_ptr_dtor(&zerror);
+	
+	/* Timed out during the lookup, connector_resolved() frees it */
+	if( ! op->resolving)
+	{
+		connector_op_free(op);
+	}
+	
+	connector_release_if_idle(obj TSRMLS_CC);
+}
+
+/* Reports the failure of op on the next loop iteration, so the callback is
+   never called from within connect() */
+static void connector_op_fail(connector_op *op, const char *error)
+{
+	if( ! op->error)
+	{
+		op->error = estrdup(error);
+	}
+	
+	if(op->fd >= 0)
+	{
+		ev_io_stop(op->connector->loop, &op->io);
+		close(op->fd);
+		op->fd = -1;
+	}
+	
+	ev_timer_stop(op->connector->loop, &op->timer);
+	ev_timer_set(&op->timer, 0., 0.);
+	ev_timer_start(op->connector->loop, &op->timer);
+}
+
+/* Starts connecting to the next resolved address, fails if none is left */
+static void connector_op_try_next(connector_op *op)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin   = (struct sockaddr_in *) &ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+	socklen_t len;
+	zval **address;
+	int error = ECONNREFUSED;
+	
+	while(zend_hash_index_find(Z_ARRVAL_P(op->addresses), op->next_address++, (void **) &address) == SUCCESS)
+	{
+		memset(&ss, 0, sizeof(ss));
+		
+		if(Z_TYPE_PP(address) != IS_STRING)
+		{
+			continue;
+		}
+		
+		if(inet_pton(AF_INET, Z_STRVAL_PP(address), &sin->sin_addr) == 1)
+		{
+			sin->sin_family = AF_INET;
+			sin->sin_port   = htons(op->port);
+			len = sizeof(struct sockaddr_in);
+		}
+		else if(inet_pton(AF_INET6, Z_STRVAL_PP(address), &sin6->sin6_addr) == 1)
+		{
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port   = htons(op->port);
+			len = sizeof(struct sockaddr_in6);
+		}
+		else
+		{
+			continue;
+		}
+		
+		if((op->fd = connector_socket(ss.ss_family)) < 0)
+		{
+			error = errno;
+			
+			continue;
+		}
+		
+		if(connect(op->fd, (struct sockaddr *) &ss, len) == 0 || errno == EINPROGRESS)
+		{
+			/* Writable once connected or failed, SO_ERROR tells which */
+			ev_io_set(&op->io, op->fd, EV_WRITE);
+			ev_io_start(op->connector->loop, &op->io);
+			
+			return;
+		}
+		
+		error = errno;
+		
+		close(op->fd);
+		op->fd = -1;
+	}
+	
+	connector_op_fail(op, strerror(error));
+}
+
+static void connector_resolved(void *arg, zval *result, const char *error TSRMLS_DC)
+{
+	connector_op *op = (connector_op *) arg;
+	
+	op->resolving = 0;
+	
+	/* Cancelled meanwhile */
+	if( ! op->connector)
+	{
+		connector_op_free(op);
+		
+		return;
+	}
+	
+	if(Z_TYPE_P(result) != IS_ARRAY)
+	{
+		connector_op_fail(op, error ? error : "Name does not resolve");
+		
+		return;
+	}
+	
+	zval_add_ref(&result);
+	op->addresses    = result;
+	op->next_address = 0;
+	
+	connector_op_try_next(op);
+}
+
+/* Starts a new connection for op, looking up the host if needed */
+static void connector_op_start(connector_op *op TSRMLS_DC)
+{
+	connector_object *obj = op->connector;
+	unsigned char addr[sizeof(struct in6_addr)];
+	
+	if(inet_pton(AF_INET, op->host, addr) == 1 || inet_pton(AF_INET6, op->host, addr) == 1)
+	{
+		MAKE_STD_ZVAL(op->addresses);
+		array_init_size(op->addresses, 1);
+		add_next_index_stringl(op->addresses, op->host, op->host_len, 1);
+		
+		connector_op_try_next(op);
+		
+		return;
+	}
+	
+	op->resolving = 1;
+	
+	if(resolver_lookup_ex(obj->resolver, op->host, op->host_len, connector_resolved, op TSRMLS_CC) != SUCCESS)
+	{
+		op->resolving = 0;
+		
+		connector_op_fail(op, "Resolver is not available");
+	}
+}
+
+static void connector_io_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	connector_op *op = (connector_op *) w;
+	php_stream *stream;
+	zval *zstream;
+	int error = 0;
+	socklen_t len = sizeof(error);
+	
+	ev_io_stop(loop, w);
+	
+	if(getsockopt(op->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+	{
+		error = errno;
+	}
+	
+	if(error)
+	{
+		close(op->fd);
+		op->fd = -1;
+		
+		if(op->pooled)
+		{
+			/* Broken idle connection, connect anew */
+			op->pooled = 0;
+			
+			connector_op_start(op TSRMLS_CC);
+		}
+		else if(op->next_address < zend_hash_num_elements(Z_ARRVAL_P(op->addresses)))
+		{
+			connector_op_try_next(op);
+		}
+		else
+		{
+			connector_op_fail(op, strerror(error));
+		}
+		
+		return;
+	}
+	
+	if( ! (stream = php_stream_sock_open_from_socket(op->fd, NULL)))
+	{
+		connector_op_fail(op, "Failed to create a stream");
+		
+		return;
+	}
+	
+	op->fd = -1;
+	
+	/* The socket is non-blocking, make the stream layer agree */
+	php_stream_set_option(stream, PHP_STREAM_OPTION_BLOCKING, 0, NULL);
+	
+	MAKE_STD_ZVAL(zstream);
+	php_stream_to_zval(stream, zstream);
+	
+	connector_op_finish(op, zstream TSRMLS_CC);
+	
+	zval_ptr_dtor(&zstream);
+}
+
+/* Timeout, or a failure to report */
+static void connector_timer_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	connector_op *op = (connector_op *)((char *) w - XtOffsetOf(connector_op, timer));
+	zval *result;
+	
+	if( ! op->error)
+	{
+		op->error = estrdup("Connection timed out");
+	}
+	
+	MAKE_STD_ZVAL(result);
+	ZVAL_BOOL(result, 0);
+	
+	connector_op_finish(op, result TSRMLS_CC);
+	
+	zval_ptr_dtor(&result);
+}
+
+/* Stops all attempts without calling their callbacks and closes the pool */
+static void connector_detach(connector_object *obj)
+{
+	connector_op *op;
+	
+	if( ! obj->loop)
+	{
+		return;
+	}
+	
+	while((op = obj->ops))
+	{
+		connector_op_unlink(op);
+		
+		/* The Resolver owns ops waiting for it */
+		if( ! op->resolving)
+		{
+			connector_op_free(op);
+		}
+	}
+	
+	connector_sweep_stop(obj);
+	ev_cleanup_stop(obj->loop, &obj->cleanup_watcher);
+	
+	zend_hash_clean(&obj->idle);
+	
+	obj->loop = NULL;
+}
+
+/* The EventLoop is being destroyed */
+static void connector_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	connector_object *obj = (connector_object *)((char *) w - XtOffsetOf(connector_object, cleanup_watcher));
+	
+	connector_detach(obj);
+	connector_release_if_idle(obj TSRMLS_CC);
+}
+
+FREE_STORAGE(connector_object,
+
+	connector_detach(obj);
+	
+	zend_hash_destroy(&obj->idle);
+	
+	if(obj->resolver)
+	{
+		zval_ptr_dtor(&obj->resolver);
+	}
+)
+
+CREATE_HANDLER(connector_object, connector_object, connector_object_free, connector_object_handlers,
+	zend_hash_init(&obj->idle, 0, NULL, connector_idle_dtor, 0);
+	
+	obj->max_idle     = 8;
+	obj->idle_timeout = 60.;
+)
+
+
+/* Splits "host:port", "[host]:port" or "tcp://host:port" into *host (not
+   terminated) and *port, returns 0 if invalid */
+static int connector_parse_address(const char *address, int address_len, const char **host, int *host_len, unsigned short *port)
+{
+	const char *end = address + address_len;
+	const char *colon;
+	char *port_end;
+	long portnum;
+	
+	if(address_len > 6 && strncasecmp(address, "tcp://", 6) == 0)
+	{
+		address += 6;
+	}
+	
+	if(*address == '[')
+	{
+		*host = ++address;
+		
+		if( ! (colon = memchr(address, ']', end - address)) || colon + 1 >= end || colon[1] != ':')
+		{
+			return 0;
+		}
+		
+		*host_len = (int) (colon - address);
+		colon++;
+	}
+	else
+	{
+		*host = address;
+		
+		if( ! (colon = memchr(address, ':', end - address)) || memchr(colon + 1, ':', end - colon - 1))
+		{
+			return 0;
+		}
+		
+		*host_len = (int) (colon - address);
+	}
+	
+	portnum = strtol(colon + 1, &port_end, 10);
+	
+	if(*host_len < 1 || port_end != end || portnum < 1 || portnum > 65535)
+	{
+		return 0;
+	}
+	
+	*port = (unsigned short) portnum;
+	
+	return 1;
+}
+
+/**
+ * Creates a connector for $loop.
+ * 
+ * Options:
+ *  * "resolver":     libev\Resolver used for host names, without one only
+ *                    numeric addresses can be connected to
+ *  * "max_idle":     int, idle connections kept per address, default 8
+ *  * "idle_timeout": double, seconds an idle connection is kept, default 60,
+ *                    0 keeps them until they break
+ * 
+ * @param  EventLoop
+ * @param  array
+ */
+PHP_METHOD(Connector, __construct)
+{
+	zval *zloop;
+	zval *zoptions = NULL;
+	zval **entry;
+	connector_object *obj = (connector_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	PARSE_PARAMETERS(Connector, "O|a", &zloop, event_loop_ce, &zoptions);
+	
+	if(zoptions)
+	{
+		if(zend_hash_find(Z_ARRVAL_P(zoptions), "resolver", sizeof("resolver"), (void **) &entry) == SUCCESS && Z_TYPE_PP(entry) != IS_NULL)
+		{
+			if(Z_TYPE_PP(entry) != IS_OBJECT || ! instance_of_class(Z_OBJCE_P(*entry), resolver_ce))
+			{
+				zend_throw_exception(NULL, "libev\\Connector: option 'resolver' must be a libev\\Resolver", 1 TSRMLS_CC);
+				
+				return;
+			}
+			
+			zval_add_ref(entry);
+			obj->resolver = *entry;
+		}
+		
+		if(zend_hash_find(Z_ARRVAL_P(zoptions), "max_idle", sizeof("max_idle"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_long_ex(entry);
+			
+			obj->max_idle = Z_LVAL_PP(entry) < 0 ? 0 : Z_LVAL_PP(entry);
+		}
+		
+		if(zend_hash_find(Z_ARRVAL_P(zoptions), "idle_timeout", sizeof("idle_timeout"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_double_ex(entry);
+			
+			obj->idle_timeout = Z_DVAL_PP(entry) < 0. ? 0. : Z_DVAL_PP(entry);
+		}
+	}
+	
+	obj->loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop;
+	
+	if( ! obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\Connector: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	ev_timer_init(&obj->sweep_timer, connector_sweep_callback, 0., 0.);
+	
+	ev_cleanup_init(&obj->cleanup_watcher, connector_cleanup_callback);
+	ev_cleanup_start(obj->loop, &obj->cleanup_watcher);
+}
+
+/**
+ * Connects to $address ("host:port", "[host]:port" or "tcp://host:port"),
+ * reusing an idle connection to the same address if one is usable. The
+ * callback is called from the loop, never before connect() has returned.
+ * 
+ * Callback signature: callback(resource|false $stream, string|null $error),
+ * the stream is non-blocking.
+ * 
+ * @param  string
+ * @param  double  Seconds, including the name lookup, 0 waits forever
+ * @param  callback
+ * @return int     Id for Connector::cancel()
+ * @return false   if the EventLoop has been destroyed
+ */
+PHP_METHOD(Connector, connect)
+{
+	char *address;
+	int address_len;
+	double timeout;
+	const char *host;
+	int host_len;
+	unsigned short port;
+	unsigned char addr[sizeof(struct in6_addr)];
+	char *key;
+	connector_op *op;
+	connector_object *obj = (connector_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sdz", &address, &address_len, &timeout, &callback) != SUCCESS) {
+		return;
+	}
+	
+	CHECK_CALLBACK;
+	
+	if( ! obj->loop)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	if(strlen(address) != (size_t) address_len || ! connector_parse_address(address, address_len, &host, &host_len, &port))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Connector::connect(): invalid address '%s'", address);
+		
+		return;
+	}
+	
+	op = ecalloc(1, sizeof(connector_op));
+	
+	op->host     = estrndup(host, host_len);
+	op->host_len = host_len;
+	op->port     = port;
+	op->fd       = -1;
+	
+	if( ! obj->resolver && inet_pton(AF_INET, op->host, addr) != 1 && inet_pton(AF_INET6, op->host, addr) != 1)
+	{
+		efree(op->host);
+		efree(op);
+		
+		zend_throw_exception(NULL, "libev\\Connector::connect(): a Resolver is needed for host names", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	zval_add_ref(&callback);
+	op->callback  = callback;
+	op->fcc       = callback_fcc;
+	op->id        = ++obj->next_id;
+	op->connector = obj;
+	
+	if(obj->ops)
+	{
+		obj->ops->prev = op;
+	}
+	
+	op->next = obj->ops;
+	obj->ops = op;
+	
+	if( ! obj->this)
+	{
+		/* Independent reference to the object, held while connecting */
+		MAKE_STD_ZVAL(obj->this);
+		*obj->this = *getThis();
+		zval_copy_ctor(obj->this);
+		INIT_PZVAL(obj->this);
+	}
+	
+	ev_io_init(&op->io, connector_io_callback, -1, EV_WRITE);
+	ev_timer_init(&op->timer, connector_timer_callback, timeout, 0.);
+	
+	if(timeout > 0.)
+	{
+		ev_timer_start(obj->loop, &op->timer);
+	}
+	
+	key = zend_str_tolower_dup(address, address_len);
+	
+	if((op->fd = connector_checkout(obj, key, address_len)) >= 0)
+	{
+		/* Connected sockets are writable right away, its SO_ERROR is checked too */
+		op->pooled = 1;
+		
+		ev_io_set(&op->io, op->fd, EV_WRITE);
+		ev_io_start(obj->loop, &op->io);
+	}
+	else
+	{
+		connector_op_start(op TSRMLS_CC);
+	}
+	
+	efree(key);
+	
+	RETURN_LONG(op->id);
+}
+
+/**
+ * Cancels a connection attempt, its callback will not be called.
+ * 
+ * @param  int
+ * @return boolean  false if no attempt with the id is in progress
+ */
+PHP_METHOD(Connector, cancel)
+{
+	long id;
+	connector_op *op;
+	connector_object *obj = (connector_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &id) != SUCCESS) {
+		return;
+	}
+	
+	for(op = obj->ops; op; op = op->next)
+	{
+		if(op->id == id)
+		{
+			connector_op_unlink(op);
+			
+			/* The Resolver owns ops waiting for it, connector_resolved() frees it */
+			if( ! op->resolving)
+			{
+				connector_op_free(op);
+			}
+			
+			connector_release_if_idle(obj TSRMLS_CC);
+			
+			RETURN_BOOL(1);
+		}
+	}
+	
+	RETURN_BOOL(0);
+}
+
+/**
+ * Puts an idle connection to $address into the pool and closes $stream, a
+ * later connect() to the same address string will reuse it. Only release
+ * connections which have no unread data and no request in progress.
+ * 
+ * @param  resource  Stream returned by Connector::connect()
+ * @param  string    Address as passed to connect()
+ * @return boolean   false if the pool for the address is full or the
+ *                   connection is unusable, the stream is left open then
+ */
+PHP_METHOD(Connector, release)
+{
+	zval *zstream;
+	char *address;
+	int address_len;
+	char *key;
+	php_stream *stream;
+	php_socket_t fd;
+	connector_idle **list = NULL;
+	connector_idle *head = NULL;
+	connector_idle *entry;
+	long count = 0;
+	connector_object *obj = (connector_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "rs", &zstream, &address, &address_len) != SUCCESS) {
+		return;
+	}
+	
+	ZEND_FETCH_RESOURCE(stream, php_stream *, &zstream, -1, "stream", php_file_le_stream());
+	
+	if( ! obj->loop || php_stream_cast(stream, PHP_STREAM_AS_SOCKETD | PHP_STREAM_CAST_INTERNAL, (void *) &fd, 0) != SUCCESS || fd < 0)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	key = zend_str_tolower_dup(address, address_len);
+	
+	if(zend_hash_find(&obj->idle, key, address_len + 1, (void **) &list) == SUCCESS)
+	{
+		head = *list;
+		
+		for(entry = head; entry; entry = entry->next)
+		{
+			count++;
+		}
+	}
+	
+	if(count >= obj->max_idle || ! connector_fd_healthy((int) fd) || (fd = dup((int) fd)) < 0)
+	{
+		efree(key);
+		
+		RETURN_BOOL(0);
+	}
+	
+	fcntl((int) fd, F_SETFD, FD_CLOEXEC);
+	
+	entry = emalloc(sizeof(connector_idle));
+	
+	entry->fd    = (int) fd;
+	entry->since = ev_now(obj->loop);
+	entry->next  = head;
+	
+	/* Updating the hash would run connector_idle_dtor() on the parked list */
+	if(list)
+	{
+		*list = entry;
+	}
+	else
+	{
+		zend_hash_add(&obj->idle, key, address_len + 1, &entry, sizeof(entry), NULL);
+	}
+	
+	efree(key);
+	
+	/* Like fclose(), our duplicate keeps the connection open */
+	php_stream_close(stream);
+	
+	connector_sweep_start(obj);
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Returns the number of idle connections, to $address or in total.
+ * 
+ * @param  string
+ * @return int
+ */
+PHP_METHOD(Connector, getIdleCount)
+{
+	char *address = NULL;
+	int address_len = 0;
+	char *key;
+	connector_idle **list;
+	connector_idle *entry;
+	HashPosition pos;
+	long count = 0;
+	connector_object *obj = (connector_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|s", &address, &address_len) != SUCCESS) {
+		return;
+	}
+	
+	if(address)
+	{
+		key = zend_str_tolower_dup(address, address_len);
+		
+		if(zend_hash_find(&obj->idle, key, address_len + 1, (void **) &list) == SUCCESS)
+		{
+			for(entry = *list; entry; entry = entry->next)
+			{
+				count++;
+			}
+		}
+		
+		efree(key);
+		
+		RETURN_LONG(count);
+	}
+	
+	for(zend_hash_internal_pointer_reset_ex(&obj->idle, &pos);
+		zend_hash_get_current_data_ex(&obj->idle, (void **) &list, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(&obj->idle, &pos))
+	{
+		for(entry = *list; entry; entry = entry->next)
+		{
+			count++;
+		}
+	}
+	
+	RETURN_LONG(count);
+}
+
+/**
+ * Closes the idle connections, to $address or all.
+ * 
+ * @param  string
+ * @return void
+ */
+PHP_METHOD(Connector, closeIdle)
+{
+	char *address = NULL;
+	int address_len = 0;
+	char *key;
+	connector_object *obj = (connector_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|s", &address, &address_len) != SUCCESS) {
+		return;
+	}
+	
+	if( ! address)
+	{
+		zend_hash_clean(&obj->idle);
+		
+		return;
+	}
+	
+	key = zend_str_tolower_dup(address, address_len);
+	
+	zend_hash_del(&obj->idle, key, address_len + 1);
+	
+	efree(key);
+}
+
+
+static const zend_function_entry connector_methods[] = {
+	ZEND_ME(Connector, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(Connector, connect, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Connector, cancel, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Connector, release, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Connector, getIdleCount, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Connector, closeIdle, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
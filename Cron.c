@@ -0,0 +1,421 @@
+
+/*
+ * Cron expression scheduling for CronEvent.
+ * 
+ * The expression is parsed into bitmasks once, the next trigger time is then
+ * calculated in C by the ev_periodic reschedule callback, in local time.
+ * 
+ * Supported syntax, five whitespace separated fields:
+ * 
+ *   minute (0-59)  hour (0-23)  day of month (1-31)  month (1-12)  day of week (0-7)
+ * 
+ * Each field is a comma separated list of "*", "N" or "N-M", optionally
+ * followed by "/step". Months and days of week also accept three letter
+ * English names, and Sunday is both 0 and 7. If both day fields are restricted
+ * either one matching is enough, like in Vixie cron. The macros @yearly,
+ * @annually, @monthly, @weekly, @daily, @midnight and @hourly are also accepted.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <strings.h>
+
+/* How many years ahead to search for a match before giving up */
+#define CRON_MAX_YEARS 8
+
+static const char *const cron_month_names[] = {
+	"jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec", NULL
+};
+
+static const char *const cron_weekday_names[] = {
+	"sun", "mon", "tue", "wed", "thu", "fri", "sat", NULL
+};
+
+static const struct {
+	const char *name;
+	const char *expression;
+} cron_macros[] = {
+	{"@yearly",   "0 0 1 1 *"},
+	{"@annually", "0 0 1 1 *"},
+	{"@monthly",  "0 0 1 * *"},
+	{"@weekly",   "0 0 * * 0"},
+	{"@daily",    "0 0 * * *"},
+	{"@midnight", "0 0 * * *"},
+	{"@hourly",   "0 * * * *"},
+	{NULL, NULL}
+};
+
+/* Parses a number or a name (names[0] is min) at *p, returns -1 on failure */
+static int cron_parse_value(const char **p, int min, const char *const *names)
+{
+	int value = 0;
+	int i;
+	
+	if(isdigit((unsigned char) **p))
+	{
+		while(isdigit((unsigned char) **p) && value < 1000)
+		{
+			value = value * 10 + (*(*p)++ - '0');
+		}
+		
+		return value;
+	}
+	
+	for(i = 0; names && names[i]; i++)
+	{
+		if(strncasecmp(*p, names[i], 3) == 0)
+		{
+			*p += 3;
+			
+			return min + i;
+		}
+	}
+	
+	return -1;
+}
+
+/* Parses one field at *p into bits, returns 0 on failure, *star is set if the
+   field starts with "*" */
+static int cron_parse_field(const char **p, uint64_t *bits, int min, int max, const char *const *names, int *star)
+{
+	int from;
+	int to;
+	int step;
+	int range;
+	int i;
+	
+	*bits = 0;
+	*star = **p == '*';
+	
+	do
+	{
+		if(**p == '*')
+		{
+			(*p)++;
+			
+			from  = min;
+			to    = max;
+			range = 1;
+		}
+		else
+		{
+			if((from = cron_parse_value(p, min, names)) < 0)
+			{
+				return 0;
+			}
+			
+			to    = from;
+			range = **p == '-';
+			
+			if(range)
+			{
+				(*p)++;
+				
+				if((to = cron_parse_value(p, min, names)) < 0)
+				{
+					return 0;
+				}
+			}
+		}
+		
+		step = 1;
+		
+		if(**p == '/')
+		{
+			(*p)++;
+			
+			if( ! isdigit((unsigned char) **p) || (step = cron_parse_value(p, min, NULL)) < 1)
+			{
+				return 0;
+			}
+			
+			/* "N/step" means "N-max/step" */
+			if( ! range)
+			{
+				to = max;
+			}
+		}
+		
+		if(from < min || to > max || from > to)
+		{
+			return 0;
+		}
+		
+		for(i = from; i <= to; i += step)
+		{
+			*bits |= (uint64_t) 1 << i;
+		}
+	}
+	while(*(*p)++ == ',');
+	
+	(*p)--;
+	
+	return **p == '\0' || isspace((unsigned char) **p);
+}
+
+/* Parses a cron expression into spec, returns 0 if it is invalid */
+static int cron_parse(const char *expression, cron_spec *spec)
+{
+	const char *p = expression;
+	uint64_t bits[5];
+	int star[5];
+	int i;
+	
+	static const struct {
+		int min;
+		int max;
+		const char *const *names;
+	} fields[5] = {
+		{0, 59, NULL},
+		{0, 23, NULL},
+		{1, 31, NULL},
+		{1, 12, cron_month_names},
+		{0,  7, cron_weekday_names}
+	};
+	
+	while(isspace((unsigned char) *p))
+	{
+		p++;
+	}
+	
+	if(*p == '@')
+	{
+		for(i = 0; cron_macros[i].name; i++)
+		{
+			if(strcasecmp(p, cron_macros[i].name) == 0)
+			{
+				return cron_parse(cron_macros[i].expression, spec);
+			}
+		}
+		
+		return 0;
+	}
+	
+	for(i = 0; i < 5; i++)
+	{
+		if( ! cron_parse_field(&p, &bits[i], fields[i].min, fields[i].max, fields[i].names, &star[i]))
+		{
+			return 0;
+		}
+		
+		while(isspace((unsigned char) *p))
+		{
+			p++;
+		}
+	}
+	
+	if(*p != '\0')
+	{
+		return 0;
+	}
+	
+	/* Sunday is both 0 and 7 */
+	if(bits[4] & (1 << 7))
+	{
+		bits[4] = (bits[4] | 1) & ~((uint64_t) 1 << 7);
+	}
+	
+	spec->minutes  = bits[0];
+	spec->hours    = (uint32_t) bits[1];
+	spec->days     = (uint32_t) bits[2];
+	spec->months   = (uint16_t) bits[3];
+	spec->weekdays = (uint8_t) bits[4];
+	spec->day_or   = ! star[2] && ! star[4];
+	
+	return 1;
+}
+
+static inline int cron_day_matches(const cron_spec *spec, const struct tm *tm)
+{
+	int mday = (spec->days >> tm->tm_mday) & 1;
+	int wday = (spec->weekdays >> tm->tm_wday) & 1;
+	
+	return spec->day_or ? mday || wday : mday && wday;
+}
+
+/* Returns the first time matching spec which is later than now, 0 if there is
+   none within CRON_MAX_YEARS */
+static double cron_next(const cron_spec *spec, double now)
+{
+	time_t t = (time_t) (floor(now / 60.) * 60.) + 60;
+	time_t next;
+	struct tm tm;
+	int last_year;
+	
+	localtime_r(&t, &tm);
+	
+	last_year = tm.tm_year + CRON_MAX_YEARS;
+	
+	while(tm.tm_year <= last_year)
+	{
+		if( ! ((spec->months >> (tm.tm_mon + 1)) & 1))
+		{
+			tm.tm_mon++;
+			tm.tm_mday = 1;
+			tm.tm_hour = 0;
+			tm.tm_min  = 0;
+		}
+		else if( ! cron_day_matches(spec, &tm))
+		{
+			tm.tm_mday++;
+			tm.tm_hour = 0;
+			tm.tm_min  = 0;
+		}
+		else if( ! ((spec->hours >> tm.tm_hour) & 1))
+		{
+			tm.tm_hour++;
+			tm.tm_min = 0;
+		}
+		else if( ! ((spec->minutes >> tm.tm_min) & 1))
+		{
+			tm.tm_min++;
+		}
+		else
+		{
+			return (double) t;
+		}
+		
+		tm.tm_sec   = 0;
+		tm.tm_isdst = -1;
+		
+		next = mktime(&tm);
+		
+		/* Daylight saving time transitions can make mktime() step backwards */
+		t = next > t ? next : t + 60;
+		
+		localtime_r(&t, &tm);
+	}
+	
+	return 0.;
+}
+
+static ev_tstamp cron_reschedule_callback(ev_periodic *w, ev_tstamp now)
+{
+	double next = cron_next(&((cron_watcher *) w)->spec, now);
+	
+	/* Never, libev requires a time later than now */
+	return next > 0. ? next : now + 1e30;
+}
+
+/**
+ * Triggers at the times matching a cron expression, evaluated in local time.
+ * The expression is parsed once and the next time is calculated without
+ * calling PHP.
+ * 
+ * Format: "minute hour day-of-month month day-of-week", each field being
+ * a comma separated list of "*", "N" or "N-M" with an optional "/step".
+ * Months and days of week also accept three letter English names, and
+ * @yearly, @monthly, @weekly, @daily and @hourly are accepted as well.
+ * 
+ * @param  callback
+ * @param  string  Cron expression, eg. "30 9-17 * * mon-fri"
+ */
+PHP_METHOD(CronEvent, __construct)
+{
+	char *expression;
+	int expression_len;
+	cron_spec spec;
+	event_object *obj;
+	cron_watcher *w;
+	dCALLBACK;
+	
+	PARSE_PARAMETERS(CronEvent, "zs", &callback, &expression, &expression_len);
+	
+	CHECK_CALLBACK;
+	
+	if(strlen(expression) != (size_t) expression_len || ! cron_parse(expression, &spec))
+	{
+		zend_throw_exception(NULL, "libev\\CronEvent: Invalid cron expression.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(cron_next(&spec, ev_time()) == 0.)
+	{
+		zend_throw_exception(NULL, "libev\\CronEvent: Cron expression never matches.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	EVENT_OBJECT_PREPARE(obj, callback);
+	
+	w = (cron_watcher *)obj->watcher;
+	
+	w->spec       = spec;
+	w->expression = estrndup(expression, expression_len);
+	
+	ev_periodic_init(&w->periodic, event_callback, 0., 0., cron_reschedule_callback);
+}
+
+/**
+ * Returns the cron expression.
+ * 
+ * @return string
+ */
+PHP_METHOD(CronEvent, getExpression)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	cron_watcher *w = (cron_watcher *)obj->watcher;
+	
+	if( ! w->expression)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_STRING(w->expression, 1);
+}
+
+/**
+ * Returns the time the event is scheduled to trigger next, only valid when
+ * the event is active.
+ * 
+ * @return double
+ * @return false  if the event is not active
+ */
+PHP_METHOD(CronEvent, getTime)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! event_is_active(obj))
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_DOUBLE(event_periodic_at(obj));
+}
+
+/**
+ * Calculates the first time matching the expression which is later than $time.
+ * 
+ * @param  double  Unix timestamp, defaults to the current time
+ * @return double
+ * @return false   if the expression does not match within the next years
+ */
+PHP_METHOD(CronEvent, getNextTime)
+{
+	double time = 0.;
+	double next;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|d", &time) != SUCCESS) {
+		return;
+	}
+	
+	if( ! ((cron_watcher *)obj->watcher)->expression)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	if( ! ZEND_NUM_ARGS())
+	{
+		time = ev_time();
+	}
+	
+	if((next = cron_next(&((cron_watcher *)obj->watcher)->spec, time)) == 0.)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_DOUBLE(next);
+}
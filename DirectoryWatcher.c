@@ -0,0 +1,943 @@
+
+/*
+ * Recursive directory watching with inotify, for trees too large for one
+ * StatEvent per file.
+ * 
+ * All DirectoryWatchers of a loop share one inotify descriptor. inotify
+ * returns the same watch descriptor when a directory is added twice, so every
+ * wd maps to a list of dir_watches, one per DirectoryWatcher watching the
+ * directory.
+ * 
+ * Directories are found with readdir(), d_type tells them apart from files
+ * and where it is unknown inotify_add_watch() with IN_ONLYDIR fails for
+ * files, so nothing is stat()ed. Changes are collected per path and delivered
+ * in batches once no further event has arrived for the path for the debounce
+ * delay, the pending changes are kept in order of their last event so a single
+ * timer serves all of them.
+ */
+
+#include <dirent.h>
+#include <sys/inotify.h>
+
+/* Flags of the changes reported by DirectoryWatcher */
+#define DIR_WATCH_CREATED    1
+#define DIR_WATCH_MODIFIED   2
+#define DIR_WATCH_ATTRIB     4
+#define DIR_WATCH_DELETED    8
+#define DIR_WATCH_MOVED_FROM 16
+#define DIR_WATCH_MOVED_TO   32
+#define DIR_WATCH_IS_DIR     64
+#define DIR_WATCH_OVERFLOW   128
+
+#define DIR_WATCH_ALL (DIR_WATCH_CREATED | DIR_WATCH_MODIFIED | DIR_WATCH_ATTRIB | \
+	DIR_WATCH_DELETED | DIR_WATCH_MOVED_FROM | DIR_WATCH_MOVED_TO)
+
+/* Events every watched directory needs, to follow the tree */
+#define DIR_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+	IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_MASK_ADD)
+
+/* Room for at least 256 events with a name of NAME_MAX */
+#define DIR_WATCH_BUFFER_SIZE 65536
+
+/* Reads of the inotify descriptor per wakeup */
+#define DIR_WATCH_READ_BATCH 16
+
+struct dir_watcher_object;
+
+/* Directory watched for a DirectoryWatcher */
+typedef struct dir_watch {
+	struct dir_watch          *next;   /* Next dir_watch of the same wd */
+	struct dir_watcher_object *owner;
+	int                       wd;
+	int                       len;
+	char                      path[1];
+} dir_watch;
+
+/* Change waiting for the debounce delay to pass */
+typedef struct dir_change {
+	struct dir_change *prev;
+	struct dir_change *next;
+	ev_tstamp         at;      /* Time of the last event for the path */
+	long              flags;   /* DIR_WATCH_* of all its events */
+	int               len;
+	char              path[1];
+} dir_change;
+
+/* The inotify descriptor shared by the DirectoryWatchers of a loop */
+typedef struct dir_inotify {
+	struct ev_loop            *loop;
+	event_loop_object         *loop_obj;  /* NULL once the EventLoop object has been freed */
+	int                       fd;
+	ev_io                     watcher;
+	ev_cleanup                cleanup_watcher;
+	HashTable                 watches;    /* wd => first dir_watch of the wd */
+	struct dir_watcher_object *watchers;  /* Open DirectoryWatchers */
+	char                      *buf;
+} dir_inotify;
+
+typedef struct dir_watcher_object {
+	zend_object    std;
+	zval           *this;        /* Reference keeping the object alive while open */
+	dir_inotify    *inotify;     /* NULL once closed or the loop was destroyed */
+	struct dir_watcher_object *prev;
+	struct dir_watcher_object *next;
+	zval           *callback;
+	zend_fcall_info_cache fcc;
+	char           *path;
+	int            path_len;
+	int            recursive;
+	long           events;       /* DIR_WATCH_* to report */
+	double         debounce;
+	HashTable      dirs;         /* path => dir_watch */
+	HashTable      changes;      /* path => dir_change */
+	dir_change     *head;        /* Oldest change */
+	dir_change     *tail;
+	ev_timer       timer;        /* Expires when head is due */
+	int            limit_warned; /* Warned about the inotify watch limit */
+} dir_watcher_object;
+
+/* Argument of dir_watch_remove_below() */
+typedef struct dir_prefix {
+	const char *path;
+	int        len;
+} dir_prefix;
+
+zend_class_entry *dir_watcher_ce;
+
+zend_object_handlers dir_watcher_object_handlers;
+
+
+/* Frees in once no DirectoryWatcher uses it anymore */
+static void dir_inotify_release(dir_inotify *in)
+{
+	if(in->watchers)
+	{
+		return;
+	}
+	
+	ev_io_stop(in->loop, &in->watcher);
+	ev_cleanup_stop(in->loop, &in->cleanup_watcher);
+	
+	close(in->fd);
+	
+	zend_hash_destroy(&in->watches);
+	
+	if(in->loop_obj)
+	{
+		in->loop_obj->inotify = NULL;
+	}
+	
+	efree(in->buf);
+	efree(in);
+}
+
+/* The EventLoop object is freed, but its ev_loop might live on */
+static void dir_inotify_loop_freed(event_loop_object *loop_obj)
+{
+	if(loop_obj->inotify)
+	{
+		loop_obj->inotify->loop_obj = NULL;
+		loop_obj->inotify = NULL;
+	}
+}
+
+/* Destructor of dir_watcher_object->dirs, unlinks the dir_watch from its wd
+   and removes the inotify watch if it was the last one */
+static void dir_watch_dtor(void *data)
+{
+	dir_watch *w = *(dir_watch **) data;
+	dir_inotify *in = w->owner->inotify;
+	dir_watch **p;
+	
+	if(zend_hash_index_find(&in->watches, w->wd, (void **) &p) == SUCCESS)
+	{
+		for(; *p; p = &(*p)->next)
+		{
+			if(*p == w)
+			{
+				*p = w->next;
+				
+				break;
+			}
+		}
+		
+		if(zend_hash_index_find(&in->watches, w->wd, (void **) &p) == SUCCESS && ! *p)
+		{
+			zend_hash_index_del(&in->watches, w->wd);
+			
+			/* Fails harmlessly if the kernel has already removed it */
+			inotify_rm_watch(in->fd, w->wd);
+		}
+	}
+	
+	efree(w);
+}
+
+/* Adds path to the watched directories, returns 0 and sets errno if path is
+   not a directory or cannot be watched */
+static int dir_watcher_add(dir_watcher_object *obj, const char *path, int len)
+{
+	dir_inotify *in = obj->inotify;
+	dir_watch *w;
+	dir_watch **found;
+	dir_watch *head = NULL;
+	dir_watch **p;
+	uint32_t mask = DIR_WATCH_MASK;
+	int wd;
+	
+	if(obj->events & DIR_WATCH_MODIFIED)
+	{
+		mask |= IN_MODIFY | IN_CLOSE_WRITE;
+	}
+	
+	if(obj->events & DIR_WATCH_ATTRIB)
+	{
+		mask |= IN_ATTRIB;
+	}
+	
+	if((wd = inotify_add_watch(in->fd, path, mask)) < 0)
+	{
+		return 0;
+	}
+	
+	if(zend_hash_find(&obj->dirs, path, len + 1, (void **) &found) == SUCCESS)
+	{
+		if((*found)->wd == wd)
+		{
+			return 1;
+		}
+		
+		/* Replaced by another directory of the same name */
+		zend_hash_del(&obj->dirs, path, len + 1);
+	}
+	
+	w = emalloc(sizeof(dir_watch) + len);
+	
+	w->owner = obj;
+	w->wd    = wd;
+	w->len   = len;
+	memcpy(w->path, path, len + 1);
+	
+	if(zend_hash_index_find(&in->watches, wd, (void **) &p) == SUCCESS)
+	{
+		w->next = *p;
+		*p = w;
+	}
+	else
+	{
+		w->next = NULL;
+		head    = w;
+		
+		zend_hash_index_update(&in->watches, wd, &head, sizeof(dir_watch *), NULL);
+	}
+	
+	zend_hash_update(&obj->dirs, path, len + 1, &w, sizeof(dir_watch *), NULL);
+	
+	return 1;
+}
+
+/* Removes dir_watches at or below a path, for zend_hash_apply_with_argument() */
+static int dir_watch_remove_below(void *data, void *arg TSRMLS_DC)
+{
+	dir_watch *w = *(dir_watch **) data;
+	dir_prefix *prefix = (dir_prefix *) arg;
+	
+	if(w->len >= prefix->len && memcmp(w->path, prefix->path, prefix->len) == 0 &&
+		(w->len == prefix->len || w->path[prefix->len] == '/' || prefix->path[prefix->len - 1] == '/'))
+	{
+		return ZEND_HASH_APPLY_REMOVE;
+	}
+	
+	return ZEND_HASH_APPLY_KEEP;
+}
+
+/* Sets path to dir/name, without doubling the slash of the root "/" */
+static int dir_path_join(char **path, const char *dir, int dir_len, const char *name)
+{
+	return spprintf(path, 0, "%s%s%s", dir, dir_len && dir[dir_len - 1] == '/' ? "" : "/", name);
+}
+
+/* Queues flags for path, delaying its delivery until debounce seconds after
+   the last change */
+static void dir_watcher_change(dir_watcher_object *obj, const char *path, int len, long flags)
+{
+	dir_change *c;
+	dir_change **found;
+	
+	if(zend_hash_find(&obj->changes, path, len + 1, (void **) &found) == SUCCESS)
+	{
+		c = *found;
+		c->flags |= flags;
+		
+		if(c == obj->tail)
+		{
+			c->at = ev_now(obj->inotify->loop);
+			
+			return;
+		}
+		
+		/* Move it to the tail, keeping the list ordered by time */
+		if(c->prev)
+		{
+			c->prev->next = c->next;
+		}
+		else
+		{
+			obj->head = c->next;
+		}
+		
+		c->next->prev = c->prev;
+	}
+	else
+	{
+		c = emalloc(sizeof(dir_change) + len);
+		
+		c->flags = flags;
+		c->len   = len;
+		memcpy(c->path, path, len + 1);
+		
+		zend_hash_update(&obj->changes, path, len + 1, &c, sizeof(dir_change *), NULL);
+	}
+	
+	c->at   = ev_now(obj->inotify->loop);
+	c->next = NULL;
+	c->prev = obj->tail;
+	
+	if(obj->tail)
+	{
+		obj->tail->next = c;
+	}
+	else
+	{
+		obj->head = c;
+	}
+	
+	obj->tail = c;
+	
+	if( ! ev_is_active(&obj->timer))
+	{
+		ev_timer_set(&obj->timer, obj->debounce, 0.);
+		ev_timer_start(obj->inotify->loop, &obj->timer);
+	}
+}
+
+/* Drops all pending changes */
+static void dir_watcher_changes_clear(dir_watcher_object *obj)
+{
+	dir_change *c;
+	
+	while((c = obj->head))
+	{
+		obj->head = c->next;
+		
+		efree(c);
+	}
+	
+	obj->tail = NULL;
+	
+	zend_hash_clean(&obj->changes);
+}
+
+/* Watches the directory path and, if recursive, all directories below it,
+   report queues every entry found as created */
+static void dir_watcher_scan(dir_watcher_object *obj, const char *path, int len, int report TSRMLS_DC)
+{
+	char **stack;
+	int size = 16;
+	int depth = 0;
+	char *dir;
+	char *child;
+	int dir_len;
+	int child_len;
+	DIR *d;
+	struct dirent *entry;
+	
+	stack = emalloc(size * sizeof(char *));
+	stack[depth++] = estrndup(path, len);
+	
+	while(depth)
+	{
+		dir     = stack[--depth];
+		dir_len = strlen(dir);
+		
+		if( ! dir_watcher_add(obj, dir, dir_len))
+		{
+			if(errno == ENOSPC && ! obj->limit_warned)
+			{
+				php_error_docref(NULL TSRMLS_CC, E_WARNING, "libev\\DirectoryWatcher: inotify watch limit reached, raise fs.inotify.max_user_watches, %s and others are not watched", dir);
+				
+				obj->limit_warned = 1;
+			}
+			
+			efree(dir);
+			
+			continue;
+		}
+		
+		if(( ! obj->recursive && ! report) || ! (d = opendir(dir)))
+		{
+			efree(dir);
+			
+			continue;
+		}
+		
+		while((entry = readdir(d)))
+		{
+			if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+			{
+				continue;
+			}
+			
+			child_len = dir_path_join(&child, dir, dir_len, entry->d_name);
+			
+			if(report)
+			{
+				dir_watcher_change(obj, child, child_len, DIR_WATCH_CREATED | (entry->d_type == DT_DIR ? DIR_WATCH_IS_DIR : 0));
+			}
+			
+			/* DT_UNKNOWN is told apart by dir_watcher_add() */
+			if(obj->recursive && (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN))
+			{
+				if(depth == size)
+				{
+					size *= 2;
+					stack = safe_erealloc(stack, size, sizeof(char *), 0);
+				}
+				
+				stack[depth++] = child;
+			}
+			else
+			{
+				efree(child);
+			}
+		}
+		
+		closedir(d);
+		efree(dir);
+	}
+	
+	efree(stack);
+}
+
+/* Handles an event of a directory watched by obj */
+static void dir_watcher_event(dir_watcher_object *obj, dir_watch *w, struct inotify_event *ev TSRMLS_DC)
+{
+	long flags = 0;
+	char *path;
+	int len;
+	dir_prefix prefix;
+	
+	if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+	{
+		/* Directories below the root are reported by their parent */
+		if(w->len != obj->path_len || memcmp(w->path, obj->path, w->len) != 0)
+		{
+			return;
+		}
+		
+		flags = DIR_WATCH_IS_DIR | (ev->mask & IN_DELETE_SELF ? DIR_WATCH_DELETED : DIR_WATCH_MOVED_FROM);
+	}
+	
+	flags |= ev->mask & IN_CREATE ? DIR_WATCH_CREATED : 0;
+	flags |= ev->mask & (IN_MODIFY | IN_CLOSE_WRITE) ? DIR_WATCH_MODIFIED : 0;
+	flags |= ev->mask & IN_ATTRIB ? DIR_WATCH_ATTRIB : 0;
+	flags |= ev->mask & IN_DELETE ? DIR_WATCH_DELETED : 0;
+	flags |= ev->mask & IN_MOVED_FROM ? DIR_WATCH_MOVED_FROM : 0;
+	flags |= ev->mask & IN_MOVED_TO ? DIR_WATCH_MOVED_TO : 0;
+	flags |= ev->mask & IN_ISDIR ? DIR_WATCH_IS_DIR : 0;
+	
+	if(ev->len)
+	{
+		len = dir_path_join(&path, w->path, w->len, ev->name);
+	}
+	else
+	{
+		path = estrndup(w->path, w->len);
+		len  = w->len;
+	}
+	
+	if((ev->mask & IN_ISDIR) && obj->recursive)
+	{
+		if(ev->mask & IN_MOVED_FROM)
+		{
+			/* Its watches would report the old paths */
+			prefix.path = path;
+			prefix.len  = len;
+			
+			zend_hash_apply_with_argument(&obj->dirs, dir_watch_remove_below, &prefix TSRMLS_CC);
+		}
+		
+		if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			/* Entries might have been created before the watch was added */
+			dir_watcher_scan(obj, path, len, 1 TSRMLS_CC);
+		}
+	}
+	
+	if(flags & obj->events)
+	{
+		dir_watcher_change(obj, path, len, flags & (obj->events | DIR_WATCH_IS_DIR));
+	}
+	
+	efree(path);
+}
+
+static void dir_inotify_callback(struct ev_loop *loop, ev_io *iow, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	dir_inotify *in = (dir_inotify *)((char *) iow - XtOffsetOf(dir_inotify, watcher));
+	dir_watcher_object *obj;
+	struct inotify_event *ev;
+	dir_watch **p;
+	dir_watch *w;
+	dir_watch *next;
+	ssize_t len;
+	char *pos;
+	int n;
+	
+	/* No PHP code runs here, callbacks are only called by the timers */
+	for(n = 0; n < DIR_WATCH_READ_BATCH; n++)
+	{
+		if((len = read(in->fd, in->buf, DIR_WATCH_BUFFER_SIZE)) <= 0)
+		{
+			break;
+		}
+		
+		for(pos = in->buf; pos < in->buf + len; pos += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (struct inotify_event *) pos;
+			
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				/* Events were lost, the application has to rescan */
+				for(obj = in->watchers; obj; obj = obj->next)
+				{
+					dir_watcher_change(obj, obj->path, obj->path_len, DIR_WATCH_OVERFLOW);
+				}
+				
+				continue;
+			}
+			
+			if(ev->mask & IN_IGNORED)
+			{
+				/* The directory is gone, the kernel has removed its watch */
+				while(zend_hash_index_find(&in->watches, ev->wd, (void **) &p) == SUCCESS && *p)
+				{
+					zend_hash_del(&(*p)->owner->dirs, (*p)->path, (*p)->len + 1);
+				}
+				
+				continue;
+			}
+			
+			if(zend_hash_index_find(&in->watches, ev->wd, (void **) &p) != SUCCESS)
+			{
+				continue;
+			}
+			
+			for(w = *p; w; w = next)
+			{
+				next = w->next;
+				
+				dir_watcher_event(w->owner, w, ev TSRMLS_CC);
+			}
+		}
+	}
+}
+
+/* Calls callback($watcher, $changes) */
+static void dir_watcher_call(dir_watcher_object *obj, zval *changes TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = obj->this;
+	zval **params[2] = { &self, &changes };
+	
+	libev_call_function(obj->callback, &obj->fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+}
+
+/* Delivers the changes which have been quiet for the debounce delay */
+static void dir_watcher_timer_callback(struct ev_loop *loop, ev_timer *t, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	dir_watcher_object *obj = (dir_watcher_object *)((char *) t - XtOffsetOf(dir_watcher_object, timer));
+	ev_tstamp due = ev_now(loop) - obj->debounce;
+	dir_change *c;
+	zval *changes;
+	zval *self;
+	
+	MAKE_STD_ZVAL(changes);
+	array_init(changes);
+	
+	/* Allow for the timer firing a tiny bit early */
+	while((c = obj->head) && c->at <= due + 1e-6)
+	{
+		if( ! (obj->head = c->next))
+		{
+			obj->tail = NULL;
+		}
+		else
+		{
+			obj->head->prev = NULL;
+		}
+		
+		add_assoc_long_ex(changes, c->path, c->len + 1, c->flags);
+		zend_hash_del(&obj->changes, c->path, c->len + 1);
+		
+		efree(c);
+	}
+	
+	if(obj->head)
+	{
+		ev_timer_set(t, obj->head->at - due, 0.);
+		ev_timer_start(loop, t);
+	}
+	
+	if(zend_hash_num_elements(Z_ARRVAL_P(changes)))
+	{
+		/* The callback might close the watcher and release the last reference */
+		self = obj->this;
+		zval_add_ref(&self);
+		
+		dir_watcher_call(obj, changes TSRMLS_CC);
+		
+		zval_ptr_dtor(&self);
+	}
+	
+	zval_ptr_dtor(&changes);
+}
+
+/* Stops watching and leaves the shared inotify descriptor */
+static void dir_watcher_detach(dir_watcher_object *obj)
+{
+	dir_inotify *in = obj->inotify;
+	
+	if( ! in)
+	{
+		return;
+	}
+	
+	ev_timer_stop(in->loop, &obj->timer);
+	
+	dir_watcher_changes_clear(obj);
+	
+	/* dir_watch_dtor() needs obj->inotify */
+	zend_hash_clean(&obj->dirs);
+	
+	if(obj->prev)
+	{
+		obj->prev->next = obj->next;
+	}
+	else
+	{
+		in->watchers = obj->next;
+	}
+	
+	if(obj->next)
+	{
+		obj->next->prev = obj->prev;
+	}
+	
+	obj->prev    = NULL;
+	obj->next    = NULL;
+	obj->inotify = NULL;
+	
+	dir_inotify_release(in);
+}
+
+/* Drops the self reference, the object might be freed */
+static void dir_watcher_release(dir_watcher_object *obj TSRMLS_DC)
+{
+	zval *self = obj->this;
+	
+	obj->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* The EventLoop is being destroyed */
+static void dir_inotify_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	dir_inotify *in = (dir_inotify *)((char *) w - XtOffsetOf(dir_inotify, cleanup_watcher));
+	dir_watcher_object *obj;
+	int last = 0;
+	
+	/* Detaching the last watcher frees in */
+	while( ! last)
+	{
+		obj  = in->watchers;
+		last = ! obj->next;
+		
+		dir_watcher_detach(obj);
+		dir_watcher_release(obj TSRMLS_CC);
+	}
+}
+
+/* Returns the inotify descriptor shared by the DirectoryWatchers of loop_obj,
+   NULL and sets errno if it cannot be created */
+static dir_inotify *dir_inotify_get(event_loop_object *loop_obj)
+{
+	dir_inotify *in;
+	int fd;
+	
+	if(loop_obj->inotify)
+	{
+		return loop_obj->inotify;
+	}
+	
+	if((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+	{
+		return NULL;
+	}
+	
+	in = emalloc(sizeof(dir_inotify));
+	memset(in, 0, sizeof(dir_inotify));
+	
+	in->loop     = loop_obj->loop;
+	in->loop_obj = loop_obj;
+	in->fd       = fd;
+	in->buf      = emalloc(DIR_WATCH_BUFFER_SIZE);
+	
+	zend_hash_init(&in->watches, 0, NULL, NULL, 0);
+	
+	ev_io_init(&in->watcher, dir_inotify_callback, fd, EV_READ);
+	ev_io_start(in->loop, &in->watcher);
+	
+	ev_cleanup_init(&in->cleanup_watcher, dir_inotify_cleanup_callback);
+	ev_cleanup_start(in->loop, &in->cleanup_watcher);
+	
+	loop_obj->inotify = in;
+	
+	return in;
+}
+
+FREE_STORAGE(dir_watcher_object,
+
+	dir_watcher_detach(obj);
+	
+	zend_hash_destroy(&obj->dirs);
+	zend_hash_destroy(&obj->changes);
+	
+	if(obj->callback)
+	{
+		zval_ptr_dtor(&obj->callback);
+	}
+	
+	if(obj->path)
+	{
+		efree(obj->path);
+	}
+)
+
+CREATE_HANDLER(dir_watcher_object, dir_watcher_object, dir_watcher_object_free, dir_watcher_object_handlers,
+	obj->recursive = 1;
+	obj->events    = DIR_WATCH_ALL;
+	obj->debounce  = 0.1;
+	
+	zend_hash_init(&obj->dirs, 0, NULL, dir_watch_dtor, 0);
+	zend_hash_init(&obj->changes, 0, NULL, NULL, 0);
+	
+	ev_init(&obj->timer, dir_watcher_timer_callback);
+)
+
+
+/**
+ * Watches the directory $path and everything below it, using one inotify
+ * descriptor for all DirectoryWatchers of the EventLoop.
+ * 
+ * Changes are collected per path and delivered in batches, once no further
+ * change of a path has happened for the debounce delay, the flags of all its
+ * changes meanwhile are combined. Directories created later are watched as
+ * well, their entries are reported as created in case they were created
+ * before the watch was added.
+ * 
+ * Callback signature: callback(DirectoryWatcher $watcher, array $changes),
+ * $changes is path => flags (DirectoryWatcher::CREATED, MODIFIED, ATTRIB,
+ * DELETED, MOVED_FROM, MOVED_TO, plus IS_DIR for directories). OVERFLOW on
+ * $path means events were lost and the tree should be rescanned.
+ * 
+ * Options:
+ *  * "recursive": bool, watch subdirectories, default true
+ *  * "debounce": float, seconds a path has to be quiet before delivery, default 0.1
+ *  * "events": int, DirectoryWatcher flags to report, default all
+ * 
+ * Each directory takes one inotify watch, of which there are at most
+ * fs.inotify.max_user_watches per user.
+ * 
+ * @param  EventLoop
+ * @param  string
+ * @param  callback
+ * @param  array
+ */
+PHP_METHOD(DirectoryWatcher, __construct)
+{
+	zval *zloop;
+	zval *zoptions = NULL;
+	zval **entry;
+	char *path;
+	int path_len;
+	event_loop_object *loop_obj;
+	dir_watcher_object *obj = (dir_watcher_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	PARSE_PARAMETERS(DirectoryWatcher, "Osz|a", &zloop, event_loop_ce, &path, &path_len, &callback, &zoptions);
+	
+	CHECK_CALLBACK;
+	
+	if(zoptions && zend_hash_find(Z_ARRVAL_P(zoptions), "recursive", sizeof("recursive"), (void **) &entry) == SUCCESS)
+	{
+		convert_to_boolean_ex(entry);
+		
+		obj->recursive = Z_BVAL_PP(entry);
+	}
+	
+	if(zoptions && zend_hash_find(Z_ARRVAL_P(zoptions), "debounce", sizeof("debounce"), (void **) &entry) == SUCCESS)
+	{
+		convert_to_double_ex(entry);
+		
+		obj->debounce = Z_DVAL_PP(entry) < 0. ? 0. : Z_DVAL_PP(entry);
+	}
+	
+	if(zoptions && zend_hash_find(Z_ARRVAL_P(zoptions), "events", sizeof("events"), (void **) &entry) == SUCCESS)
+	{
+		convert_to_long_ex(entry);
+		
+		obj->events = Z_LVAL_PP(entry) & DIR_WATCH_ALL;
+	}
+	
+	/* Paths are reported below $path as given, without a trailing slash */
+	while(path_len > 1 && path[path_len - 1] == '/')
+	{
+		path_len--;
+	}
+	
+	loop_obj = (event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC);
+	
+	if( ! loop_obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\DirectoryWatcher: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(obj->inotify)
+	{
+		zend_throw_exception(NULL, "libev\\DirectoryWatcher: already watching", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if( ! (obj->inotify = dir_inotify_get(loop_obj)))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\DirectoryWatcher: inotify_init1() failed: %s", strerror(errno));
+		
+		return;
+	}
+	
+	obj->next = obj->inotify->watchers;
+	
+	if(obj->next)
+	{
+		obj->next->prev = obj;
+	}
+	
+	obj->inotify->watchers = obj;
+	
+	obj->path     = estrndup(path, path_len);
+	obj->path_len = path_len;
+	
+	if( ! dir_watcher_add(obj, obj->path, obj->path_len))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\DirectoryWatcher: cannot watch %s: %s", obj->path, strerror(errno));
+		
+		dir_watcher_detach(obj);
+		
+		return;
+	}
+	
+	dir_watcher_scan(obj, obj->path, obj->path_len, 0 TSRMLS_CC);
+	
+	zval_add_ref(&callback);
+	obj->callback = callback;
+	obj->fcc      = callback_fcc;
+	
+	/* Independent reference to the object, held while open */
+	MAKE_STD_ZVAL(obj->this);
+	*obj->this = *getThis();
+	zval_copy_ctor(obj->this);
+	INIT_PZVAL(obj->this);
+}
+
+/**
+ * Returns the watched path.
+ * 
+ * @return string
+ */
+PHP_METHOD(DirectoryWatcher, getPath)
+{
+	dir_watcher_object *obj = (dir_watcher_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! obj->path)
+	{
+		RETURN_NULL();
+	}
+	
+	RETURN_STRINGL(obj->path, obj->path_len, 1);
+}
+
+/**
+ * Returns the number of directories watched, ie. inotify watches used.
+ * 
+ * @return int
+ */
+PHP_METHOD(DirectoryWatcher, getWatchCount)
+{
+	dir_watcher_object *obj = (dir_watcher_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(zend_hash_num_elements(&obj->dirs));
+}
+
+/**
+ * Returns the number of changes waiting for their debounce delay.
+ * 
+ * @return int
+ */
+PHP_METHOD(DirectoryWatcher, getPendingCount)
+{
+	dir_watcher_object *obj = (dir_watcher_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(zend_hash_num_elements(&obj->changes));
+}
+
+/**
+ * Stops watching, pending changes are dropped.
+ * 
+ * @return void
+ */
+PHP_METHOD(DirectoryWatcher, close)
+{
+	dir_watcher_object *obj = (dir_watcher_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	dir_watcher_detach(obj);
+	dir_watcher_release(obj TSRMLS_CC);
+}
+
+
+static const zend_function_entry dir_watcher_methods[] = {
+	ZEND_ME(DirectoryWatcher, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(DirectoryWatcher, getPath, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(DirectoryWatcher, getWatchCount, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(DirectoryWatcher, getPendingCount, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(DirectoryWatcher, close, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
@@ -1,35 +1,51 @@
 
+
+/**
+ * Returns true if flags is a combination of the EventLoop::BACKEND_* and
+ * EventLoop::FLAG_* constants.
+ */
+static int is_valid_flags(long flags)
+{
+	return (flags & ~(EVBACKEND_ALL | EVFLAG_NOENV | EVFLAG_FORKCHECK |
+		EVFLAG_NOINOTIFY | EVFLAG_SIGNALFD | EVFLAG_NOSIGMASK)) == 0;
+}
+
 /**
  * Normal constructor for EventLoop instance.
+ * 
+ * @param  int  Any combination of the EventLoop::BACKEND_* and EventLoop::FLAG_*
+ *              constants, BACKEND_AUTO lets libev pick the best backend
  */
 PHP_METHOD(EventLoop, __construct)
 {
-	int backend = EVFLAG_AUTO;
+	long flags = EVFLAG_AUTO;
 	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
 	assert( ! obj->loop);
 	
-	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &backend) != SUCCESS) {
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &flags) != SUCCESS) {
 		return;
 	}
 	
 	/* Check parameter */
-	if(EVFLAG_AUTO       != backend &&
-	   EVBACKEND_SELECT  != backend &&
-	   EVBACKEND_POLL    != backend &&
-	   EVBACKEND_EPOLL   != backend &&
-	   EVBACKEND_KQUEUE  != backend &&
-	   EVBACKEND_DEVPOLL != backend &&
-	   EVBACKEND_PORT    != backend &&
-	   EVBACKEND_ALL     != backend) {
+	if( ! is_valid_flags(flags)) {
 		/* TODO: libev-specific exception class here */
-		zend_throw_exception(NULL, "libev\\EventLoop: backend parameter must be "
-			"one of the EventLoop::BACKEND_* constants.", 1 TSRMLS_CC);
+		zend_throw_exception(NULL, "libev\\EventLoop: flags parameter must be a combination "
+			"of the EventLoop::BACKEND_* and EventLoop::FLAG_* constants.", 1 TSRMLS_CC);
 		
 		return;
 	}
 	
-	obj->loop = ev_loop_new(backend);
+	obj->loop = ev_loop_new((unsigned int) flags);
+	
+	if( ! obj->loop) {
+		zend_throw_exception(NULL, "libev\\EventLoop: none of the requested backends "
+			"is available.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	LOOP_SET_TSRMLS(obj->loop);
 	
 	IF_DEBUG(ev_verify(obj->loop));
 }
@@ -39,36 +55,247 @@ PHP_METHOD(EventLoop, __construct)
  * and it is not recommended to use it unless you require ChildEvent watchers
  * as they can only be attached to the default loop.
  * 
+ * @param  int  Any combination of the EventLoop::BACKEND_* and EventLoop::FLAG_*
+ *              constants, only used by the call creating the default loop
  * @return EventLoop
  */
 PHP_METHOD(EventLoop, getDefaultLoop)
 {
+	long flags = EVFLAG_AUTO;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &flags) != SUCCESS) {
+		return;
+	}
+	
+	if( ! is_valid_flags(flags)) {
+		zend_throw_exception(NULL, "libev\\EventLoop: flags parameter must be a combination "
+			"of the EventLoop::BACKEND_* and EventLoop::FLAG_* constants.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
 	/* Singleton */
-	if( ! default_event_loop_object)
+	if( ! LIBEV_G(default_event_loop_object))
 	{
-		ALLOC_INIT_ZVAL(default_event_loop_object);
+#ifdef ZTS
+		/* ev_default_loop is shared by the whole process */
+		tsrm_mutex_lock(default_loop_mutex);
+		
+		if(default_loop_owner && default_loop_owner != TSRMLS_C)
+		{
+			tsrm_mutex_unlock(default_loop_mutex);
+			
+			zend_throw_exception(NULL, "libev\\EventLoop: the default loop is in use "
+				"by another thread.", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		default_loop_owner = TSRMLS_C;
+		
+		tsrm_mutex_unlock(default_loop_mutex);
+#endif
+		
+		ALLOC_INIT_ZVAL(LIBEV_G(default_event_loop_object));
 		
 		/* Create object without calling constructor, we now have an EventLoop missing the ev_loop */
-		if(object_init_ex(default_event_loop_object, event_loop_ce) != SUCCESS) {
+		if(object_init_ex(LIBEV_G(default_event_loop_object), event_loop_ce) != SUCCESS) {
 			/* TODO: Error handling */
 			RETURN_BOOL(0);
 		
 			return;
 		}
 		
-		event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(default_event_loop_object TSRMLS_CC);
+		event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(LIBEV_G(default_event_loop_object) TSRMLS_CC);
 		
 		assert( ! obj->loop);
 		
-		/* TODO: allow other EVFLAGs */
-		obj->loop = ev_default_loop(EVFLAG_AUTO);
+		obj->loop = ev_default_loop((unsigned int) flags);
+		
+		if( ! obj->loop) {
+			zval_ptr_dtor(&LIBEV_G(default_event_loop_object));
+			LIBEV_G(default_event_loop_object) = NULL;
+			
+#ifdef ZTS
+			tsrm_mutex_lock(default_loop_mutex);
+			default_loop_owner = NULL;
+			tsrm_mutex_unlock(default_loop_mutex);
+#endif
+			
+			zend_throw_exception(NULL, "libev\\EventLoop: none of the requested backends "
+				"is available.", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		LOOP_SET_TSRMLS(obj->loop);
+		
+#if HAVE_PIDFD
+		child_pidfd_reaper_start(obj->loop);
+#endif
 		
 		IF_DEBUG(ev_verify(obj->loop));
 		IF_DEBUG(libev_printf("Created default_event_loop_object\n"));
 	}
 	
 	/* Return copy, no destruct on our local zval */
-	RETURN_ZVAL(default_event_loop_object, 1, 0);
+	RETURN_ZVAL(LIBEV_G(default_event_loop_object), 1, 0);
+}
+
+/**
+ * Returns the named persistent event loop, the underlying libev loop is kept
+ * alive between requests so the kernel backend state (epoll/kqueue descriptors,
+ * signal pipes etc.) does not have to be rebuilt for every request.
+ * 
+ * Only the ev_loop survives the request, all Event objects are stopped and
+ * detached from it when the request ends and CleanupEvents are NOT invoked.
+ * Within a request the same EventLoop object is returned for the same name.
+ * 
+ * Requires the libev.persistent_loops INI setting to be enabled.
+ * 
+ * @param  string  Name identifying the loop
+ * @param  int     Any combination of the EventLoop::BACKEND_* and EventLoop::FLAG_*
+ *                 constants, only used when the loop is created
+ * @return EventLoop
+ */
+PHP_METHOD(EventLoop, getPersistentLoop)
+{
+	char *name;
+	int name_len;
+	long flags = EVFLAG_AUTO;
+	persistent_loop *entry;
+	event_loop_object *obj;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|l", &name, &name_len, &flags) != SUCCESS) {
+		return;
+	}
+	
+	if( ! INI_BOOL("libev.persistent_loops"))
+	{
+		zend_throw_exception(NULL, "libev\\EventLoop: persistent loops require "
+			"the libev.persistent_loops INI setting to be enabled.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if( ! is_valid_flags(flags))
+	{
+		zend_throw_exception(NULL, "libev\\EventLoop: flags parameter must be a combination "
+			"of the EventLoop::BACKEND_* and EventLoop::FLAG_* constants.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(zend_hash_find(&LIBEV_G(persistent_loops), name, name_len + 1, (void **)&entry) != SUCCESS)
+	{
+		persistent_loop new_entry;
+		
+		new_entry.loop   = ev_loop_new((unsigned int) flags);
+		new_entry.object = NULL;
+		
+		if( ! new_entry.loop)
+		{
+			zend_throw_exception(NULL, "libev\\EventLoop: could not create the "
+				"persistent loop.", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		LOOP_SET_TSRMLS(new_entry.loop);
+		
+		zend_hash_add(&LIBEV_G(persistent_loops), name, name_len + 1, &new_entry, sizeof(persistent_loop), (void **)&entry);
+		
+		IF_DEBUG(libev_printf("Created persistent loop %s\n", name));
+	}
+	
+	if( ! entry->object)
+	{
+		ALLOC_INIT_ZVAL(entry->object);
+		
+		/* Create object without calling constructor, the ev_loop is already present */
+		if(object_init_ex(entry->object, event_loop_ce) != SUCCESS) {
+			zval_ptr_dtor(&entry->object);
+			entry->object = NULL;
+			
+			RETURN_BOOL(0);
+		}
+		
+		obj = (event_loop_object *)zend_object_store_get_object(entry->object TSRMLS_CC);
+		
+		obj->loop       = entry->loop;
+		obj->persistent = 1;
+		
+		IF_DEBUG(ev_verify(obj->loop));
+	}
+	
+	/* Return copy, the registry keeps its own reference until RSHUTDOWN */
+	RETURN_ZVAL(entry->object, 1, 0);
+}
+
+/**
+ * Returns true if the loop was obtained from EventLoop::getPersistentLoop().
+ * 
+ * @return boolean
+ */
+PHP_METHOD(EventLoop, isPersistent)
+{
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(obj->persistent);
+}
+
+/**
+ * Sets how the EventLoop holds on to the Events added to it, can only be
+ * changed while no Events are associated with the loop.
+ * 
+ * EventLoop::RETAIN_STRONG keeps added Events alive until they are removed or
+ * stopped, even if no variable references them (default).
+ * 
+ * EventLoop::RETAIN_WEAK does not keep a reference, an Event is stopped and
+ * removed from the loop when the last variable referencing it goes away.
+ * 
+ * @param  int  One of the EventLoop::RETAIN_* constants
+ * @return boolean  false if Events are associated with the loop
+ */
+PHP_METHOD(EventLoop, setRetainPolicy)
+{
+	long policy;
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &policy) != SUCCESS) {
+		return;
+	}
+	
+	if(policy != LOOP_RETAIN_STRONG && policy != LOOP_RETAIN_WEAK)
+	{
+		zend_throw_exception(NULL, "libev\\EventLoop: policy parameter must be "
+			"one of the EventLoop::RETAIN_* constants.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	/* The linked Events were added with the old policy */
+	if(obj->events)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	obj->retain = (int) policy;
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Returns the retain policy of the EventLoop, one of the EventLoop::RETAIN_*
+ * constants.
+ * 
+ * @return int
+ */
+PHP_METHOD(EventLoop, getRetainPolicy)
+{
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(obj->retain);
 }
 
 /**
@@ -87,6 +314,10 @@ PHP_METHOD(EventLoop, notifyFork)
 	{
 		ev_loop_fork(obj->loop);
 		
+		/* Jobs the worker threads of the parent were running are done as
+		   interrupted, on the next iteration like the reinitialization */
+		worker_pool_notify_fork();
+		
 		RETURN_BOOL(1);
 	}
 	
@@ -306,6 +537,359 @@ PHP_METHOD(EventLoop, run)
 	RETURN_BOOL(0);
 }
 
+/* Deadline of EventLoop::runFor() */
+static void run_timer_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	/* libev has stopped the timer, undo the ev_unref() of runFor() */
+	ev_ref(loop);
+	
+	ev_break(loop, EVBREAK_ONE);
+}
+
+/**
+ * Runs the event loop until $seconds have passed or $maxCallbacks Event
+ * callbacks have been invoked, whichever comes first. Like run() it also
+ * returns when no more events are attached.
+ * 
+ * The deadline is an internal timer which does not keep the loop alive, so
+ * this is considerably cheaper than calling run(EventLoop::RUN_NOWAIT)
+ * repeatedly. When the callback budget is reached the current loop iteration
+ * is completed first, so slightly more callbacks might be invoked.
+ * 
+ * @param  double  Maximum time to run, seconds, 0 = no deadline
+ * @param  int     Maximum number of callbacks, 0 = no limit
+ * @return int     The number of Event callbacks invoked
+ * @return false   if object is not initialized or already inside runFor()
+ */
+PHP_METHOD(EventLoop, runFor)
+{
+	double seconds;
+	long max_callbacks = 0;
+	long dispatched;
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "d|l", &seconds, &max_callbacks) != SUCCESS) {
+		return;
+	}
+	
+	assert(obj->loop);
+	
+	/* Nested runFor() calls would share the timer and counters */
+	if( ! obj->loop || obj->run_active)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	if(seconds > 0.)
+	{
+		/* The deadline is measured from now, not from the last loop iteration */
+		ev_now_update(obj->loop);
+		
+		ev_timer_init(&obj->run_timer, run_timer_callback, seconds, 0.);
+		ev_timer_start(obj->loop, &obj->run_timer);
+		
+		/* Do not let the deadline keep the loop running */
+		ev_unref(obj->loop);
+	}
+	
+	obj->run_active     = 1;
+	obj->run_budget     = max_callbacks > 0 ? max_callbacks : 0;
+	obj->run_dispatched = 0;
+	
+	ev_run(obj->loop, 0);
+	
+	obj->run_active     = 0;
+	
+	if(ev_is_active(&obj->run_timer))
+	{
+		ev_ref(obj->loop);
+		ev_timer_stop(obj->loop, &obj->run_timer);
+	}
+	
+	dispatched = obj->run_dispatched;
+	
+	obj->run_budget = 0;
+	
+	RETURN_LONG(dispatched);
+}
+
+#define LOOP_TIMER_TIMEOUT  0
+#define LOOP_TIMER_INTERVAL 1
+#define LOOP_TIMER_DEFER    2
+
+#define loop_timer_get(obj, i) \
+	(&(obj)->timer_slabs[(i) / LOOP_TIMER_SLAB_SIZE][(i) % LOOP_TIMER_SLAB_SIZE])
+
+/* Takes a free loop_timer from the pool, allocating a new slab if needed,
+   returns NULL if the maximum number of timers is reached */
+static loop_timer *loop_timer_alloc(event_loop_object *obj)
+{
+	loop_timer *slab;
+	loop_timer *t;
+	int base;
+	int i;
+	
+	if( ! obj->timer_free)
+	{
+		base = obj->timer_slab_count * LOOP_TIMER_SLAB_SIZE;
+		
+		if(base + LOOP_TIMER_SLAB_SIZE > LOOP_TIMER_INDEX_MASK + 1)
+		{
+			return NULL;
+		}
+		
+		slab = ecalloc(LOOP_TIMER_SLAB_SIZE, sizeof(loop_timer));
+		
+		obj->timer_slabs = erealloc(obj->timer_slabs, (obj->timer_slab_count + 1) * sizeof(loop_timer *));
+		obj->timer_slabs[obj->timer_slab_count++] = slab;
+		
+		/* Chain the new slots into the free list, lowest index first */
+		for(i = LOOP_TIMER_SLAB_SIZE - 1; i >= 0; i--)
+		{
+			slab[i].loop_obj   = obj;
+			slab[i].index      = base + i;
+			slab[i].generation = 1;
+			slab[i].next_free  = obj->timer_free;
+			obj->timer_free    = base + i + 1;
+		}
+	}
+	
+	t = loop_timer_get(obj, obj->timer_free - 1);
+	
+	obj->timer_free = t->next_free;
+	
+	return t;
+}
+
+/* Stops the timer and returns it to the pool, invalidating its handle */
+static void loop_timer_release(loop_timer *t TSRMLS_DC)
+{
+	event_loop_object *obj = t->loop_obj;
+	
+	ev_timer_stop(obj->loop, &t->timer);
+	
+	zval_ptr_dtor(&t->callback);
+	t->callback = NULL;
+	
+	/* Generation is kept positive so handles are always positive */
+	t->generation = (t->generation + 1) & (LONG_MAX >> LOOP_TIMER_INDEX_BITS);
+	
+	if( ! t->generation)
+	{
+		t->generation = 1;
+	}
+	
+	t->next_free    = obj->timer_free;
+	obj->timer_free = t->index + 1;
+}
+
+/* Finds the active timer for handle, NULL if it has been released */
+static loop_timer *loop_timer_find(event_loop_object *obj, long handle)
+{
+	long index = handle & LOOP_TIMER_INDEX_MASK;
+	loop_timer *t;
+	
+	if(handle <= 0 || index >= obj->timer_slab_count * LOOP_TIMER_SLAB_SIZE)
+	{
+		return NULL;
+	}
+	
+	t = loop_timer_get(obj, index);
+	
+	return t->callback && LOOP_TIMER_HANDLE(t) == handle ? t : NULL;
+}
+
+/* Stops and frees all timers, called when the EventLoop object is freed */
+static void loop_timers_free(event_loop_object *obj TSRMLS_DC)
+{
+	loop_timer *t;
+	int i;
+	
+	for(i = 0; i < obj->timer_slab_count * LOOP_TIMER_SLAB_SIZE; i++)
+	{
+		t = loop_timer_get(obj, i);
+		
+		if(t->callback)
+		{
+			/* A persistent ev_loop outlives us */
+			ev_timer_stop(obj->loop, &t->timer);
+			
+			zval_ptr_dtor(&t->callback);
+		}
+	}
+	
+	for(i = 0; i < obj->timer_slab_count; i++)
+	{
+		efree(obj->timer_slabs[i]);
+	}
+	
+	if(obj->timer_slabs)
+	{
+		efree(obj->timer_slabs);
+	}
+	
+	obj->timer_slabs      = NULL;
+	obj->timer_slab_count = 0;
+	obj->timer_free       = 0;
+}
+
+static void loop_timer_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	loop_timer *t  = (loop_timer *) w;
+	event_loop_object *obj = t->loop_obj;
+	long handle    = LOOP_TIMER_HANDLE(t);
+	zval *callback = t->callback;
+	zend_fcall_info_cache fcc = t->fcc;
+	zval *retval = NULL;
+	zval *arg;
+	zval **params[1] = { &arg };
+	
+	/* The callback might clear its own timer, keep the callback alive */
+	zval_add_ref(&callback);
+	
+	MAKE_STD_ZVAL(arg);
+	ZVAL_LONG(arg, handle);
+	
+	libev_call_function(callback, &fcc, 1, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+	
+	zval_ptr_dtor(&arg);
+	zval_ptr_dtor(&callback);
+	
+	/* One-shot timers are done, unless the callback cleared it already (the slot
+	   may even have been reused, hence the handle check) */
+	if(LOOP_TIMER_HANDLE(t) == handle && t->callback && ! ev_is_active(w))
+	{
+		loop_timer_release(t TSRMLS_CC);
+	}
+	
+	/* Counts towards the EventLoop::runFor() callback budget too */
+	if(++obj->run_dispatched == obj->run_budget)
+	{
+		ev_break(loop, EVBREAK_ONE);
+	}
+}
+
+/* Shared implementation of EventLoop::setTimeout(), setInterval() and defer() */
+static void loop_timer_method(INTERNAL_FUNCTION_PARAMETERS, int type)
+{
+	double after = 0.;
+	double repeat = 0.;
+	loop_timer *t;
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	if(type == LOOP_TIMER_DEFER)
+	{
+		if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) != SUCCESS) {
+			return;
+		}
+	}
+	else if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "zd", &callback, &after) != SUCCESS) {
+		return;
+	}
+	
+	CHECK_CALLBACK;
+	
+	if(type == LOOP_TIMER_INTERVAL)
+	{
+		if(after <= 0.)
+		{
+			zend_throw_exception(NULL, "libev\\EventLoop: interval must be positive.", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		repeat = after;
+	}
+	
+	if( ! obj->loop || ! (t = loop_timer_alloc(obj)))
+	{
+		RETURN_BOOL(0);
+	}
+	
+	zval_add_ref(&callback);
+	t->callback = callback;
+	t->fcc      = callback_fcc;
+	
+	ev_timer_init(&t->timer, loop_timer_callback, after > 0. ? after : 0., repeat);
+	ev_timer_start(obj->loop, &t->timer);
+	
+	RETURN_LONG(LOOP_TIMER_HANDLE(t));
+}
+
+/**
+ * Calls $callback($handle) once after $seconds, without creating a TimerEvent.
+ * The timers are kept in a pool inside the EventLoop and keep the loop running
+ * until they have fired or are cleared.
+ * 
+ * @param  callback
+ * @param  double  Seconds until the call
+ * @return int     Timer handle for EventLoop::clearTimer()
+ * @return false   if the maximum number of timers is reached
+ */
+PHP_METHOD(EventLoop, setTimeout)
+{
+	loop_timer_method(INTERNAL_FUNCTION_PARAM_PASSTHRU, LOOP_TIMER_TIMEOUT);
+}
+
+/**
+ * Calls $callback($handle) every $seconds until cleared with EventLoop::clearTimer().
+ * 
+ * @param  callback
+ * @param  double  Seconds between calls, first call after $seconds
+ * @return int     Timer handle for EventLoop::clearTimer()
+ * @return false   if the maximum number of timers is reached
+ */
+PHP_METHOD(EventLoop, setInterval)
+{
+	loop_timer_method(INTERNAL_FUNCTION_PARAM_PASSTHRU, LOOP_TIMER_INTERVAL);
+}
+
+/**
+ * Calls $callback($handle) on the next loop iteration.
+ * 
+ * @param  callback
+ * @return int     Timer handle for EventLoop::clearTimer()
+ * @return false   if the maximum number of timers is reached
+ */
+PHP_METHOD(EventLoop, defer)
+{
+	loop_timer_method(INTERNAL_FUNCTION_PARAM_PASSTHRU, LOOP_TIMER_DEFER);
+}
+
+/**
+ * Cancels a timer created by EventLoop::setTimeout(), setInterval() or defer().
+ * 
+ * @param  int  Timer handle
+ * @return boolean  false if the timer already fired or was cleared
+ */
+PHP_METHOD(EventLoop, clearTimer)
+{
+	long handle;
+	loop_timer *t;
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &handle) != SUCCESS) {
+		return;
+	}
+	
+	if( ! (t = loop_timer_find(obj, handle)))
+	{
+		RETURN_BOOL(0);
+	}
+	
+	loop_timer_release(t TSRMLS_CC);
+	
+	RETURN_BOOL(1);
+}
+
 /**
  * Breaks the current event loop after it has processed all outstanding events.
  * 
@@ -529,24 +1113,32 @@ PHP_METHOD(EventLoop, add)
 		}
 		
 		EVENT_WATCHER_ACTION(event, loop_obj, start, io)
-		else EVENT_WATCHER_ACTION(event, loop_obj, start, timer)
+		else if(instance_of_class(event->std.ce, timer_event_ce))
+		{
+			timer_slack_align(loop_obj->loop, (timer_watcher *)event->watcher, ev_now(loop_obj->loop) + ((ev_timer *)event->watcher)->at);
+			ev_timer_start(loop_obj->loop, (ev_timer *)event->watcher);
+			IF_DEBUG(libev_printf("Calling ev_timer_start\n"));
+		}
 		else EVENT_WATCHER_ACTION(event, loop_obj, start, periodic)
+		else EVENT_WATCHER_ACTION_CE(event, loop_obj, start, periodic, cron_event_ce)
 		else EVENT_WATCHER_ACTION(event, loop_obj, start, signal)
 		else if(instance_of_class(event->std.ce, child_event_ce))
 		{
-			/* Special logic, ev_child can only be attached to the default loop */
-			if( ! ev_is_default_loop(loop_obj->loop))
+			/* Special logic, ev_child can only be attached to the default loop,
+			   other loops need pidfd support */
+			if( ! child_event_start(loop_obj, event))
 			{
 				/* TODO: libev-specific exception class here */
-				zend_throw_exception(NULL, "libev\\ChildEvent can only be added to the default event-loop", 1 TSRMLS_CC);
+				zend_throw_exception(NULL, "libev\\ChildEvent can only be added to the default event-loop, or to any loop for a single PID on Linux 5.4+", 1 TSRMLS_CC);
 				
 				return;
 			}
-			
-			ev_child_start(loop_obj->loop, (ev_child *)event->watcher);
-			IF_DEBUG(libev_printf("Calling ev_child_start\n"));
 		}
-		else EVENT_WATCHER_ACTION(event, loop_obj, start, stat)
+		else if(instance_of_class(event->std.ce, stat_event_ce))
+		{
+			/* Special logic, the stat() calls might be run by the worker threads */
+			stat_event_start(loop_obj, event);
+		}
 		else EVENT_WATCHER_ACTION(event, loop_obj, start, idle)
 		else EVENT_WATCHER_ACTION(event, loop_obj, start, async)
 		else EVENT_WATCHER_ACTION(event, loop_obj, start, cleanup)
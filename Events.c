@@ -64,6 +64,7 @@ PHP_METHOD(Event, setCallback)
 	
 	zval_add_ref(&callback);
 	obj->callback = callback;
+	obj->fcc      = callback_fcc;
 }
 
 /**
@@ -96,6 +97,52 @@ PHP_METHOD(Event, clearPending)
 	RETURN_LONG(0);
 }
 
+/**
+ * Attaches arbitrary data to the event, it is passed as the last parameter to
+ * the callback. This allows a single callback, eg. a static method, to serve
+ * many Events instead of a closure per Event.
+ * 
+ * @param  mixed  null removes the data
+ */
+PHP_METHOD(Event, setData)
+{
+	zval *data;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &data) != SUCCESS) {
+		return;
+	}
+	
+	if(obj->data)
+	{
+		zval_ptr_dtor(&obj->data);
+		obj->data = NULL;
+	}
+	
+	if(Z_TYPE_P(data) != IS_NULL)
+	{
+		zval_add_ref(&data);
+		obj->data = data;
+	}
+}
+
+/**
+ * Returns the data attached with Event::setData().
+ * 
+ * @return mixed
+ */
+PHP_METHOD(Event, getData)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(obj->data)
+	{
+		RETURN_ZVAL(obj->data, 1, 0);
+	}
+	
+	RETURN_NULL();
+}
+
 /* TODO: Add Event::getCallback() ? */
 /* TODO: Add Event::getPriority() and Event::setPriority() */
 
@@ -174,6 +221,75 @@ PHP_METHOD(IOEvent, __construct)
 	event_io_init(obj, (int) file_desc, (int) events);
 }
 
+/**
+ * Changes the stream and events to watch, if the IOEvent is associated with an
+ * EventLoop it is restarted with the new values.
+ * 
+ * @param  resource  the PHP stream to watch
+ * @param  int  either IOEvent::READ and/or IOEvent::WRITE
+ */
+PHP_METHOD(IOEvent, set)
+{
+	dFILE_DESC;
+	long events;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Zl", &fd, &events) != SUCCESS) {
+		return;
+	}
+	
+	if( ! (events & (EV_READ | EV_WRITE)))
+	{
+		zend_throw_exception(NULL, "libev\\IOEvent: events parameter must be "
+			"at least one of IOEvent::READ or IOEvent::WRITE", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	EXTRACT_FILE_DESC(IOEvent, set);
+	
+	EVENT_WATCHER_MODIFY(obj, io, ev_io_set((ev_io *)obj->watcher, (int) file_desc, (int) events));
+}
+
+/**
+ * Changes the events to watch on the current stream, eg. to add IOEvent::WRITE
+ * while there is data to send. Cheaper than IOEvent::set() as the stream does
+ * not need to be registered again with the kernel.
+ * 
+ * @param  int  either IOEvent::READ and/or IOEvent::WRITE
+ */
+PHP_METHOD(IOEvent, modify)
+{
+	long events;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &events) != SUCCESS) {
+		return;
+	}
+	
+	if( ! (events & (EV_READ | EV_WRITE)))
+	{
+		zend_throw_exception(NULL, "libev\\IOEvent: events parameter must be "
+			"at least one of IOEvent::READ or IOEvent::WRITE", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	EVENT_WATCHER_MODIFY(obj, io, event_io_modify(obj, (int) events));
+}
+
+/**
+ * Returns the events watched, IOEvent::READ and/or IOEvent::WRITE.
+ * 
+ * @return int
+ */
+PHP_METHOD(IOEvent, getEvents)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(((ev_io *)obj->watcher)->events & (EV_READ | EV_WRITE));
+}
+
 
 /**
  * Creates a timer event which will occur approximately after $after seconds
@@ -199,6 +315,32 @@ PHP_METHOD(TimerEvent, __construct)
 	event_timer_init(obj, after, repeat);
 }
 
+/**
+ * Changes the timeout and repeat values, if the TimerEvent is associated with an
+ * EventLoop it is restarted to trigger $after seconds from now.
+ * 
+ * @param  double    Time before first triggering, seconds
+ * @param  double    Time between repeats, seconds, Default: 0 = no repeat
+ */
+PHP_METHOD(TimerEvent, set)
+{
+	double after;
+	double repeat = 0.;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "d|d", &after, &repeat) != SUCCESS) {
+		return;
+	}
+	
+	EVENT_WATCHER_MODIFY(obj, timer,
+		ev_timer_set((ev_timer *)obj->watcher, after, repeat);
+		((timer_watcher *)obj->watcher)->after = after;
+		if(event_has_loop(obj))
+		{
+			timer_slack_align(obj->loop_obj->loop, (timer_watcher *)obj->watcher, ev_now(obj->loop_obj->loop) + after);
+		});
+}
+
 /**
  * Returns the seconds between event triggering.
  * 
@@ -239,11 +381,10 @@ PHP_METHOD(TimerEvent, setRepeat)
  */
 PHP_METHOD(TimerEvent, getAfter)
 {
-	/* TODO: Not sure if this is a good idea, ev_timer->at is marked as private in ev.h */
-	
 	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	RETURN_DOUBLE(((ev_timer *)obj->watcher)->at);
+	/* Not ev_timer->at, it is private in ev.h and might be aligned to the slack */
+	RETURN_DOUBLE(((timer_watcher *)obj->watcher)->after);
 }
 
 /**
@@ -270,6 +411,23 @@ PHP_METHOD(TimerEvent, again)
 	{
 		event_timer_again(event_obj);
 		
+		if(event_is_active(event_obj))
+		{
+			timer_watcher *tw = (timer_watcher *)event_obj->watcher;
+			struct ev_loop *loop = event_obj->loop_obj->loop;
+			
+			if(tw->slack > 0.)
+			{
+				ev_timer_stop(loop, &tw->timer);
+				timer_slack_align(loop, tw, ev_now(loop) + tw->timer.repeat);
+				ev_timer_start(loop, &tw->timer);
+			}
+			else
+			{
+				tw->deadline = ev_now(loop) + tw->timer.repeat;
+			}
+		}
+		
 		if( ! event_is_active(event_obj) && ! event_is_pending(event_obj))
 		{
 			/* No longer referenced by libev, so remove GC protection */
@@ -304,6 +462,46 @@ PHP_METHOD(TimerEvent, getRemaining)
 }
 
 
+/**
+ * Sets how many seconds the timer may fire late, allowing it to share a wakeup
+ * with other timers. The deadline is moved forward to a multiple of the largest
+ * power of two not greater than $slack, so timers with similar slack expire
+ * together. Takes effect the next time the timer is started or repeats.
+ * 
+ * @param  double  Tolerance in seconds, 0 = exact (default)
+ * @return void
+ */
+PHP_METHOD(TimerEvent, setSlack)
+{
+	double slack;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "d", &slack) != SUCCESS) {
+		return;
+	}
+	
+	if(slack < 0.)
+	{
+		zend_throw_exception(NULL, "libev\\TimerEvent: slack must not be negative.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	((timer_watcher *)obj->watcher)->slack = slack;
+}
+
+/**
+ * Returns the tolerance set by TimerEvent::setSlack().
+ * 
+ * @return double
+ */
+PHP_METHOD(TimerEvent, getSlack)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_DOUBLE(((timer_watcher *)obj->watcher)->slack);
+}
+
 /**
  * Schedules an event (or a repeating series of events) at a specific point
  * in time.
@@ -341,6 +539,27 @@ PHP_METHOD(PeriodicEvent, __construct)
 	event_periodic_init(obj, after, repeat, 0);
 }
 
+/**
+ * Changes the offset and interval, if the PeriodicEvent is associated with an
+ * EventLoop it is rescheduled immediately.
+ * 
+ * @param  double  The offset value
+ * @param  double  the interval value, Default = 0, no repeat
+ */
+PHP_METHOD(PeriodicEvent, set)
+{
+	double offset;
+	double interval = 0.;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "d|d", &offset, &interval) != SUCCESS) {
+		return;
+	}
+	
+	EVENT_WATCHER_MODIFY(obj, periodic, ev_periodic_set((ev_periodic *)obj->watcher,
+		offset, interval, ((ev_periodic *)obj->watcher)->reschedule_cb));
+}
+
 /**
  * Returns the time for the next trigger of the event, seconds.
  * 
@@ -439,7 +658,93 @@ PHP_METHOD(PeriodicEvent, again)
 	RETURN_BOOL(0);
 }
 
-/* TODO: Reschedule callback for PeriodicEvent? */
+/* Calls the PHP reschedule callback with ($event, $now), a failing callback or
+   one returning a time which is not later than now stops the event from firing */
+static ev_tstamp periodic_reschedule_callback(ev_periodic *w, ev_tstamp now)
+{
+	event_object *event = ((ev_watcher *) w)->event;
+	
+	/* Not linked to its loop yet when first started by EventLoop::add(), that
+	   runs in the thread of the loop anyway */
+	LOOP_FETCH_TSRMLS(event->loop_obj ? event->loop_obj->loop : NULL);
+	
+	periodic_watcher *pw = (periodic_watcher *) w;
+	zval *retval = NULL;
+	zval *args[2];
+	zval **params[2] = { &args[0], &args[1] };
+	ev_tstamp at = now + 1e30;
+	
+	args[0] = event->this;
+	zval_add_ref(&args[0]);
+	
+	MAKE_STD_ZVAL(args[1]);
+	ZVAL_DOUBLE(args[1], now);
+	
+	if(libev_call_function(pw->reschedule, &pw->reschedule_fcc, 2, params, &retval TSRMLS_CC) == SUCCESS && retval)
+	{
+		convert_to_double(retval);
+		
+		if(Z_DVAL_P(retval) > now)
+		{
+			at = Z_DVAL_P(retval);
+		}
+	}
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+	
+	zval_ptr_dtor(&args[0]);
+	zval_ptr_dtor(&args[1]);
+	
+	return at;
+}
+
+/**
+ * Sets a callback which calculates the next time the event should trigger,
+ * replacing offset and interval. It is called as $callback($event, $now) and
+ * has to return a time (double) later than $now, otherwise the event will not
+ * trigger again. If the PeriodicEvent is associated with an EventLoop it is
+ * rescheduled immediately.
+ * 
+ * NOTE: The reschedule callback is called by libev while it is updating its
+ *       timers, it must not start, stop or modify any Event or EventLoop.
+ * 
+ * @param  callback|null  null restores the offset and interval behaviour
+ * @return void
+ */
+PHP_METHOD(PeriodicEvent, setRescheduleCallback)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	periodic_watcher *pw = (periodic_watcher *)obj->watcher;
+	zval *old;
+	dCALLBACK;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z!", &callback) != SUCCESS) {
+		return;
+	}
+	
+	if(callback)
+	{
+		CHECK_CALLBACK;
+		
+		zval_add_ref(&callback);
+	}
+	
+	/* Keep the old callback until libev is done with it */
+	old = pw->reschedule;
+	
+	EVENT_WATCHER_MODIFY(obj, periodic,
+		pw->reschedule     = callback;
+		pw->reschedule_fcc = callback_fcc;
+		pw->periodic.reschedule_cb = callback ? periodic_reschedule_callback : 0);
+	
+	if(old)
+	{
+		zval_ptr_dtor(&old);
+	}
+}
 
 
 PHP_METHOD(SignalEvent, __construct)
@@ -457,88 +762,628 @@ PHP_METHOD(SignalEvent, __construct)
 	event_signal_init(obj, (int) signo);
 }
 
-
 /**
- * This event will be triggered on child status changes.
- * 
- * NOTE: Must be attached to the default loop (ie. the instance from
- * EventLoop::getDefaultLoop())
+ * Changes the signal to watch, if the SignalEvent is associated with an EventLoop
+ * it is restarted for the new signal.
  * 
- * @param  callback
- * @param  int   PID, 0 if all children
- * @param  boolean  If to also trigger on suspend/continue events and not just termination
+ * @param  int  Signal number, one of the SignalEvent::* constants
  */
-PHP_METHOD(ChildEvent, __construct)
+PHP_METHOD(SignalEvent, set)
 {
-	long pid;
-	zend_bool trace = 0;
-	event_object *obj;
-	dCALLBACK;
-	
-	PARSE_PARAMETERS(ChildEvent, "zl|b", &callback, &pid, &trace);
+	long signo;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	CHECK_CALLBACK;
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &signo) != SUCCESS) {
+		return;
+	}
 	
-	EVENT_OBJECT_PREPARE(obj, callback);
+	if(signo <= 0 || signo >= NSIG)
+	{
+		zend_throw_exception(NULL, "libev\\SignalEvent: invalid signal number", 1 TSRMLS_CC);
+		
+		return;
+	}
 	
-	event_child_init(obj, (int) pid, (int) trace);
+	EVENT_WATCHER_MODIFY(obj, signal, ev_signal_set((ev_signal *)obj->watcher, (int) signo));
 }
 
 /**
- * Returns the PID this event was registered for.
+ * Returns the signal number this event is watching.
  * 
  * @return int
- * @return false  if object has not been initialized
  */
-PHP_METHOD(ChildEvent, getPid)
+PHP_METHOD(SignalEvent, getSignal)
 {
 	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	RETURN_LONG(((ev_child *)obj->watcher)->pid);
+	RETURN_LONG(((ev_signal *)obj->watcher)->signum);
 }
 
-/**
- * Returns the PID for the last child triggering this event.
- * 
- * @return int
- * @return false  if object has not been initialized
- */
-PHP_METHOD(ChildEvent, getRPid)
+
+#if HAVE_PIDFD
+#  include <sys/syscall.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#  ifndef P_PIDFD
+#    define P_PIDFD 3
+#  endif
+
+/* A pidfd opened with child_pidfd_open() */
+typedef struct child_pidfd_entry {
+	int   pidfd;
+	pid_t pid;
+	int   status; /* -1 unless the default loop has reaped the child */
+	struct child_pidfd_entry *next;
+} child_pidfd_entry;
+
+/* The SIGCHLD handler of the default loop reaps every child with waitpid(-1),
+   including those watched with a pidfd, and only hands the status to ev_child
+   watchers. The reaper is a catch-all ev_child on the default loop which records
+   it for the open pidfds, shared by all threads like the default loop itself */
+static struct {
+	pthread_mutex_t   lock;
+	child_pidfd_entry *head;
+	ev_child          reaper;
+} child_pidfds = { PTHREAD_MUTEX_INITIALIZER };
+
+/* libev invokes ev_child watchers of the same PID before reaping the next child */
+static void child_pidfd_reaper_callback(struct ev_loop *loop, ev_child *w, int revents)
 {
-	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	child_pidfd_entry *entry;
+	
+	pthread_mutex_lock(&child_pidfds.lock);
+	
+	for(entry = child_pidfds.head; entry; entry = entry->next)
+	{
+		if(entry->pid == w->rpid && entry->status == -1)
+		{
+			entry->status = w->rstatus;
+			
+			break;
+		}
+	}
 	
-	RETURN_LONG(((ev_child *)obj->watcher)->rpid);
+	pthread_mutex_unlock(&child_pidfds.lock);
 }
 
-/**
- * Returns the exit/trace status (see waitpid and sys/wait.h) caused by the child
- * ChildEvent::getRPid().
- * 
- * @return int
- * @return false  if object has not been initialized
- */
-PHP_METHOD(ChildEvent, getRStatus)
+/* Called once the default loop has been created */
+static void child_pidfd_reaper_start(struct ev_loop *loop)
 {
-	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	if(ev_is_active(&child_pidfds.reaper))
+	{
+		return;
+	}
+	
+	ev_child_init(&child_pidfds.reaper, child_pidfd_reaper_callback, 0, 0);
+	((ev_watcher *) &child_pidfds.reaper)->event = NULL;
 	
-	RETURN_LONG(((ev_child *)obj->watcher)->rstatus);
+	ev_child_start(loop, &child_pidfds.reaper);
+	
+	/* Does not keep the default loop running */
+	ev_unref(loop);
 }
 
+/* Called before the default loop is destroyed */
+static void child_pidfd_reaper_stop(struct ev_loop *loop)
+{
+	if(ev_is_active(&child_pidfds.reaper))
+	{
+		ev_ref(loop);
+		ev_child_stop(loop, &child_pidfds.reaper);
+	}
+}
 
-/**
- * Watches a file system path for attribute changes, triggers when at least
- * one attribute has been changed.
- * 
- * The path does not need to exist, and the event will be triggered when the
- * path starts to exist.
- * 
- * The portable implementation of ev_stat is using the system stat() call
- * to regularily poll the path for changes which is inefficient. But even
- * with OS supported change notifications it can be resource-intensive if
- * many StatEvent watchers are used.
- * 
- * If inotify is supported and is compiled into libev that will be used instead
- * of stat() where possible.
+/* pidfd_open() for a child which has not been reaped yet, the status is
+   recorded if the default loop reaps it until child_pidfd_close() */
+static int child_pidfd_open(pid_t pid)
+{
+	child_pidfd_entry *entry = malloc(sizeof(child_pidfd_entry));
+	int pidfd;
+	
+	if( ! entry)
+	{
+		errno = ENOMEM;
+		
+		return -1;
+	}
+	
+	if((pidfd = (int) syscall(SYS_pidfd_open, pid, 0)) < 0)
+	{
+		free(entry);
+		
+		return -1;
+	}
+	
+	entry->pidfd  = pidfd;
+	entry->pid    = pid;
+	entry->status = -1;
+	
+	pthread_mutex_lock(&child_pidfds.lock);
+	
+	entry->next = child_pidfds.head;
+	child_pidfds.head = entry;
+	
+	pthread_mutex_unlock(&child_pidfds.lock);
+	
+	return pidfd;
+}
+
+/* Closes a pidfd from child_pidfd_open() */
+static void child_pidfd_close(int pidfd)
+{
+	child_pidfd_entry **link;
+	child_pidfd_entry *entry;
+	
+	pthread_mutex_lock(&child_pidfds.lock);
+	
+	for(link = &child_pidfds.head; *link; link = &(*link)->next)
+	{
+		if((*link)->pidfd == pidfd)
+		{
+			entry = *link;
+			*link = entry->next;
+			
+			free(entry);
+			
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&child_pidfds.lock);
+	
+	close(pidfd);
+}
+
+/* The status recorded for the child of pidfd, -1 if the default loop has not reaped it */
+static int child_pidfd_reaped(int pidfd)
+{
+	child_pidfd_entry *entry;
+	int status = -1;
+	
+	pthread_mutex_lock(&child_pidfds.lock);
+	
+	for(entry = child_pidfds.head; entry; entry = entry->next)
+	{
+		if(entry->pidfd == pidfd)
+		{
+			status = entry->status;
+			
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&child_pidfds.lock);
+	
+	return status;
+}
+
+/* Reaps the terminated child of pidfd without blocking, returns its status
+   encoded like waitpid() does, -1 if it has been reaped by someone else than
+   the default loop. waitid(P_PIDFD) needs Linux 5.4 while pidfd_open() exists
+   since 5.3, waitpid() is used if the kernel rejects P_PIDFD */
+static int child_pidfd_reap(int pidfd, pid_t pid)
+{
+	siginfo_t info;
+	int status = -1;
+	
+	memset(&info, 0, sizeof(info));
+	
+	/* Fails with ECHILD if the SIGCHLD handler of the default loop reaped it first */
+	if(waitid(P_PIDFD, (id_t) pidfd, &info, WEXITED | WNOHANG) == 0)
+	{
+		/* Same encoding as waitpid() */
+		if( ! info.si_pid)
+		{
+			status = -1;
+		}
+		else if(info.si_code == CLD_EXITED)
+		{
+			status = (info.si_status & 0xff) << 8;
+		}
+		else if(info.si_code == CLD_DUMPED)
+		{
+			status = info.si_status | 0x80;
+		}
+		else
+		{
+			status = info.si_status;
+		}
+	}
+	else if(errno != EINVAL || waitpid(pid, &status, WNOHANG) != pid)
+	{
+		status = -1;
+	}
+	
+	return status == -1 ? child_pidfd_reaped(pidfd) : status;
+}
+
+/* Called when the pidfd of a ChildEvent becomes readable, ie. the child has
+   terminated, reaps it and calls the PHP callback like ev_child would. A pidfd
+   stays readable, so the event is stopped and removed from the loop */
+static void child_pidfd_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	child_watcher *cw = (child_watcher *)((char *) w - offsetof(child_watcher, io));
+	
+	ev_io_stop(loop, w);
+	
+	cw->child.rpid    = cw->child.pid;
+	cw->child.rstatus = child_pidfd_reap(cw->pidfd, cw->child.pid);
+	
+	child_pidfd_close(cw->pidfd);
+	cw->pidfd = -1;
+	
+	/* Removes the event from the loop unless the callback restarted it with
+	   ChildEvent::set(), the event might be freed afterwards */
+	event_callback_ex(loop, (ev_watcher *) w, revents, NULL);
+}
+#endif
+
+/* Starts the ChildEvent on loop_obj, returns 0 if it cannot be watched there:
+   The default loop uses ev_child, other loops need a pidfd for a single PID */
+static int child_event_start(event_loop_object *loop_obj, event_object *event)
+{
+	child_watcher *cw = event_child_watcher(event);
+	
+	/* Event::setPriority() might have been called while the ev_io was in use */
+	ev_set_priority(&cw->child, ev_priority(event->watcher));
+	
+	event->watcher = (ev_watcher *) &cw->child;
+	event->eflags &= ~EVENT_FLAG_PIDFD;
+	
+	if(ev_is_default_loop(loop_obj->loop))
+	{
+		ev_child_start(loop_obj->loop, &cw->child);
+		IF_DEBUG(libev_printf("Calling ev_child_start\n"));
+		
+		return 1;
+	}
+	
+#if HAVE_PIDFD
+	/* ev_child flags is the trace flag, pidfd only reports termination */
+	if(cw->child.pid <= 0 || cw->child.flags)
+	{
+		return 0;
+	}
+	
+	if(cw->pidfd < 0 && (cw->pidfd = child_pidfd_open((pid_t) cw->child.pid)) < 0)
+	{
+		return 0;
+	}
+	
+	ev_io_init(&cw->io, child_pidfd_callback, cw->pidfd, EV_READ);
+	ev_set_priority(&cw->io, ev_priority(&cw->child));
+	((ev_watcher *) &cw->io)->event = event;
+	
+	event->watcher = (ev_watcher *) &cw->io;
+	event->eflags |= EVENT_FLAG_PIDFD;
+	
+	ev_io_start(loop_obj->loop, &cw->io);
+	IF_DEBUG(libev_printf("Calling ev_io_start for pidfd %d\n", cw->pidfd));
+	
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * This event will be triggered on child status changes.
+ * 
+ * NOTE: Must be attached to the default loop (ie. the instance from
+ * EventLoop::getDefaultLoop()), except on Linux 5.4+ where a ChildEvent for a
+ * single PID without $trace can be attached to any loop, it then watches a
+ * pidfd and is removed from the loop once the child has terminated.
+ * 
+ * @param  callback
+ * @param  int   PID, 0 if all children
+ * @param  boolean  If to also trigger on suspend/continue events and not just termination
+ */
+PHP_METHOD(ChildEvent, __construct)
+{
+	long pid;
+	zend_bool trace = 0;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	/* Before anything which can fail, the pidfd is closed on free */
+	event_child_watcher(obj)->pidfd = -1;
+	
+	PARSE_PARAMETERS(ChildEvent, "zl|b", &callback, &pid, &trace);
+	
+	CHECK_CALLBACK;
+	
+	EVENT_OBJECT_PREPARE(obj, callback);
+	
+	event_child_init(obj, (int) pid, (int) trace);
+}
+
+/**
+ * Changes the PID to watch, if the ChildEvent is associated with an EventLoop
+ * it is restarted for the new PID. Throws if the new PID cannot be watched on
+ * that EventLoop, the event is then removed from it.
+ * 
+ * @param  int   PID, 0 if all children
+ * @param  boolean  If to also trigger on suspend/continue events and not just termination
+ */
+PHP_METHOD(ChildEvent, set)
+{
+	long pid;
+	zend_bool trace = 0;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|b", &pid, &trace) != SUCCESS) {
+		return;
+	}
+	
+	child_watcher *cw = event_child_watcher(obj);
+	
+	EVENT_STOP(obj);
+	
+#if HAVE_PIDFD
+	if(cw->pidfd >= 0)
+	{
+		child_pidfd_close(cw->pidfd);
+		cw->pidfd = -1;
+	}
+#endif
+	
+	ev_child_set(&cw->child, (int) pid, (int) trace);
+	
+	if(event_has_loop(obj) && ! child_event_start(obj->loop_obj, obj))
+	{
+		EVENT_LOOP_REF_DEL(obj);
+		
+		zend_throw_exception(NULL, "libev\\ChildEvent: Cannot watch the PID on this event-loop.", 1 TSRMLS_CC);
+	}
+}
+
+/**
+ * Returns the PID this event was registered for.
+ * 
+ * @return int
+ * @return false  if object has not been initialized
+ */
+PHP_METHOD(ChildEvent, getPid)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(event_child_watcher(obj)->child.pid);
+}
+
+/**
+ * Returns the PID for the last child triggering this event.
+ * 
+ * @return int
+ * @return false  if object has not been initialized
+ */
+PHP_METHOD(ChildEvent, getRPid)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(event_child_watcher(obj)->child.rpid);
+}
+
+/**
+ * Returns the exit/trace status (see waitpid and sys/wait.h) caused by the child
+ * ChildEvent::getRPid().
+ * 
+ * @return int
+ * @return false  if object has not been initialized
+ */
+PHP_METHOD(ChildEvent, getRStatus)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(event_child_watcher(obj)->child.rstatus);
+}
+
+/**
+ * Returns true if the ChildEvent is watching its PID using a pidfd, which is
+ * the case when it has been added to another EventLoop than the default loop.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(ChildEvent, usesPidfd)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(obj->eflags & EVENT_FLAG_PIDFD);
+}
+
+
+/* stat() job of a StatEvent polling with the worker threads */
+typedef struct stat_job {
+	worker_job  job;
+	ev_statdata attr;
+	char        path[1];
+} stat_job;
+
+/* Runs in a worker thread, same as ev_stat_stat() of libev */
+static void stat_job_work(worker_job *job)
+{
+	stat_job *j = (stat_job *) job;
+	
+	if(lstat(j->path, &j->attr) < 0)
+	{
+		j->attr.st_nlink = 0;
+	}
+	else if( ! j->attr.st_nlink)
+	{
+		j->attr.st_nlink = 1;
+	}
+}
+
+static void stat_job_free(worker_job *job)
+{
+	free(job);
+}
+
+/* Stores the result like stat_timer_cb() of libev does, calling the PHP
+   callback if an attribute has changed */
+static void stat_job_done(worker_job *job TSRMLS_DC)
+{
+	stat_job *j = (stat_job *) job;
+	struct ev_loop *loop = job->queue->loop;
+	event_object *event = (event_object *) job->queue->data;
+	stat_watcher *sw = event_stat_watcher(event);
+	ev_statdata *attr = &sw->stat.attr;
+	ev_statdata *now = &j->attr;
+	
+	sw->busy = 0;
+	
+	/* Polled again by the next timer tick */
+	if(job->interrupted)
+	{
+		stat_job_free(job);
+		
+		return;
+	}
+	
+	/* The first result is the state changes are compared to */
+	if( ! sw->primed)
+	{
+		sw->stat.attr = j->attr;
+		sw->primed    = 1;
+		
+		stat_job_free(job);
+		
+		return;
+	}
+	
+	if(attr->st_dev != now->st_dev || attr->st_ino != now->st_ino ||
+		attr->st_mode != now->st_mode || attr->st_nlink != now->st_nlink ||
+		attr->st_uid != now->st_uid || attr->st_gid != now->st_gid ||
+		attr->st_rdev != now->st_rdev || attr->st_size != now->st_size ||
+		attr->st_atime != now->st_atime || attr->st_mtime != now->st_mtime ||
+		attr->st_ctime != now->st_ctime)
+	{
+		sw->stat.prev = sw->stat.attr;
+		sw->stat.attr = j->attr;
+		
+		stat_job_free(job);
+		
+		event_callback(loop, event->watcher, EV_STAT);
+		
+		return;
+	}
+	
+	stat_job_free(job);
+}
+
+/* Submits a stat() job unless the previous one is still running, so a slow
+   file system delays the results instead of piling up jobs */
+static void stat_thread_timer_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	stat_watcher *sw = (stat_watcher *)((char *) w - XtOffsetOf(stat_watcher, timer));
+	size_t len = strlen(sw->stat.path);
+	stat_job *j;
+	
+	if(sw->busy || ! (j = malloc(sizeof(stat_job) + len)))
+	{
+		return;
+	}
+	
+	memset(j, 0, sizeof(stat_job));
+	memcpy(j->path, sw->stat.path, len + 1);
+	
+	j->job.work = stat_job_work;
+	j->job.done = stat_job_done;
+	j->job.free = stat_job_free;
+	
+	if( ! worker_submit(sw->queue, &j->job))
+	{
+		free(j);
+		
+		return;
+	}
+	
+	sw->busy = 1;
+}
+
+/* The EventLoop is being destroyed, the queue has to be closed before */
+static void stat_thread_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	stat_watcher *sw = (stat_watcher *)((char *) w - XtOffsetOf(stat_watcher, cleanup));
+	
+	stat_event_thread_stop(loop, ((ev_watcher *) &sw->timer)->event);
+}
+
+static void stat_event_thread_stop(struct ev_loop *loop, event_object *event)
+{
+	stat_watcher *sw = event_stat_watcher(event);
+	
+	ev_timer_stop(loop, &sw->timer);
+	ev_cleanup_stop(loop, &sw->cleanup);
+	
+	/* A job still running is freed instead of done */
+	worker_queue_close(sw->queue);
+	
+	sw->queue = NULL;
+	sw->busy  = 0;
+	
+	ev_set_priority(&sw->stat, ev_priority(&sw->timer));
+	
+	event->watcher = (ev_watcher *) &sw->stat;
+	event->eflags &= ~EVENT_FLAG_STAT_THREAD;
+}
+
+/* Starts the StatEvent on loop_obj, with ev_stat or polling with the worker
+   threads, the latter falls back to ev_stat if no queue can be opened */
+static void stat_event_start(event_loop_object *loop_obj, event_object *event)
+{
+	stat_watcher *sw = event_stat_watcher(event);
+	ev_tstamp interval = sw->stat.interval;
+	
+	if( ! sw->threaded || ! (sw->queue = worker_queue_open(loop_obj->loop, event)))
+	{
+		ev_stat_start(loop_obj->loop, &sw->stat);
+		IF_DEBUG(libev_printf("Calling ev_stat_start\n"));
+		
+		return;
+	}
+	
+	/* The limits of libev for ev_stat */
+	if(interval == 0.)
+	{
+		interval = 5.0074891;
+	}
+	else if(interval < 0.1074891)
+	{
+		interval = 0.1074891;
+	}
+	
+	/* The first job right away, it provides the attributes to compare with */
+	ev_timer_init(&sw->timer, stat_thread_timer_callback, 0., interval);
+	ev_set_priority(&sw->timer, ev_priority(&sw->stat));
+	((ev_watcher *) &sw->timer)->event = event;
+	
+	ev_cleanup_init(&sw->cleanup, stat_thread_cleanup_callback);
+	
+	sw->primed = 0;
+	
+	event->watcher = (ev_watcher *) &sw->timer;
+	event->eflags |= EVENT_FLAG_STAT_THREAD;
+	
+	ev_timer_start(loop_obj->loop, &sw->timer);
+	ev_cleanup_start(loop_obj->loop, &sw->cleanup);
+	IF_DEBUG(libev_printf("Calling ev_timer_start for threaded stat()\n"));
+}
+
+/**
+ * Watches a file system path for attribute changes, triggers when at least
+ * one attribute has been changed.
+ * 
+ * The path does not need to exist, and the event will be triggered when the
+ * path starts to exist.
+ * 
+ * The portable implementation of ev_stat is using the system stat() call
+ * to regularily poll the path for changes which is inefficient. But even
+ * with OS supported change notifications it can be resource-intensive if
+ * many StatEvent watchers are used. To watch whole directory trees use
+ * DirectoryWatcher, which shares one inotify descriptor per loop.
+ * 
+ * If inotify is supported and is compiled into libev that will be used instead
+ * of stat() where possible.
  * 
  * NOTE: When libev is doing the stat() call the loop will be blocked, so it
  *       is not recommended to use it on network resources as there might be
@@ -555,6 +1400,12 @@ PHP_METHOD(ChildEvent, getRStatus)
  * because Linux gettimeofday() might return a different time from time(),
  * the libev manual recommends 1.02)
  * 
+ * With $threaded the path is polled by the worker threads (see
+ * libev.worker_threads) instead, a slow file system then delays the results
+ * of this StatEvent only, not the loop. inotify is not used, the first result
+ * is available one job after adding it to an EventLoop, and a stat() taking
+ * longer than the interval delays the next one.
+ * 
  * @param  callback
  * @param  string  Path to file to watch, does not need to exist at time of call
  *                 NOTE: absolute paths are to be preferred, as libev's behaviour
@@ -562,6 +1413,7 @@ PHP_METHOD(ChildEvent, getRStatus)
  * @param  double    the minimum interval libev will check for file-changes,
  *                   will automatically be set to the minimum value by libev if
  *                   the supplied value is smaller than the allowed minimum.
+ * @param  boolean  If to run the stat() calls in a worker thread
  */
 PHP_METHOD(StatEvent, __construct)
 {
@@ -569,10 +1421,11 @@ PHP_METHOD(StatEvent, __construct)
 	int filename_len;
 	char *stat_path;
 	double interval = 0.;
+	zend_bool threaded = 0;
 	event_object *obj;
 	dCALLBACK;
 	
-	PARSE_PARAMETERS(StatEvent, "zs|d", &callback, &filename, &filename_len, &interval);
+	PARSE_PARAMETERS(StatEvent, "zs|db", &callback, &filename, &filename_len, &interval, &threaded);
 	
 	assert(strlen(filename) == filename_len);
 	
@@ -588,6 +1441,8 @@ PHP_METHOD(StatEvent, __construct)
 	EVENT_OBJECT_PREPARE(obj, callback);
 	
 	event_stat_init(obj, stat_path, interval);
+	
+	event_stat_watcher(obj)->threaded = threaded;
 }
 
 /**
@@ -600,7 +1455,7 @@ PHP_METHOD(StatEvent, getPath)
 {
 	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	RETURN_STRING(((ev_stat *)obj->watcher)->path, 1);
+	RETURN_STRING(event_stat_watcher(obj)->stat.path, 1);
 }
 
 /**
@@ -613,42 +1468,28 @@ PHP_METHOD(StatEvent, getInterval)
 {
 	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	RETURN_DOUBLE(((ev_stat *)obj->watcher)->interval);
-}
-
-/* The two macros below are more or less copies from php_if_fstat */
-#define MAKE_LONG_ZVAL(name, val)\
-	MAKE_STD_ZVAL(name); \
-	ZVAL_LONG(name, val);
-
-#define ev_statdata_to_php_array(statdata, php_zval)        \
-	zval *s_dev, *s_ino, *s_mode, *s_nlink, *s_uid, *s_gid, \
-		*s_rdev, *s_size, *s_atime, *s_mtime, *s_ctime;     \
-	array_init(php_zval);                                   \
-	MAKE_LONG_ZVAL(s_dev, statdata.st_dev);                 \
-	MAKE_LONG_ZVAL(s_ino, statdata.st_ino);                 \
-	MAKE_LONG_ZVAL(s_mode, statdata.st_mode);               \
-	MAKE_LONG_ZVAL(s_nlink, statdata.st_nlink);             \
-	MAKE_LONG_ZVAL(s_uid, statdata.st_uid);                 \
-	MAKE_LONG_ZVAL(s_gid, statdata.st_gid);                 \
-	MAKE_LONG_ZVAL(s_rdev, statdata.st_rdev);               \
-	MAKE_LONG_ZVAL(s_size, statdata.st_size);               \
-	MAKE_LONG_ZVAL(s_atime, statdata.st_atime);             \
-	MAKE_LONG_ZVAL(s_mtime, statdata.st_mtime);             \
-	MAKE_LONG_ZVAL(s_ctime, statdata.st_ctime);             \
-	/* Store string indexes referencing the same zval*/     \
-	zend_hash_update(HASH_OF(php_zval), "dev", strlen("dev")+1, (void *)&s_dev, sizeof(zval *), NULL);       \
-	zend_hash_update(HASH_OF(php_zval), "ino", strlen("ino")+1, (void *)&s_ino, sizeof(zval *), NULL);       \
-	zend_hash_update(HASH_OF(php_zval), "mode", strlen("mode")+1, (void *)&s_mode, sizeof(zval *), NULL);    \
-	zend_hash_update(HASH_OF(php_zval), "nlink", strlen("nlink")+1, (void *)&s_nlink, sizeof(zval *), NULL); \
-	zend_hash_update(HASH_OF(php_zval), "uid", strlen("uid")+1, (void *)&s_uid, sizeof(zval *), NULL);       \
-	zend_hash_update(HASH_OF(php_zval), "gid", strlen("gid")+1, (void *)&s_gid, sizeof(zval *), NULL);       \
-	zend_hash_update(HASH_OF(php_zval), "rdev", strlen("rdev")+1, (void *)&s_rdev, sizeof(zval *), NULL);    \
-	zend_hash_update(HASH_OF(php_zval), "size", strlen("size")+1, (void *)&s_size, sizeof(zval *), NULL);    \
-	zend_hash_update(HASH_OF(php_zval), "atime", strlen("atime")+1, (void *)&s_atime, sizeof(zval *), NULL); \
-	zend_hash_update(HASH_OF(php_zval), "mtime", strlen("mtime")+1, (void *)&s_mtime, sizeof(zval *), NULL); \
-	zend_hash_update(HASH_OF(php_zval), "ctime", strlen("ctime")+1, (void *)&s_ctime, sizeof(zval *), NULL); \
-	
+	RETURN_DOUBLE(event_stat_watcher(obj)->stat.interval);
+}
+
+/* Fills php_zval with an array of the interesting parts of statdata */
+static void ev_statdata_to_php_array(ev_statdata *statdata, zval *php_zval)
+{
+	/* Sized up front, avoids rehashing while adding the 11 keys */
+	array_init_size(php_zval, 16);
+	
+	add_assoc_long_ex(php_zval, "dev", sizeof("dev"), statdata->st_dev);
+	add_assoc_long_ex(php_zval, "ino", sizeof("ino"), statdata->st_ino);
+	add_assoc_long_ex(php_zval, "mode", sizeof("mode"), statdata->st_mode);
+	add_assoc_long_ex(php_zval, "nlink", sizeof("nlink"), statdata->st_nlink);
+	add_assoc_long_ex(php_zval, "uid", sizeof("uid"), statdata->st_uid);
+	add_assoc_long_ex(php_zval, "gid", sizeof("gid"), statdata->st_gid);
+	add_assoc_long_ex(php_zval, "rdev", sizeof("rdev"), statdata->st_rdev);
+	add_assoc_long_ex(php_zval, "size", sizeof("size"), statdata->st_size);
+	add_assoc_long_ex(php_zval, "atime", sizeof("atime"), statdata->st_atime);
+	add_assoc_long_ex(php_zval, "mtime", sizeof("mtime"), statdata->st_mtime);
+	add_assoc_long_ex(php_zval, "ctime", sizeof("ctime"), statdata->st_ctime);
+}
+
 /**
  * Returns the last stat information received about the file,
  * all array elements will be zero if the event has not been added to an EventLoop.
@@ -662,7 +1503,7 @@ PHP_METHOD(StatEvent, getAttr)
 {
 	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	ev_statdata_to_php_array(((ev_stat *)obj->watcher)->attr, return_value);
+	ev_statdata_to_php_array(&event_stat_watcher(obj)->stat.attr, return_value);
 }
 
 /**
@@ -678,7 +1519,62 @@ PHP_METHOD(StatEvent, getPrev)
 {
 	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
 	
-	ev_statdata_to_php_array(((ev_stat *)obj->watcher)->prev, return_value);
+	ev_statdata_to_php_array(&event_stat_watcher(obj)->stat.prev, return_value);
+}
+
+/**
+ * Returns the last stat information received about the file like getAttr(),
+ * as a StatResult which only converts the fields asked for.
+ * 
+ * @return StatResult
+ */
+PHP_METHOD(StatEvent, getStat)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	stat_result_init(return_value, &event_stat_watcher(obj)->stat.attr TSRMLS_CC);
+}
+
+/**
+ * Returns the next to last stat information received about the file like
+ * getPrev(), as a StatResult.
+ * 
+ * @return StatResult
+ */
+PHP_METHOD(StatEvent, getPrevStat)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	stat_result_init(return_value, &event_stat_watcher(obj)->stat.prev TSRMLS_CC);
+}
+
+/**
+ * Returns the fields which differ between the last and the next to last stat
+ * information, a combination of the StatResult::DEV, INO, MODE, NLINK, UID,
+ * GID, RDEV, SIZE, ATIME, MTIME, CTIME and BLOCKS constants.
+ * 
+ * NOTE: Timestamps are compared including nanoseconds, but a change of only
+ *       the nanoseconds does not trigger the event.
+ * 
+ * @return int
+ */
+PHP_METHOD(StatEvent, changedFields)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(stat_fields_changed(&event_stat_watcher(obj)->stat.attr, &event_stat_watcher(obj)->stat.prev));
+}
+
+/**
+ * Returns true if the stat() calls are run by the worker threads.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(StatEvent, isThreaded)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(event_stat_watcher(obj)->threaded);
 }
 
 PHP_METHOD(IdleEvent, __construct)
@@ -713,20 +1609,53 @@ PHP_METHOD(CleanupEvent, __construct)
 }
 
 
+/**
+ * Creates an AsyncEvent, the callback receives ($event, $revents, $payloads)
+ * where $payloads is the array of values queued by AsyncEvent::push() since
+ * the last time the callback was called (empty if only send() was used).
+ * 
+ * @param  callback
+ * @param  int  Maximum number of queued payloads
+ * @param  int  One of the AsyncEvent::OVERFLOW_* constants, what to do when
+ *              push() is called on a full queue
+ */
 PHP_METHOD(AsyncEvent, __construct)
 {
+	long capacity = ASYNC_DEFAULT_CAPACITY;
+	long overflow = ASYNC_OVERFLOW_DROP_NEW;
 	event_object *obj;
+	async_watcher *w;
 	dCALLBACK;
 
-	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &callback) != SUCCESS) {
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|ll", &callback, &capacity, &overflow) != SUCCESS) {
 		return;
 	}
 	
 	CHECK_CALLBACK;
 	
+	if(capacity < 1)
+	{
+		zend_throw_exception(NULL, "libev\\AsyncEvent: capacity must be positive.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(overflow != ASYNC_OVERFLOW_DROP_NEW && overflow != ASYNC_OVERFLOW_DROP_OLDEST)
+	{
+		zend_throw_exception(NULL, "libev\\AsyncEvent: overflow parameter must be "
+			"one of the AsyncEvent::OVERFLOW_* constants.", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
 	EVENT_OBJECT_PREPARE(obj, callback);
 	
 	event_async_init(obj);
+	
+	w = (async_watcher *)obj->watcher;
+	
+	w->capacity = (unsigned int) capacity;
+	w->overflow = (int) overflow;
 }
 
 /**
@@ -749,4 +1678,102 @@ PHP_METHOD(AsyncEvent, send)
 	RETURN_BOOL(0);
 }
 
+/**
+ * Queues a payload and sends an event to the AsyncEvent object, all payloads
+ * pushed before the callback runs are delivered in a single call.
+ * 
+ * If the queue is full the payload is dropped with OVERFLOW_DROP_NEW, and the
+ * oldest queued payload is dropped with OVERFLOW_DROP_OLDEST.
+ * 
+ * The queue is not locked, push() must be called on the thread running the
+ * loop, use a ThreadChannel to send from other threads.
+ * 
+ * @param  mixed
+ * @return boolean  false if the object is not attached to an event loop or
+ *                  if the payload was dropped
+ */
+PHP_METHOD(AsyncEvent, push)
+{
+	zval *payload;
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	async_watcher *w  = (async_watcher *)obj->watcher;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &payload) != SUCCESS) {
+		return;
+	}
+	
+	if( ! event_has_loop(obj))
+	{
+		RETURN_BOOL(0);
+	}
+	
+	if(w->count == w->capacity)
+	{
+		w->dropped++;
+		
+		if(w->overflow == ASYNC_OVERFLOW_DROP_NEW)
+		{
+			RETURN_BOOL(0);
+		}
+		
+		/* ASYNC_OVERFLOW_DROP_OLDEST */
+		zval_ptr_dtor(&w->queue[w->head]);
+		
+		w->head = (w->head + 1) % w->capacity;
+		w->count--;
+	}
+	
+	if( ! w->queue)
+	{
+		w->queue = safe_emalloc(w->capacity, sizeof(zval *), 0);
+	}
+	
+	/* A reference would let the caller change the payload while it is queued */
+	if(PZVAL_IS_REF(payload))
+	{
+		zval *copy;
+		
+		ALLOC_ZVAL(copy);
+		MAKE_COPY_ZVAL(&payload, copy);
+		
+		payload = copy;
+	}
+	else
+	{
+		zval_add_ref(&payload);
+	}
+	
+	w->queue[(w->head + w->count) % w->capacity] = payload;
+	w->count++;
+	
+	/* Multiple sends before the callback runs coalesce into one wakeup */
+	ev_async_send(obj->loop_obj->loop, &w->async);
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Returns the number of payloads waiting to be delivered.
+ * 
+ * @return int
+ */
+PHP_METHOD(AsyncEvent, getQueuedCount)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(((async_watcher *)obj->watcher)->count);
+}
+
+/**
+ * Returns the number of payloads dropped because the queue was full.
+ * 
+ * @return int
+ */
+PHP_METHOD(AsyncEvent, getDroppedCount)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(((async_watcher *)obj->watcher)->dropped);
+}
+
 /* TODO: Implement ev_async_pending? */
\ No newline at end of file
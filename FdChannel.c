@@ -0,0 +1,683 @@
+
+/*
+ * Passes file descriptors and a payload between processes over a Unix socket
+ * with SCM_RIGHTS, eg. for handing accepted connections to workers or live
+ * listening sockets from an old to a new process.
+ * 
+ * Messages are framed by the socket, which must be SOCK_SEQPACKET or
+ * SOCK_DGRAM. Every message starts with a header byte so that an empty
+ * payload can be told apart from the peer closing the channel.
+ */
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Descriptors per message, the kernel limit SCM_MAX_FD */
+#define FD_CHANNEL_MAX_FDS 253
+
+/* Messages read per wakeup */
+#define FD_CHANNEL_READ_BATCH 64
+
+#define FD_CHANNEL_HEADER 0x01
+
+#ifndef MSG_CMSG_CLOEXEC
+#  define MSG_CMSG_CLOEXEC 0
+#endif
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+/* Message waiting to be sent */
+typedef struct fd_channel_message {
+	struct fd_channel_message *next;
+	int    nfds;
+	int    *fds;        /* Duplicates, closed once sent */
+	size_t len;
+	char   data[1];     /* Header byte and payload */
+} fd_channel_message;
+
+typedef struct fd_channel_object {
+	zend_object     std;
+	zval            *this;         /* Reference keeping the object alive while reading or sending */
+	struct ev_loop  *loop;         /* NULL once closed or the loop was destroyed */
+	ev_io           read_watcher;
+	ev_io           write_watcher;
+	ev_cleanup      cleanup_watcher;
+	int             fd;
+	zval            *callback;
+	zend_fcall_info_cache fcc;
+	char            *buf;          /* Receive buffer of max_payload + 1 bytes */
+	size_t          max_payload;
+	fd_channel_message *head;
+	fd_channel_message *tail;
+	long            queued;
+} fd_channel_object;
+
+zend_class_entry *fd_channel_ce;
+
+zend_object_handlers fd_channel_object_handlers;
+
+
+static void fd_channel_message_free(fd_channel_message *m)
+{
+	int i;
+	
+	for(i = 0; i < m->nfds; i++)
+	{
+		close(m->fds[i]);
+	}
+	
+	if(m->fds)
+	{
+		efree(m->fds);
+	}
+	
+	efree(m);
+}
+
+/* Drops the self reference, the object might be freed */
+static void fd_channel_release(fd_channel_object *obj TSRMLS_DC)
+{
+	zval *self = obj->this;
+	
+	obj->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Releases the self reference once neither reading nor sending */
+static void fd_channel_release_if_idle(fd_channel_object *obj TSRMLS_DC)
+{
+	if(obj->this && ( ! obj->loop || ( ! ev_is_active(&obj->read_watcher) && ! obj->head)))
+	{
+		fd_channel_release(obj TSRMLS_CC);
+	}
+}
+
+/* Stops all watchers and closes the socket, queued messages are dropped */
+static void fd_channel_detach(fd_channel_object *obj)
+{
+	fd_channel_message *m;
+	
+	if( ! obj->loop)
+	{
+		return;
+	}
+	
+	ev_io_stop(obj->loop, &obj->read_watcher);
+	ev_io_stop(obj->loop, &obj->write_watcher);
+	ev_cleanup_stop(obj->loop, &obj->cleanup_watcher);
+	
+	while((m = obj->head))
+	{
+		obj->head = m->next;
+		
+		fd_channel_message_free(m);
+	}
+	
+	obj->tail   = NULL;
+	obj->queued = 0;
+	
+	close(obj->fd);
+	obj->fd = -1;
+	
+	obj->loop = NULL;
+}
+
+/* Sends queued messages until the queue is empty or the socket buffer is
+   full, returns 0 and sets errno on other errors */
+static int fd_channel_flush(fd_channel_object *obj)
+{
+	fd_channel_message *m;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE(sizeof(int) * FD_CHANNEL_MAX_FDS)];
+	
+	while((m = obj->head))
+	{
+		memset(&msg, 0, sizeof(msg));
+		
+		iov.iov_base   = m->data;
+		iov.iov_len    = m->len;
+		msg.msg_iov    = &iov;
+		msg.msg_iovlen = 1;
+		
+		if(m->nfds)
+		{
+			memset(control, 0, sizeof(control));
+			
+			msg.msg_control    = control;
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * m->nfds);
+			
+			cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type  = SCM_RIGHTS;
+			cm->cmsg_len   = CMSG_LEN(sizeof(int) * m->nfds);
+			
+			memcpy(CMSG_DATA(cm), m->fds, sizeof(int) * m->nfds);
+		}
+		
+		if(sendmsg(obj->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOBUFS;
+		}
+		
+		/* The peer holds its own references now */
+		if( ! (obj->head = m->next))
+		{
+			obj->tail = NULL;
+		}
+		
+		obj->queued--;
+		
+		fd_channel_message_free(m);
+	}
+	
+	return 1;
+}
+
+/* Calls callback($channel, $fds, $payload) */
+static void fd_channel_call(fd_channel_object *obj, zval *fds, zval *payload TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = obj->this;
+	zval **params[3] = { &self, &fds, &payload };
+	
+	libev_call_function(obj->callback, &obj->fcc, 3, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+}
+
+/* Wraps a received descriptor in a PHP stream, sockets as socket streams so
+   they work with stream_socket_*() and IOEvent alike */
+static php_stream *fd_channel_open_stream(int fd TSRMLS_DC)
+{
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+	
+	if(fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		return php_stream_sock_open_from_socket(fd, NULL);
+	}
+	
+	switch(flags & O_ACCMODE)
+	{
+		case O_RDONLY:
+			return php_stream_fopen_from_fd(fd, "r", NULL);
+		case O_WRONLY:
+			return php_stream_fopen_from_fd(fd, flags & O_APPEND ? "a" : "w", NULL);
+		default:
+			return php_stream_fopen_from_fd(fd, flags & O_APPEND ? "a+" : "r+", NULL);
+	}
+}
+
+static void fd_channel_read_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	fd_channel_object *obj = (fd_channel_object *)((char *) w - XtOffsetOf(fd_channel_object, read_watcher));
+	char control[CMSG_SPACE(sizeof(int) * FD_CHANNEL_MAX_FDS)];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	php_stream *stream;
+	zval *self;
+	zval *zfds;
+	zval *zfd;
+	zval *payload;
+	ssize_t len;
+	int *fds;
+	int nfds;
+	int i;
+	int n;
+	
+	/* The callback might close the channel and release the last reference */
+	self = obj->this;
+	zval_add_ref(&self);
+	
+	for(n = 0; n < FD_CHANNEL_READ_BATCH && obj->loop; n++)
+	{
+		memset(&msg, 0, sizeof(msg));
+		
+		iov.iov_base       = obj->buf;
+		iov.iov_len        = obj->max_payload + 1;
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		
+		if((len = recvmsg(obj->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				break;
+			}
+			
+			/* The channel is broken, report it like EOF */
+			len = 0;
+		}
+		
+		if(len == 0)
+		{
+			ev_io_stop(loop, w);
+			
+			MAKE_STD_ZVAL(zfds);
+			ZVAL_NULL(zfds);
+			MAKE_STD_ZVAL(payload);
+			ZVAL_NULL(payload);
+			
+			fd_channel_call(obj, zfds, payload TSRMLS_CC);
+			
+			zval_ptr_dtor(&zfds);
+			zval_ptr_dtor(&payload);
+			
+			break;
+		}
+		
+		MAKE_STD_ZVAL(zfds);
+		array_init(zfds);
+		
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			{
+				continue;
+			}
+			
+			fds  = (int *) CMSG_DATA(cm);
+			nfds = (int) ((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+			
+			for(i = 0; i < nfds; i++)
+			{
+				/* Truncated messages are dropped, their descriptors only closed */
+				if((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || *obj->buf != FD_CHANNEL_HEADER || ! (stream = fd_channel_open_stream(fds[i] TSRMLS_CC)))
+				{
+					close(fds[i]);
+					
+					continue;
+				}
+				
+				MAKE_STD_ZVAL(zfd);
+				php_stream_to_zval(stream, zfd);
+				add_next_index_zval(zfds, zfd);
+			}
+		}
+		
+		if((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || *obj->buf != FD_CHANNEL_HEADER)
+		{
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "libev\\FdChannel: dropped a truncated or foreign message");
+			
+			zval_ptr_dtor(&zfds);
+			
+			continue;
+		}
+		
+		MAKE_STD_ZVAL(payload);
+		ZVAL_STRINGL(payload, obj->buf + 1, len - 1, 1);
+		
+		fd_channel_call(obj, zfds, payload TSRMLS_CC);
+		
+		zval_ptr_dtor(&zfds);
+		zval_ptr_dtor(&payload);
+	}
+	
+	if(obj->loop && ! ev_is_active(&obj->read_watcher))
+	{
+		fd_channel_release_if_idle(obj TSRMLS_CC);
+	}
+	
+	zval_ptr_dtor(&self);
+}
+
+static void fd_channel_write_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	fd_channel_object *obj = (fd_channel_object *)((char *) w - XtOffsetOf(fd_channel_object, write_watcher));
+	
+	if( ! fd_channel_flush(obj))
+	{
+		/* The peer is gone, nothing can be sent anymore */
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "libev\\FdChannel: sendmsg() failed, dropping %ld queued messages: %s", obj->queued, strerror(errno));
+		
+		while(obj->head)
+		{
+			fd_channel_message *m = obj->head;
+			
+			obj->head = m->next;
+			
+			fd_channel_message_free(m);
+		}
+		
+		obj->tail   = NULL;
+		obj->queued = 0;
+	}
+	
+	if( ! obj->head)
+	{
+		ev_io_stop(loop, w);
+		
+		fd_channel_release_if_idle(obj TSRMLS_CC);
+	}
+}
+
+/* The EventLoop is being destroyed */
+static void fd_channel_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	fd_channel_object *obj = (fd_channel_object *)((char *) w - XtOffsetOf(fd_channel_object, cleanup_watcher));
+	
+	fd_channel_detach(obj);
+	fd_channel_release(obj TSRMLS_CC);
+}
+
+FREE_STORAGE(fd_channel_object,
+
+	fd_channel_detach(obj);
+	
+	if(obj->callback)
+	{
+		zval_ptr_dtor(&obj->callback);
+	}
+	
+	if(obj->buf)
+	{
+		efree(obj->buf);
+	}
+)
+
+CREATE_HANDLER(fd_channel_object, fd_channel_object, fd_channel_object_free, fd_channel_object_handlers,
+	obj->fd          = -1;
+	obj->max_payload = 65536;
+)
+
+
+/**
+ * Creates a connected pair of sockets suitable for FdChannel, share it with a
+ * child process by forking or spawning it with one of them as descriptor.
+ * 
+ * @return array  Two socket streams
+ */
+PHP_METHOD(FdChannel, createPair)
+{
+	int sv[2];
+	php_stream *stream;
+	zval *zstream;
+	int i;
+	
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0)
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\FdChannel: socketpair() failed: %s", strerror(errno));
+		
+		return;
+	}
+	
+	array_init_size(return_value, 2);
+	
+	for(i = 0; i < 2; i++)
+	{
+		if( ! (stream = php_stream_sock_open_from_socket(sv[i], NULL)))
+		{
+			close(sv[i]);
+			
+			continue;
+		}
+		
+		MAKE_STD_ZVAL(zstream);
+		php_stream_to_zval(stream, zstream);
+		add_next_index_zval(return_value, zstream);
+	}
+}
+
+/**
+ * Creates a channel over the Unix socket $socket (SOCK_SEQPACKET or
+ * SOCK_DGRAM), eg. one of FdChannel::createPair(). The channel uses a
+ * duplicate of the descriptor, the caller can close $socket.
+ * 
+ * Received messages are delivered to the callback, a channel without callback
+ * only sends. The descriptors arrive as streams which can be passed to
+ * IOEvent, stream_socket_accept() etc.
+ * 
+ * Callback signature: callback(FdChannel $channel, array|null $fds, string|null $payload),
+ * null if the peer has closed the channel.
+ * 
+ * Options:
+ *  * "max_payload": int, longest payload accepted, default 65536
+ * 
+ * @param  EventLoop
+ * @param  resource
+ * @param  callback|null
+ * @param  array
+ */
+PHP_METHOD(FdChannel, __construct)
+{
+	zval *zloop;
+	zval *zoptions = NULL;
+	zval **entry;
+	int type = 0;
+	socklen_t type_len = sizeof(type);
+	fd_channel_object *obj = (fd_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dFILE_DESC;
+	dCALLBACK;
+	
+	PARSE_PARAMETERS(FdChannel, "OZ|za", &zloop, event_loop_ce, &fd, &callback, &zoptions);
+	
+	if(callback && Z_TYPE_P(callback) == IS_NULL)
+	{
+		callback = NULL;
+	}
+	
+	if(callback)
+	{
+		CHECK_CALLBACK;
+	}
+	
+	EXTRACT_FILE_DESC(FdChannel, __construct);
+	
+	if(getsockopt((int) file_desc, SOL_SOCKET, SO_TYPE, &type, &type_len) != 0 || (type != SOCK_SEQPACKET && type != SOCK_DGRAM))
+	{
+		zend_throw_exception(NULL, "libev\\FdChannel: socket must be a SOCK_SEQPACKET or SOCK_DGRAM Unix socket", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(zoptions && zend_hash_find(Z_ARRVAL_P(zoptions), "max_payload", sizeof("max_payload"), (void **) &entry) == SUCCESS)
+	{
+		convert_to_long_ex(entry);
+		
+		obj->max_payload = Z_LVAL_PP(entry) < 0 ? 0 : (size_t) Z_LVAL_PP(entry);
+	}
+	
+	obj->loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop;
+	
+	if( ! obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\FdChannel: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if((obj->fd = fcntl((int) file_desc, F_DUPFD_CLOEXEC, 0)) < 0)
+	{
+		obj->loop = NULL;
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\FdChannel: failed to duplicate descriptor: %s", strerror(errno));
+		
+		return;
+	}
+	
+	ev_io_init(&obj->read_watcher, fd_channel_read_callback, obj->fd, EV_READ);
+	ev_io_init(&obj->write_watcher, fd_channel_write_callback, obj->fd, EV_WRITE);
+	
+	ev_cleanup_init(&obj->cleanup_watcher, fd_channel_cleanup_callback);
+	ev_cleanup_start(obj->loop, &obj->cleanup_watcher);
+	
+	if( ! callback)
+	{
+		return;
+	}
+	
+	zval_add_ref(&callback);
+	obj->callback = callback;
+	obj->fcc      = callback_fcc;
+	
+	obj->buf = emalloc(obj->max_payload + 1);
+	
+	ev_io_start(obj->loop, &obj->read_watcher);
+	
+	/* Independent reference to the object, held while reading */
+	MAKE_STD_ZVAL(obj->this);
+	*obj->this = *getThis();
+	zval_copy_ctor(obj->this);
+	INIT_PZVAL(obj->this);
+}
+
+/**
+ * Queues a message with the descriptors of $fds (streams or sockets) and
+ * $payload. The descriptors are duplicated right away, the caller can close
+ * its streams once send() has returned.
+ * 
+ * @param  array
+ * @param  string
+ * @return boolean  false if the channel is closed
+ */
+PHP_METHOD(FdChannel, send)
+{
+	zval *zfds;
+	char *payload = "";
+	int payload_len = 0;
+	int descs[FD_CHANNEL_MAX_FDS];
+	int nfds = 0;
+	int i;
+	HashPosition pos;
+	fd_channel_message *m;
+	fd_channel_object *obj = (fd_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dFILE_DESC;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|s", &zfds, &payload, &payload_len) != SUCCESS) {
+		return;
+	}
+	
+	if(zend_hash_num_elements(Z_ARRVAL_P(zfds)) > FD_CHANNEL_MAX_FDS)
+	{
+		zend_throw_exception(NULL, "libev\\FdChannel::send(): at most 253 descriptors per message", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zfds), &pos);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(zfds), (void **) &fd, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(zfds), &pos))
+	{
+		EXTRACT_FILE_DESC(FdChannel, send);
+		
+		descs[nfds++] = (int) file_desc;
+	}
+	
+	if( ! obj->loop)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	m = emalloc(sizeof(fd_channel_message) + payload_len);
+	
+	m->next = NULL;
+	m->nfds = 0;
+	m->fds  = nfds ? safe_emalloc(nfds, sizeof(int), 0) : NULL;
+	m->len  = payload_len + 1;
+	
+	m->data[0] = FD_CHANNEL_HEADER;
+	memcpy(m->data + 1, payload, payload_len);
+	
+	for(i = 0; i < nfds; i++)
+	{
+		if((m->fds[i] = fcntl(descs[i], F_DUPFD_CLOEXEC, 0)) < 0)
+		{
+			fd_channel_message_free(m);
+			
+			zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\FdChannel::send(): failed to duplicate descriptor: %s", strerror(errno));
+			
+			return;
+		}
+		
+		m->nfds++;
+	}
+	
+	if(obj->tail)
+	{
+		obj->tail->next = m;
+	}
+	else
+	{
+		obj->head = m;
+		
+		ev_io_start(obj->loop, &obj->write_watcher);
+	}
+	
+	obj->tail = m;
+	obj->queued++;
+	
+	if( ! obj->this)
+	{
+		/* Independent reference to the object, held while sending */
+		MAKE_STD_ZVAL(obj->this);
+		*obj->this = *getThis();
+		zval_copy_ctor(obj->this);
+		INIT_PZVAL(obj->this);
+	}
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Returns the number of messages waiting to be sent.
+ * 
+ * @return int
+ */
+PHP_METHOD(FdChannel, getQueuedCount)
+{
+	fd_channel_object *obj = (fd_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(obj->queued);
+}
+
+/**
+ * Stops reading and closes the channel after a last attempt to send the
+ * queued messages, those which cannot be sent right away are dropped.
+ * 
+ * @return void
+ */
+PHP_METHOD(FdChannel, close)
+{
+	fd_channel_object *obj = (fd_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! obj->loop)
+	{
+		return;
+	}
+	
+	fd_channel_flush(obj);
+	fd_channel_detach(obj);
+	fd_channel_release(obj TSRMLS_CC);
+}
+
+
+static const zend_function_entry fd_channel_methods[] = {
+	ZEND_ME(FdChannel, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(FdChannel, createPair, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	ZEND_ME(FdChannel, send, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(FdChannel, getQueuedCount, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(FdChannel, close, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
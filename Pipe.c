@@ -0,0 +1,613 @@
+
+/*
+ * Moves data from one file descriptor to another without copying it through
+ * PHP strings, eg. for proxying between two sockets.
+ * 
+ * With splice() the data moves kernel-side from the source into an internal
+ * pipe and from there to the destination. A read watcher on the source and a
+ * write watcher on the destination drive the transfer, reading stops while
+ * the pipe is full and the destination is not writable (backpressure).
+ * Without splice() a buffer of the pipe size is used instead.
+ */
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#define PIPE_PROGRESS 1
+#define PIPE_EOF      2
+#define PIPE_ERROR    3
+
+/* Transfers per wakeup, so one busy pipe cannot starve the other watchers */
+#define PIPE_MAX_ROUNDS 16
+
+typedef struct pipe_object {
+	zend_object     std;
+	zval            *this;          /* Reference keeping the object alive while transferring */
+	struct ev_loop  *loop;          /* NULL once finished, cancelled or the loop was destroyed */
+	ev_io           in_watcher;     /* Source readable */
+	ev_io           out_watcher;    /* Destination writable */
+	ev_cleanup      cleanup_watcher;
+	int             from;           /* Duplicates of the descriptors passed to splice() */
+	int             to;
+	int             pipe[2];        /* With splice() */
+	char            *buf;           /* Without splice() */
+	size_t          offset;         /* Start of the buffered data in buf */
+	size_t          capacity;
+	size_t          buffered;       /* Bytes read but not yet written */
+	long            bytes;          /* Bytes written to the destination */
+	int             eof;
+	int             half_close;
+	int             progress;
+	char            *error;
+	zval            *callback;
+	zend_fcall_info_cache fcc;
+} pipe_object;
+
+zend_class_entry *pipe_ce;
+
+zend_object_handlers pipe_object_handlers;
+
+
+/* Moves data from the source into the pipe, like read() */
+static ssize_t pipe_move_in(pipe_object *p)
+{
+#if HAVE_SPLICE
+	return splice(p->from, NULL, p->pipe[1], NULL, p->capacity, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+	if(p->offset + p->buffered >= p->capacity)
+	{
+		errno = EAGAIN;
+		
+		return -1;
+	}
+	
+	return read(p->from, p->buf + p->offset + p->buffered, p->capacity - p->offset - p->buffered);
+#endif
+}
+
+/* Moves data from the pipe to the destination, like write() */
+static ssize_t pipe_move_out(pipe_object *p)
+{
+#if HAVE_SPLICE
+	return splice(p->pipe[0], NULL, p->to, NULL, p->buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+	ssize_t n = write(p->to, p->buf + p->offset, p->buffered);
+	
+	if(n > 0)
+	{
+		p->offset = (size_t) n == p->buffered ? 0 : p->offset + n;
+	}
+	
+	return n;
+#endif
+}
+
+/* Stops the watchers and closes all descriptors */
+static void pipe_detach(pipe_object *p)
+{
+	if( ! p->loop)
+	{
+		return;
+	}
+	
+	ev_io_stop(p->loop, &p->in_watcher);
+	ev_io_stop(p->loop, &p->out_watcher);
+	ev_cleanup_stop(p->loop, &p->cleanup_watcher);
+	
+	close(p->from);
+	close(p->to);
+
+#if HAVE_SPLICE
+	close(p->pipe[0]);
+	close(p->pipe[1]);
+#endif
+
+	p->loop = NULL;
+}
+
+/* Drops the callback and the self reference, the object might be freed */
+static void pipe_release(pipe_object *p TSRMLS_DC)
+{
+	zval *self = p->this;
+	
+	if(p->callback)
+	{
+		zval_ptr_dtor(&p->callback);
+		p->callback = NULL;
+	}
+	
+	p->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Calls callback($pipe, $event, $bytes) */
+static void pipe_call(pipe_object *p, long event, long bytes TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = p->this;
+	zval *zevent;
+	zval *zbytes;
+	zval **params[3] = { &self, &zevent, &zbytes };
+	
+	MAKE_STD_ZVAL(zevent);
+	ZVAL_LONG(zevent, event);
+	
+	MAKE_STD_ZVAL(zbytes);
+	ZVAL_LONG(zbytes, bytes);
+	
+	libev_call_function(p->callback, &p->fcc, 3, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+	
+	zval_ptr_dtor(&zevent);
+	zval_ptr_dtor(&zbytes);
+}
+
+/* Stops the transfer and reports EOF or the error, releasing the object */
+static void pipe_finish(pipe_object *p, const char *error TSRMLS_DC)
+{
+	if(error)
+	{
+		p->error = estrdup(error);
+	}
+	else if(p->half_close)
+	{
+		/* Forward the EOF, fails harmlessly if the destination is no socket */
+		shutdown(p->to, SHUT_WR);
+	}
+	
+	pipe_detach(p);
+	
+	if(p->callback)
+	{
+		pipe_call(p, error ? PIPE_ERROR : PIPE_EOF, p->bytes TSRMLS_CC);
+	}
+	
+	pipe_release(p TSRMLS_CC);
+}
+
+/* Moves as much data as possible without blocking and sets up the watchers
+   for what remains */
+static void pipe_pump(pipe_object *p TSRMLS_DC)
+{
+	ssize_t n;
+	long moved = 0;
+	int full = 0;
+	int rounds;
+	
+	for(rounds = 0; rounds < PIPE_MAX_ROUNDS; rounds++)
+	{
+		while(p->buffered)
+		{
+			if((n = pipe_move_out(p)) > 0)
+			{
+				p->buffered -= n;
+				p->bytes    += n;
+				moved       += n;
+			}
+			else if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				break;
+			}
+			else
+			{
+				pipe_finish(p, strerror(errno) TSRMLS_CC);
+				
+				return;
+			}
+		}
+		
+		if(p->eof)
+		{
+			break;
+		}
+		
+		if((n = pipe_move_in(p)) > 0)
+		{
+			p->buffered += n;
+		}
+		else if(n == 0)
+		{
+			p->eof = 1;
+		}
+		else if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		{
+			/* With data buffered this might be the pipe being full rather than the
+			   source being empty, wait for the destination then */
+			full = p->buffered > 0;
+			
+			break;
+		}
+		else
+		{
+			pipe_finish(p, strerror(errno) TSRMLS_CC);
+			
+			return;
+		}
+	}
+	
+	if(p->eof && ! p->buffered)
+	{
+		pipe_finish(p, NULL TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(p->eof || full)
+	{
+		ev_io_stop(p->loop, &p->in_watcher);
+	}
+	else
+	{
+		ev_io_start(p->loop, &p->in_watcher);
+	}
+	
+	if(p->buffered)
+	{
+		ev_io_start(p->loop, &p->out_watcher);
+	}
+	else
+	{
+		ev_io_stop(p->loop, &p->out_watcher);
+	}
+	
+	if(p->progress && moved && p->callback)
+	{
+		pipe_call(p, PIPE_PROGRESS, moved TSRMLS_CC);
+	}
+}
+
+static void pipe_run(pipe_object *p TSRMLS_DC)
+{
+	zval *self = p->this;
+	
+	/* The callback might cancel and release the last reference */
+	zval_add_ref(&self);
+	
+	pipe_pump(p TSRMLS_CC);
+	
+	zval_ptr_dtor(&self);
+}
+
+static void pipe_in_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	pipe_run((pipe_object *)((char *) w - XtOffsetOf(pipe_object, in_watcher)) TSRMLS_CC);
+}
+
+static void pipe_out_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	pipe_run((pipe_object *)((char *) w - XtOffsetOf(pipe_object, out_watcher)) TSRMLS_CC);
+}
+
+/* The EventLoop is being destroyed */
+static void pipe_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	pipe_object *p = (pipe_object *)((char *) w - XtOffsetOf(pipe_object, cleanup_watcher));
+	
+	pipe_detach(p);
+	pipe_release(p TSRMLS_CC);
+}
+
+FREE_STORAGE(pipe_object,
+
+	pipe_detach(obj);
+	
+	if(obj->callback)
+	{
+		zval_ptr_dtor(&obj->callback);
+	}
+	
+	if(obj->error)
+	{
+		efree(obj->error);
+	}
+	
+	if(obj->buf)
+	{
+		efree(obj->buf);
+	}
+)
+
+CREATE_HANDLER(pipe_object, pipe_object, pipe_object_free, pipe_object_handlers,
+	obj->from = -1;
+	obj->to   = -1;
+)
+
+
+/* Duplicates fd for the transfer and makes it non-blocking, -1 on failure */
+static int pipe_dup(int fd)
+{
+	int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	
+	if(copy >= 0)
+	{
+		/* Shared with fd, as the file status flags belong to the open file */
+		fcntl(copy, F_SETFL, fcntl(copy, F_GETFL) | O_NONBLOCK);
+	}
+	
+	return copy;
+}
+
+/**
+ * Private, use Pipe::splice().
+ */
+PHP_METHOD(Pipe, __construct)
+{
+	/* Intentionally left empty */
+}
+
+/**
+ * Moves everything readable from $from to $to until EOF or an error, both
+ * are streams or sockets which are made non-blocking. The transfer uses
+ * duplicates of the descriptors, the caller stays responsible for closing
+ * $from and $to.
+ * 
+ * Callback signature: callback(Pipe $pipe, int $event, int $bytes), event is
+ * Pipe::EOF (after half-closing $to) or Pipe::ERROR with the total number of
+ * bytes moved, or with the "progress" option Pipe::PROGRESS with the number
+ * of bytes moved since the last call.
+ * 
+ * Options:
+ *  * "pipe_size":  int, size of the internal pipe (F_SETPIPE_SZ) or buffer,
+ *                  default 65536
+ *  * "half_close": boolean, shutdown(SHUT_WR) $to on EOF, default true
+ *  * "progress":   boolean, report bytes as they are moved, default false
+ * 
+ * @param  EventLoop
+ * @param  resource
+ * @param  resource
+ * @param  callback
+ * @param  array
+ * @return Pipe
+ */
+PHP_METHOD(Pipe, splice)
+{
+	zval *zloop;
+	zval **zto;
+	zval *zoptions = NULL;
+	zval **entry;
+	event_loop_object *loop_obj;
+	pipe_object *p;
+	int from;
+	int to;
+	long pipe_size = 65536;
+	long half_close = 1;
+	long progress = 0;
+#if HAVE_SPLICE
+	int pipefd[2];
+#endif
+	dFILE_DESC;
+	dCALLBACK;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "OZZz|a", &zloop, event_loop_ce, &fd, &zto, &callback, &zoptions) != SUCCESS) {
+		return;
+	}
+	
+	CHECK_CALLBACK;
+	
+	EXTRACT_FILE_DESC(Pipe, splice);
+	from = (int) file_desc;
+	
+	fd = zto;
+	
+	EXTRACT_FILE_DESC(Pipe, splice);
+	to = (int) file_desc;
+	
+	loop_obj = (event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC);
+	
+	if( ! loop_obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\Pipe: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(zoptions)
+	{
+		if(zend_hash_find(Z_ARRVAL_P(zoptions), "pipe_size", sizeof("pipe_size"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_long_ex(entry);
+			
+			pipe_size = Z_LVAL_PP(entry) < 4096 ? 4096 : Z_LVAL_PP(entry);
+		}
+		
+		if(zend_hash_find(Z_ARRVAL_P(zoptions), "half_close", sizeof("half_close"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_long_ex(entry);
+			
+			half_close = Z_LVAL_PP(entry);
+		}
+		
+		if(zend_hash_find(Z_ARRVAL_P(zoptions), "progress", sizeof("progress"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_long_ex(entry);
+			
+			progress = Z_LVAL_PP(entry);
+		}
+	}
+
+#if HAVE_SPLICE
+	if(pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Pipe: pipe2() failed: %s", strerror(errno));
+		
+		return;
+	}
+
+#  ifdef F_SETPIPE_SZ
+	/* Might be limited by /proc/sys/fs/pipe-max-size, the actual size is used */
+	fcntl(pipefd[1], F_SETPIPE_SZ, (int) pipe_size);
+#  endif
+#  ifdef F_GETPIPE_SZ
+	pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+	
+	if(pipe_size <= 0)
+	{
+		pipe_size = 65536;
+	}
+#  endif
+#endif
+
+	from = pipe_dup(from);
+	to   = pipe_dup(to);
+	
+	if(from < 0 || to < 0)
+	{
+		int error = errno;
+		
+		if(from >= 0)
+		{
+			close(from);
+		}
+		
+		if(to >= 0)
+		{
+			close(to);
+		}
+
+#if HAVE_SPLICE
+		close(pipefd[0]);
+		close(pipefd[1]);
+#endif
+
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Pipe: failed to duplicate descriptor: %s", strerror(error));
+		
+		return;
+	}
+	
+	object_init_ex(return_value, pipe_ce);
+	
+	p = (pipe_object *)zend_object_store_get_object(return_value TSRMLS_CC);
+	
+	p->loop       = loop_obj->loop;
+	p->from       = from;
+	p->to         = to;
+	p->capacity   = (size_t) pipe_size;
+	p->half_close = half_close != 0;
+	p->progress   = progress != 0;
+
+#if HAVE_SPLICE
+	p->pipe[0] = pipefd[0];
+	p->pipe[1] = pipefd[1];
+#else
+	p->buf = emalloc(p->capacity);
+#endif
+
+	zval_add_ref(&callback);
+	p->callback = callback;
+	p->fcc      = callback_fcc;
+	
+	/* Independent reference to the object, held until the transfer has finished */
+	MAKE_STD_ZVAL(p->this);
+	*p->this = *return_value;
+	zval_copy_ctor(p->this);
+	INIT_PZVAL(p->this);
+	
+	ev_io_init(&p->in_watcher, pipe_in_callback, p->from, EV_READ);
+	ev_io_init(&p->out_watcher, pipe_out_callback, p->to, EV_WRITE);
+	
+	ev_cleanup_init(&p->cleanup_watcher, pipe_cleanup_callback);
+	ev_cleanup_start(p->loop, &p->cleanup_watcher);
+	
+	/* Nothing is moved before the loop runs, the callback is never called from here */
+	ev_io_start(p->loop, &p->in_watcher);
+}
+
+/**
+ * Stops the transfer without calling the callback, data which was read but
+ * not yet written is lost.
+ * 
+ * @return boolean  false if the transfer had already ended
+ */
+PHP_METHOD(Pipe, cancel)
+{
+	pipe_object *p = (pipe_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! p->loop)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	pipe_detach(p);
+	pipe_release(p TSRMLS_CC);
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Returns the number of bytes written to the destination.
+ * 
+ * @return int
+ */
+PHP_METHOD(Pipe, getBytes)
+{
+	pipe_object *p = (pipe_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(p->bytes);
+}
+
+/**
+ * Returns the number of bytes read from the source but not yet written.
+ * 
+ * @return int
+ */
+PHP_METHOD(Pipe, getBufferedBytes)
+{
+	pipe_object *p = (pipe_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG((long) p->buffered);
+}
+
+/**
+ * Returns true while the transfer is in progress.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(Pipe, isActive)
+{
+	pipe_object *p = (pipe_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(p->loop != NULL);
+}
+
+/**
+ * Returns the error which ended the transfer.
+ * 
+ * @return string|null
+ */
+PHP_METHOD(Pipe, getError)
+{
+	pipe_object *p = (pipe_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! p->error)
+	{
+		RETURN_NULL();
+	}
+	
+	RETURN_STRING(p->error, 1);
+}
+
+
+static const zend_function_entry pipe_methods[] = {
+	ZEND_ME(Pipe, __construct, NULL, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+	ZEND_ME(Pipe, splice, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	ZEND_ME(Pipe, cancel, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Pipe, getBytes, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Pipe, getBufferedBytes, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Pipe, isActive, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Pipe, getError, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
@@ -0,0 +1,1012 @@
+
+/*
+ * Process spawning with non-blocking stdio handled by an EventLoop.
+ * 
+ * Children are started with posix_spawnp(), which glibc implements with
+ * clone(CLONE_VM | CLONE_VFORK), so no shell is involved and the page tables
+ * of a large parent are not copied. stdin, stdout and stderr are UNIX socket
+ * pairs (like libuv), which lets stdin be written with MSG_NOSIGNAL.
+ * 
+ * The child is reaped with ev_child on the default loop and with a pidfd on
+ * other loops (Linux 5.4+). The Process object keeps itself alive until the
+ * child has exited and its output has been read to the end, then calls the
+ * exit callback and releases all callbacks.
+ */
+
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Missing on macOS, see process_pipe_prepare() */
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+#ifndef SOCK_CLOEXEC
+#  define SOCK_CLOEXEC 0
+#endif
+
+extern char **environ;
+
+/* Maximum number of bytes passed to a stdout/stderr callback at a time */
+#define PROCESS_READ_SIZE 65536
+
+struct process_object;
+
+/* Parent end of the stdout or stderr of the child */
+typedef struct process_pipe {
+	ev_io  io;
+	int    fd;        /* -1 if closed or not captured */
+	zval   *callback;
+	zend_fcall_info_cache fcc;
+	struct process_object *process;
+} process_pipe;
+
+typedef struct process_object {
+	zend_object     std;
+	zval            *this;         /* Reference keeping the object alive until finished */
+	struct ev_loop  *loop;         /* NULL once finished or when the loop was destroyed */
+	pid_t           pid;
+	int             exited;        /* The child has been reaped */
+	int             status;        /* waitpid() status, -1 if unknown */
+	int             pidfd;         /* -1 if ev_child is used */
+	ev_child        child_watcher;
+	ev_io           pidfd_watcher;
+	ev_cleanup      cleanup_watcher;
+	process_pipe    out;
+	process_pipe    err;
+	ev_io           in_watcher;
+	int             in_fd;         /* -1 if closed or not captured */
+	char            *in_buf;       /* Data queued by Process::write() */
+	size_t          in_len;
+	size_t          in_size;
+	int             in_close;      /* Close stdin once in_buf has been written */
+	zval            *on_exit;
+	zend_fcall_info_cache on_exit_fcc;
+} process_object;
+
+zend_class_entry *process_ce;
+
+zend_object_handlers process_object_handlers;
+
+/* Calls callback($process, $arg) */
+static void process_call(process_object *proc, zval *callback, zend_fcall_info_cache *fcc, zval *arg TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = proc->this;
+	zval **params[2] = { &self, &arg };
+	
+	libev_call_function(callback, fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+}
+
+static void process_close_stdin(process_object *proc)
+{
+	if(proc->in_fd >= 0)
+	{
+		if(proc->loop)
+		{
+			ev_io_stop(proc->loop, &proc->in_watcher);
+		}
+		
+		close(proc->in_fd);
+		proc->in_fd = -1;
+	}
+	
+	proc->in_len = 0;
+}
+
+static void process_close_pipe(process_object *proc, process_pipe *pipe)
+{
+	if(pipe->fd >= 0)
+	{
+		if(proc->loop)
+		{
+			ev_io_stop(proc->loop, &pipe->io);
+		}
+		
+		close(pipe->fd);
+		pipe->fd = -1;
+	}
+}
+
+/* Stops all watchers, the process can no longer be reaped or read from */
+static void process_detach(process_object *proc)
+{
+	if( ! proc->loop)
+	{
+		return;
+	}
+	
+	if(proc->pidfd >= 0)
+	{
+		ev_io_stop(proc->loop, &proc->pidfd_watcher);
+	}
+	else
+	{
+		ev_child_stop(proc->loop, &proc->child_watcher);
+	}
+	
+	ev_io_stop(proc->loop, &proc->out.io);
+	ev_io_stop(proc->loop, &proc->err.io);
+	ev_io_stop(proc->loop, &proc->in_watcher);
+	ev_cleanup_stop(proc->loop, &proc->cleanup_watcher);
+	
+	proc->loop = NULL;
+}
+
+/* Drops the callbacks and the self reference, the object might be freed */
+static void process_release(process_object *proc TSRMLS_DC)
+{
+	zval *self = proc->this;
+	
+	if(proc->on_exit)
+	{
+		zval_ptr_dtor(&proc->on_exit);
+		proc->on_exit = NULL;
+	}
+	
+	if(proc->out.callback)
+	{
+		zval_ptr_dtor(&proc->out.callback);
+		proc->out.callback = NULL;
+	}
+	
+	if(proc->err.callback)
+	{
+		zval_ptr_dtor(&proc->err.callback);
+		proc->err.callback = NULL;
+	}
+	
+	proc->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Calls the exit callback once the child has been reaped and its output has
+   been read to the end */
+static void process_maybe_finish(process_object *proc TSRMLS_DC)
+{
+	zval *status;
+	
+	if( ! proc->exited || proc->out.fd >= 0 || proc->err.fd >= 0 || ! proc->this)
+	{
+		return;
+	}
+	
+	process_close_stdin(proc);
+	process_detach(proc);
+	
+	if(proc->on_exit)
+	{
+		MAKE_STD_ZVAL(status);
+		ZVAL_LONG(status, proc->status);
+		
+		process_call(proc, proc->on_exit, &proc->on_exit_fcc, status TSRMLS_CC);
+		
+		zval_ptr_dtor(&status);
+	}
+	
+	process_release(proc TSRMLS_CC);
+}
+
+static void process_exited(process_object *proc, int status TSRMLS_DC)
+{
+	proc->exited = 1;
+	proc->status = status;
+	
+#if HAVE_PIDFD
+	if(proc->pidfd >= 0)
+	{
+		ev_io_stop(proc->loop, &proc->pidfd_watcher);
+		child_pidfd_close(proc->pidfd);
+		proc->pidfd = -1;
+	}
+	else
+#endif
+	{
+		ev_child_stop(proc->loop, &proc->child_watcher);
+	}
+	
+	process_maybe_finish(proc TSRMLS_CC);
+}
+
+static void process_child_cb(struct ev_loop *loop, ev_child *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	process_exited((process_object *)((char *) w - XtOffsetOf(process_object, child_watcher)), w->rstatus TSRMLS_CC);
+}
+
+#if HAVE_PIDFD
+static void process_pidfd_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	process_object *proc = (process_object *)((char *) w - XtOffsetOf(process_object, pidfd_watcher));
+	
+	process_exited(proc, child_pidfd_reap(proc->pidfd, proc->pid) TSRMLS_CC);
+}
+#endif
+
+static void process_read_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	process_pipe *pipe = (process_pipe *) w;
+	process_object *proc = pipe->process;
+	char *buf = emalloc(PROCESS_READ_SIZE + 1);
+	ssize_t n = read(pipe->fd, buf, PROCESS_READ_SIZE);
+	zval *data;
+	
+	if(n > 0)
+	{
+		buf[n] = '\0';
+		
+		MAKE_STD_ZVAL(data);
+		ZVAL_STRINGL(data, buf, (int) n, 0);
+		
+		process_call(proc, pipe->callback, &pipe->fcc, data TSRMLS_CC);
+		
+		zval_ptr_dtor(&data);
+		
+		return;
+	}
+	
+	efree(buf);
+	
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		return;
+	}
+	
+	/* EOF, or an error which is treated as such */
+	process_close_pipe(proc, pipe);
+	process_maybe_finish(proc TSRMLS_CC);
+}
+
+static void process_write_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	process_object *proc = (process_object *)((char *) w - XtOffsetOf(process_object, in_watcher));
+	ssize_t n = send(proc->in_fd, proc->in_buf, proc->in_len, MSG_NOSIGNAL);
+	
+	if(n < 0)
+	{
+		if(errno != EAGAIN && errno != EINTR)
+		{
+			/* The child closed its stdin, drop the queue */
+			process_close_stdin(proc);
+		}
+		
+		return;
+	}
+	
+	proc->in_len -= (size_t) n;
+	memmove(proc->in_buf, proc->in_buf + n, proc->in_len);
+	
+	if( ! proc->in_len)
+	{
+		ev_io_stop(loop, w);
+		
+		if(proc->in_close)
+		{
+			process_close_stdin(proc);
+		}
+	}
+}
+
+/* The EventLoop is being destroyed, the child will not be reaped */
+static void process_cleanup_cb(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	process_object *proc = (process_object *)((char *) w - XtOffsetOf(process_object, cleanup_watcher));
+	
+	process_detach(proc);
+	process_close_stdin(proc);
+	process_close_pipe(proc, &proc->out);
+	process_close_pipe(proc, &proc->err);
+	process_release(proc TSRMLS_CC);
+}
+
+FREE_STORAGE(process_object,
+	
+	process_detach(obj);
+	process_close_stdin(obj);
+	process_close_pipe(obj, &obj->out);
+	process_close_pipe(obj, &obj->err);
+	
+#if HAVE_PIDFD
+	if(obj->pidfd >= 0)
+	{
+		child_pidfd_close(obj->pidfd);
+	}
+#endif
+	
+	if(obj->in_buf)
+	{
+		efree(obj->in_buf);
+	}
+	
+	if(obj->on_exit)
+	{
+		zval_ptr_dtor(&obj->on_exit);
+	}
+	
+	if(obj->out.callback)
+	{
+		zval_ptr_dtor(&obj->out.callback);
+	}
+	
+	if(obj->err.callback)
+	{
+		zval_ptr_dtor(&obj->err.callback);
+	}
+)
+
+CREATE_HANDLER(process_object, process_object, process_object_free, process_object_handlers,
+	obj->pidfd  = -1;
+	obj->status = -1;
+	obj->in_fd  = -1;
+	obj->out.fd = -1;
+	obj->err.fd = -1;
+)
+
+
+/* Stdio modes of Process::spawn() */
+#define PROCESS_STDIO_INHERIT 0
+#define PROCESS_STDIO_NULL    1
+#define PROCESS_STDIO_PIPE    2
+
+/* Reads the stdio mode of options[name] into *mode, resolving callbacks into
+   *callback and *fcc, returns 0 and throws if the option is invalid */
+static int process_stdio_option(HashTable *options, const char *name, int allow_bool, int *mode, zval **callback, zend_fcall_info_cache *fcc TSRMLS_DC)
+{
+	zval **entry;
+	char *callback_tmp = NULL;
+	
+	*callback = NULL;
+	
+	if( ! options || zend_hash_find(options, name, strlen(name) + 1, (void **) &entry) != SUCCESS || Z_TYPE_PP(entry) == IS_NULL)
+	{
+		return 1;
+	}
+	
+	if(Z_TYPE_PP(entry) == IS_BOOL)
+	{
+		if( ! Z_LVAL_PP(entry))
+		{
+			*mode = PROCESS_STDIO_NULL;
+			
+			return 1;
+		}
+		
+		if(allow_bool)
+		{
+			*mode = PROCESS_STDIO_PIPE;
+			
+			return 1;
+		}
+	}
+	else if( ! allow_bool)
+	{
+		if(libev_callback_resolve(*entry, &callback_tmp, fcc TSRMLS_CC))
+		{
+			efree(callback_tmp);
+			
+			*mode     = PROCESS_STDIO_PIPE;
+			*callback = *entry;
+			
+			return 1;
+		}
+		
+		efree(callback_tmp);
+	}
+	
+	zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Process: invalid value for option '%s'", name);
+	
+	return 0;
+}
+
+/* Makes the parent end fds[0] of a socketpair non-blocking, and where the
+   flags are missing (macOS) does what SOCK_CLOEXEC and MSG_NOSIGNAL would */
+static int process_pipe_prepare(int fds[2])
+{
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	
+	if(setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0)
+	{
+		return -1;
+	}
+#endif
+	
+	if( ! SOCK_CLOEXEC && (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0))
+	{
+		return -1;
+	}
+	
+	return fcntl(fds[0], F_SETFL, O_NONBLOCK);
+}
+
+/* Converts a PHP array into a NULL terminated string vector, environment
+   arrays with string keys become "key=value", returns NULL if a string contains
+   a NUL byte */
+static char **process_string_vector(HashTable *ht, int env)
+{
+	HashPosition pos;
+	zval **entry;
+	zval tmp;
+	char *key;
+	uint key_len;
+	ulong index;
+	char **vec = safe_emalloc(zend_hash_num_elements(ht) + 1, sizeof(char *), 0);
+	int i = 0;
+	
+	for(zend_hash_internal_pointer_reset_ex(ht, &pos);
+		zend_hash_get_current_data_ex(ht, (void **) &entry, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(ht, &pos))
+	{
+		tmp = **entry;
+		zval_copy_ctor(&tmp);
+		convert_to_string(&tmp);
+		
+		if(strlen(Z_STRVAL(tmp)) != (size_t) Z_STRLEN(tmp))
+		{
+			zval_dtor(&tmp);
+			
+			break;
+		}
+		
+		if(env && zend_hash_get_current_key_ex(ht, &key, &key_len, &index, 0, &pos) == HASH_KEY_IS_STRING)
+		{
+			spprintf(&vec[i++], 0, "%s=%s", key, Z_STRVAL(tmp));
+		}
+		else
+		{
+			vec[i++] = estrndup(Z_STRVAL(tmp), Z_STRLEN(tmp));
+		}
+		
+		zval_dtor(&tmp);
+	}
+	
+	vec[i] = NULL;
+	
+	if(i != zend_hash_num_elements(ht))
+	{
+		while(i--)
+		{
+			efree(vec[i]);
+		}
+		
+		efree(vec);
+		
+		return NULL;
+	}
+	
+	return vec;
+}
+
+static void process_free_vector(char **vec)
+{
+	char **p;
+	
+	for(p = vec; vec && *p; p++)
+	{
+		efree(*p);
+	}
+	
+	if(vec)
+	{
+		efree(vec);
+	}
+}
+
+/**
+ * Private, use Process::spawn().
+ */
+PHP_METHOD(Process, __construct)
+{
+	/* Intentionally left empty */
+}
+
+/**
+ * Starts $argv[0] with the arguments $argv, searching PATH if it does not
+ * contain a slash. No shell is involved.
+ * 
+ * Options:
+ *  * "cwd":    string, working directory of the child
+ *  * "env":    array, environment as name => value, default is to inherit
+ *  * "stdin":  true (default) to write with Process::write(), false for /dev/null,
+ *              null to inherit
+ *  * "stdout": callback($process, string $data) receiving the output, false for
+ *              /dev/null, null (default) to inherit
+ *  * "stderr": same as "stdout"
+ *  * "exit":   callback($process, int $status) called once the child has exited
+ *              and its output has been read, $status as returned by waitpid()
+ * 
+ * @param  EventLoop  The default loop, or any loop on Linux 5.4+
+ * @param  array      Program and arguments
+ * @param  array      Options
+ * @return Process
+ */
+PHP_METHOD(Process, spawn)
+{
+	zval *zloop;
+	zval *zargv;
+	zval *zoptions = NULL;
+	zval **entry;
+	HashTable *options = NULL;
+	event_loop_object *loop_obj;
+	process_object *proc;
+	int in_mode = PROCESS_STDIO_PIPE;
+	int out_mode = PROCESS_STDIO_INHERIT;
+	int err_mode = PROCESS_STDIO_INHERIT;
+	zval *out_cb, *err_cb, *exit_cb = NULL;
+	zend_fcall_info_cache out_fcc, err_fcc, exit_fcc = empty_fcall_info_cache;
+	zval *dummy;
+	zend_fcall_info_cache dummy_fcc;
+	int fds[3][2] = { {-1, -1}, {-1, -1}, {-1, -1} };
+	int modes[3];
+	char **argv = NULL;
+	char **envp = NULL;
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+	char *cwd = NULL;
+#endif
+	char *callback_tmp = NULL;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	pid_t pid;
+	int pidfd = -1;
+	int ret;
+	int i;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Oa|a", &zloop, event_loop_ce, &zargv, &zoptions) != SUCCESS) {
+		return;
+	}
+	
+	loop_obj = (event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC);
+	
+	if( ! loop_obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\Process: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+
+#if ! HAVE_PIDFD
+	if( ! ev_is_default_loop(loop_obj->loop))
+	{
+		zend_throw_exception(NULL, "libev\\Process: only the default event-loop can reap children without pidfd support", 1 TSRMLS_CC);
+		
+		return;
+	}
+#endif
+
+	if( ! zend_hash_num_elements(Z_ARRVAL_P(zargv)))
+	{
+		zend_throw_exception(NULL, "libev\\Process: argv must not be empty", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	options = zoptions ? Z_ARRVAL_P(zoptions) : NULL;
+	
+	if( ! process_stdio_option(options, "stdin", 1, &in_mode, &dummy, &dummy_fcc TSRMLS_CC) ||
+		! process_stdio_option(options, "stdout", 0, &out_mode, &out_cb, &out_fcc TSRMLS_CC) ||
+		! process_stdio_option(options, "stderr", 0, &err_mode, &err_cb, &err_fcc TSRMLS_CC))
+	{
+		return;
+	}
+	
+	/* "stdin" => null means inherit, false means /dev/null */
+	if(options && zend_hash_find(options, "stdin", sizeof("stdin"), (void **) &entry) == SUCCESS && Z_TYPE_PP(entry) == IS_NULL)
+	{
+		in_mode = PROCESS_STDIO_INHERIT;
+	}
+	
+	if(options && zend_hash_find(options, "exit", sizeof("exit"), (void **) &entry) == SUCCESS && Z_TYPE_PP(entry) != IS_NULL)
+	{
+		if( ! libev_callback_resolve(*entry, &callback_tmp, &exit_fcc TSRMLS_CC))
+		{
+			zend_throw_exception_ex(NULL, 0 TSRMLS_CC, "'%s' is not a valid callback", callback_tmp);
+			efree(callback_tmp);
+			
+			return;
+		}
+		
+		efree(callback_tmp);
+		
+		exit_cb = *entry;
+	}
+	
+	if(options && zend_hash_find(options, "cwd", sizeof("cwd"), (void **) &entry) == SUCCESS && Z_TYPE_PP(entry) != IS_NULL)
+	{
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+		if(Z_TYPE_PP(entry) != IS_STRING || strlen(Z_STRVAL_PP(entry)) != (size_t) Z_STRLEN_PP(entry))
+		{
+			zend_throw_exception(NULL, "libev\\Process: invalid value for option 'cwd'", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		cwd = Z_STRVAL_PP(entry);
+#else
+		zend_throw_exception(NULL, "libev\\Process: option 'cwd' requires posix_spawn_file_actions_addchdir_np()", 1 TSRMLS_CC);
+		
+		return;
+#endif
+	}
+	
+	if( ! (argv = process_string_vector(Z_ARRVAL_P(zargv), 0)))
+	{
+		zend_throw_exception(NULL, "libev\\Process: argv must not contain NUL bytes", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if(options && zend_hash_find(options, "env", sizeof("env"), (void **) &entry) == SUCCESS && Z_TYPE_PP(entry) != IS_NULL)
+	{
+		if(Z_TYPE_PP(entry) != IS_ARRAY || ! (envp = process_string_vector(Z_ARRVAL_PP(entry), 1)))
+		{
+			process_free_vector(argv);
+			
+			zend_throw_exception(NULL, "libev\\Process: invalid value for option 'env'", 1 TSRMLS_CC);
+			
+			return;
+		}
+	}
+	
+	modes[0] = in_mode;
+	modes[1] = out_mode;
+	modes[2] = err_mode;
+	
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	
+	/* [i][0] is the parent end, [i][1] the child end */
+	for(i = 0, ret = 0; i < 3 && ! ret; i++)
+	{
+		if(modes[i] == PROCESS_STDIO_PIPE)
+		{
+			if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds[i]) < 0 ||
+				process_pipe_prepare(fds[i]) < 0)
+			{
+				ret = errno;
+			}
+			else
+			{
+				ret = posix_spawn_file_actions_adddup2(&actions, fds[i][1], i);
+			}
+		}
+		else if(modes[i] == PROCESS_STDIO_NULL)
+		{
+			ret = posix_spawn_file_actions_addopen(&actions, i, "/dev/null", i ? O_WRONLY : O_RDONLY, 0);
+		}
+	}
+
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP
+	if( ! ret && cwd)
+	{
+		ret = posix_spawn_file_actions_addchdir_np(&actions, cwd);
+	}
+#endif
+
+	if( ! ret)
+	{
+		/* Undo the signal handling of libev and PHP in the child */
+		sigemptyset(&mask);
+		posix_spawnattr_setsigmask(&attr, &mask);
+		
+		for(i = 1; i < NSIG; i++)
+		{
+			if(i != SIGKILL && i != SIGSTOP)
+			{
+				sigaddset(&mask, i);
+			}
+		}
+		
+		posix_spawnattr_setsigdefault(&attr, &mask);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+		
+		ret = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp ? envp : environ);
+	}
+	
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	
+	for(i = 0; i < 3; i++)
+	{
+		if(fds[i][1] >= 0)
+		{
+			close(fds[i][1]);
+		}
+		
+		if(ret && fds[i][0] >= 0)
+		{
+			close(fds[i][0]);
+		}
+	}
+	
+	if(ret)
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Process: failed to spawn %s: %s", argv[0], strerror(ret));
+		
+		process_free_vector(argv);
+		process_free_vector(envp);
+		
+		return;
+	}
+	
+	process_free_vector(argv);
+	process_free_vector(envp);
+
+#if HAVE_PIDFD
+	/* The child cannot have been reaped yet, the pid is still ours */
+	if( ! ev_is_default_loop(loop_obj->loop) && (pidfd = child_pidfd_open(pid)) < 0)
+	{
+		ret = errno;
+		
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		
+		for(i = 0; i < 3; i++)
+		{
+			if(fds[i][0] >= 0)
+			{
+				close(fds[i][0]);
+			}
+		}
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Process: pidfd_open() failed: %s", strerror(ret));
+		
+		return;
+	}
+#endif
+
+	object_init_ex(return_value, process_ce);
+	
+	proc = (process_object *)zend_object_store_get_object(return_value TSRMLS_CC);
+	
+	proc->pid   = pid;
+	proc->pidfd = pidfd;
+	proc->loop  = loop_obj->loop;
+	
+	/* Independent reference to the object, held until the process is finished */
+	MAKE_STD_ZVAL(proc->this);
+	*proc->this = *return_value;
+	zval_copy_ctor(proc->this);
+	INIT_PZVAL(proc->this);
+	
+#if HAVE_PIDFD
+	if(proc->pidfd >= 0)
+	{
+		ev_io_init(&proc->pidfd_watcher, process_pidfd_cb, proc->pidfd, EV_READ);
+		ev_io_start(proc->loop, &proc->pidfd_watcher);
+	}
+	else
+#endif
+	{
+		ev_child_init(&proc->child_watcher, process_child_cb, pid, 0);
+		ev_child_start(proc->loop, &proc->child_watcher);
+	}
+	
+	if(exit_cb)
+	{
+		zval_add_ref(&exit_cb);
+		proc->on_exit     = exit_cb;
+		proc->on_exit_fcc = exit_fcc;
+	}
+	
+	proc->in_fd = fds[0][0];
+	ev_io_init(&proc->in_watcher, process_write_cb, proc->in_fd, EV_WRITE);
+	
+	proc->out.process = proc;
+	proc->err.process = proc;
+	
+	if((proc->out.fd = fds[1][0]) >= 0)
+	{
+		zval_add_ref(&out_cb);
+		proc->out.callback = out_cb;
+		proc->out.fcc      = out_fcc;
+		
+		ev_io_init(&proc->out.io, process_read_cb, proc->out.fd, EV_READ);
+		ev_io_start(proc->loop, &proc->out.io);
+	}
+	
+	if((proc->err.fd = fds[2][0]) >= 0)
+	{
+		zval_add_ref(&err_cb);
+		proc->err.callback = err_cb;
+		proc->err.fcc      = err_fcc;
+		
+		ev_io_init(&proc->err.io, process_read_cb, proc->err.fd, EV_READ);
+		ev_io_start(proc->loop, &proc->err.io);
+	}
+	
+	ev_cleanup_init(&proc->cleanup_watcher, process_cleanup_cb);
+	ev_cleanup_start(proc->loop, &proc->cleanup_watcher);
+}
+
+/**
+ * Queues $data to be written to the stdin of the child, as much as possible
+ * is written right away.
+ * 
+ * @param  string
+ * @return boolean  false if stdin is not a pipe or has been closed
+ */
+PHP_METHOD(Process, write)
+{
+	char *data;
+	int data_len;
+	ssize_t n = 0;
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &data, &data_len) != SUCCESS) {
+		return;
+	}
+	
+	if(proc->in_fd < 0 || proc->in_close || ! proc->loop)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	if( ! proc->in_len)
+	{
+		if((n = send(proc->in_fd, data, (size_t) data_len, MSG_NOSIGNAL)) < 0)
+		{
+			if(errno != EAGAIN && errno != EINTR)
+			{
+				process_close_stdin(proc);
+				
+				RETURN_BOOL(0);
+			}
+			
+			n = 0;
+		}
+		
+		if(n == data_len)
+		{
+			RETURN_BOOL(1);
+		}
+	}
+	
+	if(proc->in_len + (data_len - n) > proc->in_size)
+	{
+		proc->in_size = proc->in_len + (data_len - n);
+		proc->in_buf  = erealloc(proc->in_buf, proc->in_size);
+	}
+	
+	memcpy(proc->in_buf + proc->in_len, data + n, data_len - n);
+	proc->in_len += data_len - n;
+	
+	ev_io_start(proc->loop, &proc->in_watcher);
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Closes the stdin of the child once all queued data has been written.
+ * 
+ * @return void
+ */
+PHP_METHOD(Process, closeStdin)
+{
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(proc->in_len)
+	{
+		proc->in_close = 1;
+	}
+	else
+	{
+		process_close_stdin(proc);
+	}
+}
+
+/**
+ * Sends a signal to the child.
+ * 
+ * @param  int  Signal number, default SIGTERM
+ * @return boolean  false if the child has already been reaped or kill() failed
+ */
+PHP_METHOD(Process, kill)
+{
+	long signo = SIGTERM;
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &signo) != SUCCESS) {
+		return;
+	}
+	
+	/* Once reaped the PID might belong to another process */
+	if( ! proc->pid || proc->exited || ! proc->loop)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_BOOL(kill(proc->pid, (int) signo) == 0);
+}
+
+/**
+ * Returns the PID of the child.
+ * 
+ * @return int
+ */
+PHP_METHOD(Process, getPid)
+{
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(proc->pid);
+}
+
+/**
+ * Returns true until the child has been reaped.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(Process, isRunning)
+{
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(proc->pid && ! proc->exited);
+}
+
+/**
+ * Returns the status of the child as returned by waitpid(), use
+ * pcntl_wexitstatus() and friends to decode it. -1 if the child was reaped
+ * by someone else, like pcntl_waitpid(), before its pidfd was read.
+ * 
+ * @return int
+ * @return false  if the child is still running
+ */
+PHP_METHOD(Process, getExitStatus)
+{
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! proc->exited)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_LONG(proc->status);
+}
+
+/**
+ * Returns the number of bytes queued by Process::write() which have not been
+ * written to the child yet.
+ * 
+ * @return int
+ */
+PHP_METHOD(Process, getQueuedBytes)
+{
+	process_object *proc = (process_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG((long) proc->in_len);
+}
+
+
+static const zend_function_entry process_methods[] = {
+	ZEND_ME(Process, __construct, NULL, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+	ZEND_ME(Process, spawn, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	ZEND_ME(Process, write, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Process, closeStdin, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Process, kill, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Process, getPid, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Process, isRunning, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Process, getExitStatus, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Process, getQueuedBytes, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
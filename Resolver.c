@@ -0,0 +1,1221 @@
+
+/*
+ * Host name resolution which does not block the EventLoop.
+ * 
+ * Lookups run on the threads of Worker.c. By default getaddrinfo() is used,
+ * which honours /etc/hosts, nsswitch.conf and resolv.conf but does not report
+ * the TTL of the records, so its results are cached for the "ttl" option.
+ * With the "nameservers" option the A and AAAA records are instead queried
+ * over UDP from those servers and cached for the TTL of the records.
+ * 
+ * Concurrent lookups of the same name share one job. Results, cached ones
+ * too, are always delivered by the loop and never from within resolve().
+ */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* Missing on macOS, FD_CLOEXEC is set with fcntl() there */
+#ifndef SOCK_CLOEXEC
+#  define SOCK_CLOEXEC 0
+#endif
+
+/* Maximum number of addresses delivered for a name */
+#define RESOLVER_MAX_ADDRESSES   32
+#define RESOLVER_MAX_NAMESERVERS 3
+
+/* DNS record types and class */
+#define RESOLVER_TYPE_A    1
+#define RESOLVER_TYPE_AAAA 28
+#define RESOLVER_CLASS_IN  1
+
+typedef struct resolver_nameserver {
+	struct sockaddr_storage addr;
+	socklen_t               addr_len;
+} resolver_nameserver;
+
+/* C function receiving a result instead of a PHP callback, result is an array
+   of addresses or false */
+typedef void (*resolver_handler)(void *arg, zval *result, const char *error TSRMLS_DC);
+
+/* Callback waiting for the result of a lookup */
+typedef struct resolver_waiter {
+	struct resolver_waiter *next;
+	zval   *callback;    /* NULL if handler is used */
+	zend_fcall_info_cache fcc;
+	resolver_handler handler;
+	void   *handler_arg;
+	zval   *result;  /* Set for waiters on the ready list */
+	char   *error;
+} resolver_waiter;
+
+/* Lookup in progress, value of resolver_object->pending */
+typedef struct resolver_pending {
+	resolver_waiter *head;
+	resolver_waiter *tail;
+} resolver_pending;
+
+/* Value of resolver_object->cache */
+typedef struct resolver_cache_entry {
+	double expires;
+	zval   *result;  /* Array of addresses, or false */
+	char   *error;   /* NULL if the lookup succeeded */
+} resolver_cache_entry;
+
+/* Job run by a worker thread, allocated with malloc() */
+typedef struct resolver_job {
+	worker_job job;
+	char       *host;
+	int        nscount;  /* 0 to use getaddrinfo() */
+	resolver_nameserver nameservers[RESOLVER_MAX_NAMESERVERS];
+	int        timeout;  /* Milliseconds to wait for a nameserver */
+	int        attempts;
+	/* Result */
+	int        count;
+	char       addresses[RESOLVER_MAX_ADDRESSES][INET6_ADDRSTRLEN];
+	double     ttl;      /* Smallest TTL of the records, -1 if unknown */
+	const char *error;   /* Static string, NULL on success */
+} resolver_job;
+
+typedef struct resolver_object {
+	zend_object     std;
+	zval            *this;         /* Reference keeping the object alive while callbacks are waiting */
+	struct ev_loop  *loop;         /* NULL once the loop was destroyed */
+	worker_queue    *queue;
+	ev_timer        ready_timer;   /* Delivers the ready list on the next iteration */
+	ev_cleanup      cleanup_watcher;
+	resolver_waiter *ready_head;   /* Waiters for cached or immediate results */
+	resolver_waiter *ready_tail;
+	HashTable       pending;       /* name => resolver_pending */
+	HashTable       cache;         /* name => resolver_cache_entry */
+	double          ttl;
+	double          max_ttl;
+	double          negative_ttl;
+	long            cache_size;
+	int             nscount;
+	resolver_nameserver nameservers[RESOLVER_MAX_NAMESERVERS];
+	int             timeout;
+	int             attempts;
+} resolver_object;
+
+zend_class_entry *resolver_ce;
+
+zend_object_handlers resolver_object_handlers;
+
+
+/* Worker thread part */
+
+static void resolver_job_free(worker_job *job)
+{
+	free(((resolver_job *) job)->host);
+	free(job);
+}
+
+/* Adds the address unless already present */
+static void resolver_job_add(resolver_job *j, int family, const void *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	int i;
+	
+	if(j->count == RESOLVER_MAX_ADDRESSES || ! inet_ntop(family, addr, buf, sizeof(buf)))
+	{
+		return;
+	}
+	
+	for(i = 0; i < j->count; i++)
+	{
+		if(strcmp(j->addresses[i], buf) == 0)
+		{
+			return;
+		}
+	}
+	
+	strcpy(j->addresses[j->count++], buf);
+}
+
+static void resolver_getaddrinfo(resolver_job *j)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	int ret;
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_ADDRCONFIG;
+	
+	if((ret = getaddrinfo(j->host, NULL, &hints, &res)) != 0)
+	{
+		j->error = gai_strerror(ret);
+		
+		return;
+	}
+	
+	for(ai = res; ai; ai = ai->ai_next)
+	{
+		if(ai->ai_family == AF_INET)
+		{
+			resolver_job_add(j, AF_INET, &((struct sockaddr_in *) ai->ai_addr)->sin_addr);
+		}
+		else if(ai->ai_family == AF_INET6)
+		{
+			resolver_job_add(j, AF_INET6, &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr);
+		}
+	}
+	
+	freeaddrinfo(res);
+}
+
+/* Writes a DNS query for name to buf, returns its length or 0 if the name is
+   not valid */
+static int resolver_dns_query(unsigned char *buf, size_t size, const char *name, int id, int type)
+{
+	unsigned char *p = buf + 12;
+	unsigned char *end = buf + size - 5;
+	const char *label;
+	size_t len;
+	
+	memset(buf, 0, 12);
+	
+	buf[0] = (unsigned char) (id >> 8);
+	buf[1] = (unsigned char) id;
+	buf[2] = 0x01;  /* Recursion desired */
+	buf[5] = 1;     /* One question */
+	
+	while(*name)
+	{
+		label = name;
+		
+		while(*name && *name != '.')
+		{
+			name++;
+		}
+		
+		len = (size_t) (name - label);
+		
+		if(len < 1 || len > 63 || p + len + 1 >= end)
+		{
+			return 0;
+		}
+		
+		*p++ = (unsigned char) len;
+		memcpy(p, label, len);
+		p += len;
+		
+		/* A trailing dot ends the name */
+		if(*name)
+		{
+			name++;
+		}
+	}
+	
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = (unsigned char) type;
+	*p++ = 0;
+	*p++ = RESOLVER_CLASS_IN;
+	
+	return (int) (p - buf);
+}
+
+/* Skips a possibly compressed name, returns 0 if it is truncated */
+static int resolver_dns_skip_name(const unsigned char **p, const unsigned char *end)
+{
+	while(*p < end)
+	{
+		if(**p == 0)
+		{
+			(*p)++;
+			
+			return 1;
+		}
+		
+		if((**p & 0xc0) == 0xc0)
+		{
+			*p += 2;
+			
+			return *p <= end;
+		}
+		
+		*p += **p + 1;
+	}
+	
+	return 0;
+}
+
+/* Adds the addresses in the answer to j, returns the rcode or -1 if the
+   answer is malformed */
+static int resolver_dns_parse(resolver_job *j, const unsigned char *buf, size_t len)
+{
+	const unsigned char *p = buf + 12;
+	const unsigned char *end = buf + len;
+	int qdcount = (buf[4] << 8) | buf[5];
+	int ancount = (buf[6] << 8) | buf[7];
+	int type, rclass, rdlen;
+	double ttl;
+	
+	while(qdcount--)
+	{
+		if( ! resolver_dns_skip_name(&p, end) || (p += 4) > end)
+		{
+			return -1;
+		}
+	}
+	
+	/* Answers cut short by truncation are used as far as they go */
+	while(ancount-- && resolver_dns_skip_name(&p, end) && p + 10 <= end)
+	{
+		type  = (p[0] << 8) | p[1];
+		rclass = (p[2] << 8) | p[3];
+		ttl   = (double) (((unsigned long) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7]);
+		rdlen = (p[8] << 8) | p[9];
+		p += 10;
+		
+		if(p + rdlen > end)
+		{
+			break;
+		}
+		
+		/* The TTL of CNAMEs counts too, the name might point elsewhere later */
+		if(j->ttl < 0 || ttl < j->ttl)
+		{
+			j->ttl = ttl;
+		}
+		
+		if(rclass == RESOLVER_CLASS_IN && type == RESOLVER_TYPE_A && rdlen == 4)
+		{
+			resolver_job_add(j, AF_INET, p);
+		}
+		else if(rclass == RESOLVER_CLASS_IN && type == RESOLVER_TYPE_AAAA && rdlen == 16)
+		{
+			resolver_job_add(j, AF_INET6, p);
+		}
+		
+		p += rdlen;
+	}
+	
+	return buf[3] & 0x0f;
+}
+
+/* Queries the nameservers for records of type, returns 0 if none answered */
+static int resolver_dns_lookup(resolver_job *j, int type)
+{
+	unsigned char query[300];
+	unsigned char answer[4096];
+	struct pollfd pfd;
+	struct timespec ts;
+	int query_len;
+	int id;
+	int attempt;
+	int i;
+	int rcode;
+	ssize_t n;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	
+	/* The source port chosen by the kernel is random too */
+	id = (int) ((ts.tv_nsec ^ (long) (intptr_t) j ^ type) & 0xffff);
+	
+	if( ! (query_len = resolver_dns_query(query, sizeof(query), j->host, id, type)))
+	{
+		j->error = "Invalid name";
+		
+		return 1;
+	}
+	
+	for(attempt = 0; attempt < j->attempts; attempt++)
+	{
+		for(i = 0; i < j->nscount; i++)
+		{
+			pfd.fd     = socket(j->nameservers[i].addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			pfd.events = POLLIN;
+			
+			if(pfd.fd < 0)
+			{
+				continue;
+			}
+			
+			if( ! SOCK_CLOEXEC)
+			{
+				fcntl(pfd.fd, F_SETFD, FD_CLOEXEC);
+			}
+			
+			if(connect(pfd.fd, (struct sockaddr *) &j->nameservers[i].addr, j->nameservers[i].addr_len) < 0 ||
+				send(pfd.fd, query, (size_t) query_len, 0) != query_len)
+			{
+				close(pfd.fd);
+				
+				continue;
+			}
+			
+			n = -1;
+			
+			/* Skip stray answers, connect() makes sure they are from the server */
+			while(poll(&pfd, 1, j->timeout) > 0 && (n = recv(pfd.fd, answer, sizeof(answer), 0)) >= 0)
+			{
+				if(n >= 12 && answer[0] == query[0] && answer[1] == query[1] && (answer[2] & 0x80))
+				{
+					break;
+				}
+				
+				n = -1;
+			}
+			
+			close(pfd.fd);
+			
+			if(n < 12)
+			{
+				continue;
+			}
+			
+			rcode = resolver_dns_parse(j, answer, (size_t) n);
+			
+			/* NXDOMAIN */
+			if(rcode == 3)
+			{
+				j->error = "Name does not resolve";
+				
+				return 1;
+			}
+			
+			/* Success, or no records of this type */
+			if(rcode == 0)
+			{
+				return 1;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+static void resolver_work(worker_job *job)
+{
+	resolver_job *j = (resolver_job *) job;
+	
+	j->count = 0;
+	j->ttl   = -1;
+	j->error = NULL;
+	
+	if( ! j->nscount)
+	{
+		resolver_getaddrinfo(j);
+		
+		return;
+	}
+	
+	if( ! resolver_dns_lookup(j, RESOLVER_TYPE_A) || (j->error && ! j->count))
+	{
+		if( ! j->error)
+		{
+			j->error = "Timeout while contacting the nameservers";
+		}
+		
+		return;
+	}
+	
+	if( ! resolver_dns_lookup(j, RESOLVER_TYPE_AAAA) && ! j->count)
+	{
+		j->error = "Timeout while contacting the nameservers";
+		
+		return;
+	}
+	
+	if(j->count)
+	{
+		j->error = NULL;
+	}
+	else if( ! j->error)
+	{
+		j->error = "No address associated with name";
+	}
+}
+
+
+/* Loop thread part */
+
+static void resolver_waiter_free(resolver_waiter *w)
+{
+	if(w->callback)
+	{
+		zval_ptr_dtor(&w->callback);
+	}
+	
+	if(w->result)
+	{
+		zval_ptr_dtor(&w->result);
+	}
+	
+	if(w->error)
+	{
+		efree(w->error);
+	}
+	
+	efree(w);
+}
+
+static void resolver_waiters_free(resolver_waiter *w)
+{
+	resolver_waiter *next;
+	
+	while(w)
+	{
+		next = w->next;
+		resolver_waiter_free(w);
+		w = next;
+	}
+}
+
+static void resolver_pending_dtor(void *data)
+{
+	resolver_waiters_free(((resolver_pending *) data)->head);
+}
+
+static void resolver_cache_dtor(void *data)
+{
+	resolver_cache_entry *entry = (resolver_cache_entry *) data;
+	
+	zval_ptr_dtor(&entry->result);
+	
+	if(entry->error)
+	{
+		efree(entry->error);
+	}
+}
+
+/* Calls callback($addresses, $error), or the handler */
+static void resolver_call(resolver_waiter *w, zval *result, const char *error TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *zerror;
+	zval **params[2] = { &result, &zerror };
+	
+	if(w->handler)
+	{
+		w->handler(w->handler_arg, result, error TSRMLS_CC);
+		
+		return;
+	}
+	
+	MAKE_STD_ZVAL(zerror);
+	
+	if(error)
+	{
+		ZVAL_STRING(zerror, error, 1);
+	}
+	else
+	{
+		ZVAL_NULL(zerror);
+	}
+	
+	libev_call_function(w->callback, &w->fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+	
+	zval_ptr_dtor(&zerror);
+}
+
+/* Drops the self reference once no callback is waiting, the object might be freed */
+static void resolver_release_if_idle(resolver_object *obj TSRMLS_DC)
+{
+	zval *self = obj->this;
+	
+	if( ! self || obj->ready_head || zend_hash_num_elements(&obj->pending))
+	{
+		return;
+	}
+	
+	obj->this = NULL;
+	
+	zval_ptr_dtor(&self);
+}
+
+/* Stops all watchers and drops waiting callbacks without calling them */
+static void resolver_detach(resolver_object *obj)
+{
+	if( ! obj->loop)
+	{
+		return;
+	}
+	
+	worker_queue_close(obj->queue);
+	obj->queue = NULL;
+	
+	ev_timer_stop(obj->loop, &obj->ready_timer);
+	ev_cleanup_stop(obj->loop, &obj->cleanup_watcher);
+	
+	resolver_waiters_free(obj->ready_head);
+	obj->ready_head = NULL;
+	obj->ready_tail = NULL;
+	
+	zend_hash_clean(&obj->pending);
+	
+	obj->loop = NULL;
+}
+
+static void resolver_cache_store(resolver_object *obj, const char *name, int name_len, zval *result, const char *error, double ttl)
+{
+	resolver_cache_entry entry;
+	resolver_cache_entry *e;
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong index;
+	double now = ev_now(obj->loop);
+	
+	if(ttl <= 0. || obj->cache_size <= 0)
+	{
+		return;
+	}
+	
+	if(zend_hash_num_elements(&obj->cache) >= (uint) obj->cache_size)
+	{
+		/* Drop expired entries first, then the oldest */
+		for(zend_hash_internal_pointer_reset_ex(&obj->cache, &pos);
+			zend_hash_get_current_data_ex(&obj->cache, (void **) &e, &pos) == SUCCESS; )
+		{
+			zend_hash_get_current_key_ex(&obj->cache, &key, &key_len, &index, 0, &pos);
+			zend_hash_move_forward_ex(&obj->cache, &pos);
+			
+			if(e->expires <= now)
+			{
+				zend_hash_del(&obj->cache, key, key_len);
+			}
+		}
+		
+		if(zend_hash_num_elements(&obj->cache) >= (uint) obj->cache_size)
+		{
+			zend_hash_internal_pointer_reset_ex(&obj->cache, &pos);
+			zend_hash_get_current_key_ex(&obj->cache, &key, &key_len, &index, 0, &pos);
+			zend_hash_del(&obj->cache, key, key_len);
+		}
+	}
+	
+	entry.expires = now + ttl;
+	entry.result  = result;
+	entry.error   = error ? estrdup(error) : NULL;
+	
+	zval_add_ref(&result);
+	
+	/* Delete first, updated entries should move to the end */
+	zend_hash_del(&obj->cache, name, name_len + 1);
+	zend_hash_add(&obj->cache, name, name_len + 1, &entry, sizeof(entry), NULL);
+}
+
+static void resolver_ready_callback(struct ev_loop *loop, ev_timer *t, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	resolver_object *obj = (resolver_object *)((char *) t - XtOffsetOf(resolver_object, ready_timer));
+	resolver_waiter *w = obj->ready_head;
+	resolver_waiter *next;
+	
+	/* Waiters added by the callbacks are delivered on the next iteration */
+	obj->ready_head = NULL;
+	obj->ready_tail = NULL;
+	
+	while(w)
+	{
+		next = w->next;
+		
+		resolver_call(w, w->result, w->error TSRMLS_CC);
+		resolver_waiter_free(w);
+		
+		w = next;
+	}
+	
+	resolver_release_if_idle(obj TSRMLS_CC);
+}
+
+/* Queues a waiter for delivery on the next loop iteration */
+static void resolver_ready(resolver_object *obj, resolver_waiter *w, zval *result, const char *error)
+{
+	zval_add_ref(&result);
+	
+	w->result = result;
+	w->error  = error ? estrdup(error) : NULL;
+	
+	if(obj->ready_tail)
+	{
+		obj->ready_tail->next = w;
+	}
+	else
+	{
+		obj->ready_head = w;
+	}
+	
+	obj->ready_tail = w;
+	
+	if( ! ev_is_active(&obj->ready_timer))
+	{
+		ev_timer_set(&obj->ready_timer, 0., 0.);
+		ev_timer_start(obj->loop, &obj->ready_timer);
+	}
+}
+
+static void resolver_job_done(worker_job *job TSRMLS_DC)
+{
+	resolver_job *j = (resolver_job *) job;
+	resolver_object *obj = (resolver_object *) job->queue->data;
+	resolver_pending *pending;
+	resolver_waiter *w = NULL;
+	resolver_waiter *next;
+	zval *result;
+	int name_len = (int) strlen(j->host);
+	double ttl;
+	int i;
+	
+	/* The results are incomplete, a fork() stopped the lookup */
+	if(job->interrupted)
+	{
+		j->count = 0;
+		j->error = "Lookup interrupted by fork()";
+	}
+	
+	MAKE_STD_ZVAL(result);
+	
+	if(j->count)
+	{
+		array_init_size(result, j->count);
+		
+		for(i = 0; i < j->count; i++)
+		{
+			add_next_index_string(result, j->addresses[i], 1);
+		}
+		
+		ttl = j->ttl < 0 ? obj->ttl : (j->ttl < obj->max_ttl ? j->ttl : obj->max_ttl);
+	}
+	else
+	{
+		ZVAL_BOOL(result, 0);
+		
+		ttl = obj->negative_ttl;
+	}
+	
+	if( ! job->interrupted)
+	{
+		resolver_cache_store(obj, j->host, name_len, result, j->error, ttl);
+	}
+	
+	if(zend_hash_find(&obj->pending, j->host, name_len + 1, (void **) &pending) == SUCCESS)
+	{
+		w = pending->head;
+		pending->head = NULL;
+		
+		zend_hash_del(&obj->pending, j->host, name_len + 1);
+	}
+	
+	while(w)
+	{
+		next = w->next;
+		
+		resolver_call(w, result, j->count ? NULL : j->error TSRMLS_CC);
+		resolver_waiter_free(w);
+		
+		w = next;
+	}
+	
+	zval_ptr_dtor(&result);
+	
+	resolver_job_free(job);
+	
+	resolver_release_if_idle(obj TSRMLS_CC);
+}
+
+/* The EventLoop is being destroyed */
+static void resolver_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	resolver_object *obj = (resolver_object *)((char *) w - XtOffsetOf(resolver_object, cleanup_watcher));
+	
+	resolver_detach(obj);
+	resolver_release_if_idle(obj TSRMLS_CC);
+}
+
+FREE_STORAGE(resolver_object,
+
+	resolver_detach(obj);
+	
+	zend_hash_destroy(&obj->pending);
+	zend_hash_destroy(&obj->cache);
+)
+
+CREATE_HANDLER(resolver_object, resolver_object, resolver_object_free, resolver_object_handlers,
+	zend_hash_init(&obj->pending, 0, NULL, resolver_pending_dtor, 0);
+	zend_hash_init(&obj->cache, 0, NULL, resolver_cache_dtor, 0);
+	
+	obj->ttl        = 60.;
+	obj->max_ttl    = 3600.;
+	obj->cache_size = 1024;
+	obj->timeout    = 5000;
+	obj->attempts   = 2;
+)
+
+
+/* Parses "address", "address:port" or "[address]:port", returns 0 if invalid */
+static int resolver_parse_nameserver(const char *str, resolver_nameserver *ns)
+{
+	char host[INET6_ADDRSTRLEN + 1];
+	const char *port = NULL;
+	const char *end;
+	size_t len;
+	long portnum = 53;
+	struct sockaddr_in *sin   = (struct sockaddr_in *) &ns->addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ns->addr;
+	
+	memset(ns, 0, sizeof(*ns));
+	
+	if(*str == '[')
+	{
+		if( ! (end = strchr(++str, ']')) || (end[1] && end[1] != ':'))
+		{
+			return 0;
+		}
+		
+		port = end[1] ? end + 2 : NULL;
+	}
+	else if((end = strchr(str, ':')) && ! strchr(end + 1, ':'))
+	{
+		port = end + 1;
+	}
+	else
+	{
+		/* Plain IPv4 or IPv6 address */
+		end = str + strlen(str);
+	}
+	
+	if((len = (size_t) (end - str)) >= sizeof(host))
+	{
+		return 0;
+	}
+	
+	memcpy(host, str, len);
+	host[len] = '\0';
+	
+	if(port && ((portnum = strtol(port, (char **) &end, 10)) < 1 || portnum > 65535 || *end))
+	{
+		return 0;
+	}
+	
+	if(inet_pton(AF_INET, host, &sin->sin_addr) == 1)
+	{
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons((unsigned short) portnum);
+		ns->addr_len    = sizeof(struct sockaddr_in);
+		
+		return 1;
+	}
+	
+	if(inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1)
+	{
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port   = htons((unsigned short) portnum);
+		ns->addr_len      = sizeof(struct sockaddr_in6);
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* Reads the double options[name] into *value, returns 0 if it is negative */
+static int resolver_double_option(HashTable *options, const char *name, double *value)
+{
+	zval **entry;
+	
+	if(zend_hash_find(options, name, strlen(name) + 1, (void **) &entry) != SUCCESS)
+	{
+		return 1;
+	}
+	
+	convert_to_double_ex(entry);
+	
+	if(Z_DVAL_PP(entry) < 0.)
+	{
+		return 0;
+	}
+	
+	*value = Z_DVAL_PP(entry);
+	
+	return 1;
+}
+
+/**
+ * Creates a resolver delivering its results through $loop.
+ * 
+ * Options:
+ *  * "ttl":          double, seconds getaddrinfo() results are cached, default 60
+ *  * "max_ttl":      double, upper limit for the TTL of DNS records, default 3600
+ *  * "negative_ttl": double, seconds failed lookups are cached, default 0
+ *  * "cache_size":   int, maximum number of cached names, default 1024, 0 disables
+ *                    the cache
+ *  * "nameservers":  array of "address", "address:port" or "[address]:port",
+ *                    query these (at most 3) directly instead of using getaddrinfo()
+ *  * "timeout":      double, seconds to wait for a nameserver, default 5
+ *  * "attempts":     int, number of times each nameserver is tried, default 2
+ * 
+ * @param  EventLoop
+ * @param  array
+ */
+PHP_METHOD(Resolver, __construct)
+{
+	zval *zloop;
+	zval *zoptions = NULL;
+	zval **entry;
+	zval **ns;
+	HashTable *options;
+	HashPosition pos;
+	double timeout = 5.;
+	resolver_object *obj = (resolver_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	PARSE_PARAMETERS(Resolver, "O|a", &zloop, event_loop_ce, &zoptions);
+	
+	if(zoptions)
+	{
+		options = Z_ARRVAL_P(zoptions);
+		
+		if( ! resolver_double_option(options, "ttl", &obj->ttl) ||
+			! resolver_double_option(options, "max_ttl", &obj->max_ttl) ||
+			! resolver_double_option(options, "negative_ttl", &obj->negative_ttl) ||
+			! resolver_double_option(options, "timeout", &timeout))
+		{
+			zend_throw_exception(NULL, "libev\\Resolver: TTLs and timeout must not be negative", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		obj->timeout = (int) (timeout * 1000.);
+		
+		if(zend_hash_find(options, "cache_size", sizeof("cache_size"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_long_ex(entry);
+			
+			obj->cache_size = Z_LVAL_PP(entry);
+		}
+		
+		if(zend_hash_find(options, "attempts", sizeof("attempts"), (void **) &entry) == SUCCESS)
+		{
+			convert_to_long_ex(entry);
+			
+			obj->attempts = Z_LVAL_PP(entry) < 1 ? 1 : (int) Z_LVAL_PP(entry);
+		}
+		
+		if(zend_hash_find(options, "nameservers", sizeof("nameservers"), (void **) &entry) == SUCCESS)
+		{
+			if(Z_TYPE_PP(entry) != IS_ARRAY || zend_hash_num_elements(Z_ARRVAL_PP(entry)) > RESOLVER_MAX_NAMESERVERS)
+			{
+				zend_throw_exception(NULL, "libev\\Resolver: nameservers must be an array of at most 3 addresses", 1 TSRMLS_CC);
+				
+				return;
+			}
+			
+			for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_PP(entry), &pos);
+				zend_hash_get_current_data_ex(Z_ARRVAL_PP(entry), (void **) &ns, &pos) == SUCCESS;
+				zend_hash_move_forward_ex(Z_ARRVAL_PP(entry), &pos))
+			{
+				if(Z_TYPE_PP(ns) != IS_STRING || ! resolver_parse_nameserver(Z_STRVAL_PP(ns), &obj->nameservers[obj->nscount]))
+				{
+					obj->nscount = 0;
+					
+					zend_throw_exception(NULL, "libev\\Resolver: invalid nameserver address", 1 TSRMLS_CC);
+					
+					return;
+				}
+				
+				obj->nscount++;
+			}
+		}
+	}
+	
+	obj->loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop;
+	
+	if( ! obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\Resolver: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if( ! (obj->queue = worker_queue_open(obj->loop, obj)))
+	{
+		obj->loop = NULL;
+		
+		zend_throw_exception(NULL, "libev\\Resolver: out of memory", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	ev_timer_init(&obj->ready_timer, resolver_ready_callback, 0., 0.);
+	
+	ev_cleanup_init(&obj->cleanup_watcher, resolver_cleanup_callback);
+	ev_cleanup_start(obj->loop, &obj->cleanup_watcher);
+}
+
+/* Looks up host for w, object is the zval of obj which is referenced while
+   waiters exist, returns FAILURE if out of memory (w is freed then) */
+static int resolver_lookup(resolver_object *obj, zval *object, const char *host, int host_len, resolver_waiter *w TSRMLS_DC)
+{
+	char *name;
+	unsigned char addr[sizeof(struct in6_addr)];
+	resolver_cache_entry *cached;
+	resolver_pending *pending;
+	resolver_pending new_pending;
+	resolver_job *j;
+	zval *result;
+	
+	if( ! obj->this)
+	{
+		/* Independent reference to the object, held while callbacks are waiting */
+		MAKE_STD_ZVAL(obj->this);
+		*obj->this = *object;
+		zval_copy_ctor(obj->this);
+		INIT_PZVAL(obj->this);
+	}
+	
+	if( ! host_len || host_len > 254 || strlen(host) != (size_t) host_len)
+	{
+		MAKE_STD_ZVAL(result);
+		ZVAL_BOOL(result, 0);
+		
+		resolver_ready(obj, w, result, "Invalid name");
+		zval_ptr_dtor(&result);
+		
+		return SUCCESS;
+	}
+	
+	/* Numeric addresses need no lookup */
+	if(inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1)
+	{
+		MAKE_STD_ZVAL(result);
+		array_init_size(result, 1);
+		add_next_index_stringl(result, host, host_len, 1);
+		
+		resolver_ready(obj, w, result, NULL);
+		zval_ptr_dtor(&result);
+		
+		return SUCCESS;
+	}
+	
+	/* Names are case-insensitive */
+	name = zend_str_tolower_dup(host, host_len);
+	
+	if(zend_hash_find(&obj->cache, name, host_len + 1, (void **) &cached) == SUCCESS)
+	{
+		if(cached->expires > ev_now(obj->loop))
+		{
+			resolver_ready(obj, w, cached->result, cached->error);
+			efree(name);
+			
+			return SUCCESS;
+		}
+		
+		zend_hash_del(&obj->cache, name, host_len + 1);
+	}
+	
+	/* Another lookup of the name is in progress, wait for it */
+	if(zend_hash_find(&obj->pending, name, host_len + 1, (void **) &pending) == SUCCESS)
+	{
+		pending->tail->next = w;
+		pending->tail       = w;
+		
+		efree(name);
+		
+		return SUCCESS;
+	}
+	
+	j = calloc(1, sizeof(resolver_job));
+	
+	if(j && ! (j->host = strdup(name)))
+	{
+		free(j);
+		j = NULL;
+	}
+	
+	if( ! j)
+	{
+		efree(name);
+		resolver_waiter_free(w);
+		resolver_release_if_idle(obj TSRMLS_CC);
+		
+		return FAILURE;
+	}
+	
+	j->job.work = resolver_work;
+	j->job.done = resolver_job_done;
+	j->job.free = resolver_job_free;
+	j->nscount  = obj->nscount;
+	j->timeout  = obj->timeout;
+	j->attempts = obj->attempts;
+	
+	memcpy(j->nameservers, obj->nameservers, sizeof(j->nameservers));
+	
+	new_pending.head = w;
+	new_pending.tail = w;
+	
+	zend_hash_add(&obj->pending, name, host_len + 1, &new_pending, sizeof(new_pending), NULL);
+	
+	if( ! worker_submit(obj->queue, &j->job))
+	{
+		resolver_job_free(&j->job);
+		
+		/* Deliver the failure like any other */
+		if(zend_hash_find(&obj->pending, name, host_len + 1, (void **) &pending) == SUCCESS)
+		{
+			pending->head = NULL;
+			
+			zend_hash_del(&obj->pending, name, host_len + 1);
+		}
+		
+		MAKE_STD_ZVAL(result);
+		ZVAL_BOOL(result, 0);
+		
+		resolver_ready(obj, w, result, "Worker threads are not available");
+		zval_ptr_dtor(&result);
+	}
+	
+	efree(name);
+	
+	return SUCCESS;
+}
+
+/* Looks up host for a C caller, handler(arg, $addresses, $error) is called
+   from the loop unless the loop is destroyed first, returns FAILURE if the
+   lookup could not be started */
+static int resolver_lookup_ex(zval *resolver, const char *host, int host_len, resolver_handler handler, void *arg TSRMLS_DC)
+{
+	resolver_object *obj = (resolver_object *)zend_object_store_get_object(resolver TSRMLS_CC);
+	resolver_waiter *w;
+	
+	if( ! obj->loop)
+	{
+		return FAILURE;
+	}
+	
+	w = ecalloc(1, sizeof(resolver_waiter));
+	
+	w->handler     = handler;
+	w->handler_arg = arg;
+	
+	return resolver_lookup(obj, resolver, host, host_len, w TSRMLS_CC);
+}
+
+/**
+ * Resolves $host into its IPv4 and IPv6 addresses, the callback is called from
+ * the loop, never before resolve() has returned.
+ * 
+ * Callback signature: callback(array|false $addresses, string|null $error)
+ * 
+ * @param  string
+ * @param  callback
+ * @return boolean  false if the EventLoop has been destroyed
+ */
+PHP_METHOD(Resolver, resolve)
+{
+	char *host;
+	int host_len;
+	resolver_object *obj = (resolver_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	resolver_waiter *w;
+	dCALLBACK;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz", &host, &host_len, &callback) != SUCCESS) {
+		return;
+	}
+	
+	CHECK_CALLBACK;
+	
+	if( ! obj->loop)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	w = ecalloc(1, sizeof(resolver_waiter));
+	
+	zval_add_ref(&callback);
+	w->callback = callback;
+	w->fcc      = callback_fcc;
+	
+	if(resolver_lookup(obj, getThis(), host, host_len, w TSRMLS_CC) != SUCCESS)
+	{
+		zend_throw_exception(NULL, "libev\\Resolver: out of memory", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Removes all cached results, or only those of $host.
+ * 
+ * @param  string
+ * @return void
+ */
+PHP_METHOD(Resolver, clearCache)
+{
+	char *host = NULL;
+	int host_len = 0;
+	char *name;
+	resolver_object *obj = (resolver_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|s", &host, &host_len) != SUCCESS) {
+		return;
+	}
+	
+	if( ! host)
+	{
+		zend_hash_clean(&obj->cache);
+		
+		return;
+	}
+	
+	name = zend_str_tolower_dup(host, host_len);
+	
+	zend_hash_del(&obj->cache, name, host_len + 1);
+	
+	efree(name);
+}
+
+/**
+ * Returns the number of cached names, including expired ones which have not
+ * been removed yet.
+ * 
+ * @return int
+ */
+PHP_METHOD(Resolver, getCacheSize)
+{
+	resolver_object *obj = (resolver_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(zend_hash_num_elements(&obj->cache));
+}
+
+/**
+ * Returns the number of names being looked up.
+ * 
+ * @return int
+ */
+PHP_METHOD(Resolver, getPendingCount)
+{
+	resolver_object *obj = (resolver_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(zend_hash_num_elements(&obj->pending));
+}
+
+
+static const zend_function_entry resolver_methods[] = {
+	ZEND_ME(Resolver, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(Resolver, resolve, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Resolver, clearCache, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Resolver, getCacheSize, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Resolver, getPendingCount, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
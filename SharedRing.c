@@ -0,0 +1,658 @@
+
+/*
+ * Message ring in shared memory for exchanging messages between forked
+ * processes without a syscall per message.
+ * 
+ * The ring is an anonymous MAP_SHARED mapping created before forking. Any
+ * number of processes may push, producers reserve space by advancing head with
+ * a compare-and-swap and publish a record by storing its length last. One
+ * process consumes, from the loop: a doorbell (eventfd, or a pipe without
+ * eventfd) watched by an ev_io wakes it, and it is only rung when the consumer
+ * is about to sleep, so a burst of messages costs one notification.
+ * 
+ * Record layout, 8 byte aligned: uint32 length + 1 (0 while not yet
+ * published), uint32 unused, payload. A record which does not fit before the
+ * end of the ring is preceded by a padding record up to the end.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#if HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
+
+#define shared_ring_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define shared_ring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define shared_ring_fence()             __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define SHARED_RING_MAGIC   0x52474e52
+#define SHARED_RING_PADDING 0xffffffff
+
+/* Header of a record */
+#define SHARED_RING_RECORD  8
+
+#define SHARED_RING_ALIGN(n) (((n) + 7) & ~((uint64_t) 7))
+
+/* Start of the mapping, the fields written by different sides live on
+   different cache lines */
+typedef struct shared_ring_header {
+	uint32_t magic;
+	uint32_t size;           /* Bytes of data, a power of two */
+	char     pad0[56];
+	uint64_t head;           /* Reserved by producers */
+	char     pad1[56];
+	uint64_t tail;           /* Consumed */
+	char     pad2[56];
+	uint32_t sleeping;       /* The consumer waits for the doorbell */
+	int32_t  consumer;       /* PID of the consuming process, 0 if none */
+	char     pad3[56];
+} shared_ring_header;
+
+typedef struct shared_ring_object {
+	zend_object        std;
+	zval               *this;      /* Reference keeping the object alive while consuming */
+	struct ev_loop     *loop;      /* Set while consuming */
+	ev_io              watcher;    /* Doorbell */
+	ev_cleanup         cleanup_watcher;
+	shared_ring_header *header;
+	char               *data;
+	size_t             map_size;
+	int                bell[2];    /* eventfd twice, or the read and write end of a pipe */
+	long               batch;
+	zval               *callback;
+	zend_fcall_info_cache fcc;
+} shared_ring_object;
+
+zend_class_entry *shared_ring_ce;
+
+zend_object_handlers shared_ring_object_handlers;
+
+
+/* Reserves space for and copies a message of len bytes into the ring, returns
+   0 if it is full, callers check len against shared_ring_max_length() */
+static int shared_ring_push(shared_ring_object *r, const char *msg, size_t len)
+{
+	shared_ring_header *h = r->header;
+	uint64_t size = h->size;
+	uint64_t need = SHARED_RING_ALIGN(SHARED_RING_RECORD + len);
+	uint64_t head;
+	uint64_t tail;
+	uint64_t pad;
+	uint64_t offset;
+	
+	do
+	{
+		head   = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+		tail   = shared_ring_load_acquire(&h->tail);
+		offset = head & (size - 1);
+		pad    = offset + need > size ? size - offset : 0;
+		
+		if(head + pad + need - tail > size)
+		{
+			return 0;
+		}
+	}
+	while( ! __atomic_compare_exchange_n(&h->head, &head, head + pad + need, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	
+	if(pad)
+	{
+		shared_ring_store_release((uint32_t *) (r->data + offset), SHARED_RING_PADDING);
+		
+		offset = 0;
+	}
+	
+	memcpy(r->data + offset + SHARED_RING_RECORD, msg, len);
+	
+	shared_ring_store_release((uint32_t *) (r->data + offset), (uint32_t) len + 1);
+	
+	return 1;
+}
+
+/* Longest message, at most half the ring so that it also fits when the
+   padding to the end of the ring is needed */
+static inline size_t shared_ring_max_length(shared_ring_object *r)
+{
+	return r->header->size / 2 - SHARED_RING_RECORD;
+}
+
+/* Clears consumer if it is this process, returns 0 otherwise */
+static int shared_ring_release_consumer(shared_ring_object *r)
+{
+	int32_t pid = (int32_t) getpid();
+	
+	if( ! __atomic_compare_exchange_n(&r->header->consumer, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	{
+		return 0;
+	}
+	
+	__atomic_store_n(&r->header->sleeping, 0, __ATOMIC_RELAXED);
+	
+	return 1;
+}
+
+/* Wakes the consumer if it is sleeping, once per sleep */
+static void shared_ring_ring(shared_ring_object *r)
+{
+	uint64_t one = 1;
+	
+	/* Orders the published records before reading sleeping, see shared_ring_drain() */
+	shared_ring_fence();
+	
+	if(__atomic_load_n(&r->header->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&r->header->sleeping, 0, __ATOMIC_ACQ_REL))
+	{
+		if(write(r->bell[1], &one, sizeof(one)) < 0)
+		{
+			/* Full, the consumer will wake up anyway */
+		}
+	}
+}
+
+/* Takes at most max messages out of the ring and appends them to messages,
+   returns the number taken */
+static long shared_ring_pop(shared_ring_object *r, zval *messages, long max)
+{
+	shared_ring_header *h = r->header;
+	uint64_t size = h->size;
+	uint64_t tail = h->tail;
+	uint64_t offset;
+	uint64_t need;
+	uint32_t len;
+	long n = 0;
+	
+	while(n < max)
+	{
+		offset = tail & (size - 1);
+		len    = shared_ring_load_acquire((uint32_t *) (r->data + offset));
+		
+		if( ! len)
+		{
+			break;
+		}
+		
+		if(len == SHARED_RING_PADDING)
+		{
+			need = size - offset;
+		}
+		else
+		{
+			need = SHARED_RING_ALIGN(SHARED_RING_RECORD + len - 1);
+			
+			add_next_index_stringl(messages, r->data + offset + SHARED_RING_RECORD, len - 1, 1);
+			n++;
+		}
+		
+		/* Producers expect unpublished records to read as 0 */
+		memset(r->data + offset, 0, need);
+		
+		tail += need;
+		
+		shared_ring_store_release(&h->tail, tail);
+	}
+	
+	return n;
+}
+
+/* Returns true if a published record is waiting */
+static int shared_ring_ready(shared_ring_object *r)
+{
+	shared_ring_header *h = r->header;
+	
+	return shared_ring_load_acquire((uint32_t *) (r->data + (h->tail & (h->size - 1)))) != 0;
+}
+
+/* Calls callback($ring, $messages) */
+static void shared_ring_call(shared_ring_object *r, zval *messages TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = r->this;
+	zval **params[2] = { &self, &messages };
+	
+	libev_call_function(r->callback, &r->fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+}
+
+/* Stops consuming, the ring can be consumed by another process then */
+static void shared_ring_stop(shared_ring_object *r TSRMLS_DC)
+{
+	zval *self = r->this;
+	
+	if( ! r->loop)
+	{
+		return;
+	}
+	
+	ev_io_stop(r->loop, &r->watcher);
+	ev_cleanup_stop(r->loop, &r->cleanup_watcher);
+	
+	/* Not if this is a copy inherited through fork() */
+	shared_ring_release_consumer(r);
+	
+	r->loop = NULL;
+	
+	if(r->callback)
+	{
+		zval_ptr_dtor(&r->callback);
+		r->callback = NULL;
+	}
+	
+	r->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Delivers batches until the ring is empty, then goes to sleep */
+static void shared_ring_drain(shared_ring_object *r TSRMLS_DC)
+{
+	zval *messages;
+	
+	for(;;)
+	{
+		MAKE_STD_ZVAL(messages);
+		array_init(messages);
+		
+		if(shared_ring_pop(r, messages, r->batch))
+		{
+			shared_ring_call(r, messages TSRMLS_CC);
+		}
+		
+		zval_ptr_dtor(&messages);
+		
+		if( ! r->loop)
+		{
+			/* Stopped by the callback */
+			return;
+		}
+		
+		if( ! shared_ring_ready(r))
+		{
+			__atomic_store_n(&r->header->sleeping, 1, __ATOMIC_RELAXED);
+			
+			/* Pairs with the fence in shared_ring_ring(), either the producer sees
+			   sleeping or we see its record */
+			shared_ring_fence();
+			
+			if( ! shared_ring_ready(r))
+			{
+				return;
+			}
+			
+			__atomic_store_n(&r->header->sleeping, 0, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			uint64_t one = 1;
+			
+			/* Let the other watchers run between batches, ring ourselves to get
+			   woken again after polling */
+			if(write(r->bell[1], &one, sizeof(one)) < 0)
+			{
+				/* Full, already rung */
+			}
+			
+			return;
+		}
+	}
+}
+
+static void shared_ring_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	shared_ring_object *r = (shared_ring_object *)((char *) w - XtOffsetOf(shared_ring_object, watcher));
+	zval *self = r->this;
+	char buf[64];
+	
+	if(revents & EV_READ)
+	{
+		/* Reset the doorbell */
+		while(read(r->bell[0], buf, sizeof(buf)) > 0)
+		{
+			if(r->bell[0] == r->bell[1])
+			{
+				break;
+			}
+		}
+	}
+	
+	/* The callback might stop consuming and release the last reference */
+	zval_add_ref(&self);
+	
+	shared_ring_drain(r TSRMLS_CC);
+	
+	zval_ptr_dtor(&self);
+}
+
+/* The EventLoop is being destroyed */
+static void shared_ring_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	shared_ring_object *r = (shared_ring_object *)((char *) w - XtOffsetOf(shared_ring_object, cleanup_watcher));
+	
+	shared_ring_stop(r TSRMLS_CC);
+}
+
+FREE_STORAGE(shared_ring_object,
+
+	if(obj->loop)
+	{
+		ev_io_stop(obj->loop, &obj->watcher);
+		ev_cleanup_stop(obj->loop, &obj->cleanup_watcher);
+		
+		shared_ring_release_consumer(obj);
+	}
+	
+	if(obj->callback)
+	{
+		zval_ptr_dtor(&obj->callback);
+	}
+	
+	if(obj->header)
+	{
+		munmap(obj->header, obj->map_size);
+	}
+	
+	if(obj->bell[0] >= 0)
+	{
+		close(obj->bell[0]);
+	}
+	
+	if(obj->bell[1] >= 0 && obj->bell[1] != obj->bell[0])
+	{
+		close(obj->bell[1]);
+	}
+)
+
+CREATE_HANDLER(shared_ring_object, shared_ring_object, shared_ring_object_free, shared_ring_object_handlers,
+	obj->bell[0] = -1;
+	obj->bell[1] = -1;
+)
+
+
+/**
+ * Creates a ring of $size bytes (rounded up to a power of two) in anonymous
+ * shared memory, create it before forking the processes which share it.
+ * 
+ * @param  int
+ */
+PHP_METHOD(SharedRing, __construct)
+{
+	long size = 1048576;
+	uint64_t bytes = 4096;
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	PARSE_PARAMETERS(SharedRing, "|l", &size);
+	
+	if(size < 4096 || size > 0x40000000)
+	{
+		zend_throw_exception(NULL, "libev\\SharedRing: size must be between 4 KiB and 1 GiB", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	while(bytes < (uint64_t) size)
+	{
+		bytes <<= 1;
+	}
+	
+	r->map_size = sizeof(shared_ring_header) + bytes;
+	r->header   = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	
+	if(r->header == MAP_FAILED)
+	{
+		r->header = NULL;
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\SharedRing: mmap() failed: %s", strerror(errno));
+		
+		return;
+	}
+	
+	r->header->magic = SHARED_RING_MAGIC;
+	r->header->size  = (uint32_t) bytes;
+	r->data          = (char *) (r->header + 1);
+
+#if HAVE_EVENTFD
+	/* Counter semantics make one read reset any number of writes */
+	r->bell[0] = r->bell[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	
+	if(r->bell[0] < 0)
+#else
+	if(pipe(r->bell) != 0 || fcntl(r->bell[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(r->bell[1], F_SETFL, O_NONBLOCK) != 0)
+#endif
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\SharedRing: failed to create the doorbell: %s", strerror(errno));
+		
+		return;
+	}
+}
+
+/**
+ * Appends a message, wakes the consumer if it is waiting.
+ * 
+ * @param  string
+ * @return boolean  false if the ring is full
+ */
+PHP_METHOD(SharedRing, push)
+{
+	char *msg;
+	int msg_len;
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &msg, &msg_len) != SUCCESS) {
+		return;
+	}
+	
+	if( ! r->header)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	if((size_t) msg_len > shared_ring_max_length(r))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\SharedRing::push(): message exceeds %ld bytes", (long) shared_ring_max_length(r));
+		
+		return;
+	}
+	
+	if( ! shared_ring_push(r, msg, msg_len))
+	{
+		RETURN_BOOL(0);
+	}
+	
+	shared_ring_ring(r);
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Appends the messages in order until the ring is full, the consumer is woken
+ * at most once.
+ * 
+ * @param  array
+ * @return int  Number of messages appended
+ */
+PHP_METHOD(SharedRing, pushMany)
+{
+	zval *zmessages;
+	zval **entry;
+	HashPosition pos;
+	long n = 0;
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a", &zmessages) != SUCCESS) {
+		return;
+	}
+	
+	if( ! r->header)
+	{
+		RETURN_LONG(0);
+	}
+	
+	for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zmessages), &pos);
+		zend_hash_get_current_data_ex(Z_ARRVAL_P(zmessages), (void **) &entry, &pos) == SUCCESS;
+		zend_hash_move_forward_ex(Z_ARRVAL_P(zmessages), &pos))
+	{
+		if(Z_TYPE_PP(entry) != IS_STRING || (size_t) Z_STRLEN_PP(entry) > shared_ring_max_length(r))
+		{
+			zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\SharedRing::pushMany(): messages must be strings of at most %ld bytes", (long) shared_ring_max_length(r));
+			
+			break;
+		}
+		
+		if( ! shared_ring_push(r, Z_STRVAL_PP(entry), Z_STRLEN_PP(entry)))
+		{
+			break;
+		}
+		
+		n++;
+	}
+	
+	if(n)
+	{
+		shared_ring_ring(r);
+	}
+	
+	RETURN_LONG(n);
+}
+
+/**
+ * Starts consuming the ring in this process, call it after forking. Messages
+ * are delivered in order in batches of at most $batch. Throws if another
+ * process is consuming, unless that process no longer exists.
+ * 
+ * Callback signature: callback(SharedRing $ring, array $messages)
+ * 
+ * @param  EventLoop
+ * @param  callback
+ * @param  int
+ * @return void
+ */
+PHP_METHOD(SharedRing, consume)
+{
+	zval *zloop;
+	long batch = 256;
+	int32_t none = 0;
+	struct ev_loop *loop;
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Oz|l", &zloop, event_loop_ce, &callback, &batch) != SUCCESS) {
+		return;
+	}
+	
+	CHECK_CALLBACK;
+	
+	if( ! r->header)
+	{
+		zend_throw_exception(NULL, "libev\\SharedRing::consume(): ring is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if( ! (loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop))
+	{
+		zend_throw_exception(NULL, "libev\\SharedRing::consume(): EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	/* Replaces the callback, or drops a copy inherited through fork() */
+	shared_ring_stop(r TSRMLS_CC);
+	
+	/* On failure none is the PID of the consumer */
+	while( ! __atomic_compare_exchange_n(&r->header->consumer, &none, (int32_t) getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		/* Released meanwhile, or taken over if the consumer has exited without
+		   calling stop() */
+		if( ! none || (kill((pid_t) none, 0) < 0 && errno == ESRCH))
+		{
+			continue;
+		}
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\SharedRing::consume(): already consumed by process %d", (int) none);
+		
+		return;
+	}
+	
+	zval_add_ref(&callback);
+	r->callback = callback;
+	r->fcc      = callback_fcc;
+	r->batch    = batch < 1 ? 1 : batch;
+	r->loop     = loop;
+	
+	ev_io_init(&r->watcher, shared_ring_callback, r->bell[0], EV_READ);
+	ev_io_start(r->loop, &r->watcher);
+	
+	ev_cleanup_init(&r->cleanup_watcher, shared_ring_cleanup_callback);
+	ev_cleanup_start(r->loop, &r->cleanup_watcher);
+	
+	/* Independent reference to the object, held while consuming */
+	MAKE_STD_ZVAL(r->this);
+	*r->this = *getThis();
+	zval_copy_ctor(r->this);
+	INIT_PZVAL(r->this);
+	
+	/* Messages pushed before we started */
+	ev_feed_event(r->loop, &r->watcher, EV_CUSTOM);
+}
+
+/**
+ * Stops consuming, another process can consume() then.
+ * 
+ * @return void
+ */
+PHP_METHOD(SharedRing, stop)
+{
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	shared_ring_stop(r TSRMLS_CC);
+}
+
+/**
+ * Returns the number of bytes in use, including record headers.
+ * 
+ * @return int
+ */
+PHP_METHOD(SharedRing, getUsedBytes)
+{
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! r->header)
+	{
+		RETURN_LONG(0);
+	}
+	
+	RETURN_LONG((long) (__atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->header->tail, __ATOMIC_ACQUIRE)));
+}
+
+/**
+ * Returns the size of the ring in bytes.
+ * 
+ * @return int
+ */
+PHP_METHOD(SharedRing, getSize)
+{
+	shared_ring_object *r = (shared_ring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(r->header ? (long) r->header->size : 0);
+}
+
+
+static const zend_function_entry shared_ring_methods[] = {
+	ZEND_ME(SharedRing, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(SharedRing, push, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(SharedRing, pushMany, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(SharedRing, consume, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(SharedRing, stop, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(SharedRing, getUsedBytes, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(SharedRing, getSize, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
@@ -0,0 +1,182 @@
+
+/*
+ * Read-only view of an ev_statdata, returned by StatEvent::getStat() and
+ * StatEvent::getPrevStat().
+ * 
+ * The object holds a copy of the ev_statdata and converts a field only when
+ * its getter is called, so checking a couple of fields after every change
+ * notification does not build an array of all of them.
+ */
+
+/* Fields for StatResult::changedFields() and StatEvent::changedFields() */
+#define STAT_FIELD_DEV    1
+#define STAT_FIELD_INO    2
+#define STAT_FIELD_MODE   4
+#define STAT_FIELD_NLINK  8
+#define STAT_FIELD_UID    16
+#define STAT_FIELD_GID    32
+#define STAT_FIELD_RDEV   64
+#define STAT_FIELD_SIZE   128
+#define STAT_FIELD_ATIME  256
+#define STAT_FIELD_MTIME  512
+#define STAT_FIELD_CTIME  1024
+#define STAT_FIELD_BLOCKS 2048
+
+/* Nanoseconds of the timestamps, 0 where struct stat lacks them */
+#if HAVE_STRUCT_STAT_ST_MTIM
+#  define STAT_NSEC(st, field) ((st)->field##tim.tv_nsec)
+#else
+#  define STAT_NSEC(st, field) 0
+#endif
+
+#if HAVE_STRUCT_STAT_ST_BLOCKS
+#  define STAT_BLOCKS(st) ((st)->st_blocks)
+#else
+#  define STAT_BLOCKS(st) 0
+#endif
+
+typedef struct stat_result_object {
+	zend_object std;
+	ev_statdata attr;
+} stat_result_object;
+
+zend_class_entry *stat_result_ce;
+
+zend_object_handlers stat_result_object_handlers;
+
+
+/* Returns the STAT_FIELD_* which differ between a and b, timestamps are
+   compared including their nanoseconds */
+static long stat_fields_changed(const ev_statdata *a, const ev_statdata *b)
+{
+	long changed = 0;
+	
+	changed |= a->st_dev != b->st_dev ? STAT_FIELD_DEV : 0;
+	changed |= a->st_ino != b->st_ino ? STAT_FIELD_INO : 0;
+	changed |= a->st_mode != b->st_mode ? STAT_FIELD_MODE : 0;
+	changed |= a->st_nlink != b->st_nlink ? STAT_FIELD_NLINK : 0;
+	changed |= a->st_uid != b->st_uid ? STAT_FIELD_UID : 0;
+	changed |= a->st_gid != b->st_gid ? STAT_FIELD_GID : 0;
+	changed |= a->st_rdev != b->st_rdev ? STAT_FIELD_RDEV : 0;
+	changed |= a->st_size != b->st_size ? STAT_FIELD_SIZE : 0;
+	changed |= a->st_atime != b->st_atime || STAT_NSEC(a, st_a) != STAT_NSEC(b, st_a) ? STAT_FIELD_ATIME : 0;
+	changed |= a->st_mtime != b->st_mtime || STAT_NSEC(a, st_m) != STAT_NSEC(b, st_m) ? STAT_FIELD_MTIME : 0;
+	changed |= a->st_ctime != b->st_ctime || STAT_NSEC(a, st_c) != STAT_NSEC(b, st_c) ? STAT_FIELD_CTIME : 0;
+	changed |= STAT_BLOCKS(a) != STAT_BLOCKS(b) ? STAT_FIELD_BLOCKS : 0;
+	
+	return changed;
+}
+
+/* Initializes zv as a StatResult holding a copy of attr */
+static void stat_result_init(zval *zv, const ev_statdata *attr TSRMLS_DC)
+{
+	object_init_ex(zv, stat_result_ce);
+	
+	((stat_result_object *)zend_object_store_get_object(zv TSRMLS_CC))->attr = *attr;
+}
+
+FREE_STORAGE(stat_result_object,
+	/* Nothing besides the object itself */
+)
+
+CREATE_HANDLER(stat_result_object, stat_result_object, stat_result_object_free, stat_result_object_handlers,
+	/* Zeroed, like the attributes of a StatEvent which has not been started */
+)
+
+
+/**
+ * Private, use StatEvent::getStat() or StatEvent::getPrevStat().
+ */
+PHP_METHOD(StatResult, __construct)
+{
+	/* Intentionally left empty */
+}
+
+/* Defines StatResult::method() returning expr of the ev_statdata st */
+#define STAT_RESULT_GETTER(method, expr)                                                      \
+PHP_METHOD(StatResult, method)                                                               \
+{                                                                                            \
+	const ev_statdata *st = &((stat_result_object *)zend_object_store_get_object(getThis() TSRMLS_CC))->attr; \
+	                                                                                         \
+	(void) st; /* Unused by the constant 0 of the *Nsec() getters */                        \
+	RETURN_LONG((long) (expr));                                                              \
+}
+
+/**
+ * Getters of the fields of stat(), the *Nsec() getters return the nanoseconds
+ * of the timestamps, 0 where the system does not provide them.
+ * 
+ * @return int
+ */
+STAT_RESULT_GETTER(getDev, st->st_dev)
+STAT_RESULT_GETTER(getIno, st->st_ino)
+STAT_RESULT_GETTER(getMode, st->st_mode)
+STAT_RESULT_GETTER(getNlink, st->st_nlink)
+STAT_RESULT_GETTER(getUid, st->st_uid)
+STAT_RESULT_GETTER(getGid, st->st_gid)
+STAT_RESULT_GETTER(getRdev, st->st_rdev)
+STAT_RESULT_GETTER(getSize, st->st_size)
+STAT_RESULT_GETTER(getAtime, st->st_atime)
+STAT_RESULT_GETTER(getAtimeNsec, STAT_NSEC(st, st_a))
+STAT_RESULT_GETTER(getMtime, st->st_mtime)
+STAT_RESULT_GETTER(getMtimeNsec, STAT_NSEC(st, st_m))
+STAT_RESULT_GETTER(getCtime, st->st_ctime)
+STAT_RESULT_GETTER(getCtimeNsec, STAT_NSEC(st, st_c))
+STAT_RESULT_GETTER(getBlocks, STAT_BLOCKS(st))
+
+#undef STAT_RESULT_GETTER
+
+/**
+ * Returns false if the path did not exist, ie. nlink is 0.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(StatResult, exists)
+{
+	stat_result_object *obj = (stat_result_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(obj->attr.st_nlink != 0);
+}
+
+/**
+ * Returns the fields which differ from $other, a combination of the
+ * StatResult::DEV, INO, MODE, NLINK, UID, GID, RDEV, SIZE, ATIME, MTIME,
+ * CTIME and BLOCKS constants.
+ * 
+ * @param  StatResult
+ * @return int
+ */
+PHP_METHOD(StatResult, changedFields)
+{
+	zval *zother;
+	stat_result_object *obj = (stat_result_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "O", &zother, stat_result_ce) != SUCCESS) {
+		return;
+	}
+	
+	RETURN_LONG(stat_fields_changed(&obj->attr, &((stat_result_object *)zend_object_store_get_object(zother TSRMLS_CC))->attr));
+}
+
+
+static const zend_function_entry stat_result_methods[] = {
+	ZEND_ME(StatResult, __construct, NULL, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+	ZEND_ME(StatResult, getDev, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getIno, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getMode, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getNlink, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getUid, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getGid, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getRdev, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getSize, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getAtime, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getAtimeNsec, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getMtime, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getMtimeNsec, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getCtime, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getCtimeNsec, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, getBlocks, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, exists, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatResult, changedFields, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
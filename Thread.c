@@ -0,0 +1,746 @@
+
+/*
+ * Threads running PHP scripts in their own interpreter context, ZTS builds only.
+ * 
+ * libev\Thread starts a thread which performs a request of its own and
+ * executes a script file in it, the script creates its own EventLoops. Nothing
+ * is shared between the contexts except libev\ThreadChannels, which carry
+ * string messages between the loops of the threads.
+ * 
+ * A channel is a lock-free MPSC queue (Vyukov's intrusive node queue): any
+ * number of threads push by exchanging head, the one loop consuming it pops
+ * from tail. A push is followed by an ev_async_send() to the consuming loop,
+ * libev merges the wakeups until the loop gets around to the watcher. Only the
+ * wakeup takes a mutex, which keeps the consumer from stopping while a producer
+ * is signalling its watcher.
+ */
+
+#include "php_main.h"
+#include "SAPI.h"
+
+typedef struct thread_message {
+	struct thread_message *next;
+	int                   len;
+	char                  data[1];
+} thread_message;
+
+/* Shared by all ThreadChannel objects of the channel in all threads, allocated
+   with malloc() and freed by whoever drops the last reference */
+typedef struct thread_queue {
+	thread_message  *head;      /* Last pushed, exchanged by producers */
+	char            pad0[56];
+	thread_message  *tail;      /* Next to pop, only touched by the consumer */
+	thread_message  stub;       /* Keeps the list non-empty */
+	int             refcount;
+	pthread_mutex_t lock;       /* Guards loop and async */
+	struct ev_loop  *loop;      /* Consuming loop, NULL if not consumed */
+	ev_async        *async;     /* Watcher of the consuming ThreadChannel */
+} thread_queue;
+
+/* A thread started by Thread::__construct(), owned by the Thread object, the
+   thread does not touch it once finished is set */
+typedef struct libev_thread {
+	pthread_t    id;
+	char         *file;           /* Absolute path of the script */
+	thread_queue **channels;      /* Passed to the script, Thread::getChannels() */
+	int          channel_count;
+	int          exit_status;
+	int          finished;
+	int          joined;
+} libev_thread;
+
+typedef struct thread_object {
+	zend_object  std;
+	libev_thread *thread;         /* NULL if the constructor failed */
+} thread_object;
+
+typedef struct thread_channel_object {
+	zend_object    std;
+	zval           *this;         /* Reference keeping the object alive while consuming */
+	thread_queue   *queue;
+	struct ev_loop *loop;         /* Set while consuming */
+	ev_async       async;
+	ev_cleanup     cleanup_watcher;
+	long           batch;
+	zval           *callback;
+	zend_fcall_info_cache fcc;
+} thread_channel_object;
+
+zend_class_entry *thread_ce,
+	*thread_channel_ce;
+
+zend_object_handlers thread_object_handlers,
+	thread_channel_object_handlers;
+
+
+static thread_queue *thread_queue_new(void)
+{
+	thread_queue *q = calloc(1, sizeof(thread_queue));
+	
+	if( ! q)
+	{
+		return NULL;
+	}
+	
+	q->head     = &q->stub;
+	q->tail     = &q->stub;
+	q->refcount = 1;
+	
+	pthread_mutex_init(&q->lock, NULL);
+	
+	return q;
+}
+
+static inline void thread_queue_addref(thread_queue *q)
+{
+	__atomic_add_fetch(&q->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void thread_queue_push(thread_queue *q, thread_message *m)
+{
+	thread_message *prev;
+	
+	m->next = NULL;
+	
+	prev = __atomic_exchange_n(&q->head, m, __ATOMIC_ACQ_REL);
+	
+	/* Until this store the consumer sees the list ending at prev */
+	__atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+/* Takes the oldest message, returns NULL if there is none or if a producer is
+   between exchanging head and linking its message, it signals afterwards */
+static thread_message *thread_queue_pop(thread_queue *q)
+{
+	thread_message *tail = q->tail;
+	thread_message *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	
+	if(tail == &q->stub)
+	{
+		if( ! next)
+		{
+			return NULL;
+		}
+		
+		q->tail = next;
+		tail    = next;
+		next    = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	
+	if(next)
+	{
+		q->tail = next;
+		
+		return tail;
+	}
+	
+	if(tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+	
+	/* tail is the last message, put the stub behind it so it can be taken */
+	thread_queue_push(q, &q->stub);
+	
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	
+	if(next)
+	{
+		q->tail = next;
+		
+		return tail;
+	}
+	
+	return NULL;
+}
+
+static void thread_queue_release(thread_queue *q)
+{
+	thread_message *m;
+	
+	if(__atomic_sub_fetch(&q->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+	{
+		return;
+	}
+	
+	/* No producers left, messages which were never consumed */
+	while((m = thread_queue_pop(q)))
+	{
+		free(m);
+	}
+	
+	pthread_mutex_destroy(&q->lock);
+	
+	free(q);
+}
+
+/* Appends a copy of msg and wakes the consuming loop, returns 0 if out of memory */
+static int thread_queue_send(thread_queue *q, const char *msg, int len)
+{
+	thread_message *m = malloc(sizeof(thread_message) + len);
+	
+	if( ! m)
+	{
+		return 0;
+	}
+	
+	m->len = len;
+	memcpy(m->data, msg, len);
+	
+	thread_queue_push(q, m);
+	
+	pthread_mutex_lock(&q->lock);
+	
+	if(q->async)
+	{
+		ev_async_send(q->loop, q->async);
+	}
+	
+	pthread_mutex_unlock(&q->lock);
+	
+	return 1;
+}
+
+/* Initializes zv as a ThreadChannel of q, taking a reference to q */
+static void thread_channel_init(zval *zv, thread_queue *q TSRMLS_DC)
+{
+	object_init_ex(zv, thread_channel_ce);
+	
+	thread_queue_addref(q);
+	
+	((thread_channel_object *)zend_object_store_get_object(zv TSRMLS_CC))->queue = q;
+}
+
+/* Calls callback($channel, $messages) */
+static void thread_channel_call(thread_channel_object *c, zval *messages TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = c->this;
+	zval **params[2] = { &self, &messages };
+	
+	libev_call_function(c->callback, &c->fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+}
+
+/* Stops consuming, the channel can be consumed by another loop then */
+static void thread_channel_stop(thread_channel_object *c TSRMLS_DC)
+{
+	zval *self = c->this;
+	
+	if( ! c->loop)
+	{
+		return;
+	}
+	
+	/* No producer signals the watcher after this */
+	pthread_mutex_lock(&c->queue->lock);
+	c->queue->loop  = NULL;
+	c->queue->async = NULL;
+	pthread_mutex_unlock(&c->queue->lock);
+	
+	ev_async_stop(c->loop, &c->async);
+	ev_cleanup_stop(c->loop, &c->cleanup_watcher);
+	
+	c->loop = NULL;
+	
+	if(c->callback)
+	{
+		zval_ptr_dtor(&c->callback);
+		c->callback = NULL;
+	}
+	
+	c->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+static void thread_channel_callback(struct ev_loop *loop, ev_async *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	thread_channel_object *c = (thread_channel_object *)((char *) w - XtOffsetOf(thread_channel_object, async));
+	zval *self = c->this;
+	zval *messages;
+	thread_message *m;
+	long n = 0;
+	
+	MAKE_STD_ZVAL(messages);
+	array_init(messages);
+	
+	while(n < c->batch && (m = thread_queue_pop(c->queue)))
+	{
+		add_next_index_stringl(messages, m->data, m->len, 1);
+		free(m);
+		
+		n++;
+	}
+	
+	if(n == c->batch)
+	{
+		/* More might be waiting, let the other watchers run between batches */
+		ev_async_send(loop, w);
+	}
+	
+	/* The callback might stop consuming and release the last reference */
+	zval_add_ref(&self);
+	
+	if(n)
+	{
+		thread_channel_call(c, messages TSRMLS_CC);
+	}
+	
+	zval_ptr_dtor(&messages);
+	zval_ptr_dtor(&self);
+}
+
+/* The EventLoop is being destroyed */
+static void thread_channel_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	thread_channel_object *c = (thread_channel_object *)((char *) w - XtOffsetOf(thread_channel_object, cleanup_watcher));
+	
+	thread_channel_stop(c TSRMLS_CC);
+}
+
+/* Runs the script of t in a new interpreter context */
+static void *thread_main(void *arg)
+{
+	libev_thread *t = (libev_thread *) arg;
+	zend_file_handle file_handle;
+	/* Allocates the globals of this thread */
+	TSRMLS_FETCH();
+	
+	/* The request of the thread has no client of its own */
+	SG(server_context) = NULL;
+	
+	zend_first_try
+	{
+		if(php_request_startup(TSRMLS_C) == SUCCESS)
+		{
+			/* Reset by php_request_startup() */
+			SG(headers_sent)            = 1;
+			SG(request_info).no_headers = 1;
+			
+			LIBEV_G(thread) = t;
+			
+			memset(&file_handle, 0, sizeof(file_handle));
+			file_handle.type     = ZEND_HANDLE_FILENAME;
+			file_handle.filename = t->file;
+			
+			php_execute_script(&file_handle TSRMLS_CC);
+			
+			t->exit_status = EG(exit_status);
+			
+			php_request_shutdown(NULL);
+			
+			LIBEV_G(thread) = NULL;
+		}
+		else
+		{
+			t->exit_status = 255;
+		}
+	}
+	zend_end_try();
+	
+	ts_free_thread();
+	
+	__atomic_store_n(&t->finished, 1, __ATOMIC_RELEASE);
+	
+	return NULL;
+}
+
+static void thread_free(libev_thread *t)
+{
+	int i;
+	
+	for(i = 0; i < t->channel_count; i++)
+	{
+		thread_queue_release(t->channels[i]);
+	}
+	
+	free(t->channels);
+	free(t->file);
+	free(t);
+}
+
+FREE_STORAGE(thread_object,
+
+	if(obj->thread)
+	{
+		/* The thread reads obj->thread until its script has finished */
+		if( ! obj->thread->joined)
+		{
+			pthread_join(obj->thread->id, NULL);
+		}
+		
+		thread_free(obj->thread);
+	}
+)
+
+CREATE_HANDLER(thread_object, thread_object, thread_object_free, thread_object_handlers, ;)
+
+FREE_STORAGE(thread_channel_object,
+
+	if(obj->loop)
+	{
+		pthread_mutex_lock(&obj->queue->lock);
+		obj->queue->loop  = NULL;
+		obj->queue->async = NULL;
+		pthread_mutex_unlock(&obj->queue->lock);
+		
+		ev_async_stop(obj->loop, &obj->async);
+		ev_cleanup_stop(obj->loop, &obj->cleanup_watcher);
+	}
+
+	if(obj->callback)
+	{
+		zval_ptr_dtor(&obj->callback);
+	}
+
+	if(obj->queue)
+	{
+		thread_queue_release(obj->queue);
+	}
+)
+
+CREATE_HANDLER(thread_channel_object, thread_channel_object, thread_channel_object_free, thread_channel_object_handlers, ;)
+
+
+/**
+ * Starts a thread executing the script $file in an interpreter context of its
+ * own, the script gets the ThreadChannels in $channels from Thread::getChannels().
+ * 
+ * @param  string
+ * @param  array   ThreadChannels
+ */
+PHP_METHOD(Thread, __construct)
+{
+	char *file;
+	int file_len;
+	char *path;
+	zval *zchannels = NULL;
+	zval **entry;
+	HashPosition pos;
+	libev_thread *t;
+	sigset_t all;
+	sigset_t old;
+	int ret;
+	thread_object *obj = (thread_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	PARSE_PARAMETERS(Thread, "s|a", &file, &file_len, &zchannels);
+	
+	if(obj->thread)
+	{
+		zend_throw_exception(NULL, "libev\\Thread::__construct(): thread has already been started", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	/* Other SAPIs need the context of a client request to run one */
+	if(strcmp(sapi_module.name, "cli") != 0 && strcmp(sapi_module.name, "embed") != 0)
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Thread::__construct(): not supported by the %s SAPI", sapi_module.name);
+		
+		return;
+	}
+	
+	if(zchannels)
+	{
+		for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zchannels), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(zchannels), (void **) &entry, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(zchannels), &pos))
+		{
+			if(Z_TYPE_PP(entry) != IS_OBJECT || ! instance_of_class(Z_OBJCE_P(*entry), thread_channel_ce))
+			{
+				zend_throw_exception(NULL, "libev\\Thread::__construct(): channels must be libev\\ThreadChannel objects", 1 TSRMLS_CC);
+				
+				return;
+			}
+		}
+	}
+	
+	/* The thread does not share the working directory of this request */
+	if( ! (path = expand_filepath(file, NULL TSRMLS_CC)))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Thread::__construct(): invalid path '%s'", file);
+		
+		return;
+	}
+	
+	t = calloc(1, sizeof(libev_thread));
+	
+	if( ! t || ! (t->file = strdup(path)))
+	{
+		free(t);
+		efree(path);
+		
+		zend_throw_exception(NULL, "libev\\Thread::__construct(): out of memory", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	efree(path);
+	
+	if(zchannels && zend_hash_num_elements(Z_ARRVAL_P(zchannels)))
+	{
+		t->channels = malloc(zend_hash_num_elements(Z_ARRVAL_P(zchannels)) * sizeof(thread_queue *));
+		
+		if( ! t->channels)
+		{
+			thread_free(t);
+			
+			zend_throw_exception(NULL, "libev\\Thread::__construct(): out of memory", 1 TSRMLS_CC);
+			
+			return;
+		}
+		
+		for(zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zchannels), &pos);
+			zend_hash_get_current_data_ex(Z_ARRVAL_P(zchannels), (void **) &entry, &pos) == SUCCESS;
+			zend_hash_move_forward_ex(Z_ARRVAL_P(zchannels), &pos))
+		{
+			t->channels[t->channel_count] = ((thread_channel_object *)zend_object_store_get_object(*entry TSRMLS_CC))->queue;
+			
+			thread_queue_addref(t->channels[t->channel_count++]);
+		}
+	}
+	
+	/* Signals are left to the thread running the loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	
+	ret = pthread_create(&t->id, NULL, thread_main, t);
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if(ret != 0)
+	{
+		thread_free(t);
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\Thread::__construct(): pthread_create() failed: %s", strerror(ret));
+		
+		return;
+	}
+	
+	obj->thread = t;
+}
+
+/**
+ * Waits for the script of the thread to finish.
+ * 
+ * @return int  Exit status of the script
+ */
+PHP_METHOD(Thread, join)
+{
+	thread_object *obj = (thread_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! obj->thread)
+	{
+		RETURN_LONG(-1);
+	}
+	
+	if( ! obj->thread->joined)
+	{
+		pthread_join(obj->thread->id, NULL);
+		
+		obj->thread->joined = 1;
+	}
+	
+	RETURN_LONG(obj->thread->exit_status);
+}
+
+/**
+ * Returns true if the script of the thread has not finished yet.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(Thread, isRunning)
+{
+	thread_object *obj = (thread_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_BOOL(obj->thread && ! __atomic_load_n(&obj->thread->finished, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Returns the ThreadChannels passed to the Thread running this script, in the
+ * same order, an empty array if not running in a Thread.
+ * 
+ * @return array
+ */
+PHP_METHOD(Thread, getChannels)
+{
+	libev_thread *t = LIBEV_G(thread);
+	zval *zchannel;
+	int i;
+	
+	array_init(return_value);
+	
+	for(i = 0; t && i < t->channel_count; i++)
+	{
+		MAKE_STD_ZVAL(zchannel);
+		thread_channel_init(zchannel, t->channels[i] TSRMLS_CC);
+		
+		add_next_index_zval(return_value, zchannel);
+	}
+}
+
+
+/**
+ * Creates a channel, pass it to Thread::__construct() to share it with the
+ * script of the thread.
+ */
+PHP_METHOD(ThreadChannel, __construct)
+{
+	thread_channel_object *c = (thread_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! (c->queue = thread_queue_new()))
+	{
+		zend_throw_exception(NULL, "libev\\ThreadChannel::__construct(): out of memory", 1 TSRMLS_CC);
+	}
+}
+
+/**
+ * Appends a message, wakes the consuming loop. Can be called from any thread.
+ * 
+ * @param  string
+ * @return boolean
+ */
+PHP_METHOD(ThreadChannel, send)
+{
+	char *msg;
+	int msg_len;
+	thread_channel_object *c = (thread_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &msg, &msg_len) != SUCCESS) {
+		return;
+	}
+	
+	if( ! c->queue)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_BOOL(thread_queue_send(c->queue, msg, msg_len));
+}
+
+/**
+ * Starts consuming the channel in the loop, which it keeps running until
+ * stopped. Only one loop, of any thread, can consume a channel at a time.
+ * Messages are delivered in order of sending per thread, in batches of at
+ * most $batch.
+ * 
+ * Callback signature: callback(ThreadChannel $channel, array $messages)
+ * 
+ * @param  EventLoop
+ * @param  callback
+ * @param  int
+ * @return void
+ */
+PHP_METHOD(ThreadChannel, consume)
+{
+	zval *zloop;
+	long batch = 256;
+	int busy;
+	struct ev_loop *loop;
+	thread_channel_object *c = (thread_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Oz|l", &zloop, event_loop_ce, &callback, &batch) != SUCCESS) {
+		return;
+	}
+	
+	CHECK_CALLBACK;
+	
+	if( ! c->queue)
+	{
+		zend_throw_exception(NULL, "libev\\ThreadChannel::consume(): channel is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if( ! (loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop))
+	{
+		zend_throw_exception(NULL, "libev\\ThreadChannel::consume(): EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	/* Replaces the callback */
+	thread_channel_stop(c TSRMLS_CC);
+	
+	ev_async_init(&c->async, thread_channel_callback);
+	ev_async_start(loop, &c->async);
+	
+	pthread_mutex_lock(&c->queue->lock);
+	
+	if( ! (busy = c->queue->async != NULL))
+	{
+		c->queue->loop  = loop;
+		c->queue->async = &c->async;
+	}
+	
+	pthread_mutex_unlock(&c->queue->lock);
+	
+	if(busy)
+	{
+		ev_async_stop(loop, &c->async);
+		
+		zend_throw_exception(NULL, "libev\\ThreadChannel::consume(): already consumed by another loop", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	zval_add_ref(&callback);
+	c->callback = callback;
+	c->fcc      = callback_fcc;
+	c->batch    = batch < 1 ? 1 : batch;
+	c->loop     = loop;
+	
+	ev_cleanup_init(&c->cleanup_watcher, thread_channel_cleanup_callback);
+	ev_cleanup_start(c->loop, &c->cleanup_watcher);
+	
+	/* Independent reference to the object, held while consuming */
+	MAKE_STD_ZVAL(c->this);
+	*c->this = *getThis();
+	zval_copy_ctor(c->this);
+	INIT_PZVAL(c->this);
+	
+	/* Messages sent before we started */
+	ev_async_send(c->loop, &c->async);
+}
+
+/**
+ * Stops consuming, another loop can consume() then.
+ * 
+ * @return void
+ */
+PHP_METHOD(ThreadChannel, stop)
+{
+	thread_channel_object *c = (thread_channel_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	thread_channel_stop(c TSRMLS_CC);
+}
+
+
+static const zend_function_entry thread_methods[] = {
+	ZEND_ME(Thread, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(Thread, join, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Thread, isRunning, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Thread, getChannels, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	{NULL, NULL, NULL}
+};
+
+static const zend_function_entry thread_channel_methods[] = {
+	ZEND_ME(ThreadChannel, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(ThreadChannel, send, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(ThreadChannel, consume, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(ThreadChannel, stop, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
@@ -0,0 +1,995 @@
+
+/*
+ * UDP socket receiving and sending datagrams in batches.
+ * 
+ * On readiness one recvmmsg() fills a preallocated vector of buffers and the
+ * callback receives all datagrams in one array, instead of one IOEvent
+ * wakeup, one callback and one stream_socket_recvfrom() per datagram.
+ * UdpSocket::send() queues datagrams, the queue is written with sendmmsg()
+ * once the socket is writable, ie. at most once per loop iteration.
+ * 
+ * Where the kernel supports it (Linux 4.18+), queued datagrams of the same
+ * size to the same peer are sent as one UDP_SEGMENT (GSO) message, and with
+ * the "gro" option received datagrams coalesced by UDP_GRO are split again.
+ * Without recvmmsg()/sendmmsg() a recvmsg()/sendmsg() loop is used instead.
+ */
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+/* Missing on macOS, udp_socket_open() uses fcntl() there */
+#ifndef SOCK_NONBLOCK
+#  define SOCK_NONBLOCK 0
+#endif
+
+#ifndef SOCK_CLOEXEC
+#  define SOCK_CLOEXEC 0
+#endif
+
+/* Upper limit for the "batch" option */
+#define UDP_SOCKET_MAX_BATCH 1024
+
+/* Messages per sendmmsg() call */
+#define UDP_SOCKET_SEND_BATCH 64
+
+/* Datagrams coalesced into one UDP_SEGMENT message, the kernel allows 64 */
+#define UDP_SOCKET_GSO_SEGMENTS 64
+
+/* Largest UDP payload */
+#define UDP_SOCKET_MAX_PAYLOAD 65507
+
+#if ! HAVE_RECVMMSG || ! HAVE_SENDMMSG
+struct udp_socket_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int  msg_len;
+};
+#  define mmsghdr udp_socket_mmsghdr
+#endif
+
+/* Datagram waiting in the send queue */
+typedef struct udp_datagram {
+	struct udp_datagram     *next;
+	struct sockaddr_storage peer;
+	socklen_t               peer_len;
+	size_t                  len;
+	char                    data[1];
+} udp_datagram;
+
+typedef struct udp_socket_object {
+	zend_object     std;
+	zval            *this;           /* Reference keeping the object alive while reading or sending */
+	struct ev_loop  *loop;           /* NULL once closed or the loop was destroyed */
+	ev_io           read_watcher;
+	ev_io           write_watcher;
+	ev_cleanup      cleanup_watcher;
+	int             fd;
+	zval            *callback;
+	zend_fcall_info_cache fcc;
+	int             gro;
+	int             gso;
+	/* Receive vector of batch buffers of buffer_size bytes each */
+	int             batch;
+	size_t          buffer_size;
+	char            *buffers;
+	struct mmsghdr  *recv_msgs;
+	struct iovec    *recv_iovs;
+	struct sockaddr_storage *recv_peers;
+	char            *recv_controls;
+	/* Send queue, written by udp_socket_flush() */
+	udp_datagram    *head;
+	udp_datagram    *tail;
+	long            queued;
+	long            max_queue;
+	struct mmsghdr  *send_msgs;
+	struct iovec    *send_iovs;
+	char            *send_controls;
+} udp_socket_object;
+
+zend_class_entry *udp_socket_ce;
+
+zend_object_handlers udp_socket_object_handlers;
+
+/* Space for the UDP_GRO and UDP_SEGMENT control messages */
+#define UDP_SOCKET_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+
+static int udp_socket_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+#if HAVE_RECVMMSG
+	return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+#else
+	unsigned int i;
+	ssize_t len;
+	
+	for(i = 0; i < n; i++)
+	{
+		if((len = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT)) < 0)
+		{
+			return i ? (int) i : -1;
+		}
+		
+		msgs[i].msg_len = (unsigned int) len;
+	}
+	
+	return (int) n;
+#endif
+}
+
+static int udp_socket_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n)
+{
+#if HAVE_SENDMMSG
+	return sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+#else
+	unsigned int i;
+	ssize_t len;
+	
+	for(i = 0; i < n; i++)
+	{
+		if((len = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT)) < 0)
+		{
+			return i ? (int) i : -1;
+		}
+		
+		msgs[i].msg_len = (unsigned int) len;
+	}
+	
+	return (int) n;
+#endif
+}
+
+/* Returns a non-blocking, close-on-exec UDP socket, -1 and errno on failure */
+static int udp_socket_open(int family)
+{
+	int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	
+	if(fd >= 0 && ! SOCK_NONBLOCK && (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0))
+	{
+		int error = errno;
+		
+		close(fd);
+		errno = error;
+		
+		return -1;
+	}
+	
+	return fd;
+}
+
+/* Parses the numeric "address:port" or "[address]:port" into ss, returns 0 if invalid */
+static int udp_socket_parse_address(const char *address, int address_len, struct sockaddr_storage *ss, socklen_t *len)
+{
+	struct sockaddr_in *sin   = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+	const char *host;
+	int host_len;
+	char buf[INET6_ADDRSTRLEN];
+	char *end;
+	const char *colon;
+	long port;
+	
+	memset(ss, 0, sizeof(*ss));
+	
+	if(address_len < 1 || strlen(address) != (size_t) address_len)
+	{
+		return 0;
+	}
+	
+	if(*address == '[')
+	{
+		host = address + 1;
+		
+		if( ! (colon = strchr(host, ']')) || colon[1] != ':')
+		{
+			return 0;
+		}
+		
+		host_len = (int) (colon - host);
+		colon++;
+	}
+	else
+	{
+		host = address;
+		
+		if( ! (colon = strchr(host, ':')) || strchr(colon + 1, ':'))
+		{
+			return 0;
+		}
+		
+		host_len = (int) (colon - host);
+	}
+	
+	port = strtol(colon + 1, &end, 10);
+	
+	if(host_len < 1 || host_len >= (int) sizeof(buf) || colon[1] == '\0' || *end != '\0' || port < 0 || port > 65535)
+	{
+		return 0;
+	}
+	
+	memcpy(buf, host, host_len);
+	buf[host_len] = '\0';
+	
+	if(inet_pton(AF_INET, buf, &sin->sin_addr) == 1)
+	{
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons((unsigned short) port);
+		*len = sizeof(struct sockaddr_in);
+		
+		return 1;
+	}
+	
+	if(inet_pton(AF_INET6, buf, &sin6->sin6_addr) == 1)
+	{
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port   = htons((unsigned short) port);
+		*len = sizeof(struct sockaddr_in6);
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* Formats ss as "address:port" or "[address]:port" into buf, returns the length */
+static int udp_socket_format_address(const struct sockaddr_storage *ss, char *buf, size_t size)
+{
+	char host[INET6_ADDRSTRLEN];
+	
+	if(ss->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ss;
+		
+		inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+		
+		return snprintf(buf, size, "[%s]:%u", host, (unsigned) ntohs(sin6->sin6_port));
+	}
+	else
+	{
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+		
+		inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+		
+		return snprintf(buf, size, "%s:%u", host, (unsigned) ntohs(sin->sin_port));
+	}
+}
+
+/* Drops the callback and the self reference, the object might be freed */
+static void udp_socket_release(udp_socket_object *obj TSRMLS_DC)
+{
+	zval *self = obj->this;
+	
+	obj->this = NULL;
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Releases the self reference once neither reading nor sending */
+static void udp_socket_release_if_idle(udp_socket_object *obj TSRMLS_DC)
+{
+	if(obj->this && ( ! obj->loop || ( ! ev_is_active(&obj->read_watcher) && ! obj->head)))
+	{
+		udp_socket_release(obj TSRMLS_CC);
+	}
+}
+
+static void udp_socket_free_queue(udp_socket_object *obj)
+{
+	udp_datagram *d;
+	
+	while((d = obj->head))
+	{
+		obj->head = d->next;
+		
+		efree(d);
+	}
+	
+	obj->tail   = NULL;
+	obj->queued = 0;
+}
+
+/* Stops all watchers and closes the socket, queued datagrams are dropped */
+static void udp_socket_detach(udp_socket_object *obj)
+{
+	if( ! obj->loop)
+	{
+		return;
+	}
+	
+	ev_io_stop(obj->loop, &obj->read_watcher);
+	ev_io_stop(obj->loop, &obj->write_watcher);
+	ev_cleanup_stop(obj->loop, &obj->cleanup_watcher);
+	
+	udp_socket_free_queue(obj);
+	
+	close(obj->fd);
+	obj->fd = -1;
+	
+	obj->loop = NULL;
+}
+
+/* Removes the first count datagrams from the queue */
+static void udp_socket_dequeue(udp_socket_object *obj, int count)
+{
+	udp_datagram *d;
+	
+	while(count-- > 0 && (d = obj->head))
+	{
+		if( ! (obj->head = d->next))
+		{
+			obj->tail = NULL;
+		}
+		
+		obj->queued--;
+		
+		efree(d);
+	}
+}
+
+/* Writes queued datagrams until the queue is empty or the socket buffer is
+   full, datagrams the kernel rejects (eg. unreachable peers) are dropped */
+static void udp_socket_flush(udp_socket_object *obj)
+{
+	int segments[UDP_SOCKET_SEND_BATCH];
+	struct mmsghdr *msg;
+	struct iovec *iov;
+	udp_datagram *d;
+	size_t total;
+	int count;
+	int sent;
+	int n;
+	int i;
+	
+	while(obj->head)
+	{
+		iov = obj->send_iovs;
+		
+		for(n = 0, d = obj->head; d && n < UDP_SOCKET_SEND_BATCH; n++)
+		{
+			msg = &obj->send_msgs[n];
+			
+			memset(msg, 0, sizeof(*msg));
+			
+			msg->msg_hdr.msg_name    = &d->peer;
+			msg->msg_hdr.msg_namelen = d->peer_len;
+			msg->msg_hdr.msg_iov     = iov;
+			
+			iov->iov_base = d->data;
+			iov->iov_len  = d->len;
+			iov++;
+			
+			segments[n] = 1;
+			total       = d->len;
+
+#ifdef UDP_SEGMENT
+			/* Following datagrams of the same size to the same peer, the last may be shorter */
+			while(obj->gso && d->len && d->next && segments[n] < UDP_SOCKET_GSO_SEGMENTS
+				&& d->next->len && d->next->len <= msg->msg_hdr.msg_iov[0].iov_len
+				&& total + d->next->len <= UDP_SOCKET_MAX_PAYLOAD
+				&& d->next->peer_len == d->peer_len && memcmp(&d->next->peer, &d->peer, d->peer_len) == 0)
+			{
+				d = d->next;
+				
+				iov->iov_base = d->data;
+				iov->iov_len  = d->len;
+				iov++;
+				
+				segments[n]++;
+				total += d->len;
+				
+				if(d->len < msg->msg_hdr.msg_iov[0].iov_len)
+				{
+					break;
+				}
+			}
+			
+			if(segments[n] > 1)
+			{
+				struct cmsghdr *cm;
+				
+				msg->msg_hdr.msg_control    = obj->send_controls + n * UDP_SOCKET_CONTROL_SIZE;
+				msg->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				
+				cm = CMSG_FIRSTHDR(&msg->msg_hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type  = UDP_SEGMENT;
+				cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+				
+				*(uint16_t *) CMSG_DATA(cm) = (uint16_t) msg->msg_hdr.msg_iov[0].iov_len;
+			}
+#endif
+
+			msg->msg_hdr.msg_iovlen = segments[n];
+			
+			d = d->next;
+		}
+		
+		if((sent = udp_socket_sendmmsg(obj->fd, obj->send_msgs, n)) < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR)
+			{
+				return;
+			}
+
+#ifdef UDP_SEGMENT
+			/* No GSO support by the device or the kernel, send them one by one */
+			if(segments[0] > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+			{
+				obj->gso = 0;
+				
+				continue;
+			}
+#endif
+
+			udp_socket_dequeue(obj, segments[0]);
+			
+			continue;
+		}
+		
+		for(i = 0, count = 0; i < sent; i++)
+		{
+			count += segments[i];
+		}
+		
+		udp_socket_dequeue(obj, count);
+	}
+}
+
+/* Calls callback($socket, $datagrams) */
+static void udp_socket_call(udp_socket_object *obj, zval *datagrams TSRMLS_DC)
+{
+	zval *retval = NULL;
+	zval *self = obj->this;
+	zval **params[2] = { &self, &datagrams };
+	
+	libev_call_function(obj->callback, &obj->fcc, 2, params, &retval TSRMLS_CC);
+	
+	if(retval)
+	{
+		zval_ptr_dtor(&retval);
+	}
+}
+
+static void udp_socket_read_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	udp_socket_object *obj = (udp_socket_object *)((char *) w - XtOffsetOf(udp_socket_object, read_watcher));
+	struct msghdr *hdr;
+	zval *datagrams;
+	zval *datagram;
+	zval *self;
+	char peer[INET6_ADDRSTRLEN + 8];
+	int peer_len;
+	size_t segment;
+	size_t offset;
+	size_t len;
+	int n;
+	int i;
+	
+	for(i = 0; i < obj->batch; i++)
+	{
+		hdr = &obj->recv_msgs[i].msg_hdr;
+		
+		hdr->msg_namelen = sizeof(struct sockaddr_storage);
+		hdr->msg_flags   = 0;
+		
+		if(obj->gro)
+		{
+			hdr->msg_control    = obj->recv_controls + i * UDP_SOCKET_CONTROL_SIZE;
+			hdr->msg_controllen = UDP_SOCKET_CONTROL_SIZE;
+		}
+	}
+	
+	/* Errors, like ECONNREFUSED from an earlier send, are left to the next read */
+	if((n = udp_socket_recvmmsg(obj->fd, obj->recv_msgs, obj->batch)) <= 0)
+	{
+		return;
+	}
+	
+	MAKE_STD_ZVAL(datagrams);
+	array_init_size(datagrams, n);
+	
+	for(i = 0; i < n; i++)
+	{
+		hdr     = &obj->recv_msgs[i].msg_hdr;
+		len     = obj->recv_msgs[i].msg_len;
+		segment = len;
+
+#ifdef UDP_GRO
+		if(obj->gro)
+		{
+			struct cmsghdr *cm;
+			
+			for(cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm))
+			{
+				if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+				{
+					segment = (size_t) *(int *) CMSG_DATA(cm);
+				}
+			}
+		}
+#endif
+
+		peer_len = udp_socket_format_address(obj->recv_peers + i, peer, sizeof(peer));
+		
+		/* Coalesced datagrams are split again into segment sized payloads */
+		offset = 0;
+		
+		do
+		{
+			if(segment > len - offset || ! segment)
+			{
+				segment = len - offset;
+			}
+			
+			MAKE_STD_ZVAL(datagram);
+			array_init_size(datagram, 2);
+			add_next_index_stringl(datagram, (char *) hdr->msg_iov->iov_base + offset, segment, 1);
+			add_next_index_stringl(datagram, peer, peer_len, 1);
+			
+			add_next_index_zval(datagrams, datagram);
+			
+			offset += segment;
+		}
+		while(offset < len);
+	}
+	
+	/* The callback might close the socket and release the last reference */
+	self = obj->this;
+	zval_add_ref(&self);
+	
+	udp_socket_call(obj, datagrams TSRMLS_CC);
+	
+	zval_ptr_dtor(&datagrams);
+	zval_ptr_dtor(&self);
+}
+
+static void udp_socket_write_callback(struct ev_loop *loop, ev_io *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	udp_socket_object *obj = (udp_socket_object *)((char *) w - XtOffsetOf(udp_socket_object, write_watcher));
+	
+	udp_socket_flush(obj);
+	
+	if( ! obj->head)
+	{
+		ev_io_stop(loop, w);
+		
+		udp_socket_release_if_idle(obj TSRMLS_CC);
+	}
+}
+
+/* The EventLoop is being destroyed */
+static void udp_socket_cleanup_callback(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	udp_socket_object *obj = (udp_socket_object *)((char *) w - XtOffsetOf(udp_socket_object, cleanup_watcher));
+	
+	udp_socket_detach(obj);
+	udp_socket_release(obj TSRMLS_CC);
+}
+
+FREE_STORAGE(udp_socket_object,
+
+	udp_socket_detach(obj);
+	
+	if(obj->fd >= 0)
+	{
+		close(obj->fd);
+	}
+	
+	if(obj->callback)
+	{
+		zval_ptr_dtor(&obj->callback);
+	}
+	
+	if(obj->buffers)
+	{
+		efree(obj->buffers);
+		efree(obj->recv_msgs);
+		efree(obj->recv_iovs);
+		efree(obj->recv_peers);
+		efree(obj->recv_controls);
+	}
+	
+	if(obj->send_msgs)
+	{
+		efree(obj->send_msgs);
+		efree(obj->send_iovs);
+		efree(obj->send_controls);
+	}
+)
+
+CREATE_HANDLER(udp_socket_object, udp_socket_object, udp_socket_object_free, udp_socket_object_handlers,
+	obj->fd          = -1;
+	obj->batch       = 64;
+	obj->buffer_size = 2048;
+	obj->max_queue   = 65536;
+#ifdef UDP_SEGMENT
+	obj->gso         = 1;
+#endif
+)
+
+
+/* Reads a boolean/integer option */
+static int udp_socket_option(zval *options, const char *name, long *value)
+{
+	zval **entry;
+	
+	if( ! options || zend_hash_find(Z_ARRVAL_P(options), name, strlen(name) + 1, (void **) &entry) != SUCCESS)
+	{
+		return 0;
+	}
+	
+	convert_to_long_ex(entry);
+	
+	*value = Z_LVAL_PP(entry);
+	
+	return 1;
+}
+
+/**
+ * Creates a UDP socket bound to $address, "address:port" or "[address]:port"
+ * with a numeric address, port 0 picks a free port.
+ * 
+ * Received datagrams are delivered in batches to the callback, a socket
+ * without callback only sends.
+ * 
+ * Callback signature: callback(UdpSocket $socket, array $datagrams), each
+ * datagram is array(string $payload, string $peer).
+ * 
+ * Options:
+ *  * "batch":       int, datagrams read per recvmmsg(), default 64, at most 1024
+ *  * "buffer_size": int, bytes per datagram, longer datagrams are truncated,
+ *                   default 2048
+ *  * "max_queue":   int, datagrams send() queues at most, default 65536
+ *  * "gro":         boolean, let the kernel coalesce received datagrams
+ *                   (UDP_GRO), needs 64 KiB buffers, default false
+ *  * "gso":         boolean, send equally sized datagrams to the same peer
+ *                   as one UDP_SEGMENT message, default true where available
+ *  * "reuseport":   boolean, set SO_REUSEPORT, default false
+ *  * "rcvbuf":      int, SO_RCVBUF
+ *  * "sndbuf":      int, SO_SNDBUF
+ * 
+ * @param  EventLoop
+ * @param  string
+ * @param  callback|null
+ * @param  array
+ */
+PHP_METHOD(UdpSocket, __construct)
+{
+	zval *zloop;
+	zval *zoptions = NULL;
+	char *address;
+	int address_len;
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	long value;
+	int on = 1;
+	int i;
+	udp_socket_object *obj = (udp_socket_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	dCALLBACK;
+	
+	PARSE_PARAMETERS(UdpSocket, "Os|za", &zloop, event_loop_ce, &address, &address_len, &callback, &zoptions);
+	
+	if(callback && Z_TYPE_P(callback) == IS_NULL)
+	{
+		callback = NULL;
+	}
+	
+	if(callback)
+	{
+		CHECK_CALLBACK;
+	}
+	
+	if( ! udp_socket_parse_address(address, address_len, &ss, &ss_len))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\UdpSocket: invalid address '%s'", address);
+		
+		return;
+	}
+	
+	if(udp_socket_option(zoptions, "batch", &value))
+	{
+		obj->batch = value < 1 ? 1 : (value > UDP_SOCKET_MAX_BATCH ? UDP_SOCKET_MAX_BATCH : (int) value);
+	}
+	
+	if(udp_socket_option(zoptions, "buffer_size", &value))
+	{
+		obj->buffer_size = value < 1 ? 1 : (value > UDP_SOCKET_MAX_PAYLOAD ? UDP_SOCKET_MAX_PAYLOAD : (size_t) value);
+	}
+	
+	if(udp_socket_option(zoptions, "max_queue", &value))
+	{
+		obj->max_queue = value < 1 ? 1 : value;
+	}
+
+#ifdef UDP_GRO
+	if(udp_socket_option(zoptions, "gro", &value))
+	{
+		obj->gro = value != 0;
+	}
+#endif
+
+#ifdef UDP_SEGMENT
+	if(udp_socket_option(zoptions, "gso", &value))
+	{
+		obj->gso = value != 0;
+	}
+#endif
+
+	obj->loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop;
+	
+	if( ! obj->loop)
+	{
+		zend_throw_exception(NULL, "libev\\UdpSocket: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if((obj->fd = udp_socket_open(ss.ss_family)) < 0)
+	{
+		obj->loop = NULL;
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\UdpSocket: socket() failed: %s", strerror(errno));
+		
+		return;
+	}
+
+#ifdef SO_REUSEPORT
+	if(udp_socket_option(zoptions, "reuseport", &value) && value)
+	{
+		setsockopt(obj->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	}
+#endif
+
+	if(udp_socket_option(zoptions, "rcvbuf", &value) && value > 0)
+	{
+		i = (int) value;
+		setsockopt(obj->fd, SOL_SOCKET, SO_RCVBUF, &i, sizeof(i));
+	}
+	
+	if(udp_socket_option(zoptions, "sndbuf", &value) && value > 0)
+	{
+		i = (int) value;
+		setsockopt(obj->fd, SOL_SOCKET, SO_SNDBUF, &i, sizeof(i));
+	}
+
+#ifdef UDP_GRO
+	/* Coalesced datagrams need room for up to 64 KiB */
+	if(obj->gro && setsockopt(obj->fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0)
+	{
+		obj->buffer_size = 65535;
+	}
+	else
+	{
+		obj->gro = 0;
+	}
+#endif
+
+	if(bind(obj->fd, (struct sockaddr *) &ss, ss_len) != 0)
+	{
+		close(obj->fd);
+		obj->fd   = -1;
+		obj->loop = NULL;
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\UdpSocket: bind() to '%s' failed: %s", address, strerror(errno));
+		
+		return;
+	}
+	
+	obj->send_msgs     = ecalloc(UDP_SOCKET_SEND_BATCH, sizeof(struct mmsghdr));
+	obj->send_iovs     = ecalloc(UDP_SOCKET_SEND_BATCH * UDP_SOCKET_GSO_SEGMENTS, sizeof(struct iovec));
+	obj->send_controls = ecalloc(UDP_SOCKET_SEND_BATCH, UDP_SOCKET_CONTROL_SIZE);
+	
+	ev_io_init(&obj->read_watcher, udp_socket_read_callback, obj->fd, EV_READ);
+	ev_io_init(&obj->write_watcher, udp_socket_write_callback, obj->fd, EV_WRITE);
+	
+	ev_cleanup_init(&obj->cleanup_watcher, udp_socket_cleanup_callback);
+	ev_cleanup_start(obj->loop, &obj->cleanup_watcher);
+	
+	if( ! callback)
+	{
+		return;
+	}
+	
+	zval_add_ref(&callback);
+	obj->callback = callback;
+	obj->fcc      = callback_fcc;
+	
+	obj->buffers       = safe_emalloc(obj->batch, obj->buffer_size, 0);
+	obj->recv_msgs     = ecalloc(obj->batch, sizeof(struct mmsghdr));
+	obj->recv_iovs     = ecalloc(obj->batch, sizeof(struct iovec));
+	obj->recv_peers    = ecalloc(obj->batch, sizeof(struct sockaddr_storage));
+	obj->recv_controls = ecalloc(obj->batch, UDP_SOCKET_CONTROL_SIZE);
+	
+	for(i = 0; i < obj->batch; i++)
+	{
+		obj->recv_iovs[i].iov_base = obj->buffers + i * obj->buffer_size;
+		obj->recv_iovs[i].iov_len  = obj->buffer_size;
+		
+		obj->recv_msgs[i].msg_hdr.msg_name   = obj->recv_peers + i;
+		obj->recv_msgs[i].msg_hdr.msg_iov    = obj->recv_iovs + i;
+		obj->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	ev_io_start(obj->loop, &obj->read_watcher);
+	
+	/* Independent reference to the object, held while reading */
+	MAKE_STD_ZVAL(obj->this);
+	*obj->this = *getThis();
+	zval_copy_ctor(obj->this);
+	INIT_PZVAL(obj->this);
+}
+
+/**
+ * Queues a datagram for $peer ("address:port" or "[address]:port"), the
+ * queue is written once the socket is writable.
+ * 
+ * @param  string
+ * @param  string
+ * @return boolean  false if the queue is full or the socket is closed
+ */
+PHP_METHOD(UdpSocket, send)
+{
+	char *payload;
+	int payload_len;
+	char *peer;
+	int peer_len;
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	udp_datagram *d;
+	udp_socket_object *obj = (udp_socket_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ss", &payload, &payload_len, &peer, &peer_len) != SUCCESS) {
+		return;
+	}
+	
+	if( ! udp_socket_parse_address(peer, peer_len, &ss, &ss_len))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC, "libev\\UdpSocket::send(): invalid peer '%s'", peer);
+		
+		return;
+	}
+	
+	if(payload_len > UDP_SOCKET_MAX_PAYLOAD)
+	{
+		zend_throw_exception(NULL, "libev\\UdpSocket::send(): payload exceeds 65507 bytes", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if( ! obj->loop || obj->queued >= obj->max_queue)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	d = emalloc(sizeof(udp_datagram) + payload_len);
+	
+	d->next     = NULL;
+	d->peer     = ss;
+	d->peer_len = ss_len;
+	d->len      = payload_len;
+	
+	memcpy(d->data, payload, payload_len);
+	
+	if(obj->tail)
+	{
+		obj->tail->next = d;
+	}
+	else
+	{
+		obj->head = d;
+		
+		ev_io_start(obj->loop, &obj->write_watcher);
+	}
+	
+	obj->tail = d;
+	obj->queued++;
+	
+	if( ! obj->this)
+	{
+		/* Independent reference to the object, held while sending */
+		MAKE_STD_ZVAL(obj->this);
+		*obj->this = *getThis();
+		zval_copy_ctor(obj->this);
+		INIT_PZVAL(obj->this);
+	}
+	
+	RETURN_BOOL(1);
+}
+
+/**
+ * Writes the queued datagrams right away, as far as the socket buffer allows.
+ * 
+ * @return int  Number of datagrams still queued
+ */
+PHP_METHOD(UdpSocket, flush)
+{
+	udp_socket_object *obj = (udp_socket_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(obj->loop && obj->head)
+	{
+		udp_socket_flush(obj);
+		
+		if( ! obj->head)
+		{
+			ev_io_stop(obj->loop, &obj->write_watcher);
+			
+			udp_socket_release_if_idle(obj TSRMLS_CC);
+		}
+	}
+	
+	RETURN_LONG(obj->queued);
+}
+
+/**
+ * Returns the address the socket is bound to, "address:port" or
+ * "[address]:port".
+ * 
+ * @return string
+ * @return false   if closed
+ */
+PHP_METHOD(UdpSocket, getLocalAddress)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	char buf[INET6_ADDRSTRLEN + 8];
+	udp_socket_object *obj = (udp_socket_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if(obj->fd < 0 || getsockname(obj->fd, (struct sockaddr *) &ss, &len) != 0)
+	{
+		RETURN_BOOL(0);
+	}
+	
+	RETURN_STRINGL(buf, udp_socket_format_address(&ss, buf, sizeof(buf)), 1);
+}
+
+/**
+ * Returns the number of datagrams waiting to be sent.
+ * 
+ * @return int
+ */
+PHP_METHOD(UdpSocket, getQueuedCount)
+{
+	udp_socket_object *obj = (udp_socket_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	RETURN_LONG(obj->queued);
+}
+
+/**
+ * Stops reading and closes the socket after a last attempt to write the
+ * queued datagrams, those which do not fit into the socket buffer are dropped.
+ * 
+ * @return void
+ */
+PHP_METHOD(UdpSocket, close)
+{
+	udp_socket_object *obj = (udp_socket_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	if( ! obj->loop)
+	{
+		return;
+	}
+	
+	udp_socket_flush(obj);
+	udp_socket_detach(obj);
+	udp_socket_release(obj TSRMLS_CC);
+}
+
+
+static const zend_function_entry udp_socket_methods[] = {
+	ZEND_ME(UdpSocket, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	ZEND_ME(UdpSocket, send, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(UdpSocket, flush, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(UdpSocket, getLocalAddress, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(UdpSocket, getQueuedCount, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(UdpSocket, close, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
@@ -0,0 +1,1228 @@
+
+/*
+ * Completion based IO using Linux io_uring.
+ * 
+ * Operations are queued on a ring owned by the Uring object, submitted in
+ * one batch by an ev_prepare watcher right before the EventLoop polls, and
+ * completed through a single eventfd registered with the ring and watched
+ * by an ev_io.
+ * 
+ * Kernel support is detected at runtime, Uring::isSupported() returns false
+ * if the kernel lacks io_uring or the required operations (Linux < 5.6).
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define uring_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define uring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Default number of submission queue entries */
+#define URING_DEFAULT_ENTRIES 256
+
+/* user_data of CQEs which do not belong to any uring_op (cancel requests) */
+#define URING_IGNORE_DATA 0
+
+/* Raw ring, no PHP dependencies */
+typedef struct uring_ring {
+	int   fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned sqe_tail;    /* Next SQE to fill, published to *sq_tail on submit */
+	unsigned sqe_head;    /* First SQE not yet handed to the kernel */
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void   *sq_ptr;
+	size_t sq_size;
+	void   *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+} uring_ring;
+
+/* Creates the ring, returns 0 on success or -errno */
+static int uring_ring_init(uring_ring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned i;
+	
+	memset(ring, 0, sizeof(uring_ring));
+	memset(&p, 0, sizeof(p));
+	
+	ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	
+	if(ring->fd < 0)
+	{
+		ring->fd = 0;
+		
+		return -errno;
+	}
+	
+	/* IORING_OP_READ, _RECV, _SEND, _ACCEPT and _CONNECT arrived together
+	   with the current-position reads in Linux 5.6 */
+	if( ! (p.features & IORING_FEAT_RW_CUR_POS))
+	{
+		close(ring->fd);
+		ring->fd = 0;
+		
+		return -ENOSYS;
+	}
+	
+	ring->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes   = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	
+	if(ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		int err = errno;
+		
+		if(ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+		if(ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_size);
+		if(ring->sqes != MAP_FAILED)   munmap(ring->sqes, ring->sqes_size);
+		
+		close(ring->fd);
+		memset(ring, 0, sizeof(uring_ring));
+		
+		return -err;
+	}
+	
+	ring->sq_head    = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail    = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask    = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array   = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head    = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail    = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask    = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes       = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+	
+	/* SQEs are always filled in order, so the index array is an identity map */
+	for(i = 0; i < p.sq_entries; i++)
+	{
+		ring->sq_array[i] = i;
+	}
+	
+	ring->sqe_tail = ring->sqe_head = *ring->sq_tail;
+	
+	return 0;
+}
+
+static void uring_ring_destroy(uring_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	
+	memset(ring, 0, sizeof(uring_ring));
+}
+
+/* Returns a zeroed SQE, or NULL if the submission queue is full */
+static struct io_uring_sqe *uring_ring_get_sqe(uring_ring *ring)
+{
+	struct io_uring_sqe *sqe;
+	
+	if(ring->sqe_tail - uring_load_acquire(ring->sq_head) >= ring->sq_entries)
+	{
+		return NULL;
+	}
+	
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sqe_tail++;
+	
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	
+	return sqe;
+}
+
+/* Hands all filled SQEs to the kernel, optionally waiting for wait_nr completions,
+   returns the number of submitted SQEs or -errno */
+static int uring_ring_submit(uring_ring *ring, unsigned wait_nr)
+{
+	unsigned to_submit = ring->sqe_tail - ring->sqe_head;
+	int ret;
+	
+	uring_store_release(ring->sq_tail, ring->sqe_tail);
+	
+	if( ! to_submit && ! wait_nr)
+	{
+		return 0;
+	}
+	
+	do
+	{
+		ret = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}
+	while(ret < 0 && errno == EINTR);
+	
+	if(ret < 0)
+	{
+		return -errno;
+	}
+	
+	ring->sqe_head += ret;
+	
+	return ret;
+}
+
+/* Copies the next CQE into *cqe and consumes it, returns 0 if the queue is empty */
+static int uring_ring_next_cqe(uring_ring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned head = *ring->cq_head;
+	
+	if(head == uring_load_acquire(ring->cq_tail))
+	{
+		return 0;
+	}
+	
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	
+	uring_store_release(ring->cq_head, head + 1);
+	
+	return 1;
+}
+
+
+typedef struct uring_op {
+	long   id;
+	int    opcode;
+	int    fd;
+	int    buf_index;     /* Registered buffer slot, -1 if buf is emalloc()ed */
+	int    multishot;
+	int    armed;         /* An SQE for the op is queued or owned by the kernel */
+	int    cancelled;
+	char   *buf;
+	size_t buflen;
+	zval   *callback;
+	zval   *zfd;          /* Keeps the stream/socket (and thus fd) alive */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct uring_op *next; /* Part of double-linked list of uring_object->ops */
+	struct uring_op *prev; /* Part of double-linked list of uring_object->ops */
+} uring_op;
+
+typedef struct uring_object {
+	zend_object       std;
+	zval              *this;            /* Reference keeping the object alive while ops are in flight */
+	struct ev_loop    *loop;          /* Not the EventLoop object, persistent loops outlive it */
+	uring_ring        ring;
+	int               event_fd;
+	ev_io             eventfd_watcher;
+	ev_prepare        submit_watcher;
+	ev_cleanup        cleanup_watcher;
+	long              next_id;
+	int               no_multishot;
+	char              *fixed_bufs;
+	size_t            fixed_size;
+	int               fixed_count;
+	int               *fixed_free;      /* Stack of free registered buffer slots */
+	int               fixed_free_count;
+	uring_op          *ops;             /* Head of the doubly-linked list of ops in flight */
+	zval              **gc_buffer;      /* Scratch space for the get_gc handler */
+	int               gc_buffer_size;
+} uring_object;
+
+zend_class_entry *uring_ce;
+
+zend_object_handlers uring_object_handlers;
+
+static void uring_op_free(uring_object *u, uring_op *op)
+{
+	if(op->buf_index >= 0)
+	{
+		u->fixed_free[u->fixed_free_count++] = op->buf_index;
+	}
+	else if(op->buf)
+	{
+		efree(op->buf);
+	}
+	
+	zval_ptr_dtor(&op->callback);
+	zval_ptr_dtor(&op->zfd);
+	
+	efree(op);
+}
+
+static void uring_op_unlink(uring_object *u, uring_op *op)
+{
+	if(op->prev)
+	{
+		op->prev->next = op->next;
+	}
+	else
+	{
+		u->ops = op->next;
+	}
+	
+	if(op->next)
+	{
+		op->next->prev = op->prev;
+	}
+	
+	op->next = NULL;
+	op->prev = NULL;
+}
+
+/* Takes a reference to object while ops are in flight */
+static void uring_retain(uring_object *u, zval *object)
+{
+	if( ! u->this)
+	{
+		MAKE_STD_ZVAL(u->this);
+		*u->this = *object;
+		zval_copy_ctor(u->this);
+		INIT_PZVAL(u->this);
+	}
+}
+
+/* Drops the self reference once nothing is in flight, the object might be freed */
+static void uring_release_if_idle(uring_object *u TSRMLS_DC)
+{
+	zval *self = u->this;
+	
+	if(self && ( ! u->loop || ! u->ops))
+	{
+		u->this = NULL;
+		
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Fills an SQE for op, submitting the queue first if it is full, returns 0 on failure */
+static int uring_op_prepare(uring_object *u, uring_op *op)
+{
+	struct io_uring_sqe *sqe = uring_ring_get_sqe(&u->ring);
+	
+	if( ! sqe)
+	{
+		uring_ring_submit(&u->ring, 0);
+		
+		sqe = uring_ring_get_sqe(&u->ring);
+		
+		if( ! sqe)
+		{
+			return 0;
+		}
+	}
+	
+	op->armed      = 1;
+	sqe->opcode    = (__u8) op->opcode;
+	sqe->fd        = op->fd;
+	sqe->user_data = (__u64)(size_t) op;
+	
+	switch(op->opcode)
+	{
+		case IORING_OP_READ_FIXED:
+			sqe->buf_index = (__u16) op->buf_index;
+			/* Fall through */
+		case IORING_OP_READ:
+			sqe->addr = (__u64)(size_t) op->buf;
+			sqe->len  = (__u32) op->buflen;
+			sqe->off  = (__u64) -1;
+			break;
+		
+		case IORING_OP_RECV:
+		case IORING_OP_SEND:
+			sqe->addr = (__u64)(size_t) op->buf;
+			sqe->len  = (__u32) op->buflen;
+			sqe->msg_flags = op->opcode == IORING_OP_SEND ? MSG_NOSIGNAL : 0;
+			break;
+		
+		case IORING_OP_ACCEPT:
+			sqe->accept_flags = SOCK_CLOEXEC;
+#ifdef IORING_ACCEPT_MULTISHOT
+			if(op->multishot)
+			{
+				sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+			}
+#endif
+			break;
+		
+		case IORING_OP_CONNECT:
+			sqe->addr = (__u64)(size_t) &op->addr;
+			sqe->off  = (__u64) op->addrlen;
+			break;
+	}
+	
+	return 1;
+}
+
+static void uring_submit_cb(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+	uring_object *u = (uring_object *)((char *)w - XtOffsetOf(uring_object, submit_watcher));
+	
+	/* -EBUSY/-EAGAIN means the kernel is short on resources, retry next iteration */
+	if(uring_ring_submit(&u->ring, 0) >= 0 || u->ring.sqe_tail == u->ring.sqe_head)
+	{
+		ev_prepare_stop(loop, w);
+	}
+}
+
+/* Registers op as in flight and makes sure the loop will submit and wait for it */
+static int uring_op_queue(uring_object *u, uring_op *op)
+{
+	if( ! uring_op_prepare(u, op))
+	{
+		return 0;
+	}
+	
+	op->prev = NULL;
+	op->next = u->ops;
+	
+	if(u->ops)
+	{
+		u->ops->prev = op;
+	}
+	
+	u->ops = op;
+	
+	ev_prepare_start(u->loop, &u->submit_watcher);
+	ev_io_start(u->loop, &u->eventfd_watcher);
+	
+	return 1;
+}
+
+/* Invokes the PHP callback of op with the result of a CQE */
+static void uring_op_invoke(uring_op *op, int res TSRMLS_DC)
+{
+	zval *args[2];
+	zval retval;
+	php_stream *stream;
+	
+	MAKE_STD_ZVAL(args[0]);
+	MAKE_STD_ZVAL(args[1]);
+	
+	ZVAL_LONG(args[1], res < 0 ? -res : 0);
+	
+	if(res < 0)
+	{
+		ZVAL_BOOL(args[0], 0);
+	}
+	else switch(op->opcode)
+	{
+		case IORING_OP_READ:
+		case IORING_OP_READ_FIXED:
+		case IORING_OP_RECV:
+			ZVAL_STRINGL(args[0], op->buf, res, 1);
+			break;
+		
+		case IORING_OP_ACCEPT:
+			stream = php_stream_sock_open_from_socket(res, NULL);
+			
+			if(stream)
+			{
+				php_stream_to_zval(stream, args[0]);
+			}
+			else
+			{
+				close(res);
+				ZVAL_BOOL(args[0], 0);
+			}
+			break;
+		
+		case IORING_OP_CONNECT:
+			ZVAL_BOOL(args[0], 1);
+			break;
+		
+		default:
+			ZVAL_LONG(args[0], res);
+	}
+	
+	if(call_user_function(EG(function_table), NULL, op->callback, &retval, 2, args TSRMLS_CC) == SUCCESS)
+	{
+		zval_dtor(&retval);
+	}
+	
+	zval_ptr_dtor(&args[0]);
+	zval_ptr_dtor(&args[1]);
+}
+
+/* Handles a single CQE, returns 1 if op is done and has been freed */
+static int uring_op_complete(uring_object *u, uring_op *op, int res, unsigned flags TSRMLS_DC)
+{
+	int more = 0;
+
+#ifdef IORING_CQE_F_MORE
+	more = (flags & IORING_CQE_F_MORE) != 0;
+#endif
+	
+	op->armed = more;
+	
+	if(op->opcode == IORING_OP_ACCEPT && op->multishot && ! more && res == -EINVAL && ! op->cancelled)
+	{
+		/* Kernel does not know multishot accept, fall back to re-arming */
+		IF_DEBUG(libev_printf("Uring: multishot accept unsupported, re-arming instead\n"));
+		u->no_multishot = 1;
+		op->multishot   = 0;
+		
+		if(uring_op_prepare(u, op))
+		{
+			ev_prepare_start(u->loop, &u->submit_watcher);
+			
+			return 0;
+		}
+	}
+	
+	if(res == -ECANCELED && op->cancelled)
+	{
+		/* Cancelled by the user, no need to notify */
+	}
+	else
+	{
+		uring_op_invoke(op, res TSRMLS_CC);
+	}
+	
+	/* Accept keeps on going until cancelled or failed */
+	if(op->opcode == IORING_OP_ACCEPT && res >= 0 && ! op->cancelled)
+	{
+		if(more || (u->loop && uring_op_prepare(u, op)))
+		{
+			if( ! more)
+			{
+				ev_prepare_start(u->loop, &u->submit_watcher);
+			}
+			
+			return 0;
+		}
+	}
+	else if(more)
+	{
+		/* Final CQE for a multishot op has not arrived yet */
+		return 0;
+	}
+	
+	uring_op_unlink(u, op);
+	uring_op_free(u, op);
+	
+	return 1;
+}
+
+static void uring_eventfd_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	uring_object *u = (uring_object *)((char *)w - XtOffsetOf(uring_object, eventfd_watcher));
+	struct io_uring_cqe cqe;
+	uint64_t count;
+	zval *self = u->this;
+	
+	LOOP_FETCH_TSRMLS(loop);
+	
+	/* Reset the doorbell before reaping, completions arriving after
+	   this point will ring it again */
+	while(read(u->event_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+	
+	/* Held while ops are in flight, the callbacks might release it */
+	if(self)
+	{
+		zval_add_ref(&self);
+	}
+	
+	while(u->loop && uring_ring_next_cqe(&u->ring, &cqe))
+	{
+		if(cqe.user_data == URING_IGNORE_DATA)
+		{
+			continue;
+		}
+		
+		uring_op_complete(u, (uring_op *)(size_t) cqe.user_data, cqe.res, cqe.flags TSRMLS_CC);
+	}
+	
+	if(u->loop && ! u->ops)
+	{
+		/* Nothing in flight, do not keep the loop running */
+		ev_io_stop(loop, w);
+	}
+	
+	uring_release_if_idle(u TSRMLS_CC);
+	
+	if(self)
+	{
+		zval_ptr_dtor(&self);
+	}
+}
+
+/* Cancels everything in flight and waits for the kernel to let go of the buffers,
+   no PHP callbacks are called. Leaves the Uring detached from its EventLoop. */
+static void uring_detach(uring_object *u)
+{
+	struct io_uring_cqe cqe;
+	struct io_uring_sqe *sqe;
+	uring_op *op;
+	uring_op *next;
+	int cancels = 0;   /* Cancel requests of the current round not completed yet */
+	
+	for(op = u->ops; op; op = op->next)
+	{
+		op->cancelled = 1;
+	}
+	
+	while(u->ops)
+	{
+		/* Every round cancels all ops still in flight: a cancel might not fit
+		   into a full submission queue, or reach an op which cannot be
+		   interrupted yet, waiting for it alone could block forever */
+		if(cancels <= 0)
+		{
+			cancels = 0;
+			
+			for(op = u->ops; op; op = next)
+			{
+				next = op->next;
+				
+				if( ! op->armed)
+				{
+					/* Not owned by the kernel, no completion will arrive */
+					uring_op_unlink(u, op);
+					uring_op_free(u, op);
+					
+					continue;
+				}
+				
+				if( ! (sqe = uring_ring_get_sqe(&u->ring)))
+				{
+					uring_ring_submit(&u->ring, 0);
+					
+					if( ! (sqe = uring_ring_get_sqe(&u->ring)))
+					{
+						break;
+					}
+				}
+				
+				sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+				sqe->fd        = -1;
+				sqe->addr      = (__u64)(size_t) op;
+				sqe->user_data = URING_IGNORE_DATA;
+				
+				cancels++;
+			}
+			
+			if( ! u->ops)
+			{
+				break;
+			}
+		}
+		
+		if(uring_ring_submit(&u->ring, 1) < 0)
+		{
+			break;
+		}
+		
+		while(uring_ring_next_cqe(&u->ring, &cqe))
+		{
+			if(cqe.user_data == URING_IGNORE_DATA)
+			{
+				cancels--;
+				
+				continue;
+			}
+			
+			op = (uring_op *)(size_t) cqe.user_data;
+			
+			if(op->opcode == IORING_OP_ACCEPT && cqe.res >= 0)
+			{
+				close(cqe.res);
+			}
+
+#ifdef IORING_CQE_F_MORE
+			if(cqe.flags & IORING_CQE_F_MORE)
+			{
+				continue;
+			}
+#endif
+			uring_op_unlink(u, op);
+			uring_op_free(u, op);
+		}
+	}
+	
+	if(u->loop)
+	{
+		ev_io_stop(u->loop, &u->eventfd_watcher);
+		ev_prepare_stop(u->loop, &u->submit_watcher);
+		ev_cleanup_stop(u->loop, &u->cleanup_watcher);
+		
+		u->loop = NULL;
+	}
+}
+
+/* The EventLoop is being destroyed, detach before the ev_loop disappears */
+static void uring_cleanup_cb(struct ev_loop *loop, ev_cleanup *w, int revents)
+{
+	uring_object *u = (uring_object *)((char *)w - XtOffsetOf(uring_object, cleanup_watcher));
+	
+	LOOP_FETCH_TSRMLS(loop);
+	
+	uring_detach(u);
+	uring_release_if_idle(u TSRMLS_CC);
+}
+
+FREE_STORAGE(uring_object,
+	
+	if(obj->ring.sqes)
+	{
+		uring_detach(obj);
+		
+		uring_ring_destroy(&obj->ring);
+		close(obj->event_fd);
+	}
+	
+	if(obj->fixed_bufs)
+	{
+		efree(obj->fixed_bufs);
+		efree(obj->fixed_free);
+	}
+	
+	if(obj->gc_buffer)
+	{
+		efree(obj->gc_buffer);
+	}
+	
+	obj->this = NULL;
+)
+
+CREATE_HANDLER(uring_object, uring_object, uring_object_free, uring_object_handlers, ;)
+
+#if PHP_VERSION_ID >= 50400
+/* Reports the callbacks of the ops in flight to the cycle collector */
+static HashTable *uring_object_get_gc(zval *object, zval ***table, int *n TSRMLS_DC)
+{
+	uring_object *u = (uring_object *)zend_object_store_get_object(object TSRMLS_CC);
+	uring_op *op;
+	int count = 0;
+	
+	for(op = u->ops; op; op = op->next)
+	{
+		if(count == u->gc_buffer_size)
+		{
+			u->gc_buffer_size = u->gc_buffer_size ? u->gc_buffer_size * 2 : 16;
+			u->gc_buffer      = safe_erealloc(u->gc_buffer, u->gc_buffer_size, sizeof(zval *), 0);
+		}
+		
+		u->gc_buffer[count++] = op->callback;
+	}
+	
+	*table = u->gc_buffer;
+	*n     = count;
+	
+	return zend_std_get_properties(object TSRMLS_CC);
+}
+#endif
+
+
+/* Common prologue of the operation methods, throws a plain Exception like the
+   rest of the extension does */
+#define URING_FETCH_ATTACHED(u, method)                                              \
+	u = (uring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);          \
+	if( ! u->loop)                                                                \
+	{                                                                                 \
+		zend_throw_exception(NULL, "libev\\Uring::" #method "(): Uring is not "      \
+			"attached to an EventLoop", 1 TSRMLS_CC);                                 \
+		return;                                                                       \
+	}
+
+/* Returns 1 if the host of "host:port" or "[host]:port" is a numeric address,
+   php_network_parse_network_address_with_port() would look up a name with
+   a blocking getaddrinfo() */
+static int uring_address_is_numeric(const char *address, int address_len)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct in6_addr addr;
+	const char *host = address;
+	const char *end;
+	int family = AF_INET;
+	
+	if(address_len > 0 && *address == '[')
+	{
+		host++;
+		end    = memchr(host, ']', address_len - 1);
+		family = AF_INET6;
+	}
+	else
+	{
+		end = memchr(host, ':', address_len);
+	}
+	
+	if( ! end || end - host >= (int) sizeof(buf))
+	{
+		return 0;
+	}
+	
+	memcpy(buf, host, end - host);
+	buf[end - host] = '\0';
+	
+	return inet_pton(family, buf, &addr) == 1;
+}
+
+static uring_op *uring_op_new(uring_object *u, int opcode, int fd, zval **zfd, zval *callback)
+{
+	uring_op *op = emalloc(sizeof(uring_op));
+	
+	memset(op, 0, sizeof(uring_op));
+	
+	op->id        = ++u->next_id;
+	op->opcode    = opcode;
+	op->fd        = fd;
+	op->buf_index = -1;
+	
+	zval_add_ref(&callback);
+	zval_add_ref(zfd);
+	
+	op->callback = callback;
+	op->zfd      = *zfd;
+	
+	return op;
+}
+
+#define URING_QUEUE_OR_THROW(u, op, method)                                          \
+	if( ! uring_op_queue(u, op))                                                      \
+	{                                                                                 \
+		uring_op_free(u, op);                                                         \
+		zend_throw_exception(NULL, "libev\\Uring::" #method "(): submission queue "  \
+			"is full", 1 TSRMLS_CC);                                                  \
+		return;                                                                       \
+	}                                                                                 \
+	uring_retain(u, getThis());                                                       \
+	RETURN_LONG(op->id);
+
+
+/**
+ * Returns true if the running kernel supports the operations used by Uring.
+ * 
+ * @return boolean
+ */
+PHP_METHOD(Uring, isSupported)
+{
+	static int supported = -1;
+	uring_ring ring;
+	
+	if(supported < 0)
+	{
+		supported = uring_ring_init(&ring, 1) == 0;
+		
+		if(supported)
+		{
+			uring_ring_destroy(&ring);
+		}
+	}
+	
+	RETURN_BOOL(supported);
+}
+
+/**
+ * Creates an io_uring which completes its operations through the supplied
+ * EventLoop.
+ * 
+ * @param  EventLoop
+ * @param  int  Number of submission queue entries, rounded up to a power of two
+ * @param  int  Number of registered (fixed) read buffers, 0 to disable
+ * @param  int  Size of each registered buffer, bytes
+ */
+PHP_METHOD(Uring, __construct)
+{
+	zval *zloop;
+	long entries = URING_DEFAULT_ENTRIES;
+	long fixed_count = 0;
+	long fixed_size = 65536;
+	int  ret, i;
+	struct iovec *iov;
+	uring_object *u = (uring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	PARSE_PARAMETERS(Uring, "O|lll", &zloop, event_loop_ce, &entries, &fixed_count, &fixed_size);
+	
+	assert( ! u->ring.sqes);
+	
+	if(entries < 1 || fixed_count < 0 || fixed_count > 1024 || fixed_size < 1)
+	{
+		zend_throw_exception(NULL, "libev\\Uring: invalid ring or buffer size", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	u->loop = ((event_loop_object *)zend_object_store_get_object(zloop TSRMLS_CC))->loop;
+	
+	if( ! u->loop)
+	{
+		zend_throw_exception(NULL, "libev\\Uring: EventLoop is not initialized", 1 TSRMLS_CC);
+		
+		return;
+	}
+	
+	if((ret = uring_ring_init(&u->ring, (unsigned) entries)) < 0)
+	{
+		u->loop = NULL;
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC,
+			"libev\\Uring: io_uring is not available: %s", strerror(-ret));
+		
+		return;
+	}
+	
+	u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	
+	if(u->event_fd < 0 ||
+		syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_EVENTFD, &u->event_fd, 1) < 0)
+	{
+		ret = errno;
+		
+		if(u->event_fd >= 0)
+		{
+			close(u->event_fd);
+		}
+		
+		uring_ring_destroy(&u->ring);
+		u->loop = NULL;
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC,
+			"libev\\Uring: failed to register eventfd: %s", strerror(ret));
+		
+		return;
+	}
+	
+	if(fixed_count)
+	{
+		u->fixed_size  = (size_t) fixed_size;
+		u->fixed_bufs  = safe_emalloc(fixed_count, fixed_size, 0);
+		u->fixed_free  = safe_emalloc(fixed_count, sizeof(int), 0);
+		iov            = safe_emalloc(fixed_count, sizeof(struct iovec), 0);
+		
+		for(i = 0; i < fixed_count; i++)
+		{
+			iov[i].iov_base = u->fixed_bufs + i * u->fixed_size;
+			iov[i].iov_len  = u->fixed_size;
+			
+			u->fixed_free[i] = i;
+		}
+		
+		/* Registering is an optimization, plain reads are used if it fails
+		   (eg. because of RLIMIT_MEMLOCK) */
+		if(syscall(__NR_io_uring_register, u->ring.fd, IORING_REGISTER_BUFFERS, iov, (unsigned) fixed_count) == 0)
+		{
+			u->fixed_count      = (int) fixed_count;
+			u->fixed_free_count = (int) fixed_count;
+		}
+		
+		efree(iov);
+	}
+	
+	ev_io_init(&u->eventfd_watcher, uring_eventfd_cb, u->event_fd, EV_READ);
+	ev_prepare_init(&u->submit_watcher, uring_submit_cb);
+	ev_cleanup_init(&u->cleanup_watcher, uring_cleanup_cb);
+	
+	ev_cleanup_start(u->loop, &u->cleanup_watcher);
+}
+
+/**
+ * Reads up to $length bytes from the current position of a stream, the
+ * callback receives the data (or false) and the errno.
+ * 
+ * Callback signature: callback(string|false $data, int $errno)
+ * 
+ * @param  resource  PHP stream or socket
+ * @param  int
+ * @param  callback
+ * @return int  operation id, usable with Uring::cancel()
+ */
+PHP_METHOD(Uring, read)
+{
+	dFILE_DESC;
+	dCALLBACK;
+	long len;
+	uring_op *op;
+	uring_object *u;
+	
+	URING_FETCH_ATTACHED(u, read);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Zlz", &fd, &len, &callback) != SUCCESS) {
+		return;
+	}
+	
+	EXTRACT_FILE_DESC(Uring, read);
+	
+	CHECK_CALLBACK;
+	
+	op = uring_op_new(u, IORING_OP_READ, (int) file_desc, fd, callback);
+	op->buflen = len > 0 ? (size_t) len : 0;
+	
+	if(u->fixed_free_count && op->buflen <= u->fixed_size)
+	{
+		op->opcode    = IORING_OP_READ_FIXED;
+		op->buf_index = u->fixed_free[--u->fixed_free_count];
+		op->buf       = u->fixed_bufs + op->buf_index * u->fixed_size;
+	}
+	else
+	{
+		op->buf = emalloc(op->buflen + 1);
+	}
+	
+	URING_QUEUE_OR_THROW(u, op, read);
+}
+
+/**
+ * Receives up to $length bytes from a socket.
+ * 
+ * Callback signature: callback(string|false $data, int $errno)
+ * 
+ * @param  resource  PHP stream or socket
+ * @param  int
+ * @param  callback
+ * @return int  operation id, usable with Uring::cancel()
+ */
+PHP_METHOD(Uring, recv)
+{
+	dFILE_DESC;
+	dCALLBACK;
+	long len;
+	uring_op *op;
+	uring_object *u;
+	
+	URING_FETCH_ATTACHED(u, recv);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Zlz", &fd, &len, &callback) != SUCCESS) {
+		return;
+	}
+	
+	EXTRACT_FILE_DESC(Uring, recv);
+	
+	CHECK_CALLBACK;
+	
+	op = uring_op_new(u, IORING_OP_RECV, (int) file_desc, fd, callback);
+	op->buflen = len > 0 ? (size_t) len : 0;
+	op->buf    = emalloc(op->buflen + 1);
+	
+	URING_QUEUE_OR_THROW(u, op, recv);
+}
+
+/**
+ * Sends data on a socket, the callback receives the number of bytes sent.
+ * 
+ * Callback signature: callback(int|false $sent, int $errno)
+ * 
+ * @param  resource  PHP stream or socket
+ * @param  string
+ * @param  callback
+ * @return int  operation id, usable with Uring::cancel()
+ */
+PHP_METHOD(Uring, send)
+{
+	dFILE_DESC;
+	dCALLBACK;
+	char *data;
+	int  data_len;
+	uring_op *op;
+	uring_object *u;
+	
+	URING_FETCH_ATTACHED(u, send);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Zsz", &fd, &data, &data_len, &callback) != SUCCESS) {
+		return;
+	}
+	
+	EXTRACT_FILE_DESC(Uring, send);
+	
+	CHECK_CALLBACK;
+	
+	op = uring_op_new(u, IORING_OP_SEND, (int) file_desc, fd, callback);
+	op->buflen = (size_t) data_len;
+	op->buf    = estrndup(data, data_len);
+	
+	URING_QUEUE_OR_THROW(u, op, send);
+}
+
+/**
+ * Accepts connections on a listening socket until cancelled, the callback
+ * is invoked with a PHP stream for each new connection. Uses multishot
+ * accept where the kernel supports it.
+ * 
+ * Callback signature: callback(resource|false $client, int $errno)
+ * 
+ * @param  resource  listening PHP stream or socket
+ * @param  callback
+ * @return int  operation id, usable with Uring::cancel()
+ */
+PHP_METHOD(Uring, accept)
+{
+	dFILE_DESC;
+	dCALLBACK;
+	uring_op *op;
+	uring_object *u;
+	
+	URING_FETCH_ATTACHED(u, accept);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Zz", &fd, &callback) != SUCCESS) {
+		return;
+	}
+	
+	EXTRACT_FILE_DESC(Uring, accept);
+	
+	CHECK_CALLBACK;
+	
+	op = uring_op_new(u, IORING_OP_ACCEPT, (int) file_desc, fd, callback);
+
+#ifdef IORING_ACCEPT_MULTISHOT
+	op->multishot = ! u->no_multishot;
+#endif
+	
+	URING_QUEUE_OR_THROW(u, op, accept);
+}
+
+/**
+ * Connects a socket to the numeric address "address:port" ("[address]:port"
+ * for IPv6), host names can be looked up with libev\Resolver first.
+ * 
+ * Callback signature: callback(boolean $connected, int $errno)
+ * 
+ * @param  resource  PHP socket
+ * @param  string
+ * @param  callback
+ * @return int  operation id, usable with Uring::cancel()
+ */
+PHP_METHOD(Uring, connect)
+{
+	dFILE_DESC;
+	dCALLBACK;
+	char *address;
+	int  address_len;
+	uring_op *op;
+	uring_object *u;
+	
+	URING_FETCH_ATTACHED(u, connect);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Zsz", &fd, &address, &address_len, &callback) != SUCCESS) {
+		return;
+	}
+	
+	EXTRACT_FILE_DESC(Uring, connect);
+	
+	CHECK_CALLBACK;
+	
+	if( ! uring_address_is_numeric(address, address_len))
+	{
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC,
+			"libev\\Uring::connect(): '%s' is not a numeric address, resolve host names with libev\\Resolver", address);
+		
+		return;
+	}
+	
+	op = uring_op_new(u, IORING_OP_CONNECT, (int) file_desc, fd, callback);
+	op->addrlen = sizeof(op->addr);
+	
+	if(php_network_parse_network_address_with_port(address, address_len,
+		(struct sockaddr *) &op->addr, &op->addrlen TSRMLS_CC) != SUCCESS)
+	{
+		uring_op_free(u, op);
+		
+		zend_throw_exception_ex(NULL, 1 TSRMLS_CC,
+			"libev\\Uring::connect(): invalid address '%s'", address);
+		
+		return;
+	}
+	
+	URING_QUEUE_OR_THROW(u, op, connect);
+}
+
+/**
+ * Cancels an operation, the callback will not be invoked for it unless the
+ * operation completed before the cancellation reached the kernel.
+ * 
+ * @param  int  operation id
+ * @return boolean  false if no operation with the id is in flight
+ */
+PHP_METHOD(Uring, cancel)
+{
+	long id;
+	uring_op *op;
+	uring_object *u;
+	struct io_uring_sqe *sqe;
+	
+	URING_FETCH_ATTACHED(u, cancel);
+	
+	if(zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &id) != SUCCESS) {
+		return;
+	}
+	
+	for(op = u->ops; op; op = op->next)
+	{
+		if(op->id == id && ! op->cancelled)
+		{
+			if( ! op->armed)
+			{
+				/* Its callback is running, just prevent re-arming */
+				op->cancelled = 1;
+				
+				RETURN_BOOL(1);
+			}
+			
+			if( ! (sqe = uring_ring_get_sqe(&u->ring)))
+			{
+				uring_ring_submit(&u->ring, 0);
+				
+				if( ! (sqe = uring_ring_get_sqe(&u->ring)))
+				{
+					RETURN_BOOL(0);
+				}
+			}
+			
+			op->cancelled  = 1;
+			sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+			sqe->fd        = -1;
+			sqe->addr      = (__u64)(size_t) op;
+			sqe->user_data = URING_IGNORE_DATA;
+			
+			ev_prepare_start(u->loop, &u->submit_watcher);
+			
+			RETURN_BOOL(1);
+		}
+	}
+	
+	RETURN_BOOL(0);
+}
+
+/**
+ * Returns the number of operations which have not completed yet.
+ * 
+ * @return int
+ */
+PHP_METHOD(Uring, getPendingCount)
+{
+	long count = 0;
+	uring_op *op;
+	uring_object *u = (uring_object *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	
+	for(op = u->ops; op; op = op->next)
+	{
+		count++;
+	}
+	
+	RETURN_LONG(count);
+}
+
+static const zend_function_entry uring_methods[] = {
+	ZEND_ME(Uring, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(Uring, isSupported, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	ZEND_ME(Uring, read, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Uring, recv, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Uring, send, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Uring, accept, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Uring, connect, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Uring, cancel, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Uring, getPendingCount, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
@@ -0,0 +1,432 @@
+
+/*
+ * Thread pool running blocking calls, like getaddrinfo(), off the loop thread.
+ * 
+ * The pool is shared by all loops of the process, threads are started on
+ * demand up to libev.worker_threads and live until module shutdown. Each
+ * user owns a worker_queue bound to its loop, finished jobs are appended to
+ * it and its ev_async wakes the loop, which then calls job->done.
+ * 
+ * All pool and queue state is protected by one mutex, jobs are expected to be
+ * few and slow compared to the locking.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+
+/* Upper limit for the libev.worker_threads setting */
+#define WORKER_MAX_THREADS 64
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	worker_job      *head;       /* Jobs waiting for a thread */
+	worker_job      *tail;
+	int             max_threads;
+	int             threads;     /* Number of started threads */
+	int             idle;        /* Threads waiting for jobs */
+	int             shutdown;
+	int             atfork;      /* pthread_atfork() handlers installed */
+	int             forked;      /* In a child process, see worker_pool_restart() */
+	pthread_t       thread[WORKER_MAX_THREADS];
+	worker_job      *running[WORKER_MAX_THREADS]; /* Job being worked on by thread[i] */
+} worker_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Hands a job which has been worked on to the loop of its queue, called with
+   the lock held */
+static void worker_job_finish(worker_job *job)
+{
+	worker_queue *q = job->queue;
+	
+	job->next = NULL;
+	
+	if(q->loop)
+	{
+		if(q->tail)
+		{
+			q->tail->next = job;
+		}
+		else
+		{
+			q->head = job;
+		}
+		
+		q->tail = job;
+		
+		/* Under the lock, the queue and its loop cannot be closed meanwhile */
+		ev_async_send(q->loop, &q->async);
+	}
+	else
+	{
+		/* Closed, we are the last user of the job and maybe of the queue */
+		job->free(job);
+		
+		if( ! --q->pending)
+		{
+			free(q);
+		}
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	int slot = (int) (intptr_t) arg;
+	worker_job *job;
+	
+	pthread_mutex_lock(&worker_pool.lock);
+	
+	for(;;)
+	{
+		while( ! worker_pool.head && ! worker_pool.shutdown)
+		{
+			worker_pool.idle++;
+			pthread_cond_wait(&worker_pool.cond, &worker_pool.lock);
+			worker_pool.idle--;
+		}
+		
+		if(worker_pool.shutdown)
+		{
+			break;
+		}
+		
+		job = worker_pool.head;
+		
+		if( ! (worker_pool.head = job->next))
+		{
+			worker_pool.tail = NULL;
+		}
+		
+		worker_pool.running[slot] = job;
+		
+		pthread_mutex_unlock(&worker_pool.lock);
+		
+		job->work(job);
+		
+		pthread_mutex_lock(&worker_pool.lock);
+		
+		worker_pool.running[slot] = NULL;
+		
+		worker_job_finish(job);
+	}
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+	
+	return NULL;
+}
+
+static void worker_atfork_prepare(void)
+{
+	pthread_mutex_lock(&worker_pool.lock);
+}
+
+static void worker_atfork_parent(void)
+{
+	pthread_mutex_unlock(&worker_pool.lock);
+}
+
+/* Only the forking thread exists in the child, which may only make
+   async-signal-safe calls here, so the pool is just marked for
+   worker_pool_restart() */
+static void worker_atfork_child(void)
+{
+	worker_pool.forked = 1;
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+}
+
+/* Starts another thread, called with the lock held */
+static void worker_start_thread(void)
+{
+	sigset_t all;
+	sigset_t old;
+	
+	if( ! worker_pool.atfork)
+	{
+		pthread_atfork(worker_atfork_prepare, worker_atfork_parent, worker_atfork_child);
+		
+		worker_pool.atfork = 1;
+	}
+	
+	/* Signals are left to the thread running the loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	
+	if(pthread_create(&worker_pool.thread[worker_pool.threads], NULL, worker_thread, (void *) (intptr_t) worker_pool.threads) == 0)
+	{
+		worker_pool.threads++;
+	}
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Called with the lock held on the first use of the pool in a child process.
+   The threads of the parent do not exist here, jobs they were working on are
+   done as interrupted instead of being run a second time while the parent
+   still runs them, queued jobs get new threads */
+static void worker_pool_restart(void)
+{
+	worker_job *job;
+	int i;
+	
+	worker_pool.forked = 0;
+	
+	pthread_cond_init(&worker_pool.cond, NULL);
+	
+	for(i = 0; i < worker_pool.threads; i++)
+	{
+		if((job = worker_pool.running[i]))
+		{
+			worker_pool.running[i] = NULL;
+			
+			job->interrupted = 1;
+			
+			worker_job_finish(job);
+		}
+	}
+	
+	worker_pool.threads = 0;
+	worker_pool.idle    = 0;
+	
+	for(job = worker_pool.head; job && worker_pool.threads < worker_pool.max_threads; job = job->next)
+	{
+		worker_start_thread();
+	}
+}
+
+/* Restarts the pool after a fork(), for EventLoop::notifyFork() so interrupted
+   jobs are done even if nothing is submitted in the child */
+static void worker_pool_notify_fork(void)
+{
+	pthread_mutex_lock(&worker_pool.lock);
+	
+	if(worker_pool.forked)
+	{
+		worker_pool_restart();
+	}
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+}
+
+/* Finished jobs are done on the loop thread */
+static void worker_queue_callback(struct ev_loop *loop, ev_async *w, int revents)
+{
+	LOOP_FETCH_TSRMLS(loop);
+	
+	worker_queue *q = (worker_queue *) w;
+	worker_job *job;
+	worker_job *next;
+	
+	pthread_mutex_lock(&worker_pool.lock);
+	
+	job = q->head;
+	q->head = NULL;
+	q->tail = NULL;
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+	
+	while(job)
+	{
+		next = job->next;
+		
+		pthread_mutex_lock(&worker_pool.lock);
+		
+		if( ! q->loop)
+		{
+			/* Closed by an earlier done, its owner might be gone. The jobs not
+			   done yet still count as pending, so q has not been freed */
+			job->free(job);
+			
+			if( ! --q->pending)
+			{
+				free(q);
+			}
+			
+			pthread_mutex_unlock(&worker_pool.lock);
+			
+			job = next;
+			
+			continue;
+		}
+		
+		if( ! --q->pending)
+		{
+			ev_async_stop(loop, &q->async);
+		}
+		
+		pthread_mutex_unlock(&worker_pool.lock);
+		
+		/* Might close the queue, see above */
+		job->done(job TSRMLS_CC);
+		
+		job = next;
+	}
+}
+
+/* Creates a queue delivering finished jobs to loop */
+static worker_queue *worker_queue_open(struct ev_loop *loop, void *data)
+{
+	worker_queue *q = calloc(1, sizeof(worker_queue));
+	
+	if( ! q)
+	{
+		return NULL;
+	}
+	
+	q->loop = loop;
+	q->data = data;
+	
+	ev_async_init(&q->async, worker_queue_callback);
+	
+	return q;
+}
+
+/* Closes the queue, must be called on the loop thread before the loop is
+   destroyed, jobs which have not been done are freed instead */
+static void worker_queue_close(worker_queue *q)
+{
+	worker_job *job;
+	worker_job **p;
+	
+	if( ! q)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&worker_pool.lock);
+	
+	if(worker_pool.forked)
+	{
+		worker_pool_restart();
+	}
+	
+	ev_async_stop(q->loop, &q->async);
+	
+	/* Jobs no thread has picked up yet */
+	for(p = &worker_pool.head, worker_pool.tail = NULL; *p; )
+	{
+		if((*p)->queue == q)
+		{
+			job = *p;
+			*p  = job->next;
+			
+			job->free(job);
+			q->pending--;
+		}
+		else
+		{
+			worker_pool.tail = *p;
+			p = &(*p)->next;
+		}
+	}
+	
+	while((job = q->head))
+	{
+		q->head = job->next;
+		
+		job->free(job);
+		q->pending--;
+	}
+	
+	q->loop = NULL;
+	
+	/* Otherwise freed by the thread finishing the last job */
+	if( ! q->pending)
+	{
+		free(q);
+	}
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+}
+
+/* Queues job for a worker thread, job->done is called on the loop of q when
+   it has finished, returns 0 if the pool has been shut down */
+static int worker_submit(worker_queue *q, worker_job *job)
+{
+	pthread_mutex_lock(&worker_pool.lock);
+	
+	if(worker_pool.forked)
+	{
+		worker_pool_restart();
+	}
+	
+	if(worker_pool.shutdown || ! q->loop)
+	{
+		pthread_mutex_unlock(&worker_pool.lock);
+		
+		return 0;
+	}
+	
+	job->queue       = q;
+	job->next        = NULL;
+	job->interrupted = 0;
+	
+	if(worker_pool.tail)
+	{
+		worker_pool.tail->next = job;
+	}
+	else
+	{
+		worker_pool.head = job;
+	}
+	
+	worker_pool.tail = job;
+	
+	if( ! q->pending++)
+	{
+		ev_async_start(q->loop, &q->async);
+	}
+	
+	if(worker_pool.idle)
+	{
+		pthread_cond_signal(&worker_pool.cond);
+	}
+	else if(worker_pool.threads < worker_pool.max_threads)
+	{
+		worker_start_thread();
+	}
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+	
+	return 1;
+}
+
+static void worker_pool_init(long max_threads)
+{
+	worker_pool.max_threads = max_threads < 1 ? 1 : (max_threads > WORKER_MAX_THREADS ? WORKER_MAX_THREADS : (int) max_threads);
+}
+
+/* Stops the threads, waiting for jobs currently being worked on */
+static void worker_pool_shutdown(void)
+{
+	worker_job *job;
+	int i;
+	
+	pthread_mutex_lock(&worker_pool.lock);
+	
+	worker_pool.shutdown = 1;
+	pthread_cond_broadcast(&worker_pool.cond);
+	
+	/* Threads of the parent, they do not exist in this process */
+	if(worker_pool.forked)
+	{
+		worker_pool.threads = 0;
+	}
+	
+	pthread_mutex_unlock(&worker_pool.lock);
+	
+	for(i = 0; i < worker_pool.threads; i++)
+	{
+		pthread_join(worker_pool.thread[i], NULL);
+	}
+	
+	worker_pool.threads = 0;
+	
+	while((job = worker_pool.head))
+	{
+		worker_pool.head = job->next;
+		
+		job->free(job);
+	}
+	
+	worker_pool.tail = NULL;
+}
@@ -0,0 +1,149 @@
+<?php
+/*
+ * Measures the cost of dispatching Event callbacks. Given the paths of several
+ * builds of the extension it runs itself once per build and compares them:
+ * 
+ *   php bench/dispatch.php [iterations] before/libev.so after/libev.so
+ * 
+ * Without builds it measures the loaded extension:
+ * 
+ *   php -d extension=modules/libev.so bench/dispatch.php [iterations]
+ */
+
+$iterations = isset($argv[1]) && ctype_digit($argv[1]) ? (int) $argv[1] : 1000000;
+$builds     = array_slice($argv, isset($argv[1]) && ctype_digit($argv[1]) ? 2 : 1);
+
+if( ! empty($builds))
+{
+	$results = array();
+	
+	foreach($builds as $build)
+	{
+		$output = array();
+		
+		exec(escapeshellarg(PHP_BINARY).' -d extension='.escapeshellarg($build).' '.
+			escapeshellarg(__FILE__).' '.$iterations, $output, $status);
+		
+		if($status !== 0)
+		{
+			fprintf(STDERR, "%s failed:\n%s\n", $build, implode("\n", $output));
+			
+			exit(1);
+		}
+		
+		foreach($output as $line)
+		{
+			if(preg_match('/^(.+?)\s+(\d+) calls\s+\S+ s\s+(\d+) calls\/s$/', $line, $m))
+			{
+				$results[trim($m[1])][$build] = (float) $m[3];
+			}
+		}
+	}
+	
+	printf("%-24s", '');
+	
+	foreach($builds as $i => $build)
+	{
+		printf(" %14s", "#$i calls/s");
+	}
+	
+	printf(" %8s\n", 'last/#0');
+	
+	foreach($results as $name => $rates)
+	{
+		printf("%-24s", $name);
+		
+		foreach($builds as $build)
+		{
+			printf(" %14.0f", isset($rates[$build]) ? $rates[$build] : 0);
+		}
+		
+		$first = reset($rates);
+		$last  = end($rates);
+		
+		printf(" %7.2fx\n", $first ? $last / $first : 0);
+	}
+	
+	foreach($builds as $i => $build)
+	{
+		printf("#%d: %s\n", $i, $build);
+	}
+	
+	exit(0);
+}
+
+if( ! extension_loaded('libev'))
+{
+	fprintf(STDERR, "libev is not loaded, pass the paths of the builds to compare\n");
+	
+	exit(1);
+}
+
+function report($name, $count, $start)
+{
+	$time = microtime(true) - $start;
+	
+	printf("%-24s %10d calls %8.3f s %10.0f calls/s\n", $name, $count, $time, $count / $time);
+}
+
+/* IdleEvent fires once per loop iteration: loop overhead + callback dispatch */
+$loop  = new libev\EventLoop();
+$count = 0;
+$idle  = new libev\IdleEvent(function($event) use(&$count, $iterations, $loop)
+{
+	if(++$count >= $iterations)
+	{
+		$loop->remove($event);
+	}
+});
+
+$loop->add($idle);
+
+$start = microtime(true);
+$loop->run();
+report('IdleEvent', $count, $start);
+
+/* Many timers expiring in the same iteration: dispatch without polling in between */
+$loop   = new libev\EventLoop();
+$count  = 0;
+$timers = array();
+$cb     = function($event) use(&$count) { $count++; };
+
+for($i = 0; $i < 10000; $i++)
+{
+	$timers[] = $t = new libev\TimerEvent($cb, 0);
+	$loop->add($t);
+}
+
+$start = microtime(true);
+$loop->run();
+report('TimerEvent (10000)', $count, $start);
+
+/* Event::invoke() bypasses libev, measures the PHP callback invocation only */
+$count = 0;
+$event = new libev\IdleEvent(function() use(&$count) { $count++; });
+
+$start = microtime(true);
+for($i = 0; $i < $iterations; $i++)
+{
+	$event->invoke();
+}
+report('Event::invoke()', $count, $start);
+
+/* Creating and freeing Event objects */
+$start = microtime(true);
+for($i = 0; $i < $iterations; $i++)
+{
+	$e = new libev\TimerEvent($cb, 1);
+}
+report('new TimerEvent', $iterations, $start);
+
+/* StatEvent::getAttr() array building */
+$stat = new libev\StatEvent($cb, __FILE__);
+
+$start = microtime(true);
+for($i = 0; $i < $iterations; $i++)
+{
+	$a = $stat->getAttr();
+}
+report('StatEvent::getAttr()', $iterations, $start);
@@ -8,8 +8,58 @@ if test "$PHP_LIBEV" != "no"; then
   
   PHP_ADD_INCLUDE(libev)
   
+  dnl io_uring completion IO, needs the Linux 5.6 operations in the headers
+  AC_CACHE_CHECK([for io_uring], ac_cv_libev_io_uring, [AC_COMPILE_IFELSE([AC_LANG_PROGRAM(
+    [#include <linux/io_uring.h>
+     #include <sys/syscall.h>],
+    [int op = IORING_OP_CONNECT; unsigned f = IORING_FEAT_RW_CUR_POS; long nr = __NR_io_uring_setup;])],
+    ac_cv_libev_io_uring=yes, ac_cv_libev_io_uring=no)])
+  if test "$ac_cv_libev_io_uring" = yes; then
+    AC_DEFINE(HAVE_IO_URING, 1, [io_uring with IORING_OP_CONNECT is available (Linux)])
+  fi
+  
+  dnl pidfd_open() lets ChildEvent watch a PID on any loop (Linux 5.4)
+  AC_CACHE_CHECK([for pidfd_open], ac_cv_libev_pidfd, [AC_COMPILE_IFELSE([AC_LANG_PROGRAM(
+    [#include <sys/syscall.h>
+     #include <sys/wait.h>],
+    [long nr = SYS_pidfd_open; int f = WEXITED;])],
+    ac_cv_libev_pidfd=yes, ac_cv_libev_pidfd=no)])
+  if test "$ac_cv_libev_pidfd" = yes; then
+    AC_DEFINE(HAVE_PIDFD, 1, [pidfd_open is available (Linux)])
+  fi
+  
+  dnl Process::spawn() option "cwd" (glibc 2.29)
+  AC_CHECK_FUNCS([posix_spawn_file_actions_addchdir_np])
+  
+  dnl libev\UdpSocket batches datagrams with these, falls back to recvmsg()/sendmsg()
+  AC_CHECK_FUNCS([recvmmsg sendmmsg])
+  
+  dnl libev\Pipe moves data kernel-side with splice(), falls back to read()/write()
+  AC_CHECK_FUNCS([splice])
+  
+  dnl libev\StatResult nanosecond timestamps and block counts
+  AC_CHECK_MEMBERS([struct stat.st_mtim, struct stat.st_blocks], [], [], [#include <sys/stat.h>])
+  
   AC_DEFINE([EV_H], "ev_custom.h", [Custom wrapper for ev.h])
   
+  dnl Report the kernel interfaces libev/ev.c will use, detected by libev.m4
+  libev_signalfd=no
+  if test "$ac_cv_func_signalfd" = yes && test "$ac_cv_header_sys_signalfd_h" = yes; then
+    libev_signalfd=yes
+  fi
+  libev_eventfd=no
+  if test "$ac_cv_func_eventfd" = yes; then
+    libev_eventfd=yes
+  fi
+  libev_inotify=no
+  if test "$ac_cv_func_inotify_init" = yes && test "$ac_cv_header_sys_inotify_h" = yes; then
+    libev_inotify=yes
+  fi
+  AC_MSG_NOTICE([libev signalfd: $libev_signalfd, eventfd: $libev_eventfd, inotify: $libev_inotify, io_uring: $ac_cv_libev_io_uring, pidfd: $ac_cv_libev_pidfd])
+  
+  dnl Worker threads of libev\Resolver
+  PHP_ADD_LIBRARY(pthread,, LIBEV_SHARED_LIBADD)
+  
   PHP_ADD_EXTENSION_DEP(libev, sockets, true)
   PHP_SUBST(LIBEV_SHARED_LIBADD)
   PHP_NEW_EXTENSION(libev, libev.c libev/ev.c, $ext_shared)
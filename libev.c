@@ -48,6 +48,7 @@
 #  undef NDEBUG
 #endif
 #include <assert.h>
+#include <math.h>
 
 #ifdef COMPILE_DL_LIBEV
 ZEND_GET_MODULE(libev)
@@ -59,6 +60,7 @@ zend_class_entry *event_ce,
 	*io_event_ce,
 	*timer_event_ce,
 	*periodic_event_ce,
+	*cron_event_ce,
 	*signal_event_ce,
 	*child_event_ce,
 	*stat_event_ce,
@@ -69,13 +71,21 @@ zend_class_entry *event_ce,
 
 
 zend_object_handlers event_object_handlers,
+	periodic_event_object_handlers,
+	async_event_object_handlers,
 	event_loop_object_handlers;
 
 
-/* The object containing ev_default_loop, managed by EventLoop::getDefaultLoop() */
-zval *default_event_loop_object = NULL;
+ZEND_DECLARE_MODULE_GLOBALS(libev)
 
-#define CREATE_HANDLER(name, objtype, free_cb, handlers_var, code) \
+#ifdef ZTS
+/* ev_default_loop is process-wide, only one thread at a time may use it */
+static MUTEX_T default_loop_mutex;
+static void ***default_loop_owner = NULL;
+#endif
+
+/* size is the number of bytes to allocate for objtype, to allow for trailing data */
+#define CREATE_HANDLER_SIZE(name, objtype, size, free_cb, handlers_var, code) \
 zend_object_value name##_create(zend_class_entry *type TSRMLS_DC)\
 {                                                                                                \
 	IF_DEBUG(libev_printf("Allocating " #objtype "..."));                                        \
@@ -83,8 +93,8 @@ zend_object_value name##_create(zend_class_entry *type TSRMLS_DC)\
 	zval *tmp;                                                                                   \
 	zend_object_value retval;                                                                    \
 	                                                                                             \
-	objtype *obj = emalloc(sizeof(objtype));                                                     \
-	memset(obj, 0, sizeof(objtype));                                                             \
+	objtype *obj = emalloc(size);                                                                \
+	memset(obj, 0, size);                                                                        \
 	obj->std.ce = type;                                                                          \
 	                                                                                             \
 	ALLOC_HASHTABLE(obj->std.properties);                                                        \
@@ -102,20 +112,27 @@ zend_object_value name##_create(zend_class_entry *type TSRMLS_DC)\
 }
 
 
-#define CREATE_EVENT_HANDLER(objtype, free_cb)                        \
-CREATE_HANDLER(objtype, event_object, free_cb, event_object_handlers, \
+#define CREATE_HANDLER(name, objtype, free_cb, handlers_var, code) \
+	CREATE_HANDLER_SIZE(name, objtype, sizeof(objtype), free_cb, handlers_var, code)
+
+/* The watcher is allocated directly after the event_object, one allocation per Event */
+#define CREATE_EVENT_HANDLER_EX(objtype, free_cb, handlers_var)       \
+CREATE_HANDLER_SIZE(objtype, event_object, sizeof(event_object) + sizeof(objtype), \
+	free_cb, handlers_var,                                            \
 {                                                                     \
-	obj->watcher = emalloc(sizeof(objtype));                          \
-	memset(obj->watcher, 0, sizeof(objtype));                         \
+	obj->watcher = (ev_watcher *)(obj + 1);                           \
 	obj->watcher->event = obj;                                        \
 })
 
+#define CREATE_EVENT_HANDLER(objtype, free_cb) \
+	CREATE_EVENT_HANDLER_EX(objtype, free_cb, event_object_handlers)
+
 #define FREE_STORAGE(objtype, code) \
 void objtype##_free(void *object TSRMLS_DC) \
 {                                                                                 \
 	IF_DEBUG(libev_printf("Freeing " #objtype "..."));                            \
 	                                                                              \
-	zval *events;                                                                 \
+	event_object *ev;                                                             \
 	objtype *obj = (objtype *) object;                                            \
 	                                                                              \
 	zend_hash_destroy(obj->std.properties);                                       \
@@ -132,15 +149,15 @@ void objtype##_free(void *object TSRMLS_DC) \
 	do {                                                                            \
 		if(obj->loop_obj)                                                           \
 		{                                                                           \
-			IF_DEBUG(php_printf(" WARNING freeing 0x%lx; active: %d, pending: %d,"  \
-				" refcount: %d with evloop link ",                                  \
-				(size_t) obj->this, event_is_active(obj), event_is_pending(obj),    \
-					Z_REFCOUNT_P(obj->this)));                                      \
-			/* TODO: Stacktrace PHP, and see why obj->this is getting freed despite \
-			         being attached to an EventLoop (refcount != 0),                \
-			         so force-remove it from the evloop for now */                  \
+			IF_DEBUG(php_printf(" freeing 0x%lx; active: %d, pending: %d"           \
+				" with evloop link ",                                               \
+				(size_t) obj->this, event_is_active(obj), event_is_pending(obj)));  \
+			/* Happens with EventLoop::RETAIN_WEAK, when the object store is        \
+			   destroyed at shutdown, or when the cycle collector frees the Event   \
+			   before its EventLoop. obj->this is (being) freed already, so only    \
+			   unlink without releasing it */                                       \
 			EVENT_STOP(obj);                                                        \
-			EVENT_LOOP_REF_DEL(obj);                                                \
+			EVENT_LOOP_UNLINK(obj);                                                 \
 		}                                                                           \
 		                                                                            \
 		/* Callback might be undefined if there has been an error in constructor */ \
@@ -149,8 +166,12 @@ void objtype##_free(void *object TSRMLS_DC) \
 			zval_ptr_dtor(&obj->callback);                                          \
 		}                                                                           \
 		                                                                            \
-		efree(obj->watcher);                                                        \
-		/* No need to free obj->this, it is already done */                         \
+		if(obj->data)                                                               \
+		{                                                                           \
+			zval_ptr_dtor(&obj->data);                                              \
+		}                                                                           \
+		                                                                            \
+		/* obj->watcher is part of obj, no need to free obj->this, it is already done */ \
 		IF_DEBUG(php_printf(" freed event 0x%lx ", (size_t) obj->this));            \
 		                                                                            \
 		obj->this = NULL;                                                           \
@@ -162,26 +183,114 @@ FREE_STORAGE(event_object,
 	FREE_EVENT;
 )
 
+typedef event_object periodic_event_object;
+
+FREE_STORAGE(periodic_event_object,
+	
+	FREE_EVENT;
+	
+	/* After FREE_EVENT, the watcher is stopped */
+	if(((periodic_watcher *)obj->watcher)->reschedule)
+	{
+		zval_ptr_dtor(&((periodic_watcher *)obj->watcher)->reschedule);
+	}
+)
+
+typedef event_object child_event_object;
+
+FREE_STORAGE(child_event_object,
+	
+	FREE_EVENT;
+	
+#if HAVE_PIDFD
+	if(event_child_watcher(obj)->pidfd >= 0)
+	{
+		child_pidfd_close(event_child_watcher(obj)->pidfd);
+	}
+#endif
+)
+
+typedef event_object cron_event_object;
+
+FREE_STORAGE(cron_event_object,
+	
+	FREE_EVENT;
+	
+	if(((cron_watcher *)obj->watcher)->expression)
+	{
+		efree(((cron_watcher *)obj->watcher)->expression);
+	}
+)
+
+typedef event_object async_event_object;
+
+FREE_STORAGE(async_event_object,
+	
+	/* Release payloads which were never delivered */
+	async_watcher *w = (async_watcher *)obj->watcher;
+	
+	if(w->queue)
+	{
+		while(w->count)
+		{
+			zval_ptr_dtor(&w->queue[w->head]);
+			
+			w->head = (w->head + 1) % w->capacity;
+			w->count--;
+		}
+		
+		efree(w->queue);
+	}
+	
+	if(w->gc_buffer)
+	{
+		efree(w->gc_buffer);
+	}
+	
+	FREE_EVENT;
+)
+
 typedef event_object stat_event_object;
 
 FREE_STORAGE(stat_event_object,
 	
 	/* ev_stat has a pointer to a PHP allocated string, free it,
 	   constructor might have failed, so check */
-	if(((ev_stat *)obj->watcher)->path)
+	if(event_stat_watcher(obj)->stat.path)
 	{
-		efree((char *)((ev_stat *)obj->watcher)->path);
+		efree((char *)event_stat_watcher(obj)->stat.path);
 	}
 	
 	FREE_EVENT;
 )
 
 
+static void loop_timers_free(event_loop_object *obj TSRMLS_DC);
+static void dir_inotify_loop_freed(event_loop_object *obj);
+
 FREE_STORAGE(event_loop_object,
+	/* Timers of EventLoop::setTimeout() and friends are not visible to PHP, so no
+	   need to keep them until the Events are freed */
+	loop_timers_free(obj TSRMLS_CC);
+	
+	/* DirectoryWatchers keep using the inotify descriptor of a persistent loop */
+	dir_inotify_loop_freed(obj);
+	
 	/* We destroy the loop first, so the cleanup is called before the Event objects are
 	   (maybe) deallocated */
-	if(obj->loop) /* Loop might be half-initialized, can be caused by exception cast by
-	                 EventLoop::__construct */
+	if(obj->persistent)
+	{
+		/* The ev_loop lives on for the next request, detach all our events from it,
+		   CleanupEvents are not invoked as the loop is not destroyed */
+		IF_DEBUG(php_printf(" detaching persistent loop "));
+		
+		for(ev = obj->events; ev; ev = ev->next)
+		{
+			EVENT_STOP(ev);
+		}
+	}
+	else if(obj->loop) /* Loop might be half-initialized, can be caused by exception cast by
+	                      EventLoop::__construct */
 	{
 		/* If it is the default loop, we need to free its "singleton-zval" as we
 		   already are in the shutdown phase (so no risk of freeing the default
@@ -190,30 +299,47 @@ FREE_STORAGE(event_loop_object,
 		   all objects) */
 		if(ev_is_default_loop(obj->loop))
 		{
-			assert(default_event_loop_object);
-			assert(Z_REFCOUNT_P(default_event_loop_object) == 1);
+			assert(LIBEV_G(default_event_loop_object));
+			assert(Z_REFCOUNT_P(LIBEV_G(default_event_loop_object)) == 1);
 			
 			IF_DEBUG(php_printf(" freeing default loop "));
 			
-			zval_ptr_dtor(&default_event_loop_object);
+			zval_ptr_dtor(&LIBEV_G(default_event_loop_object));
+			
+#if HAVE_PIDFD
+			child_pidfd_reaper_stop(obj->loop);
+#endif
+			
+			ev_loop_destroy(obj->loop);
+			
+#ifdef ZTS
+			/* Allow another thread to claim the default loop */
+			tsrm_mutex_lock(default_loop_mutex);
+			default_loop_owner = NULL;
+			tsrm_mutex_unlock(default_loop_mutex);
+#endif
+		}
+		else
+		{
+			ev_loop_destroy(obj->loop);
 		}
-		
-		ev_loop_destroy(obj->loop);
 	}
 	
 	if(obj->events)
 	{
 		/* Stop and free all in the linked list */
-		event_object *ev = obj->events;
 		event_object *tmp;
 		
+		ev = obj->events;
+		
 		while(ev)
 		{
 			IF_DEBUG(libev_printf("Freeing event 0x%lx from loop\n", (size_t) ev->this));
 			assert(ev->this);
 			assert(ev->loop_obj);
 			
-			/* No need to stop the event, already done in ev_loop_destroy */
+			/* No need to stop the event, already done in ev_loop_destroy
+			   or when detaching from a persistent loop above */
 			
 			tmp = ev->next;
 			
@@ -222,37 +348,151 @@ FREE_STORAGE(event_loop_object,
 			ev->prev     = NULL;
 			ev->loop_obj = NULL;
 			
-			EVENT_DTOR(ev);
+			if(LOOP_RETAINS(obj))
+			{
+				EVENT_DTOR(ev);
+			}
 			
 			ev = tmp;
 		}
 	}
+	
+	if(obj->gc_buffer)
+	{
+		efree(obj->gc_buffer);
+	}
 )
 
+#if PHP_VERSION_ID >= 50400
+/* Reports the callback and data to the cycle collector, closures capturing the
+   Event or its EventLoop would otherwise create cycles which are never freed */
+static HashTable *event_object_get_gc(zval *object, zval ***table, int *n TSRMLS_DC)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(object TSRMLS_CC);
+	
+	/* callback and data, the collector skips NULL entries */
+	*table = &obj->callback;
+	*n     = 2;
+	
+	return zend_std_get_properties(object TSRMLS_CC);
+}
+
+/* Like event_object_get_gc(), also reporting the reschedule callback */
+static HashTable *periodic_event_object_get_gc(zval *object, zval ***table, int *n TSRMLS_DC)
+{
+	event_object *obj   = (event_object *)zend_object_store_get_object(object TSRMLS_CC);
+	periodic_watcher *w = (periodic_watcher *)obj->watcher;
+	
+	w->gc_table[0] = obj->callback;
+	w->gc_table[1] = obj->data;
+	w->gc_table[2] = w->reschedule;
+	
+	*table = w->gc_table;
+	*n     = 3;
+	
+	return zend_std_get_properties(object TSRMLS_CC);
+}
+
+/* Like event_object_get_gc(), also reporting the payloads queued by
+   AsyncEvent::push() */
+static HashTable *async_event_object_get_gc(zval *object, zval ***table, int *n TSRMLS_DC)
+{
+	event_object *obj = (event_object *)zend_object_store_get_object(object TSRMLS_CC);
+	async_watcher *w  = (async_watcher *)obj->watcher;
+	unsigned int i;
+	
+	if( ! w->gc_buffer)
+	{
+		w->gc_buffer = safe_emalloc(w->capacity, sizeof(zval *), 2 * sizeof(zval *));
+	}
+	
+	w->gc_buffer[0] = obj->callback;
+	w->gc_buffer[1] = obj->data;
+	
+	for(i = 0; i < w->count; i++)
+	{
+		w->gc_buffer[i + 2] = w->queue[(w->head + i) % w->capacity];
+	}
+	
+	*table = w->gc_buffer;
+	*n     = (int) w->count + 2;
+	
+	return zend_std_get_properties(object TSRMLS_CC);
+}
+
+/* Reports the references the loop holds on its Events (see EVENT_INCREF) to the
+   cycle collector */
+static HashTable *event_loop_object_get_gc(zval *object, zval ***table, int *n TSRMLS_DC)
+{
+	event_loop_object *obj = (event_loop_object *)zend_object_store_get_object(object TSRMLS_CC);
+	event_object *ev;
+	loop_timer *t;
+	int i;
+	int count = 0;
+	
+#  define GC_BUFFER_ADD(zv)                                                                   \
+	if(count == obj->gc_buffer_size)                                                          \
+	{                                                                                         \
+		obj->gc_buffer_size = obj->gc_buffer_size ? obj->gc_buffer_size * 2 : 16;             \
+		obj->gc_buffer      = safe_erealloc(obj->gc_buffer, obj->gc_buffer_size, sizeof(zval *), 0); \
+	}                                                                                         \
+	obj->gc_buffer[count++] = zv;
+	
+	for(ev = obj->events; ev && LOOP_RETAINS(obj); ev = ev->next)
+	{
+		GC_BUFFER_ADD(ev->this);
+	}
+	
+	/* Callbacks of EventLoop::setTimeout() and friends */
+	for(i = 0; i < obj->timer_slab_count * LOOP_TIMER_SLAB_SIZE; i++)
+	{
+		t = &obj->timer_slabs[i / LOOP_TIMER_SLAB_SIZE][i % LOOP_TIMER_SLAB_SIZE];
+		
+		if(t->callback)
+		{
+			GC_BUFFER_ADD(t->callback);
+		}
+	}
+#  undef GC_BUFFER_ADD
+	
+	*table = obj->gc_buffer;
+	*n     = count;
+	
+	return zend_std_get_properties(object TSRMLS_CC);
+}
+#endif
+
 CREATE_EVENT_HANDLER(ev_watcher, event_object_free)
 CREATE_EVENT_HANDLER(ev_io, event_object_free)
-CREATE_EVENT_HANDLER(ev_timer, event_object_free)
-CREATE_EVENT_HANDLER(ev_periodic, event_object_free)
+CREATE_EVENT_HANDLER(timer_watcher, event_object_free)
+CREATE_EVENT_HANDLER_EX(periodic_watcher, periodic_event_object_free, periodic_event_object_handlers)
+CREATE_EVENT_HANDLER(cron_watcher, cron_event_object_free)
 CREATE_EVENT_HANDLER(ev_signal, event_object_free)
-CREATE_EVENT_HANDLER(ev_child, event_object_free)
-CREATE_EVENT_HANDLER(ev_stat, stat_event_object_free)
+CREATE_EVENT_HANDLER(child_watcher, child_event_object_free)
+CREATE_EVENT_HANDLER(stat_watcher, stat_event_object_free)
 CREATE_EVENT_HANDLER(ev_idle, event_object_free)
 CREATE_EVENT_HANDLER(ev_cleanup, event_object_free)
-CREATE_EVENT_HANDLER(ev_async, event_object_free)
-CREATE_HANDLER(event_loop_object, event_loop_object, event_loop_object_free, event_loop_object_handlers, ;)
+CREATE_EVENT_HANDLER_EX(async_watcher, async_event_object_free, async_event_object_handlers)
+CREATE_HANDLER(event_loop_object, event_loop_object, event_loop_object_free, event_loop_object_handlers,
+	obj->retain = LOOP_RETAIN_DEFAULT;
+)
 
-/**
- * Generic event callback which will call the associated PHP callback.
- */
-static void event_callback(struct ev_loop *loop, ev_watcher *w, int revents)
+/* Calls the PHP callback of w->event with ($event, $revents), followed by the
+   optional payloads and the event data if set */
+static void event_callback_ex(struct ev_loop *loop, ev_watcher *w, int revents, zval *payloads)
 {
 	/* Note: loop might be null pointer because of Event::invoke() */
 	IF_DEBUG(libev_printf("Calling PHP callback\n"));
 	
-	TSRMLS_FETCH();
+	LOOP_FETCH_TSRMLS(loop);
 	
-	zval retval;
-	zval *args[2];
+	zval *retval = NULL;
+	zval *args[4];
+	zval **params[4] = { &args[0], &args[1], &args[2], &args[3] };
+	int argc = 2;
+	/* The callback might remove the event from the loop, the loop itself is kept
+	   alive by the running EventLoop::run*() */
+	event_loop_object *loop_obj = loop ? w->event->loop_obj : NULL;
 	
 	assert(w->event);
 	
@@ -264,11 +504,25 @@ static void event_callback(struct ev_loop *loop, ev_watcher *w, int revents)
 	MAKE_STD_ZVAL(args[1]);
 	ZVAL_LONG(args[1], revents);
 	
+	if(payloads)
+	{
+		args[argc++] = payloads;
+	}
+	
+	if(w->event->data)
+	{
+		args[argc++] = w->event->data;
+	}
+	
 	assert(w->event->callback);
 	
-	if(call_user_function(EG(function_table), NULL, w->event->callback, &retval, 2, args TSRMLS_CC) == SUCCESS)
+	/* Use the callback resolved by the constructor instead of looking it up for
+	   every call as call_user_function() does */
+	libev_call_function(w->event->callback, &w->event->fcc, argc, params, &retval TSRMLS_CC);
+	
+	if(retval)
 	{
-		zval_dtor(&retval);
+		zval_ptr_dtor(&retval);
 	}
 	
 	if(loop && event_has_loop(w->event) && ! ev_is_active(w) && ! ev_is_pending(w) )
@@ -276,17 +530,134 @@ static void event_callback(struct ev_loop *loop, ev_watcher *w, int revents)
 		EVENT_LOOP_REF_DEL(w->event);
 	}
 	
+	/* EventLoop::runFor() callback budget, the current iteration is completed */
+	if(loop_obj && ++loop_obj->run_dispatched == loop_obj->run_budget)
+	{
+		ev_break(loop, EVBREAK_ONE);
+	}
+	
 	zval_ptr_dtor(&args[0]);
 	zval_ptr_dtor(&args[1]);
 }
 
+static void event_callback(struct ev_loop *loop, ev_watcher *w, int revents)
+{
+	event_callback_ex(loop, w, revents, NULL);
+}
+
+/* Sets the relative timeout of the stopped timer tw to expire at deadline, moved
+   forward to the next multiple of the largest power of two not above its slack,
+   timers with similar slack then share deadlines and fire in the same loop
+   iteration instead of each causing a wakeup */
+static void timer_slack_align(struct ev_loop *loop, timer_watcher *tw, ev_tstamp deadline)
+{
+	ev_tstamp now = ev_now(loop);
+	ev_tstamp granularity;
+	int exp;
+	
+	/* Kept without slack too, setSlack() might be called while it runs */
+	tw->deadline = deadline;
+	
+	if(tw->slack <= 0.)
+	{
+		return;
+	}
+	
+	frexp(tw->slack, &exp);
+	granularity = ldexp(1., exp - 1);
+	
+	ev_timer_set(&tw->timer, ceil(deadline / granularity) * granularity - now, tw->timer.repeat);
+}
+
+/* TimerEvent callback, re-aligns repeating timers with slack before calling PHP,
+   the next deadline follows the unaligned previous one so the interval does not
+   drift */
+static void timer_event_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	timer_watcher *tw = (timer_watcher *) w;
+	ev_tstamp deadline;
+	
+	if(ev_is_active(w))
+	{
+		/* Like libev, a timer which fell behind continues from now */
+		deadline = tw->deadline + w->repeat;
+		deadline = deadline < ev_now(loop) ? ev_now(loop) : deadline;
+		
+		if(tw->slack > 0.)
+		{
+			ev_timer_stop(loop, w);
+			timer_slack_align(loop, tw, deadline);
+			ev_timer_start(loop, w);
+		}
+		else
+		{
+			tw->deadline = deadline;
+		}
+	}
+	
+	event_callback_ex(loop, (ev_watcher *) w, revents, NULL);
+}
+
+/* AsyncEvent callback, passes all payloads queued since the last wakeup as
+   an array in the third parameter */
+static void async_event_callback(struct ev_loop *loop, ev_async *w, int revents)
+{
+	async_watcher *aw = (async_watcher *) w;
+	zval *payloads;
+	
+	MAKE_STD_ZVAL(payloads);
+	array_init_size(payloads, aw->count);
+	
+	/* Drain all before calling, payloads pushed by the callback are delivered
+	   on the next wakeup */
+	while(aw->count)
+	{
+		add_next_index_zval(payloads, aw->queue[aw->head]);
+		
+		aw->head = (aw->head + 1) % aw->capacity;
+		aw->count--;
+	}
+	
+	event_callback_ex(loop, (ev_watcher *) w, revents, payloads);
+	
+	zval_ptr_dtor(&payloads);
+}
+
+#include "Worker.c"
+#include "StatResult.c"
 #include "Events.c"
+#include "Cron.c"
 #include "EventLoop.c"
 
 #if INCLUDE_EIO
 #  include "EIO.c"
 #endif
 
+#if HAVE_IO_URING
+#  include "Uring.c"
+#endif
+
+#include "Process.c"
+#include "Resolver.c"
+#include "Connector.c"
+#include "UdpSocket.c"
+#include "Pipe.c"
+#include "FdChannel.c"
+#include "SharedRing.c"
+
+#ifdef ZTS
+#  include "Thread.c"
+#endif
+
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT
+#  include "DirectoryWatcher.c"
+#else
+static void dir_inotify_loop_freed(event_loop_object *obj)
+{
+	/* Without inotify no DirectoryWatcher */
+}
+#endif
+
 
 static const zend_function_entry event_methods[] = {
 	/* Abstract __construct makes the class abstract */
@@ -294,6 +665,8 @@ static const zend_function_entry event_methods[] = {
 	ZEND_ME(Event, isActive, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(Event, isPending, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(Event, setCallback, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Event, setData, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(Event, getData, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(Event, invoke, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(Event, stop, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(Event, clearPending, NULL, ZEND_ACC_PUBLIC)
@@ -302,40 +675,60 @@ static const zend_function_entry event_methods[] = {
 
 static const zend_function_entry io_event_methods[] = {
 	ZEND_ME(IOEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(IOEvent, set, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(IOEvent, modify, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(IOEvent, getEvents, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
 static const zend_function_entry timer_event_methods[] = {
 	ZEND_ME(TimerEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(TimerEvent, set, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(TimerEvent, getRepeat, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(TimerEvent, setRepeat, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(TimerEvent, getAfter, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(TimerEvent, again, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(TimerEvent, getRemaining, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(TimerEvent, setSlack, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(TimerEvent, getSlack, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
 static const zend_function_entry periodic_event_methods[] = {
 	ZEND_ME(PeriodicEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(PeriodicEvent, set, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(PeriodicEvent, getTime, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(PeriodicEvent, getOffset, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(PeriodicEvent, setOffset, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(PeriodicEvent, getInterval, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(PeriodicEvent, setInterval, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(PeriodicEvent, again, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(PeriodicEvent, setRescheduleCallback, NULL, ZEND_ACC_PUBLIC)
+	{NULL, NULL, NULL}
+};
+
+static const zend_function_entry cron_event_methods[] = {
+	ZEND_ME(CronEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(CronEvent, getExpression, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(CronEvent, getTime, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(CronEvent, getNextTime, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
 static const zend_function_entry signal_event_methods[] = {
 	ZEND_ME(SignalEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(SignalEvent, set, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(SignalEvent, getSignal, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
 static const zend_function_entry child_event_methods[] = {
 	ZEND_ME(ChildEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
+	ZEND_ME(ChildEvent, set, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(ChildEvent, getPid, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(ChildEvent, getRPid, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(ChildEvent, getRStatus, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(ChildEvent, usesPidfd, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
@@ -345,6 +738,10 @@ static const zend_function_entry stat_event_methods[] = {
 	ZEND_ME(StatEvent, getInterval, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(StatEvent, getAttr, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(StatEvent, getPrev, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatEvent, getStat, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatEvent, getPrevStat, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatEvent, changedFields, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(StatEvent, isThreaded, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
@@ -361,12 +758,19 @@ static const zend_function_entry cleanup_event_methods[] = {
 static const zend_function_entry async_event_methods[] = {
 	ZEND_ME(AsyncEvent, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
 	ZEND_ME(AsyncEvent, send, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(AsyncEvent, push, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(AsyncEvent, getQueuedCount, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(AsyncEvent, getDroppedCount, NULL, ZEND_ACC_PUBLIC)
 	{NULL, NULL, NULL}
 };
 
 static const zend_function_entry event_loop_methods[] = {
 	ZEND_ME(EventLoop, __construct, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR | ZEND_ACC_FINAL)
 	ZEND_ME(EventLoop, getDefaultLoop, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC | ZEND_ACC_FINAL)
+	ZEND_ME(EventLoop, getPersistentLoop, NULL, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC | ZEND_ACC_FINAL)
+	ZEND_ME(EventLoop, isPersistent, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, setRetainPolicy, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, getRetainPolicy, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, notifyFork, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, isDefaultLoop, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, getIteration, NULL, ZEND_ACC_PUBLIC)
@@ -377,6 +781,11 @@ static const zend_function_entry event_loop_methods[] = {
 	ZEND_ME(EventLoop, suspend, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, resume, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, run, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, runFor, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, setTimeout, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, setInterval, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, defer, NULL, ZEND_ACC_PUBLIC)
+	ZEND_ME(EventLoop, clearTimer, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, breakLoop, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, ref, NULL, ZEND_ACC_PUBLIC)
 	ZEND_ME(EventLoop, unref, NULL, ZEND_ACC_PUBLIC)
@@ -398,15 +807,74 @@ static void *libevrealloc(void *ptr, size_t size)
 	if(size) { return erealloc(ptr, size); } else if(ptr) { efree(ptr); } return 0;
 }
 
+/* Persistent counterpart of libevrealloc, used when loops may outlive the request */
+static void *libevprealloc(void *ptr, size_t size)
+{
+	if(size) { return perealloc(ptr, size, 1); } else if(ptr) { pefree(ptr, 1); } return 0;
+}
+
+static void persistent_loop_dtor(void *data)
+{
+	ev_loop_destroy(((persistent_loop *) data)->loop);
+}
+
+static PHP_GINIT_FUNCTION(libev)
+{
+	libev_globals->default_event_loop_object = NULL;
+#ifdef ZTS
+	libev_globals->thread = NULL;
+#endif
+	
+	zend_hash_init(&libev_globals->persistent_loops, 0, NULL, persistent_loop_dtor, 1);
+}
+
+static PHP_GSHUTDOWN_FUNCTION(libev)
+{
+	zend_hash_destroy(&libev_globals->persistent_loops);
+}
+
+PHP_INI_BEGIN()
+	PHP_INI_ENTRY("libev.persistent_loops", "0", PHP_INI_SYSTEM, NULL)
+	PHP_INI_ENTRY("libev.worker_threads", "4", PHP_INI_SYSTEM, NULL)
+PHP_INI_END()
+
 PHP_MINIT_FUNCTION(libev)
 {
-	/* Change the allocator for libev */
-	ev_set_allocator(libevrealloc);
+	REGISTER_INI_ENTRIES();
+	
+	/* Change the allocator for libev, persistent loops cannot live in
+	   request-scoped memory so then all loops use the persistent allocator */
+	if(INI_BOOL("libev.persistent_loops"))
+	{
+		ev_set_allocator(libevprealloc);
+	}
+	else
+	{
+		ev_set_allocator(libevrealloc);
+	}
+	
+	/* Threads are started when the first job is submitted */
+	worker_pool_init(INI_INT("libev.worker_threads"));
+	
+#ifdef ZTS
+	default_loop_mutex = tsrm_mutex_alloc();
+#endif
 	
 	zend_class_entry ce;
 	/* Init generic object handlers for Event objects, prevent clone */
 	memcpy(&event_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
 	event_object_handlers.clone_obj = NULL;
+#if PHP_VERSION_ID >= 50400
+	event_object_handlers.get_gc    = event_object_get_gc;
+#endif
+	memcpy(&periodic_event_object_handlers, &event_object_handlers, sizeof(zend_object_handlers));
+#if PHP_VERSION_ID >= 50400
+	periodic_event_object_handlers.get_gc = periodic_event_object_get_gc;
+#endif
+	memcpy(&async_event_object_handlers, &event_object_handlers, sizeof(zend_object_handlers));
+#if PHP_VERSION_ID >= 50400
+	async_event_object_handlers.get_gc = async_event_object_get_gc;
+#endif
 	
 	
 	/* libev\Event abstract */
@@ -428,13 +896,19 @@ PHP_MINIT_FUNCTION(libev)
 	/* libev\TimerEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\TimerEvent", timer_event_methods);
 	timer_event_ce = zend_register_internal_class_ex(&ce, event_ce, NULL TSRMLS_CC);
-	timer_event_ce->create_object = ev_timer_create;
+	timer_event_ce->create_object = timer_watcher_create;
 	
 	
 	/* libev\PeriodicEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\PeriodicEvent", periodic_event_methods);
 	periodic_event_ce = zend_register_internal_class_ex(&ce, event_ce, NULL TSRMLS_CC);
-	periodic_event_ce->create_object = ev_periodic_create;
+	periodic_event_ce->create_object = periodic_watcher_create;
+	
+	
+	/* libev\CronEvent */
+	INIT_CLASS_ENTRY(ce, "libev\\CronEvent", cron_event_methods);
+	cron_event_ce = zend_register_internal_class_ex(&ce, event_ce, NULL TSRMLS_CC);
+	cron_event_ce->create_object = cron_watcher_create;
 	
 	
 	/* libev\SignalEvent */
@@ -496,12 +970,32 @@ PHP_MINIT_FUNCTION(libev)
 	/* libev\ChildEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\ChildEvent", child_event_methods);
 	child_event_ce = zend_register_internal_class_ex(&ce, event_ce, NULL TSRMLS_CC);
-	child_event_ce->create_object = ev_child_create;
+	child_event_ce->create_object = child_watcher_create;
 	
 	/* libev\StatEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\StatEvent", stat_event_methods);
 	stat_event_ce = zend_register_internal_class_ex(&ce, event_ce, NULL TSRMLS_CC);
-	stat_event_ce->create_object = ev_stat_create;
+	stat_event_ce->create_object = stat_watcher_create;
+	
+	/* libev\\StatResult */
+	INIT_CLASS_ENTRY(ce, "libev\\StatResult", stat_result_methods);
+	stat_result_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	stat_result_ce->create_object = stat_result_object_create;
+	memcpy(&stat_result_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	stat_result_object_handlers.clone_obj = NULL;
+	
+	zend_declare_class_constant_long(stat_result_ce, "DEV", sizeof("DEV") - 1, STAT_FIELD_DEV TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "INO", sizeof("INO") - 1, STAT_FIELD_INO TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "MODE", sizeof("MODE") - 1, STAT_FIELD_MODE TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "NLINK", sizeof("NLINK") - 1, STAT_FIELD_NLINK TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "UID", sizeof("UID") - 1, STAT_FIELD_UID TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "GID", sizeof("GID") - 1, STAT_FIELD_GID TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "RDEV", sizeof("RDEV") - 1, STAT_FIELD_RDEV TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "SIZE", sizeof("SIZE") - 1, STAT_FIELD_SIZE TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "ATIME", sizeof("ATIME") - 1, STAT_FIELD_ATIME TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "MTIME", sizeof("MTIME") - 1, STAT_FIELD_MTIME TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "CTIME", sizeof("CTIME") - 1, STAT_FIELD_CTIME TSRMLS_CC);
+	zend_declare_class_constant_long(stat_result_ce, "BLOCKS", sizeof("BLOCKS") - 1, STAT_FIELD_BLOCKS TSRMLS_CC);
 	
 	/* libev\IdleEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\IdleEvent", idle_event_methods);
@@ -511,7 +1005,10 @@ PHP_MINIT_FUNCTION(libev)
 	/* libev\AsyncEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\AsyncEvent", async_event_methods);
 	async_event_ce = zend_register_internal_class_ex(&ce, event_ce, NULL TSRMLS_CC);
-	async_event_ce->create_object = ev_async_create;
+	async_event_ce->create_object = async_watcher_create;
+	
+	zend_declare_class_constant_long(async_event_ce, "OVERFLOW_DROP_NEW", sizeof("OVERFLOW_DROP_NEW") - 1, ASYNC_OVERFLOW_DROP_NEW TSRMLS_CC);
+	zend_declare_class_constant_long(async_event_ce, "OVERFLOW_DROP_OLDEST", sizeof("OVERFLOW_DROP_OLDEST") - 1, ASYNC_OVERFLOW_DROP_OLDEST TSRMLS_CC);
 	
 	/* libev\CleanupEvent */
 	INIT_CLASS_ENTRY(ce, "libev\\CleanupEvent", cleanup_event_methods);
@@ -527,6 +1024,9 @@ PHP_MINIT_FUNCTION(libev)
 	event_loop_ce->create_object = event_loop_object_create;
 	memcpy(&event_loop_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
 	event_loop_object_handlers.clone_obj = NULL;
+#if PHP_VERSION_ID >= 50400
+	event_loop_object_handlers.get_gc    = event_loop_object_get_gc;
+#endif
 	
 	/* EventLoop class constants */
 	zend_declare_class_constant_long(event_loop_ce, "RUN_NOWAIT", sizeof("RUN_NOWAIT") - 1, (long) EVRUN_NOWAIT TSRMLS_CC);
@@ -544,9 +1044,119 @@ PHP_MINIT_FUNCTION(libev)
 	backend_constant(ALL);
 #   undef backend_constant
 	
+	zend_declare_class_constant_long(event_loop_ce, "RETAIN_STRONG", sizeof("RETAIN_STRONG") - 1, (long) LOOP_RETAIN_STRONG TSRMLS_CC);
+	zend_declare_class_constant_long(event_loop_ce, "RETAIN_WEAK", sizeof("RETAIN_WEAK") - 1, (long) LOOP_RETAIN_WEAK TSRMLS_CC);
+	
 	/* BACKEND_AUTO = EVFLAG_AUTO */
 	zend_declare_class_constant_long(event_loop_ce, "BACKEND_AUTO", sizeof("BACKEND_AUTO") - 1, (long) EVFLAG_AUTO TSRMLS_CC);
 	
+#   define flag_constant(name) \
+	zend_declare_class_constant_long(event_loop_ce, "FLAG_" #name, sizeof("FLAG_" #name) - 1, (long) EVFLAG_##name TSRMLS_CC)
+	flag_constant(NOENV);
+	flag_constant(FORKCHECK);
+	flag_constant(NOINOTIFY);
+	flag_constant(SIGNALFD);
+	flag_constant(NOSIGMASK);
+#   undef flag_constant
+	
+	/* libev\\Process */
+	INIT_CLASS_ENTRY(ce, "libev\\Process", process_methods);
+	process_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	process_ce->create_object = process_object_create;
+	memcpy(&process_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	process_object_handlers.clone_obj = NULL;
+	
+	/* libev\\Resolver */
+	INIT_CLASS_ENTRY(ce, "libev\\Resolver", resolver_methods);
+	resolver_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	resolver_ce->create_object = resolver_object_create;
+	memcpy(&resolver_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	resolver_object_handlers.clone_obj = NULL;
+	
+	/* libev\\Connector */
+	INIT_CLASS_ENTRY(ce, "libev\\Connector", connector_methods);
+	connector_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	connector_ce->create_object = connector_object_create;
+	memcpy(&connector_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	connector_object_handlers.clone_obj = NULL;
+	
+	/* libev\\UdpSocket */
+	INIT_CLASS_ENTRY(ce, "libev\\UdpSocket", udp_socket_methods);
+	udp_socket_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	udp_socket_ce->create_object = udp_socket_object_create;
+	memcpy(&udp_socket_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	udp_socket_object_handlers.clone_obj = NULL;
+	
+	/* libev\\Pipe */
+	INIT_CLASS_ENTRY(ce, "libev\\Pipe", pipe_methods);
+	pipe_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	pipe_ce->create_object = pipe_object_create;
+	memcpy(&pipe_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	pipe_object_handlers.clone_obj = NULL;
+	zend_declare_class_constant_long(pipe_ce, "PROGRESS", sizeof("PROGRESS") - 1, PIPE_PROGRESS TSRMLS_CC);
+	zend_declare_class_constant_long(pipe_ce, "EOF", sizeof("EOF") - 1, PIPE_EOF TSRMLS_CC);
+	zend_declare_class_constant_long(pipe_ce, "ERROR", sizeof("ERROR") - 1, PIPE_ERROR TSRMLS_CC);
+	
+	/* libev\\FdChannel */
+	INIT_CLASS_ENTRY(ce, "libev\\FdChannel", fd_channel_methods);
+	fd_channel_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	fd_channel_ce->create_object = fd_channel_object_create;
+	memcpy(&fd_channel_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	fd_channel_object_handlers.clone_obj = NULL;
+	
+	/* libev\\SharedRing */
+	INIT_CLASS_ENTRY(ce, "libev\\SharedRing", shared_ring_methods);
+	shared_ring_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	shared_ring_ce->create_object = shared_ring_object_create;
+	memcpy(&shared_ring_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	shared_ring_object_handlers.clone_obj = NULL;
+	
+#   ifdef ZTS
+		/* libev\\Thread */
+		INIT_CLASS_ENTRY(ce, "libev\\Thread", thread_methods);
+		thread_ce = zend_register_internal_class(&ce TSRMLS_CC);
+		thread_ce->create_object = thread_object_create;
+		memcpy(&thread_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+		thread_object_handlers.clone_obj = NULL;
+		
+		/* libev\\ThreadChannel */
+		INIT_CLASS_ENTRY(ce, "libev\\ThreadChannel", thread_channel_methods);
+		thread_channel_ce = zend_register_internal_class(&ce TSRMLS_CC);
+		thread_channel_ce->create_object = thread_channel_object_create;
+		memcpy(&thread_channel_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+		thread_channel_object_handlers.clone_obj = NULL;
+#   endif
+	
+#   if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT
+		/* libev\\DirectoryWatcher */
+		INIT_CLASS_ENTRY(ce, "libev\\DirectoryWatcher", dir_watcher_methods);
+		dir_watcher_ce = zend_register_internal_class(&ce TSRMLS_CC);
+		dir_watcher_ce->create_object = dir_watcher_object_create;
+		memcpy(&dir_watcher_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+		dir_watcher_object_handlers.clone_obj = NULL;
+		
+		zend_declare_class_constant_long(dir_watcher_ce, "CREATED", sizeof("CREATED") - 1, DIR_WATCH_CREATED TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "MODIFIED", sizeof("MODIFIED") - 1, DIR_WATCH_MODIFIED TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "ATTRIB", sizeof("ATTRIB") - 1, DIR_WATCH_ATTRIB TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "DELETED", sizeof("DELETED") - 1, DIR_WATCH_DELETED TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "MOVED_FROM", sizeof("MOVED_FROM") - 1, DIR_WATCH_MOVED_FROM TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "MOVED_TO", sizeof("MOVED_TO") - 1, DIR_WATCH_MOVED_TO TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "IS_DIR", sizeof("IS_DIR") - 1, DIR_WATCH_IS_DIR TSRMLS_CC);
+		zend_declare_class_constant_long(dir_watcher_ce, "OVERFLOW", sizeof("OVERFLOW") - 1, DIR_WATCH_OVERFLOW TSRMLS_CC);
+#   endif
+	
+#   if HAVE_IO_URING
+		/* libev\\Uring */
+		INIT_CLASS_ENTRY(ce, "libev\\Uring", uring_methods);
+		uring_ce = zend_register_internal_class(&ce TSRMLS_CC);
+		uring_ce->create_object = uring_object_create;
+		memcpy(&uring_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+		uring_object_handlers.clone_obj = NULL;
+#     if PHP_VERSION_ID >= 50400
+		uring_object_handlers.get_gc    = uring_object_get_gc;
+#     endif
+#   endif
+	
 #   if INCLUDE_EIO
 		INIT_CLASS_ENTRY(ce, "libev\\EIO", eio_methods);
 		eio_ce = zend_register_internal_class(&ce TSRMLS_CC);
@@ -555,9 +1165,63 @@ PHP_MINIT_FUNCTION(libev)
 	return SUCCESS;
 }
 
+PHP_MSHUTDOWN_FUNCTION(libev)
+{
+	worker_pool_shutdown();
+	
+#ifdef ZTS
+	tsrm_mutex_free(default_loop_mutex);
+#endif
+	
+	UNREGISTER_INI_ENTRIES();
+	
+	return SUCCESS;
+}
+
+PHP_RSHUTDOWN_FUNCTION(libev)
+{
+	persistent_loop *entry;
+	HashPosition pos;
+	
+	/* Release the request's EventLoop wrappers, their events are detached
+	   when the objects are freed */
+	for(zend_hash_internal_pointer_reset_ex(&LIBEV_G(persistent_loops), &pos);
+	    zend_hash_get_current_data_ex(&LIBEV_G(persistent_loops), (void **)&entry, &pos) == SUCCESS;
+	    zend_hash_move_forward_ex(&LIBEV_G(persistent_loops), &pos))
+	{
+		if(entry->object)
+		{
+			zval_ptr_dtor(&entry->object);
+			entry->object = NULL;
+		}
+	}
+	
+	return SUCCESS;
+}
+
+/* Writes the names of the backends in the mask to buf */
+static void backends_to_string(char *buf, size_t len, unsigned int backends)
+{
+	buf[0] = '\0';
+	
+#   define backend_name(name, str) \
+	if(backends & EVBACKEND_##name) { \
+		if(buf[0]) { strncat(buf, ", ", len - strlen(buf) - 1); } \
+		strncat(buf, str, len - strlen(buf) - 1); \
+	}
+	backend_name(EPOLL, "epoll");
+	backend_name(KQUEUE, "kqueue");
+	backend_name(PORT, "port");
+	backend_name(DEVPOLL, "devpoll");
+	backend_name(POLL, "poll");
+	backend_name(SELECT, "select");
+#   undef backend_name
+}
+
 static PHP_MINFO_FUNCTION(libev)
 {
 	char version[64];
+	char backends[64];
 	
 	php_info_print_table_start();
 	php_info_print_table_row(2, "Extension version", PHP_LIBEV_EXTVER);
@@ -565,7 +1229,40 @@ static PHP_MINFO_FUNCTION(libev)
 	snprintf(version, sizeof(version) -1, "%d.%d", ev_version_major(), ev_version_minor());
 	php_info_print_table_row(2, "libev version", version);
 	
+	backends_to_string(backends, sizeof(backends), ev_supported_backends());
+	php_info_print_table_row(2, "Supported backends", backends);
+	
+	backends_to_string(backends, sizeof(backends), ev_recommended_backends());
+	php_info_print_table_row(2, "Recommended backends", backends);
+	
+	/* Mirrors the EV_USE_* defaults in libev/ev.c, signalfd requires FLAG_SIGNALFD */
+#if HAVE_SIGNALFD && HAVE_SYS_SIGNALFD_H
+	php_info_print_table_row(2, "signalfd support", "enabled (EventLoop::FLAG_SIGNALFD)");
+#else
+	php_info_print_table_row(2, "signalfd support", "disabled, using self-pipe");
+#endif
+#if HAVE_EVENTFD
+	php_info_print_table_row(2, "eventfd support", "enabled");
+#else
+	php_info_print_table_row(2, "eventfd support", "disabled, using self-pipe");
+#endif
+#if HAVE_INOTIFY_INIT && HAVE_SYS_INOTIFY_H
+	php_info_print_table_row(2, "inotify support", "enabled");
+#else
+	php_info_print_table_row(2, "inotify support", "disabled, StatEvent polls");
+#endif
+#if HAVE_PIDFD
+	php_info_print_table_row(2, "pidfd support", "enabled, ChildEvent works on any loop");
+#else
+	php_info_print_table_row(2, "pidfd support", "disabled, ChildEvent needs the default loop");
+#endif
+	
+	snprintf(version, sizeof(version) - 1, "%d", zend_hash_num_elements(&LIBEV_G(persistent_loops)));
+	php_info_print_table_row(2, "Persistent loops", version);
+	
 	php_info_print_table_end();
+	
+	DISPLAY_INI_ENTRIES();
 }
 
 static const zend_module_dep libev_deps[] = {
@@ -580,12 +1277,16 @@ zend_module_entry libev_module_entry = {
 	PHP_LIBEV_EXTNAME,
 	NULL,                  /* Functions */
 	PHP_MINIT(libev),
-	NULL,                  /* MSHUTDOWN */
+	PHP_MSHUTDOWN(libev),
 	NULL,                  /* RINIT */
-	NULL,                  /* RSHUTDOWN */
+	PHP_RSHUTDOWN(libev),
 	PHP_MINFO(libev),      /* MINFO */
 	PHP_LIBEV_EXTVER,
-	STANDARD_MODULE_PROPERTIES
+	PHP_MODULE_GLOBALS(libev),
+	PHP_GINIT(libev),
+	PHP_GSHUTDOWN(libev),
+	NULL,
+	STANDARD_MODULE_PROPERTIES_EX
 };
 
 
@@ -40,6 +40,8 @@
 #include "php_streams.h"
 #include "php_network.h"
 
+#include <stdint.h>
+
 #if HAVE_SOCKETS
 #  include "ext/sockets/php_sockets.h"
 #endif
@@ -62,31 +64,229 @@ extern zend_module_entry libev_module_entry;
 #  include "TSRM.h"
 #endif
 
+ZEND_BEGIN_MODULE_GLOBALS(libev)
+	/* The object containing ev_default_loop, managed by EventLoop::getDefaultLoop() */
+	zval      *default_event_loop_object;
+	/* Named ev_loops surviving between requests, managed by EventLoop::getPersistentLoop(),
+	   name => persistent_loop, each thread has its own as an ev_loop is not thread-safe */
+	HashTable persistent_loops;
+#ifdef ZTS
+	/* The libev\Thread running the script of this thread, NULL for other threads */
+	struct libev_thread *thread;
+#endif
+ZEND_END_MODULE_GLOBALS(libev)
+
+#ifdef ZTS
+#  define LIBEV_G(v) TSRMG(libev_globals_id, zend_libev_globals *, v)
+#else
+#  define LIBEV_G(v) (libev_globals.v)
+#endif
+
+/* Each ev_loop stores the TSRM context of the thread driving it as userdata, so the
+   watcher callbacks do not have to do a costly TSRMLS_FETCH() for every event.
+   Loop might be NULL if the callback is invoked from Event::invoke(). */
+#ifdef ZTS
+#  define LOOP_SET_TSRMLS(loop) ev_set_userdata((loop), (void *) TSRMLS_C)
+#  define LOOP_FETCH_TSRMLS(loop) \
+	void ***tsrm_ls = (loop) ? (void ***) ev_userdata(loop) : (void ***) ts_resource_ex(0, NULL)
+#else
+#  define LOOP_SET_TSRMLS(loop)
+#  define LOOP_FETCH_TSRMLS(loop)
+#endif
+
+/* Retain policies for EventLoop::setRetainPolicy() */
+#define LOOP_RETAIN_STRONG 0 /* The loop keeps active Events alive */
+#define LOOP_RETAIN_WEAK   1 /* Active Events are stopped when userland drops them */
+
 /* Define NO_REATAIN as 1 to keep libev default behaviour, that it does not
-   retain the active Events beyond their scope */
+   retain the active Events beyond their scope, this is the default retain
+   policy of new EventLoops */
 #ifndef NO_RETAIN
 #  define NO_RETAIN 0
 #endif
 
+#if NO_RETAIN == 1
+#  define LOOP_RETAIN_DEFAULT LOOP_RETAIN_WEAK
+#else
+#  define LOOP_RETAIN_DEFAULT LOOP_RETAIN_STRONG
+#endif
+
 struct _event_loop_object;
 
+/* event_object->eflags */
+/* ChildEvent is watching a pidfd, event_object->watcher is the ev_io of its child_watcher */
+#define EVENT_FLAG_PIDFD 1
+/* StatEvent is polling with stat() jobs of the worker threads, event_object->watcher
+   is the ev_timer of its stat_watcher */
+#define EVENT_FLAG_STAT_THREAD 2
+
 typedef struct event_object {
 	zend_object std;
 	int         eflags;
 	ev_watcher  *watcher;
 	zval        *this;
-	zval        *callback;
+	zend_fcall_info_cache fcc; /* callback resolved once, reused for every dispatch */
+	zval        *callback; /* Start of the zvals reported to the cycle collector */
+	zval        *data;     /* Event::setData(), passed as the last callback parameter */
 	struct _event_loop_object *loop_obj;
 	struct event_object *next; /* Part of double-linked list of loop_obj->events */
 	struct event_object *prev; /* Part of double-linked list of loop_obj->events */
 } event_object;
 
+/* Number of loop_timers allocated at a time by EventLoop::setTimeout() and friends,
+   slabs are never moved as libev keeps pointers to the ev_timers */
+#define LOOP_TIMER_SLAB_SIZE  256
+/* The low bits of a timer handle are the slot index, the high bits the generation
+   of the slot, so handles of released timers do not match a reused slot */
+#define LOOP_TIMER_INDEX_BITS 20
+#define LOOP_TIMER_INDEX_MASK ((1L << LOOP_TIMER_INDEX_BITS) - 1)
+#define LOOP_TIMER_HANDLE(t)  (((t)->generation << LOOP_TIMER_INDEX_BITS) | (long) (t)->index)
+
+/* Timer started by EventLoop::setTimeout(), setInterval() or defer() */
+typedef struct loop_timer {
+	ev_timer     timer;
+	zval         *callback; /* NULL if the slot is free */
+	zend_fcall_info_cache fcc;
+	struct _event_loop_object *loop_obj;
+	long         generation;
+	int          index;
+	int          next_free; /* Index + 1 of the next free slot, 0 = end of list */
+} loop_timer;
+
 typedef struct _event_loop_object {
 	zend_object       std;
 	struct ev_loop    *loop;
+	int               persistent; /* ev_loop is owned by persistent_loops, not by this object */
+	int               retain;     /* One of LOOP_RETAIN_* */
 	struct event_object *events; /* Head of the doubly-linked list of associated events */
+	zval              **gc_buffer; /* Scratch space for the get_gc handler */
+	int               gc_buffer_size;
+	ev_timer          run_timer;      /* Deadline of EventLoop::runFor() */
+	int               run_active;     /* Inside EventLoop::runFor() */
+	long              run_budget;     /* Callbacks EventLoop::runFor() may dispatch, 0 = unlimited */
+	long              run_dispatched; /* Callbacks dispatched since EventLoop::runFor() started */
+	loop_timer        **timer_slabs;  /* Pool of EventLoop::setTimeout() timers */
+	int               timer_slab_count;
+	int               timer_free;     /* Index + 1 of the first free loop_timer, 0 = none */
+	struct dir_inotify *inotify;      /* Shared by the DirectoryWatchers of the loop */
 } event_loop_object;
 
+/* AsyncEvent overflow policies for AsyncEvent::push() */
+#define ASYNC_OVERFLOW_DROP_NEW    0
+#define ASYNC_OVERFLOW_DROP_OLDEST 1
+
+/* Default capacity of the AsyncEvent::push() queue */
+#define ASYNC_DEFAULT_CAPACITY 1024
+
+/* ev_async carrying the payloads queued by AsyncEvent::push(), the queue is a
+   bounded ring buffer which is drained as a whole when the watcher fires */
+typedef struct async_watcher {
+	ev_async     async;
+	zval         **queue;   /* capacity slots, allocated on first push */
+	unsigned int capacity;
+	unsigned int head;      /* Index of the oldest payload */
+	unsigned int count;     /* Number of queued payloads */
+	int          overflow;  /* One of ASYNC_OVERFLOW_* */
+	long         dropped;   /* Number of payloads dropped because of overflow */
+	zval         **gc_buffer; /* Scratch space for the get_gc handler, capacity + 2 slots */
+} async_watcher;
+
+/* ev_timer with the tolerance set by TimerEvent::setSlack() */
+typedef struct timer_watcher {
+	ev_timer  timer;
+	double    slack;    /* Seconds the timer may fire late, 0 = exact */
+	double    after;    /* As given to the constructor or set(), timer.at may be aligned */
+	ev_tstamp deadline; /* Unaligned time of the next expiry, repeats are based on it */
+} timer_watcher;
+
+/* ev_child with the ev_io used instead on Linux for loops other than the default
+   loop, which lack the SIGCHLD handler ev_child depends on */
+typedef struct child_watcher {
+	ev_child child;
+	ev_io    io;     /* Watches pidfd for readability, ie. child termination */
+	int      pidfd;  /* pidfd_open(child.pid), -1 if not opened */
+} child_watcher;
+
+/* The child_watcher of a ChildEvent, event_object->watcher points to its io member
+   while EVENT_FLAG_PIDFD is set */
+#define event_child_watcher(event) ((child_watcher *)((event) + 1))
+
+/* ev_periodic with the optional PHP reschedule callback of PeriodicEvent */
+typedef struct periodic_watcher {
+	ev_periodic periodic;
+	zval        *reschedule;
+	zend_fcall_info_cache reschedule_fcc;
+	zval        *gc_table[3]; /* Scratch space for the get_gc handler */
+} periodic_watcher;
+
+/* Parsed cron expression, one bit per allowed value */
+typedef struct cron_spec {
+	uint64_t minutes;   /* 0 - 59 */
+	uint32_t hours;     /* 0 - 23 */
+	uint32_t days;      /* 1 - 31 */
+	uint16_t months;    /* 1 - 12 */
+	uint8_t  weekdays;  /* 0 - 6, Sunday = 0 */
+	int      day_or;    /* Both day fields are restricted, either one matching is enough */
+} cron_spec;
+
+/* ev_periodic rescheduled by the parsed cron expression of a CronEvent */
+typedef struct cron_watcher {
+	ev_periodic periodic;
+	cron_spec   spec;
+	char        *expression;
+} cron_watcher;
+
+struct worker_queue;
+
+/* Blocking call run by the worker threads of Worker.c, allocated with malloc()
+   as it may outlive the request when its queue is closed */
+typedef struct worker_job {
+	struct worker_job   *next;
+	struct worker_queue *queue;
+	/* Runs in a worker thread, must not use PHP */
+	void (*work)(struct worker_job *job);
+	/* Runs on the thread of the loop once work has finished */
+	void (*done)(struct worker_job *job TSRMLS_DC);
+	/* Frees a job which will not be done, because its queue was closed */
+	void (*free)(struct worker_job *job);
+	/* Set in a child process if fork() was called while a thread of the parent
+	   was running work, done is called without the results then */
+	int interrupted;
+} worker_job;
+
+/* Returns finished worker_jobs to the thread of a loop through an ev_async,
+   which is active (keeping the loop running) while jobs are pending */
+typedef struct worker_queue {
+	ev_async       async;
+	struct ev_loop *loop;     /* NULL once closed */
+	worker_job     *head;     /* Finished jobs waiting for done */
+	worker_job     *tail;
+	int            pending;   /* Submitted jobs which have not been done or freed */
+	void           *data;     /* Owner of the queue */
+} worker_queue;
+
+/* ev_stat with the ev_timer used instead when the stat() calls are run by the
+   worker threads, the ev_stat keeps the path, interval and results either way */
+typedef struct stat_watcher {
+	ev_stat      stat;
+	ev_timer     timer;    /* Submits a stat() job every interval */
+	ev_cleanup   cleanup;  /* Closes queue if the loop is destroyed while polling */
+	worker_queue *queue;   /* Open while polling */
+	int          threaded; /* Requested by StatEvent::__construct() */
+	int          busy;     /* A stat() job has been submitted and not been done */
+	int          primed;   /* stat.attr holds the result of a job */
+} stat_watcher;
+
+/* The stat_watcher of a StatEvent, event_object->watcher points to its timer member
+   while EVENT_FLAG_STAT_THREAD is set */
+#define event_stat_watcher(event) ((stat_watcher *)((event) + 1))
+
+/* Entry in the persistent_loops registry, keyed by loop name */
+typedef struct _persistent_loop {
+	struct ev_loop *loop;
+	zval           *object; /* The EventLoop wrapping loop during the current request, or NULL */
+} persistent_loop;
+
 
 /* Returns true if the supplied *instance_ce == *ce or if any of *instance_ce's parent
    class-entries equals *ce. Ie. instanceof, but without the interface check. */
@@ -178,10 +378,64 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 
 #define dCALLBACK              \
 	zval *callback = NULL;     \
-	char *callback_tmp = NULL;
+	char *callback_tmp = NULL; \
+	zend_fcall_info_cache callback_fcc = empty_fcall_info_cache;
+
+/* Resolves callback into fcc to be reused by libev_call_function() for every call,
+   returns 0 if it is not callable. Callables ending up in __call(), __callStatic()
+   or an overloaded method resolve to a temporary function which zend_call_function()
+   frees after the first call, those are not cached and get resolved by every call. */
+static inline int libev_callback_resolve(zval *callback, char **callable_name, zend_fcall_info_cache *fcc TSRMLS_DC)
+{
+	zend_function *func;
+	
+	if( ! zend_is_callable_ex(callback, NULL, 0, callable_name, NULL, fcc, NULL TSRMLS_CC))
+	{
+		return 0;
+	}
+	
+	func = fcc->function_handler;
+	
+	if(func && ((func->type == ZEND_INTERNAL_FUNCTION && (func->common.fn_flags & ZEND_ACC_CALL_VIA_HANDLER)) ||
+		func->type == ZEND_OVERLOADED_FUNCTION_TEMPORARY || func->type == ZEND_OVERLOADED_FUNCTION))
+	{
+		/* Same as zend_is_callable_ex() does for a call it does not cache */
+		if(func->type != ZEND_OVERLOADED_FUNCTION)
+		{
+			efree((char *) func->common.function_name);
+		}
+		
+		efree(func);
+		
+		*fcc = empty_fcall_info_cache;
+	}
+	
+	return 1;
+}
 
+/* Calls callback with argc params, using the fcc of libev_callback_resolve(),
+   retval receives the return value if there is one */
+static inline int libev_call_function(zval *callback, zend_fcall_info_cache *fcc, int argc, zval ***params, zval **retval TSRMLS_DC)
+{
+	zend_fcall_info fci;
+	
+	fci.size           = sizeof(fci);
+	fci.function_table = EG(function_table);
+	fci.function_name  = callback;
+	fci.symbol_table   = NULL;
+	fci.object_ptr     = NULL;
+	fci.retval_ptr_ptr = retval;
+	fci.param_count    = argc;
+	fci.params         = params;
+	fci.no_separation  = 1;
+	
+	/* An uninitialized cache makes zend_call_function() resolve callback itself */
+	return zend_call_function(&fci, fcc TSRMLS_CC);
+}
+
+/* Validates callback and resolves it into callback_fcc */
 #define CHECK_CALLBACK                                            \
-	do { if( ! zend_is_callable(callback, 0, &callback_tmp TSRMLS_CC)) \
+	do { if( ! libev_callback_resolve(callback, &callback_tmp, &callback_fcc TSRMLS_CC)) \
 	{                                                             \
 		zend_throw_exception_ex(NULL, 0 TSRMLS_CC,                \
 			"'%s' is not a valid callback", callback_tmp);        \
@@ -196,6 +450,7 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 	event_object_ptr = (event_object *)zend_object_store_get_object(getThis() TSRMLS_CC); \
 	zval_add_ref(&zcallback);                                                             \
 	event_object_ptr->callback = zcallback;                                               \
+	event_object_ptr->fcc      = callback_fcc;                                            \
 	/* Do not increase refcount for $this here, as otherwise we have a cycle */           \
 	event_object_ptr->this     = getThis();                                               \
 	IF_DEBUG(libev_printf("Allocated event 0x%lx\n", (size_t) event_object_ptr->this));   \
@@ -204,7 +459,8 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 #define event_io_init(event,fd,events) \
 	do{ assert(event->watcher); ev_io_init((ev_io *)event->watcher, event_callback, fd, events); } while(0)
 #define event_timer_init(event,after,repeat) \
-	do{ assert(event->watcher); ev_timer_init((ev_timer *)event->watcher, event_callback, after, repeat); } while(0)
+	do{ assert(event->watcher); ev_timer_init((ev_timer *)event->watcher, timer_event_callback, after, repeat); \
+		((timer_watcher *)event->watcher)->after = (after); } while(0)
 #define event_periodic_init(event, ofs, ival, rcb) \
 	do{ assert(event->watcher); ev_periodic_init((ev_periodic *)event->watcher, event_callback, ofs, ival, rcb); } while(0)
 #define event_signal_init(event, signum) \
@@ -226,7 +482,26 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 #define event_cleanup_init(event) \
 	do{ assert(event->watcher); ev_cleanup_init((ev_cleanup *)event->watcher, event_callback); } while(0)
 #define event_async_init(event) \
-	do{ assert(event->watcher); ev_async_init((ev_async *)event, event_callback); }while(0)
+	do{ assert(event->watcher); ev_async_init((ev_async *)event->watcher, async_event_callback); }while(0)
+
+/* Changes only the event mask of an ev_io, without forcing libev to re-register the fd */
+#define event_io_modify(event, events_) \
+	do{ ev_io *w_ = (ev_io *)event->watcher; w_->events = (w_->events & EV__IOFDSET) | (events_); } while(0)
+
+/* Runs code to modify the watcher of an Event, if the Event is associated with a loop
+   the watcher is stopped before and started again afterwards, which keeps its loop
+   membership and GC protection (libev does not allow modifying active watchers) */
+#define EVENT_WATCHER_MODIFY(event, type, code)                                       \
+	do {                                                                              \
+		if(event_has_loop(event)) {                                                   \
+			ev_##type##_stop(event->loop_obj->loop, (ev_##type *)event->watcher);     \
+			code;                                                                     \
+			ev_##type##_start(event->loop_obj->loop, (ev_##type *)event->watcher);    \
+		}                                                                             \
+		else {                                                                        \
+			code;                                                                     \
+		}                                                                             \
+	} while(0)
 
 #define event_is_pending(event_object)  ev_is_pending(event_object->watcher)
 #define event_is_active(event_object) ev_is_active(event_object->watcher)
@@ -265,38 +540,39 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 	(event_obj->loop_obj && (event_obj->loop_obj->loop == loop_obj->loop))
 
 
-#if NO_RETAIN == 1
-#  define EVENT_INCREF(event_object)
-#  define EVENT_DTOR(event_object)
+/* The loop only holds a reference on its Events with LOOP_RETAIN_STRONG */
+#define LOOP_RETAINS(event_loop_object) ((event_loop_object)->retain == LOOP_RETAIN_STRONG)
+
+#if LIBEV_DEBUG > 1
+#  define EVENT_INCREF(event_object) \
+	do { libev_printf("Increased refcount on Event 0x%lx to %d\n", \
+	(unsigned long)((size_t) event_object->this),         \
+	Z_REFCOUNT_P(event_object->this));   \
+	zval_add_ref(&event_object->this); } while(0)
+#  define EVENT_DTOR(event_object) \
+	do { libev_printf("Decreasing refcount on Event 0x%lx to %d\n", \
+	(unsigned long)((size_t) event_object->this),          \
+	Z_REFCOUNT_P(event_object->this) - 1);                 \
+	zval_ptr_dtor(&event_object->this); } while(0)
 #else
-#  if LIBEV_DEBUG > 1
-#    define EVENT_INCREF(event_object) \
-		do { libev_printf("Increased refcount on Event 0x%lx to %d\n", \
-		(unsigned long)((size_t) event_object->this),         \
-		Z_REFCOUNT_P(event_object->this));   \
-		zval_add_ref(&event_object->this); } while(0)
-#    define EVENT_DTOR(event_object) \
-		do { libev_printf("Decreasing refcount on Event 0x%lx to %d\n", \
-		(unsigned long)((size_t) event_object->this),          \
-		Z_REFCOUNT_P(event_object->this) - 1);                 \
-		zval_ptr_dtor(&event_object->this); } while(0)
-#  else
-#    define EVENT_INCREF(event_object) \
-		do { zval_add_ref(&event_object->this); } while(0)
-#    define EVENT_DTOR(event_object) \
-		do { zval_ptr_dtor(&event_object->this); } while(0)
-#  endif
+#  define EVENT_INCREF(event_object) \
+	do { zval_add_ref(&event_object->this); } while(0)
+#  define EVENT_DTOR(event_object) \
+	do { zval_ptr_dtor(&event_object->this); } while(0)
 #endif
 
 /* Protects event_objects from garbage collection by increasing their
-   refcount and storing them in the event_loop_object's doubly-linked
-   list, also sets event_object->loop_obj to event_loop_object */
+   refcount (if the loop retains its Events) and storing them in the
+   event_loop_object's doubly-linked list, also sets event_object->loop_obj
+   to event_loop_object */
 #define EVENT_LOOP_REF_ADD(event_object, event_loop_object)  \
 	if( ! event_has_loop(event_object)) {                    \
 		assert(event_object->this);                          \
 		assert( ! event_object->next);                       \
 		assert( ! event_object->prev);                       \
-		EVENT_INCREF(event_object);                          \
+		if(LOOP_RETAINS(event_loop_object)) {                \
+			EVENT_INCREF(event_object);                      \
+		}                                                    \
 		event_object->loop_obj = event_loop_object;          \
 		if( ! event_loop_object->events) {                   \
 			event_object->next = NULL;                       \
@@ -312,10 +588,9 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 		}                                                    \
 	}
 
-/* Removes garbage collection protection by removing the event from the
-   doubly linked list, nulling the event_object->loop_obj and finally calling
-   zval_ptr_dtor */
-#define EVENT_LOOP_REF_DEL(event_object)                                 \
+/* Removes the event from the doubly linked list and nulls event_object->loop_obj,
+   without releasing the reference held by the loop */
+#define EVENT_LOOP_UNLINK(event_object)                                  \
 	if(event_object->loop_obj) {                                         \
 		assert( ! event_is_active(event_object));                        \
 		assert( ! event_is_pending(event_object));                       \
@@ -350,24 +625,55 @@ static inline int instance_of_class(const zend_class_entry *instance_ce, const z
 		event_object->next     = NULL;                                   \
 		event_object->prev     = NULL;                                   \
 		event_object->loop_obj = NULL;                                   \
-		EVENT_DTOR(event_object);                                        \
+	}
+
+/* Removes garbage collection protection by removing the event from the
+   doubly linked list, nulling the event_object->loop_obj and finally calling
+   zval_ptr_dtor if the loop retained the event */
+#define EVENT_LOOP_REF_DEL(event_object)                                 \
+	if(event_object->loop_obj) {                                         \
+		int retained = LOOP_RETAINS(event_object->loop_obj);             \
+		EVENT_LOOP_UNLINK(event_object);                                 \
+		if(retained) {                                                   \
+			EVENT_DTOR(event_object);                                    \
+		}                                                                \
 	}
 
 
 #define EVENT_WATCHER_ACTION(event_object, loop_obj, action, type)         \
-	if(instance_of_class(event_object->std.ce, type##_event_ce))           \
+	EVENT_WATCHER_ACTION_CE(event_object, loop_obj, action, type, type##_event_ce)
+
+/* For Event classes which do not share the name of their ev watcher type */
+#define EVENT_WATCHER_ACTION_CE(event_object, loop_obj, action, type, class_ce) \
+	if(instance_of_class(event_object->std.ce, class_ce))                  \
 	{                                                                      \
 		IF_DEBUG(libev_printf("Calling ev_" #type "_" #action "\n"));      \
 		ev_##type##_##action(loop_obj->loop, (ev_##type *)event_object->watcher); \
 	}
 
+/* Stops a StatEvent which polls with the worker threads, see Events.c */
+static void stat_event_thread_stop(struct ev_loop *loop, event_object *event);
+
+#if HAVE_PIDFD
+/* pidfds of ChildEvent and Process, see Events.c */
+static void child_pidfd_close(int pidfd);
+static void child_pidfd_reaper_stop(struct ev_loop *loop);
+#endif
+
 #define EVENT_STOP(event)                                              \
 	if(event_has_loop(event) && (event_is_active(event) || event_is_pending(event))) { \
 		EVENT_WATCHER_ACTION(event, event->loop_obj, stop, io)             \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, timer)     \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, periodic)  \
+		else EVENT_WATCHER_ACTION_CE(event, event->loop_obj, stop, periodic, cron_event_ce) \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, signal)    \
+		else if(event->eflags & EVENT_FLAG_PIDFD) {                        \
+			ev_io_stop(event->loop_obj->loop, (ev_io *)event->watcher);    \
+		}                                                                  \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, child)     \
+		else if(event->eflags & EVENT_FLAG_STAT_THREAD) {                  \
+			stat_event_thread_stop(event->loop_obj->loop, event);          \
+		}                                                                  \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, stat)      \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, idle)      \
 		else EVENT_WATCHER_ACTION(event, event->loop_obj, stop, async)     \